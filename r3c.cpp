@@ -3,6 +3,26 @@
 #include "r3c.h"
 #include "utils.h"
 #include <assert.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <iterator>
+#include <limits>
+#if __cplusplus < 201103L
+#   include <tr1/memory>
+#else
+#   include <memory>
+#endif // __cplusplus < 201103L
 
 #define R3C_ASSERT assert
 #define THROW_REDIS_EXCEPTION(errinfo) \
@@ -17,6 +37,13 @@ namespace r3c {
 int NUM_RETRIES = 15; // The default number of retries is 15 (CLUSTERDOWN cost more than 6s)
 int CONNECT_TIMEOUT_MILLISECONDS = 2000; // Connection timeout in milliseconds
 int READWRITE_TIMEOUT_MILLISECONDS = 2000; // Receive and send timeout in milliseconds
+int RETRY_BASE_SLEEP_MILLISECONDS = 10; // The minimum sleep between two retries
+int RETRY_MAX_SLEEP_MILLISECONDS = 1000; // The maximum sleep between two retries
+int DNS_CACHE_TTL_SECONDS = 30; // How long a resolved hostname is used before it is refreshed in background
+int TOPOLOGY_REFRESH_INTERVAL_MILLISECONDS = 1000; // The minimum interval between two full topology refreshes triggered by MOVED
+int TOPOLOGY_POLL_INTERVAL_MILLISECONDS = 10000; // How often the background refresher checks the cluster epoch
+int REPLICATION_POLL_INTERVAL_MILLISECONDS = 1000; // How often replica offsets are polled when replica lag check is enabled
+int SHARD_POINTS_PER_WEIGHT = 160; // Points of a node on the hash ring of the sharding mode per weight
 
 #if R3C_TEST // for test
     static LOG_WRITE g_error_log = r3c_log_write;
@@ -49,2439 +76,2476 @@ void set_debug_log_write(LOG_WRITE debug_log)
         g_debug_log = null_log_write;
 }
 
-static int get_retry_sleep_milliseconds(int loop_counter)
+// Decorrelated jitter: sleep = min(cap, random_between(base, previous_sleep * 3)),
+// so that threads failed at the same time do not retry in lockstep.
+static int get_retry_sleep_milliseconds(int previous_sleep_milliseconds)
 {
-    static const int sleep_milliseconds_table[] = { 10, 100, 200, 500, 1000 };
-    if (loop_counter<0 || loop_counter>=static_cast<int>(sizeof(sleep_milliseconds_table)/sleep_milliseconds_table[0]-1))
-        return 1000;
-    else
-        return sleep_milliseconds_table[loop_counter];
+    const int base = RETRY_BASE_SLEEP_MILLISECONDS;
+    const int upper = (previous_sleep_milliseconds < base)? base * 3: previous_sleep_milliseconds * 3;
+    const int sleep_milliseconds = base + static_cast<int>(get_thread_random_number() % static_cast<uint64_t>(upper - base + 1));
+    return (sleep_milliseconds > RETRY_MAX_SLEEP_MILLISECONDS)? RETRY_MAX_SLEEP_MILLISECONDS: sleep_milliseconds;
 }
 
-// Calculate the time elapsed to execute the redis command in microseconds.
-static int64_t calc_elapsed_time(const struct timeval& start_tv, const struct timeval& stop_tv)
+// Tokens are kept in thousandths to make deposits lock-free integer adds
+static volatile int64_t g_retry_tokens = 100 * 1000;
+static volatile int64_t g_retry_max_tokens = 100 * 1000;
+static volatile int64_t g_retry_deposit = 100; // 0.1 token per success
+static volatile int g_min_retries_per_second = 10;
+static volatile int64_t g_retry_reserve_second = 0;
+static volatile int g_retry_reserve_used = 0;
+
+void set_retry_budget(double retry_ratio, int min_retries_per_second, int max_tokens)
 {
-    return static_cast<int64_t>((stop_tv.tv_sec - start_tv.tv_sec) * (__UINT64_C(1000000)) + (stop_tv.tv_usec - start_tv.tv_usec));
+    g_retry_deposit = static_cast<int64_t>(retry_ratio * 1000);
+    g_min_retries_per_second = min_retries_per_second;
+    g_retry_max_tokens = static_cast<int64_t>(max_tokens) * 1000;
+    g_retry_tokens = g_retry_max_tokens;
 }
 
-enum
+static void deposit_retry_budget()
 {
-    CLUSTER_SLOTS = 16384 // number of slots, defined in cluster.h
-};
+    // 预算充足时不写共享变量，避免多线程下的缓存行争用
+    if (g_retry_deposit>0 && g_retry_tokens<g_retry_max_tokens)
+        __sync_fetch_and_add(&g_retry_tokens, g_retry_deposit);
+}
 
-std::string zaddflag2str(ZADDFLAG zaddflag)
+// Returns false if the retry budget is exhausted
+static bool withdraw_retry_budget()
 {
-    std::string zaddflag_str;
+    if (g_retry_deposit <= 0)
+        return true;
 
-    switch (zaddflag)
+    for (;;)
     {
-    case Z_XX:
-        zaddflag_str = "XX";
-        break;
-    case Z_NX:
-        zaddflag_str = "NX";
-        break;
-    case Z_CH:
-        zaddflag_str = "CH";
-        break;
-    default:
-        break;
+        const int64_t tokens = g_retry_tokens;
+        if (tokens < 1000)
+            break;
+        if (__sync_bool_compare_and_swap(&g_retry_tokens, tokens, tokens-1000))
+            return true;
     }
 
-    return zaddflag_str;
+    const int64_t current_second = get_monotonic_milliseconds() / 1000;
+    const int64_t reserve_second = g_retry_reserve_second;
+    if (reserve_second != current_second &&
+        __sync_bool_compare_and_swap(&g_retry_reserve_second, reserve_second, current_second))
+    {
+        g_retry_reserve_used = 0;
+    }
+    return __sync_fetch_and_add(&g_retry_reserve_used, 1) < g_min_retries_per_second;
 }
 
-size_t NodeHasher::operator ()(const Node& node) const
+enum
 {
-    const unsigned char* s = reinterpret_cast<const unsigned char*>(node.first.c_str());
-    const uint64_t l = static_cast<uint64_t>(node.first.size());
-    uint64_t crc = 0;
-    return static_cast<size_t>(crc64(crc, s, l));
-}
+    CLUSTER_SLOTS = 16384, // number of slots, defined in cluster.h
+    INVALID_NODE_INDEX = 0xFFFF, // slot not covered by any master
+    MAX_MIGRATED_KEYS_PER_SLOT = 10000, // _slot_migrations starts over for a slot when exceeded
+    LATENCY_HALF_LIFE_MILLISECONDS = 1000, // The latency estimate of a node without samples halves per period
+    SENTINEL_RETRY_INTERVAL_MILLISECONDS = 1000, // The minimum interval between two subscriptions to sentinels
+    WRITE_BUFFER_FLUSH_INTERVAL_MILLISECONDS = 100, // The minimum interval between two flushes of buffered writes blocked by an unavailable slot
+    WRITE_BUFFER_MAX_FLUSH_INTERVAL_MILLISECONDS = 1600, // The interval doubles up to this while the slot stays unavailable
+    SESSION_PIN_MILLISECONDS = 1000, // Reads stay on the master this long after a session write whose offset is unknown
+    SENTINEL_CHECK_INTERVAL_MILLISECONDS = 100 // The minimum interval between two reads of the +switch-master subscription, except on retries
+};
 
-std::string& node2string(const Node& node, std::string* str)
+// Command classes of adaptive timeouts, each node keeps the latency of each class
+enum CommandClass
 {
-    *str = node.first + std::string(":") + int2string(node.second);
-    return *str;
-}
+    COMMAND_CLASS_POINT = 0, // Commands on a few elements, such as GET and HSET
+    COMMAND_CLASS_BULK = 1,  // Commands whose cost grows with the data, such as HGETALL and MGET
+    NUM_LATENCY_CLASSES = 2,
+    COMMAND_CLASS_BLOCKING = 2 // Commands blocking on the server, such as BLPOP, always with the readwrite timeout
+};
 
-std::string node2string(const Node& node)
+static CommandClass get_command_class(const CommandArgs& command_args)
 {
-    std::string nodestr;
-    return node2string(node, &nodestr);
+    static const char* bulk_commands[] =
+    {
+        "BITCOUNT", "BITPOS", "DEL", "EVAL", "EVALSHA", "FLUSHALL",
+        "HGETALL", "HKEYS", "HMGET", "HMSET", "HSCAN", "HVALS", "KEYS",
+        "LRANGE", "LREM", "LTRIM", "MGET", "MSET", "PFCOUNT", "PFMERGE",
+        "SCAN", "SDIFF", "SDIFFSTORE", "SINTER", "SINTERSTORE", "SMEMBERS", "SORT", "SSCAN", "SUNION", "SUNIONSTORE",
+        "XCLAIM", "XINFO", "XPENDING", "XRANGE", "XREVRANGE", "XTRIM",
+        "ZINTERSTORE", "ZRANGE", "ZRANGEBYSCORE", "ZREMRANGEBYRANK", "ZREMRANGEBYSCORE",
+        "ZREVRANGE", "ZREVRANGEBYSCORE", "ZSCAN", "ZUNIONSTORE"
+    };
+    const std::string& command = command_args.get_command();
+
+    if (command=="BLPOP" || command=="BRPOP" || command=="BRPOPLPUSH" ||
+        command=="BZPOPMIN" || command=="BZPOPMAX" || command=="WAIT")
+    {
+        return COMMAND_CLASS_BLOCKING;
+    }
+    if (command=="XREAD" || command=="XREADGROUP")
+    {
+        // 带BLOCK参数时阻塞
+        const char** argv = command_args.get_argv();
+        for (int i=1; i<command_args.get_argc(); ++i)
+        {
+            if (0 == strcasecmp(argv[i], "BLOCK"))
+                return COMMAND_CLASS_BLOCKING;
+        }
+        return COMMAND_CLASS_BULK;
+    }
+    for (size_t i=0; i<sizeof(bulk_commands)/sizeof(bulk_commands[0]); ++i)
+    {
+        if (command == bulk_commands[i])
+            return COMMAND_CLASS_BULK;
+    }
+    return COMMAND_CLASS_POINT;
 }
 
-std::string NodeInfo::str() const
+// Commands whose state is kept by the connection, they and the commands queued by MULTI go over the same connection
+static bool is_transaction_command(const std::string& command)
 {
-    return format_string("nodeinfo://%s/%s:%d/%s", id.c_str(), node.first.c_str(), node.second, flags.c_str());
+    return command=="MULTI" || command=="EXEC" || command=="DISCARD" || command=="WATCH" || command=="UNWATCH";
 }
 
-bool NodeInfo::is_master() const
+// Commands whose result changes if repeated, a buffered write may be executed twice
+static bool is_repeat_unsafe_command(const std::string& command)
 {
-    const std::string::size_type pos = flags.find("master");
-    return (pos != std::string::npos);
+    static const char* repeat_unsafe_commands[] =
+    {
+        "APPEND", "DECR", "DECRBY", "EVAL", "EVALSHA", "EXEC", "GETSET", "HINCRBY", "HINCRBYFLOAT",
+        "INCR", "INCRBY", "INCRBYFLOAT", "LINSERT", "LPOP", "LPUSH", "LPUSHX", "MULTI",
+        "RPOP", "RPOPLPUSH", "RPUSH", "RPUSHX", "SPOP", "XADD", "ZINCRBY"
+    };
+
+    for (size_t i=0; i<sizeof(repeat_unsafe_commands)/sizeof(repeat_unsafe_commands[0]); ++i)
+    {
+        if (command == repeat_unsafe_commands[i])
+            return true;
+    }
+    return false;
 }
 
-bool NodeInfo::is_replica() const
+////////////////////////////////////////////////////////////////////////////////
+// Topology shared by all clients of the same cluster in a process,
+// so that one failover is fetched once instead of once per (thread-local) client.
+
+// A published topology is never modified, a refresh publishes a new one
+struct Topology
 {
-    const std::string::size_type pos = flags.find("slave");
-    return (pos != std::string::npos);
-}
+    std::vector<struct NodeInfo> nodes_info;
+};
 
-bool NodeInfo::is_fail() const
+// Replica offsets reported by INFO replication of the masters, published as Topology
+struct ReplicaOffset
 {
-    const std::string::size_type pos = flags.find("fail");
-    return (pos != std::string::npos);
-}
+    std::string state; // "online" once the initial sync is done
+    int64_t offset;
+    int lag_seconds;
+    int64_t master_offset; // master_repl_offset of its master
+};
 
-////////////////////////////////////////////////////////////////////////////////
-// CCommandArgs
+struct Replication
+{
+    std::map<Node, struct ReplicaOffset> replicas;
+    int64_t poll_time; // Monotonic milliseconds
+};
 
-CommandArgs::CommandArgs()
-    : _argc(0), _argv(NULL), _argvlen(NULL)
+#if __cplusplus < 201103L
+typedef std::tr1::shared_ptr<const struct Topology> TopologyPtr;
+typedef std::tr1::shared_ptr<const struct Replication> ReplicationPtr;
+#else
+typedef std::shared_ptr<const struct Topology> TopologyPtr;
+typedef std::shared_ptr<const struct Replication> ReplicationPtr;
+#endif // __cplusplus < 201103L
+
+struct TopologyEntry
+{
+    pthread_mutex_t mutex;
+    volatile uint64_t version; // Increased on each publish, clients compare it without the lock
+    TopologyPtr topology;      // Protected by mutex
+    bool fetching;             // A client is fetching the topology, protected by mutex
+    volatile uint64_t replication_version; // Increased on each poll of replica offsets
+    ReplicationPtr replication; // Protected by mutex
+
+    // The background refresher, all protected by mutex
+    pthread_cond_t cond;
+    int num_refresh_clients;   // Clients enabled background refresh
+    int num_lag_clients;       // Clients enabled replica lag check, the refresher exits when both are 0
+    bool refresher_running;
+    bool refresh_signaled;     // MOVED or connection errors since the last refresh
+    std::string raw_nodes_string;
+    std::string password;
+    int connect_timeout_milliseconds;
+    int readwrite_timeout_milliseconds;
+    SocketOptions socket_options;
+};
+
+static pthread_mutex_t g_topology_entries_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, struct TopologyEntry*>* g_topology_entries = new std::map<std::string, struct TopologyEntry*>; // Never freed
+
+// Bulk commands in flight per node in the process, see PriorityLaneOptions
+static pthread_mutex_t g_bulk_commands_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_bulk_commands_cond = PTHREAD_COND_INITIALIZER;
+static std::map<Node, int>* g_bulk_commands = new std::map<Node, int>; // Never freed
+
+// Requests in flight per node in the process, see AdmissionOptions
+static pthread_mutex_t g_admission_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_admission_cond = PTHREAD_COND_INITIALIZER;
+static std::map<Node, struct AdmissionStats>* g_admission_stats = new std::map<Node, struct AdmissionStats>; // Never freed, entries are never erased
+static int g_total_inflight_requests = 0; // Protected by g_admission_mutex
+
+// Requests in flight per node in the process for the replica selection, updated without lock once created
+static pthread_mutex_t g_outstanding_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<Node, volatile int*>* g_outstanding_requests = new std::map<Node, volatile int*>; // Never freed, nor the counters
+
+static volatile int* get_outstanding_counter(const Node& node)
 {
+    pthread_mutex_lock(&g_outstanding_mutex);
+    volatile int*& counter = (*g_outstanding_requests)[node];
+    if (NULL == counter)
+        counter = new int(0);
+    pthread_mutex_unlock(&g_outstanding_mutex);
+    return counter;
 }
 
-CommandArgs::~CommandArgs()
+AdmissionStats::AdmissionStats()
+    : inflight_requests(0),
+      inflight_bytes(0),
+      waiting_requests(0),
+      admitted_requests(0),
+      rejected_requests(0),
+      shed_requests(0)
 {
-    delete []_argvlen;
-    for (int i=0; i<_argc; ++i)
-        delete []_argv[i];
-    delete []_argv;
 }
 
-void CommandArgs::set_key(const std::string& key)
+void get_admission_stats(std::map<Node, struct AdmissionStats>* admission_stats)
 {
-    _key = key;
+    pthread_mutex_lock(&g_admission_mutex);
+    *admission_stats = *g_admission_stats;
+    pthread_mutex_unlock(&g_admission_mutex);
 }
 
-void CommandArgs::set_command(const std::string& command)
+////////////////////////////////////////////////////////////////////////////////
+// Topology snapshot on disk, so that a new process starts routing without discovery.
+//
+// Layout (host byte order):
+// magic(8) format_version(4) payload_length(4) checksum(8) payload
+// payload: key(str) num_nodes(4) { id(str) host(str) port(2) flags(1) master_id(str) num_segments(2) { begin(2) end(2) }* }*
+// str: length(2) bytes
+// The checksum is crc64 of the payload, the key is the nodes string of the client.
+
+static const char TOPOLOGY_SNAPSHOT_MAGIC[8] = {'R', '3', 'C', 'T', 'O', 'P', 'O', '\0'};
+static const uint32_t TOPOLOGY_SNAPSHOT_VERSION = 1;
+static const size_t TOPOLOGY_SNAPSHOT_HEADER_SIZE = sizeof(TOPOLOGY_SNAPSHOT_MAGIC) + 4 + 4 + 8;
+
+static pthread_mutex_t g_topology_snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::string* g_topology_snapshot_dir = new std::string; // Never freed, empty if disabled
+
+void set_topology_snapshot_dir(const std::string& dir)
 {
-    _command = command;
+    pthread_mutex_lock(&g_topology_snapshot_mutex);
+    *g_topology_snapshot_dir = dir;
+    pthread_mutex_unlock(&g_topology_snapshot_mutex);
 }
 
-void CommandArgs::add_arg(const std::string& arg)
+// Returns an empty string if snapshots are disabled
+static std::string get_topology_snapshot_filepath(const std::string& raw_nodes_string)
 {
-    _args.push_back(arg);
+    std::string filepath;
+    pthread_mutex_lock(&g_topology_snapshot_mutex);
+    if (!g_topology_snapshot_dir->empty())
+    {
+        const uint64_t key_hash = crc64(0, reinterpret_cast<const unsigned char*>(raw_nodes_string.data()), raw_nodes_string.size());
+        filepath = format_string("%s/r3c-%016" PRIx64 ".topology", g_topology_snapshot_dir->c_str(), key_hash);
+    }
+    pthread_mutex_unlock(&g_topology_snapshot_mutex);
+    return filepath;
 }
 
-void CommandArgs::add_arg(char arg)
+template <typename T>
+static void append_snapshot_value(std::string* buffer, T value)
 {
-    const std::string str(&arg, 1);
-    add_arg(str);
+    buffer->append(reinterpret_cast<const char*>(&value), sizeof(value));
 }
 
-void CommandArgs::add_arg(int32_t arg)
+static void append_snapshot_string(std::string* buffer, const std::string& str)
 {
-    _args.push_back(int2string(arg));
+    append_snapshot_value(buffer, static_cast<uint16_t>(str.size()));
+    buffer->append(str);
 }
 
-void CommandArgs::add_arg(uint32_t arg)
+template <typename T>
+static bool read_snapshot_value(const char** pos, const char* end, T* value)
 {
-    _args.push_back(int2string(arg));
+    if (end-*pos < static_cast<ptrdiff_t>(sizeof(T)))
+        return false;
+    memcpy(value, *pos, sizeof(T));
+    *pos += sizeof(T);
+    return true;
 }
 
-void CommandArgs::add_arg(int64_t arg)
+static bool read_snapshot_string(const char** pos, const char* end, std::string* str)
 {
-    _args.push_back(int2string(arg));
+    uint16_t length;
+    if (!read_snapshot_value(pos, end, &length) || end-*pos<length)
+        return false;
+    str->assign(*pos, length);
+    *pos += length;
+    return true;
 }
 
-void CommandArgs::add_args(const std::vector<std::string>& args)
+// Loops on short writes and EINTR
+static bool write_snapshot_file(int fd, const std::string& buffer)
 {
-    for (std::vector<std::string>::size_type i=0; i<args.size(); ++i)
+    size_t written = 0;
+    while (written < buffer.size())
     {
-        const std::string& arg = args[i];
-        add_arg(arg);
+        const ssize_t bytes = write(fd, buffer.data()+written, buffer.size()-written);
+        if (bytes > 0)
+            written += static_cast<size_t>(bytes);
+        else if (-1==bytes && EINTR!=errno)
+            return false;
     }
+    return 0 == fsync(fd);
 }
 
-void CommandArgs::add_args(const std::vector<std::pair<std::string, std::string> >& values)
+// Makes the rename durable
+static void sync_snapshot_dir(const std::string& filepath)
 {
-    for (std::vector<std::string>::size_type i=0; i<values.size(); ++i)
+    const std::string::size_type slash = filepath.rfind('/');
+    const std::string dirpath = (std::string::npos==slash)? std::string("."): (0==slash)? std::string("/"): filepath.substr(0, slash);
+    const int fd = open(dirpath.c_str(), O_RDONLY);
+    if (fd != -1)
     {
-        const std::string& field = values[i].first;
-        const std::string& value = values[i].second;
-        add_arg(field);
-        add_arg(value);
+        fsync(fd);
+        close(fd);
     }
 }
 
-void CommandArgs::add_args(const std::map<std::string, std::string>& map)
+// Written and synced to a temporary file then renamed, so readers never see a partial file even after a crash
+static void save_topology_snapshot(const std::string& raw_nodes_string, const std::vector<struct NodeInfo>& nodes_info)
 {
-    for (std::map<std::string, std::string>::const_iterator iter=map.begin(); iter!=map.end(); ++iter)
+    const std::string& filepath = get_topology_snapshot_filepath(raw_nodes_string);
+    if (filepath.empty())
+        return;
+
+    std::string payload;
+    append_snapshot_string(&payload, raw_nodes_string);
+    append_snapshot_value(&payload, static_cast<uint32_t>(nodes_info.size()));
+    for (std::vector<struct NodeInfo>::size_type i=0; i<nodes_info.size(); ++i)
     {
-        add_arg(iter->first);
-        add_arg(iter->second);
+        const struct NodeInfo& nodeinfo = nodes_info[i];
+        const uint8_t flags = (nodeinfo.is_master()? 1: 0) | (nodeinfo.is_replica()? 2: 0) | (nodeinfo.is_fail()? 4: 0);
+
+        append_snapshot_string(&payload, nodeinfo.id);
+        append_snapshot_string(&payload, nodeinfo.node.first);
+        append_snapshot_value(&payload, nodeinfo.node.second);
+        append_snapshot_value(&payload, flags);
+        append_snapshot_string(&payload, nodeinfo.master_id);
+        append_snapshot_value(&payload, static_cast<uint16_t>(nodeinfo.slots.size()));
+        for (SlotSegment::size_type j=0; j<nodeinfo.slots.size(); ++j)
+        {
+            append_snapshot_value(&payload, static_cast<uint16_t>(nodeinfo.slots[j].first));
+            append_snapshot_value(&payload, static_cast<uint16_t>(nodeinfo.slots[j].second));
+        }
+    }
+
+    std::string buffer(TOPOLOGY_SNAPSHOT_MAGIC, sizeof(TOPOLOGY_SNAPSHOT_MAGIC));
+    append_snapshot_value(&buffer, TOPOLOGY_SNAPSHOT_VERSION);
+    append_snapshot_value(&buffer, static_cast<uint32_t>(payload.size()));
+    append_snapshot_value(&buffer, crc64(0, reinterpret_cast<const unsigned char*>(payload.data()), payload.size()));
+    buffer.append(payload);
+
+    const std::string& tmp_filepath = format_string("%s.%d.%" PRIu64, filepath.c_str(), static_cast<int>(getpid()), get_thread_random_number());
+    const int fd = open(tmp_filepath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (-1 == fd)
+    {
+        (*g_error_log)("[R3C_SNAPSHOT][%s:%d] open %s failed: %s\n", __FILE__, __LINE__, tmp_filepath.c_str(), strerror(errno));
+        return;
+    }
+
+    const bool written = write_snapshot_file(fd, buffer);
+    close(fd);
+    if (!written || rename(tmp_filepath.c_str(), filepath.c_str())!=0)
+    {
+        (*g_error_log)("[R3C_SNAPSHOT][%s:%d] write %s failed: %s\n", __FILE__, __LINE__, filepath.c_str(), strerror(errno));
+        unlink(tmp_filepath.c_str());
+        return;
     }
+    sync_snapshot_dir(filepath);
 }
 
-void CommandArgs::add_args(const std::map<std::string, int64_t>& map, bool reverse)
+static bool decode_topology_snapshot(const char* data, size_t size, const std::string& raw_nodes_string, std::vector<struct NodeInfo>* nodes_info)
 {
-    for (std::map<std::string, int64_t>::const_iterator iter=map.begin(); iter!=map.end(); ++iter)
+    uint32_t version, payload_length, num_nodes;
+    uint64_t checksum;
+    std::string key;
+    const char* end = data + size;
+    const char* pos = data + sizeof(TOPOLOGY_SNAPSHOT_MAGIC);
+
+    if (size<TOPOLOGY_SNAPSHOT_HEADER_SIZE || memcmp(data, TOPOLOGY_SNAPSHOT_MAGIC, sizeof(TOPOLOGY_SNAPSHOT_MAGIC))!=0)
+        return false;
+    read_snapshot_value(&pos, end, &version);
+    read_snapshot_value(&pos, end, &payload_length);
+    read_snapshot_value(&pos, end, &checksum);
+    if (version!=TOPOLOGY_SNAPSHOT_VERSION || static_cast<size_t>(end-pos)!=payload_length)
+        return false;
+    if (checksum != crc64(0, reinterpret_cast<const unsigned char*>(pos), payload_length))
+        return false;
+    if (!read_snapshot_string(&pos, end, &key) || key!=raw_nodes_string)
+        return false;
+    if (!read_snapshot_value(&pos, end, &num_nodes))
+        return false;
+
+    for (uint32_t i=0; i<num_nodes; ++i)
     {
-        if (!reverse)
-        {
-            add_arg(iter->first);
-            add_arg(iter->second);
-        }
-        else
+        struct NodeInfo nodeinfo;
+        uint8_t flags;
+        uint16_t num_segments;
+
+        if (!read_snapshot_string(&pos, end, &nodeinfo.id) ||
+            !read_snapshot_string(&pos, end, &nodeinfo.node.first) ||
+            !read_snapshot_value(&pos, end, &nodeinfo.node.second) ||
+            !read_snapshot_value(&pos, end, &flags) ||
+            !read_snapshot_string(&pos, end, &nodeinfo.master_id) ||
+            !read_snapshot_value(&pos, end, &num_segments))
+            return false;
+        nodeinfo.flags = (flags&1)? "master": ((flags&2)? "slave": "");
+        if (flags & 4)
+            nodeinfo.flags += ",fail";
+        nodeinfo.ping_sent = 0;
+        nodeinfo.pong_recv = 0;
+        nodeinfo.epoch = 0;
+        nodeinfo.connected = true;
+        for (uint16_t j=0; j<num_segments; ++j)
         {
-            add_arg(iter->second);
-            add_arg(iter->first);
+            uint16_t begin_slot, end_slot;
+            if (!read_snapshot_value(&pos, end, &begin_slot) || !read_snapshot_value(&pos, end, &end_slot))
+                return false;
+            if (begin_slot>end_slot || end_slot>=CLUSTER_SLOTS)
+                return false;
+            nodeinfo.slots.push_back(std::make_pair(static_cast<int>(begin_slot), static_cast<int>(end_slot)));
         }
+        nodes_info->push_back(nodeinfo);
     }
+    return pos == end;
 }
 
-void CommandArgs::add_args(const std::vector<FVPair>& fvpairs)
+// Returns false if there is no valid snapshot, the snapshot is validated by the first MOVED or refresh
+static bool load_topology_snapshot(const std::string& raw_nodes_string, std::vector<struct NodeInfo>* nodes_info)
 {
-    for (std::vector<FVPair>::size_type i=0; i<fvpairs.size(); ++i)
+    const std::string& filepath = get_topology_snapshot_filepath(raw_nodes_string);
+    bool loaded = false;
+    struct stat st;
+
+    if (filepath.empty())
+        return false;
+    const int fd = open(filepath.c_str(), O_RDONLY);
+    if (-1 == fd)
+        return false;
+    if (0==fstat(fd, &st) && st.st_size>0)
     {
-        const FVPair& fvpair = fvpairs[i];
-        add_arg(fvpair.field);
-        add_arg(fvpair.value);
+        void* data = mmap(NULL, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            loaded = decode_topology_snapshot(static_cast<const char*>(data), static_cast<size_t>(st.st_size), raw_nodes_string, nodes_info);
+            munmap(data, static_cast<size_t>(st.st_size));
+        }
+    }
+    close(fd);
+    if (!loaded)
+    {
+        nodes_info->clear();
+        (*g_info_log)("[R3C_SNAPSHOT][%s:%d] %s is invalid and ignored\n", __FILE__, __LINE__, filepath.c_str());
     }
+    return loaded;
 }
 
-void CommandArgs::final()
+// Clients created with the same nodes string share the entry,
+// a new entry starts from the snapshot on disk if there is a valid one
+static struct TopologyEntry* get_topology_entry(const std::string& raw_nodes_string)
 {
-    _argc = static_cast<int>(_args.size());
-    _argv = new char*[_argc];
-    _argvlen = new size_t[_argc];
-
-    for (int i=0; i<_argc; ++i)
+    pthread_mutex_lock(&g_topology_entries_mutex);
+    struct TopologyEntry*& topology_entry = (*g_topology_entries)[raw_nodes_string];
+    if (NULL == topology_entry)
     {
-        _argvlen[i] = _args[i].size();
-        _argv[i] = new char[_argvlen[i]+1];
-        memcpy(_argv[i], _args[i].c_str(), _argvlen[i]); // Support binary key&value.
-        _argv[i][_argvlen[i]] = '\0';
+        topology_entry = new struct TopologyEntry;
+        pthread_mutex_init(&topology_entry->mutex, NULL);
+        pthread_cond_init(&topology_entry->cond, NULL);
+        topology_entry->version = 0;
+        topology_entry->fetching = false;
+        topology_entry->replication_version = 0;
+        topology_entry->num_refresh_clients = 0;
+        topology_entry->num_lag_clients = 0;
+        topology_entry->refresher_running = false;
+        topology_entry->refresh_signaled = false;
+        topology_entry->raw_nodes_string = raw_nodes_string;
+        topology_entry->connect_timeout_milliseconds = CONNECT_TIMEOUT_MILLISECONDS;
+        topology_entry->readwrite_timeout_milliseconds = READWRITE_TIMEOUT_MILLISECONDS;
+
+        struct Topology* topology = new struct Topology;
+        if (!load_topology_snapshot(raw_nodes_string, &topology->nodes_info))
+        {
+            delete topology;
+        }
+        else
+        {
+            topology_entry->topology.reset(topology);
+            topology_entry->version = 1;
+        }
     }
+    pthread_mutex_unlock(&g_topology_entries_mutex);
+    return topology_entry;
 }
 
-int CommandArgs::get_argc() const
+// Returns the version of the topology, 0 if nothing is published yet
+static uint64_t get_topology(struct TopologyEntry* topology_entry, TopologyPtr* topology)
 {
-    return _argc;
+    pthread_mutex_lock(&topology_entry->mutex);
+    *topology = topology_entry->topology;
+    const uint64_t version = topology_entry->version;
+    pthread_mutex_unlock(&topology_entry->mutex);
+    return version;
 }
 
-const char** CommandArgs::get_argv() const
+// Only one fetch runs per version:
+// returns false if another client is fetching, or has published a newer version than known_version
+static bool begin_fetch_topology(struct TopologyEntry* topology_entry, uint64_t known_version)
 {
-    return (const char**)_argv;
+    bool fetch = false;
+    pthread_mutex_lock(&topology_entry->mutex);
+    if (!topology_entry->fetching && topology_entry->version==known_version)
+    {
+        topology_entry->fetching = true;
+        fetch = true;
+    }
+    pthread_mutex_unlock(&topology_entry->mutex);
+    return fetch;
 }
 
-const size_t* CommandArgs::get_argvlen() const
+static bool less_nodeinfo_id(const struct NodeInfo* a, const struct NodeInfo* b)
 {
-    return _argvlen;
+    return a->id < b->id;
 }
 
-const std::string& CommandArgs::get_command() const
+// Compares what routing depends on, "myself" and ping times differ between the nodes asked
+static bool same_nodes_info(const std::vector<struct NodeInfo>& a, const std::vector<struct NodeInfo>& b)
 {
-    return _command;
-}
+    if (a.size() != b.size())
+        return false;
 
-const std::string& CommandArgs::get_key() const
-{
-    return _key;
+    std::vector<const struct NodeInfo*> x(a.size()), y(b.size());
+    for (std::vector<struct NodeInfo>::size_type i=0; i<a.size(); ++i)
+    {
+        x[i] = &a[i];
+        y[i] = &b[i];
+    }
+    std::sort(x.begin(), x.end(), less_nodeinfo_id);
+    std::sort(y.begin(), y.end(), less_nodeinfo_id);
+    for (std::vector<const struct NodeInfo*>::size_type i=0; i<x.size(); ++i)
+    {
+        if (x[i]->id!=y[i]->id || x[i]->node!=y[i]->node || x[i]->master_id!=y[i]->master_id ||
+            x[i]->is_master()!=y[i]->is_master() || x[i]->is_fail()!=y[i]->is_fail() || x[i]->slots!=y[i]->slots)
+            return false;
+    }
+    return true;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// CRedisNode
-// CRedisMasterNode
-// CRedisReplicaNode
-
-class CRedisNode
+// nodes_info is NULL if the fetch failed, end_fetch is false if begin_fetch_topology was not called,
+// returns the version published
+static uint64_t publish_topology(struct TopologyEntry* topology_entry, const std::vector<struct NodeInfo>* nodes_info, bool end_fetch)
 {
-public:
-    CRedisNode(const NodeId& nodeid, const Node& node, redisContext* redis_context)
-        : _nodeid(nodeid),
-          _node(node),
-          _redis_context(redis_context),
-          _conn_errors(0)
+    struct Topology* topology = NULL;
+    if (nodes_info != NULL)
     {
+        topology = new struct Topology;
+        topology->nodes_info = *nodes_info;
     }
 
-    ~CRedisNode()
+    pthread_mutex_lock(&topology_entry->mutex);
+    if (topology!=NULL && topology_entry->topology && same_nodes_info(topology_entry->topology->nodes_info, topology->nodes_info))
     {
-        close();
+        // Nothing changed, clients need not rebuild
+        delete topology;
+        topology = NULL;
     }
-
-    const NodeId& get_nodeid() const
+    if (topology != NULL)
     {
-        return _nodeid;
+        topology_entry->topology.reset(topology);
+        __sync_fetch_and_add(&topology_entry->version, 1);
     }
+    if (end_fetch)
+        topology_entry->fetching = false;
+    const uint64_t version = topology_entry->version;
+    pthread_mutex_unlock(&topology_entry->mutex);
 
-    const Node& get_node() const
+    if (topology != NULL)
+        save_topology_snapshot(topology_entry->raw_nodes_string, topology->nodes_info);
+    return version;
+}
+
+// ASKING and the command are sent in one write, the reply of ASKING is skipped
+static redisReply* asking_command(redisContext* redis_context, const CommandArgs& command_args)
+{
+    redisReply* redis_reply = NULL;
+
+    if (REDIS_OK == redisAppendCommand(redis_context, "ASKING") &&
+        REDIS_OK == redisAppendCommandArgv(redis_context, command_args.get_argc(), command_args.get_argv(), command_args.get_argvlen()) &&
+        REDIS_OK == redisGetReply(redis_context, reinterpret_cast<void**>(&redis_reply)))
     {
-        return _node;
+        freeReplyObject(redis_reply);
+        redis_reply = NULL;
+        if (REDIS_OK != redisGetReply(redis_context, reinterpret_cast<void**>(&redis_reply)))
+            redis_reply = NULL;
     }
+    return redis_reply;
+}
 
-    redisContext* get_redis_context() const
+// The replication offset in the reply of ROLE, -1 if unknown
+static int64_t get_role_offset(const redisReply* role_reply)
+{
+    if (role_reply->type==REDIS_REPLY_ARRAY && role_reply->elements>=2 && role_reply->element[0]->type==REDIS_REPLY_STRING)
     {
-        return _redis_context;
+        const redisReply* const* element = role_reply->element;
+
+        if (0==strcmp(element[0]->str, "master") && element[1]->type==REDIS_REPLY_INTEGER)
+            return static_cast<int64_t>(element[1]->integer);
+        if (0==strcmp(element[0]->str, "slave") && role_reply->elements>=5 && element[4]->type==REDIS_REPLY_INTEGER)
+            return static_cast<int64_t>(element[4]->integer);
     }
+    return -1;
+}
 
-    void set_redis_context(redisContext* redis_context)
+// Sends ROLE and the command in one round trip, ROLE goes first if role_first is true.
+// Commands on a connection run in order, so the offset of a ROLE after a write covers the write,
+// and a read after ROLE sees at least the offset ROLE replied.
+static redisReply* role_command(redisContext* redis_context, const CommandArgs& command_args, bool role_first, int64_t* offset)
+{
+    redisReply* redis_reply = NULL;
+    redisReply* role_reply = NULL;
+    int ret = REDIS_OK;
+
+    *offset = -1;
+    if (role_first)
+        ret = redisAppendCommand(redis_context, "ROLE");
+    if (REDIS_OK == ret)
+        ret = redisAppendCommandArgv(redis_context, command_args.get_argc(), command_args.get_argv(), command_args.get_argvlen());
+    if (REDIS_OK==ret && !role_first)
+        ret = redisAppendCommand(redis_context, "ROLE");
+    if (REDIS_OK == ret)
     {
-        _redis_context = redis_context;
-        if (NULL == _redis_context)
+        void** first_reply = reinterpret_cast<void**>(role_first? &role_reply: &redis_reply);
+        void** second_reply = reinterpret_cast<void**>(role_first? &redis_reply: &role_reply);
+
+        if (REDIS_OK==redisGetReply(redis_context, first_reply) && REDIS_OK==redisGetReply(redis_context, second_reply))
         {
-            ++_conn_errors;
-            //(*g_debug_log)("%s\n", str().c_str());
+            *offset = get_role_offset(role_reply);
+            freeReplyObject(role_reply);
+            return redis_reply;
         }
     }
+    if (redis_reply != NULL)
+        freeReplyObject(redis_reply);
+    if (role_reply != NULL)
+        freeReplyObject(role_reply);
+    return NULL;
+}
 
-    void close()
-    {
-        if (_redis_context != NULL)
-        {
-            redisFree(_redis_context);
-            _redis_context = NULL;
-        }
-    }
-
-    std::string str() const
-    {
-        return format_string("node://(connerrors:%u)%s:%d", _conn_errors, _node.first.c_str(), _node.second);
-    }
-
-    unsigned int get_conn_errors() const
-    {
-        return _conn_errors;
-    }
-
-    void inc_conn_errors()
-    {
-        ++_conn_errors;
-    }
-
-    void reset_conn_errors()
-    {
-        _conn_errors = 0;
-    }
-
-    void set_conn_errors(unsigned int conn_errors)
-    {
-        _conn_errors = conn_errors;
-    }
+// Writes the command out without waiting for the reply
+static bool send_command(redisContext* redis_context, const CommandArgs& command_args)
+{
+    int done = 0;
 
-    bool need_refresh_master() const
+    if (REDIS_OK != redisAppendCommandArgv(redis_context, command_args.get_argc(), command_args.get_argv(), command_args.get_argvlen()))
+        return false;
+    do
     {
-        return ((_conn_errors>3 && 0==_conn_errors%3) || (_conn_errors>2018));
-    }
-
-protected:
-    NodeId _nodeid;
-    Node _node;
-    redisContext* _redis_context;
-    unsigned int _conn_errors; // 连续连接失败数
-};
-
-class CRedisMasterNode;
+        if (REDIS_OK != redisBufferWrite(redis_context, &done))
+            return false;
+    } while (!done);
+    return true;
+}
 
-class CRedisReplicaNode: public CRedisNode
+// Calculate the time elapsed to execute the redis command in microseconds.
+static int64_t calc_elapsed_time(const struct timeval& start_tv, const struct timeval& stop_tv)
 {
-public:
-    CRedisReplicaNode(const NodeId& node_id, const Node& node, redisContext* redis_context)
-        : CRedisNode(node_id, node, redis_context),
-          _redis_master_node(NULL)
-    {
-    }
-
-private:
-    CRedisMasterNode* _redis_master_node;
-};
+    return static_cast<int64_t>((stop_tv.tv_sec - start_tv.tv_sec) * (__UINT64_C(1000000)) + (stop_tv.tv_usec - start_tv.tv_usec));
+}
 
-class CRedisMasterNode: public CRedisNode
+std::string zaddflag2str(ZADDFLAG zaddflag)
 {
-public:
-    CRedisMasterNode(const NodeId& node_id, const Node& node, redisContext* redis_context)
-        : CRedisNode(node_id, node, redis_context),
-          _index(0)
-    {
-    }
-
-    ~CRedisMasterNode()
-    {
-        clear();
-    }
-
-    void clear()
-    {
-        for (RedisReplicaNodeTable::iterator iter=_redis_replica_nodes.begin(); iter!=_redis_replica_nodes.end(); ++iter)
-        {
-            CRedisReplicaNode* replica_node = iter->second;
-            delete replica_node;
-        }
-        _redis_replica_nodes.clear();
-    }
-
-    void add_replica_node(CRedisReplicaNode* redis_replica_node)
-    {
-        const Node& node = redis_replica_node->get_node();
-        const std::pair<RedisReplicaNodeTable::iterator, bool> ret = _redis_replica_nodes.insert(std::make_pair(node, redis_replica_node));
-        if (!ret.second)
-        {
-            CRedisReplicaNode* old_replica_node = ret.first->second;
-            delete old_replica_node;
-            ret.first->second = redis_replica_node;
-        }
-    }
+    std::string zaddflag_str;
 
-    CRedisNode* choose_node(ReadPolicy read_policy)
+    switch (zaddflag)
     {
-        const unsigned int num_redis_replica_nodes = static_cast<unsigned int>(_redis_replica_nodes.size());
-        CRedisNode* redis_node = NULL;
-
-        if (0 == num_redis_replica_nodes)
-        {
-            redis_node = this;
-        }
-        else
-        {
-            unsigned int K = _index++ % (num_redis_replica_nodes+1); // Included master
-
-            if (RP_READ_REPLICA==read_policy && K==num_redis_replica_nodes)
-            {
-                redis_node = this;
-            }
-            else
-            {
-                RedisReplicaNodeTable::iterator iter = _redis_replica_nodes.begin();
-
-                for (unsigned int i=0; i<K; ++i)
-                {
-                    if (++iter == _redis_replica_nodes.end())
-                        iter = _redis_replica_nodes.begin();
-                }
-                if (iter != _redis_replica_nodes.end())
-                {
-                    redis_node = iter->second;
-                }
-                if (NULL == redis_node)
-                {
-                    redis_node = this;
-                }
-            }
-        }
-
-        return redis_node;
+    case Z_XX:
+        zaddflag_str = "XX";
+        break;
+    case Z_NX:
+        zaddflag_str = "NX";
+        break;
+    case Z_CH:
+        zaddflag_str = "CH";
+        break;
+    default:
+        break;
     }
 
-private:
-#if __cplusplus < 201103L
-    typedef std::tr1::unordered_map<Node, CRedisReplicaNode*, NodeHasher> RedisReplicaNodeTable;
-#else
-    typedef std::unordered_map<Node, CRedisReplicaNode*, NodeHasher> RedisReplicaNodeTable;
-#endif // __cplusplus < 201103L
-    RedisReplicaNodeTable _redis_replica_nodes;
-    unsigned int _index;
-};
+    return zaddflag_str;
+}
 
-////////////////////////////////////////////////////////////////////////////////
-// RedisReplyHelper
+size_t NodeHasher::operator ()(const Node& node) const
+{
+    const unsigned char* s = reinterpret_cast<const unsigned char*>(node.first.c_str());
+    const uint64_t l = static_cast<uint64_t>(node.first.size());
+    uint64_t crc = 0;
+    return static_cast<size_t>(crc64(crc, s, l));
+}
 
-RedisReplyHelper::RedisReplyHelper()
-    : _redis_reply(NULL)
+std::string& node2string(const Node& node, std::string* str)
 {
+    if (is_unix_socket_node(node))
+        *str = std::string("unix:") + node.first;
+    else
+        *str = node.first + std::string(":") + int2string(node.second);
+    return *str;
 }
 
-RedisReplyHelper::RedisReplyHelper(const redisReply* redis_reply)
-    : _redis_reply(redis_reply)
+std::string node2string(const Node& node)
 {
+    std::string nodestr;
+    return node2string(node, &nodestr);
 }
 
-RedisReplyHelper::RedisReplyHelper(const RedisReplyHelper& other)
+bool is_unix_socket_node(const Node& node)
 {
-    _redis_reply = other.detach();
+    return (0 == node.second) && !node.first.empty() && ('/' == node.first[0]);
 }
 
-RedisReplyHelper::~RedisReplyHelper()
+SocketOptions::SocketOptions()
+    : tcp_nodelay(true),
+      keepalive_idle_seconds(0),
+      keepalive_interval_seconds(0),
+      keepalive_count(0),
+      send_buffer_bytes(0),
+      receive_buffer_bytes(0),
+      user_timeout_milliseconds(0)
 {
-    free();
 }
 
-RedisReplyHelper::operator bool() const
+CircuitBreakerOptions::CircuitBreakerOptions()
+    : failure_threshold(3),
+      open_milliseconds(1000)
 {
-    return _redis_reply != NULL;
 }
 
-void RedisReplyHelper::free()
+ReplicaLagOptions::ReplicaLagOptions()
+    : max_lag_bytes(-1),
+      max_lag_seconds(-1)
 {
-    if (_redis_reply != NULL)
-    {
-        freeReplyObject((void*)_redis_reply);
-        _redis_reply = NULL;
-    }
 }
 
-const redisReply* RedisReplyHelper::get() const
+HedgeOptions::HedgeOptions()
+    : percentile(95),
+      min_delay_milliseconds(1),
+      budget_percent(5),
+      min_samples(100)
 {
-    return _redis_reply;
 }
 
-const redisReply* RedisReplyHelper::detach() const
+AdmissionOptions::AdmissionOptions()
+    : max_inflight_requests(0),
+      max_inflight_bytes(0),
+      max_total_inflight_requests(0),
+      policy(ADMISSION_BLOCK),
+      max_wait_milliseconds(100),
+      bulk_percent(50)
 {
-    const redisReply* redis_reply = _redis_reply;
-    _redis_reply = NULL;
-    return redis_reply;
 }
 
-RedisReplyHelper& RedisReplyHelper::operator =(const redisReply* redis_reply)
+PriorityLaneOptions::PriorityLaneOptions()
+    : classify_bulk_commands(true),
+      max_inflight_bulk_commands(4),
+      max_wait_milliseconds(1000)
 {
-    free();
-    _redis_reply = redis_reply;
-    return *this;
 }
 
-RedisReplyHelper& RedisReplyHelper::operator =(const RedisReplyHelper& other)
+AdaptiveTimeoutOptions::AdaptiveTimeoutOptions()
+    : percentile(99),
+      multiplier(4),
+      min_timeout_milliseconds(20),
+      max_timeout_milliseconds(0),
+      min_samples(100)
 {
-    free();
-    _redis_reply = other.detach();
-    return *this;
 }
 
-const redisReply* RedisReplyHelper::operator ->() const
+WriteBufferOptions::WriteBufferOptions()
+    : max_commands(10000),
+      max_delay_milliseconds(5000),
+      final_flush_milliseconds(1000)
 {
-    return _redis_reply;
 }
 
-std::ostream& RedisReplyHelper::operator <<(std::ostream& os)
+ReadRoute::ReadRoute(ReadPolicy read_policy)
+    : read_policy(read_policy)
 {
-    os << *_redis_reply;
-    return os;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// ErrorInfo
+ReadRoute::ReadRoute(const Node& node, ReadPolicy read_policy)
+    : read_policy(read_policy),
+      node(node)
+{
+}
 
-ErrorInfo::ErrorInfo()
-    : errcode(0)
+ReadRoute::ReadRoute(const std::string& zone)
+    : read_policy(RP_PRIORITY_LOCAL_ZONE),
+      zone(zone)
 {
 }
 
-ErrorInfo::ErrorInfo(const std::string& raw_errmsg_, const std::string& errmsg_, const std::string& errtype_, int errcode_)
-    : raw_errmsg(raw_errmsg_), errmsg(errmsg_), errtype(errtype_), errcode(errcode_)
+int64_t SessionToken::get_offset(const Node& master_node) const
 {
+    const std::map<Node, int64_t>::const_iterator iter = _offsets.find(master_node);
+    return (iter == _offsets.end())? -1: iter->second;
 }
 
-void ErrorInfo::clear()
+void SessionToken::update_offset(const Node& master_node, int64_t offset)
 {
-    errcode = 0;
-    errtype.clear();
-    errmsg.clear();
-    raw_errmsg.clear();
+    const std::pair<std::map<Node, int64_t>::iterator, bool> ret = _offsets.insert(std::make_pair(master_node, offset));
+    if (!ret.second && ret.first->second<offset)
+        ret.first->second = offset;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// CRedisException
+void SessionToken::pin_master(const Node& master_node, int64_t until_milliseconds)
+{
+    _pinned_masters[master_node] = until_milliseconds;
+}
 
-CRedisException::CRedisException(
-        const struct ErrorInfo& errinfo,
-        const char* file, int line,
-        const std::string& node_ip, uint16_t node_port,
-        const std::string& command, const std::string& key) throw ()
-    :  _errinfo(errinfo),
-       _line(line),
-       _node_ip(node_ip), _node_port(node_port),
-       _command(command), _key(key)
+bool SessionToken::is_master_pinned(const Node& master_node, int64_t now_milliseconds) const
 {
-    const char* slash_position = strrchr(file, '/');
-    const std::string* file_cp = &_file;
-    std::string* file_p = const_cast<std::string*>(file_cp);
+    const std::map<Node, int64_t>::const_iterator iter = _pinned_masters.find(master_node);
+    return iter!=_pinned_masters.end() && now_milliseconds<iter->second;
+}
 
-    if (NULL == slash_position)
-    {
-        *file_p = file;
-    }
-    else
+std::string SessionToken::str() const
+{
+    std::string str = "session://";
+    for (std::map<Node, int64_t>::const_iterator iter=_offsets.begin(); iter!=_offsets.end(); ++iter)
     {
-        *file_p = std::string(slash_position + 1);
+        if (iter != _offsets.begin())
+            str += ",";
+        str += format_string("%s:%" PRId64, node2string(iter->first).c_str(), iter->second);
     }
+    return str;
 }
 
-const char* CRedisException::what() const throw()
+std::string NodeInfo::str() const
 {
-    return _errinfo.errmsg.c_str();
+    return format_string("nodeinfo://%s/%s:%d/%s", id.c_str(), node.first.c_str(), node.second, flags.c_str());
 }
 
-std::string CRedisException::str() const throw ()
+bool NodeInfo::is_master() const
 {
-    const std::string& errmsg = format_string("redis_exception://%s:%d/CMD:%s/%s/(%d)%s@%s:%d/(KEY:%.*s)",
-            _node_ip.c_str(), _node_port,
-            _command.c_str(),
-            _errinfo.errtype.c_str(), _errinfo.errcode, _errinfo.errmsg.c_str(),
-            _file.c_str(), _line,
-            static_cast<int>(_key.size()), _key.c_str());
-
-#if __cplusplus < 201103L
-    return errmsg;
-#else
-    return std::move(errmsg);
-#endif // __cplusplus < 201103L
+    const std::string::size_type pos = flags.find("master");
+    return (pos != std::string::npos);
 }
 
-bool is_general_error(const std::string& errtype)
+bool NodeInfo::is_replica() const
 {
-    return (errtype.size() == sizeof("ERR")-1) && (errtype == "ERR");
+    const std::string::size_type pos = flags.find("slave");
+    return (pos != std::string::npos);
 }
 
-bool is_ask_error(const std::string& errtype)
+bool NodeInfo::is_fail() const
 {
-    return (errtype.size() == sizeof("ASK")-1) && (errtype == "ASK");
+    const std::string::size_type pos = flags.find("fail");
+    return (pos != std::string::npos);
 }
 
-bool is_clusterdown_error(const std::string& errtype)
+bool TopologyDiff::empty() const
 {
-    // CLUSTERDOWN The cluster is down
-    // 如果在从未成为主之前，将主和从同时干掉，则即使从正常了，从也无法成为主，
-    // 这个时候必须将原来的主恢复，否则该部分slots就不能再服务
-    return (errtype.size() == sizeof("CLUSTERDOWN")-1) && (errtype == "CLUSTERDOWN");
+    return slot_changes.empty() && added_masters.empty() && removed_masters.empty() &&
+           added_replicas.empty() && removed_replicas.empty();
 }
 
-bool is_moved_error(const std::string& errtype)
+std::string TopologyDiff::str() const
 {
-    return (errtype.size() == sizeof("MOVED")-1) && (errtype == "MOVED");
+    return format_string("topology://slot_changes/%d/added_masters/%d/removed_masters/%d/promoted_masters/%d/added_replicas/%d/removed_replicas/%d",
+            static_cast<int>(slot_changes.size()), static_cast<int>(added_masters.size()), static_cast<int>(removed_masters.size()),
+            static_cast<int>(promoted_masters.size()), static_cast<int>(added_replicas.size()), static_cast<int>(removed_replicas.size()));
 }
 
-bool is_noauth_error(const std::string& errtype)
+// Taken before and after a change to compute the TopologyDiff
+struct TopologyView
 {
-    // NOAUTH Authentication required.
-    return (errtype.size() == sizeof("NOAUTH")-1) && (errtype == "NOAUTH");
-}
+    std::vector<uint16_t> slot2index;
+    std::vector<Node> index2node;
+    std::set<Node> masters;
+    std::set<Node> replicas;
 
-bool is_noscript_error(const std::string& errtype)
-{
-    // NOSCRIPT No matching script. Please use EVAL.
-    return (errtype.size() == sizeof("NOSCRIPT")-1) && (errtype == "NOSCRIPT");
+    const Node& get_slot_node(int slot) const
+    {
+        static const Node empty_node("", 0);
+        const uint16_t index = slot2index.empty()? static_cast<uint16_t>(INVALID_NODE_INDEX): slot2index[slot];
+        return (index < index2node.size())? index2node[index]: empty_node;
+    }
+};
+
+static void diff_nodes(const std::set<Node>& old_nodes, const std::set<Node>& new_nodes, std::vector<Node>* added_nodes, std::vector<Node>* removed_nodes)
+{
+    std::set_difference(new_nodes.begin(), new_nodes.end(), old_nodes.begin(), old_nodes.end(), std::back_inserter(*added_nodes));
+    std::set_difference(old_nodes.begin(), old_nodes.end(), new_nodes.begin(), new_nodes.end(), std::back_inserter(*removed_nodes));
 }
 
-bool is_wrongtype_error(const std::string& errtype)
+static void diff_topology(const struct TopologyView& old_view, const struct TopologyView& new_view, struct TopologyDiff* diff)
 {
-    return (errtype.size() == sizeof("WRONGTYPE")-1) && (errtype == "WRONGTYPE");
+    for (int slot=0; slot<CLUSTER_SLOTS; ++slot)
+    {
+        const Node& old_node = old_view.get_slot_node(slot);
+        const Node& new_node = new_view.get_slot_node(slot);
+
+        if (old_node != new_node)
+        {
+            // Consecutive slots with the same move are merged into one range
+            if (!diff->slot_changes.empty() &&
+                diff->slot_changes.back().end_slot==slot-1 &&
+                diff->slot_changes.back().old_node==old_node &&
+                diff->slot_changes.back().new_node==new_node)
+            {
+                diff->slot_changes.back().end_slot = slot;
+            }
+            else
+            {
+                struct SlotOwnerChange slot_change;
+                slot_change.begin_slot = slot;
+                slot_change.end_slot = slot;
+                slot_change.old_node = old_node;
+                slot_change.new_node = new_node;
+                diff->slot_changes.push_back(slot_change);
+            }
+        }
+    }
+
+    diff_nodes(old_view.masters, new_view.masters, &diff->added_masters, &diff->removed_masters);
+    diff_nodes(old_view.replicas, new_view.replicas, &diff->added_replicas, &diff->removed_replicas);
+    for (std::vector<Node>::size_type i=0; i<diff->added_masters.size(); ++i)
+    {
+        if (old_view.replicas.count(diff->added_masters[i]) > 0)
+            diff->promoted_masters.push_back(diff->added_masters[i]);
+    }
 }
 
-bool is_busygroup_error(const std::string& errtype)
+////////////////////////////////////////////////////////////////////////////////
+// CCommandArgs
+
+CommandArgs::CommandArgs()
+    : _argc(0), _argv(NULL), _argvlen(NULL)
 {
-    return (errtype.size() == sizeof("BUSYGROUP")-1) && (errtype == "BUSYGROUP");
 }
 
-bool is_nogroup_error(const std::string& errtype)
+CommandArgs::~CommandArgs()
 {
-    return (errtype.size() == sizeof("NOGROUP")-1) && (errtype == "NOGROUP");
+    delete []_argvlen;
+    for (int i=0; i<_argc; ++i)
+        delete []_argv[i];
+    delete []_argv;
 }
 
-bool is_crossslot_error(const std::string& errtype)
+void CommandArgs::set_key(const std::string& key)
 {
-    return (errtype.size() == sizeof("CROSSSLOT")-1) && (errtype == "CROSSSLOT");
+    _key = key;
 }
 
-////////////////////////////////////////////////////////////////////////////////
-// CRedisClient
+void CommandArgs::set_command(const std::string& command)
+{
+    _command = command;
+}
 
-CRedisClient::CRedisClient(
-        const std::string& raw_nodes_string,
-        int connect_timeout_milliseconds,
-        int readwrite_timeout_milliseconds,
-        const std::string& password,
-        ReadPolicy read_policy
-        )
-            : _command_monitor(NULL),
-              _raw_nodes_string(raw_nodes_string),
-              _connect_timeout_milliseconds(connect_timeout_milliseconds),
-              _readwrite_timeout_milliseconds(readwrite_timeout_milliseconds),
-              _password(password),
-              _read_policy(read_policy)
+void CommandArgs::add_arg(const std::string& arg)
 {
-    init();
+    _args.push_back(arg);
 }
 
-CRedisClient::CRedisClient(
-        const std::string& raw_nodes_string,
-        const std::string& password,
-        int connect_timeout_milliseconds,
-        int readwrite_timeout_milliseconds,
-        ReadPolicy read_policy)
-            : _command_monitor(NULL),
-              _raw_nodes_string(raw_nodes_string),
-              _connect_timeout_milliseconds(connect_timeout_milliseconds),
-              _readwrite_timeout_milliseconds(readwrite_timeout_milliseconds),
-              _password(password),
-              _read_policy(read_policy)
+void CommandArgs::add_arg(char arg)
 {
-    init();
+    const std::string str(&arg, 1);
+    add_arg(str);
 }
 
-CRedisClient::CRedisClient(
-        const std::string& raw_nodes_string,
-        ReadPolicy read_policy,
-        const std::string& password,
-        int connect_timeout_milliseconds,
-        int readwrite_timeout_milliseconds)
-            : _command_monitor(NULL),
-              _raw_nodes_string(raw_nodes_string),
-              _connect_timeout_milliseconds(connect_timeout_milliseconds),
-              _readwrite_timeout_milliseconds(readwrite_timeout_milliseconds),
-              _password(password),
-              _read_policy(read_policy)
+void CommandArgs::add_arg(int32_t arg)
 {
-    init();
+    _args.push_back(int2string(arg));
 }
 
-CRedisClient::~CRedisClient()
+void CommandArgs::add_arg(uint32_t arg)
 {
-    fini();
+    _args.push_back(int2string(arg));
 }
 
-const std::string& CRedisClient::get_raw_nodes_string() const
+void CommandArgs::add_arg(int64_t arg)
 {
-    return _raw_nodes_string;
+    _args.push_back(int2string(arg));
 }
 
-const std::string& CRedisClient::get_nodes_string() const
+void CommandArgs::add_args(const std::vector<std::string>& args)
 {
-    return _nodes_string;
+    for (std::vector<std::string>::size_type i=0; i<args.size(); ++i)
+    {
+        const std::string& arg = args[i];
+        add_arg(arg);
+    }
 }
 
-std::string CRedisClient::str() const
+void CommandArgs::add_args(const std::vector<std::pair<std::string, std::string> >& values)
 {
-    if (cluster_mode())
-        return std::string("rediscluster://") + _raw_nodes_string;
-    else
-        return std::string("redisstandalone://") + _raw_nodes_string;
+    for (std::vector<std::string>::size_type i=0; i<values.size(); ++i)
+    {
+        const std::string& field = values[i].first;
+        const std::string& value = values[i].second;
+        add_arg(field);
+        add_arg(value);
+    }
 }
 
-bool CRedisClient::cluster_mode() const
+void CommandArgs::add_args(const std::map<std::string, std::string>& map)
 {
-    return _nodes.size() > 1;
+    for (std::map<std::string, std::string>::const_iterator iter=map.begin(); iter!=map.end(); ++iter)
+    {
+        add_arg(iter->first);
+        add_arg(iter->second);
+    }
 }
 
-const char* CRedisClient::get_mode_str() const
+void CommandArgs::add_args(const std::map<std::string, int64_t>& map, bool reverse)
 {
-    return cluster_mode()? "CLUSTER": "STANDALONE";
+    for (std::map<std::string, int64_t>::const_iterator iter=map.begin(); iter!=map.end(); ++iter)
+    {
+        if (!reverse)
+        {
+            add_arg(iter->first);
+            add_arg(iter->second);
+        }
+        else
+        {
+            add_arg(iter->second);
+            add_arg(iter->first);
+        }
+    }
 }
 
-void CRedisClient::enable_debug_log()
+void CommandArgs::add_args(const std::vector<FVPair>& fvpairs)
 {
-    _enable_debug_log = true;
+    for (std::vector<FVPair>::size_type i=0; i<fvpairs.size(); ++i)
+    {
+        const FVPair& fvpair = fvpairs[i];
+        add_arg(fvpair.field);
+        add_arg(fvpair.value);
+    }
 }
 
-void CRedisClient::disable_debug_log()
+void CommandArgs::final()
 {
-    _enable_debug_log = false;
+    _argc = static_cast<int>(_args.size());
+    _argv = new char*[_argc];
+    _argvlen = new size_t[_argc];
+
+    for (int i=0; i<_argc; ++i)
+    {
+        _argvlen[i] = _args[i].size();
+        _argv[i] = new char[_argvlen[i]+1];
+        memcpy(_argv[i], _args[i].c_str(), _argvlen[i]); // Support binary key&value.
+        _argv[i][_argvlen[i]] = '\0';
+    }
 }
 
-void CRedisClient::enable_info_log()
+int CommandArgs::get_argc() const
 {
-    _enable_info_log = true;
+    return _argc;
 }
 
-void CRedisClient::disable_info_log()
+const char** CommandArgs::get_argv() const
 {
-    _enable_info_log = false;
+    return (const char**)_argv;
 }
 
-void CRedisClient::enable_error_log()
+const size_t* CommandArgs::get_argvlen() const
 {
-    _enable_error_log = true;
+    return _argvlen;
 }
 
-void CRedisClient::disable_error_log()
+const std::string& CommandArgs::get_command() const
 {
-    _enable_error_log = false;
+    return _command;
 }
 
-int CRedisClient::list_nodes(std::vector<struct NodeInfo>* nodes_info)
+const std::string& CommandArgs::get_key() const
 {
-    struct ErrorInfo errinfo;
+    return _key;
+}
 
-    for (RedisMasterNodeTable::iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
+// Latency distribution in microseconds, for the hedge delay and adaptive timeouts.
+// Bucket widths grow by powers of 2 with 4 sub-buckets each,
+// all counts are halved when the samples exceed MAX_SAMPLES so that old samples fade out.
+class CLatencyHistogram
+{
+public:
+    enum
     {
-        const Node& node = iter->first;
-        struct CRedisNode* redis_node = iter->second;
-        redisContext* redis_context = redis_node->get_redis_context();
+        NUM_BUCKETS = 128,
+        MAX_SAMPLES = 10000
+    };
 
-        if (redis_context != NULL)
+    CLatencyHistogram()
+        : _num_samples(0)
+    {
+        memset(_buckets, 0, sizeof(_buckets));
+    }
+
+    void add(int64_t cost_us)
+    {
+        if (++_num_samples > MAX_SAMPLES)
         {
-            if (list_cluster_nodes(nodes_info, &errinfo, redis_context, node))
-                break;
+            _num_samples = 0;
+            for (int i=0; i<NUM_BUCKETS; ++i)
+            {
+                _buckets[i] /= 2;
+                _num_samples += _buckets[i];
+            }
+            ++_num_samples;
         }
+        ++_buckets[get_bucket(cost_us)];
     }
-    if (nodes_info->empty())
+
+    int64_t get_num_samples() const
     {
-        THROW_REDIS_EXCEPTION(errinfo);
+        return _num_samples;
     }
 
-    return static_cast<int>(nodes_info->size());
-}
-
-void CRedisClient::flushall()
-{
-    const int num_retries = NUM_RETRIES;
-    const std::string key;
-    CommandArgs cmd_args;
-    cmd_args.set_command("FLUSHALL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.final();
+    // The upper bound of the bucket the percentile falls in
+    int64_t get_percentile(int percentile) const
+    {
+        const int64_t rank = (_num_samples * percentile + 99) / 100;
+        int64_t count = 0;
 
-    // Simple string reply (REDIS_REPLY_STATUS)
-    redis_command(true, num_retries, key, cmd_args, NULL);
-}
+        for (int i=0; i<NUM_BUCKETS; ++i)
+        {
+            count += _buckets[i];
+            if (count >= rank)
+                return get_upper_bound(i);
+        }
+        return get_upper_bound(NUM_BUCKETS-1);
+    }
 
-void CRedisClient::multi(const std::string& key, Node* which)
-{
-    if (cluster_mode())
+private:
+    static int get_bucket(int64_t cost_us)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errcode = ERROR_NOT_SUPPORT;
-        errinfo.errmsg = "MULTI not supported in cluster mode";
-        THROW_REDIS_EXCEPTION(errinfo);
+        if (cost_us < 4)
+            return (cost_us < 0)? 0: static_cast<int>(cost_us);
+
+        const int msb = 63 - __builtin_clzll(static_cast<unsigned long long>(cost_us));
+        const int bucket = msb*4 + static_cast<int>((cost_us >> (msb-2)) & 3);
+        return (bucket < NUM_BUCKETS)? bucket: NUM_BUCKETS-1;
     }
-    else
+
+    static int64_t get_upper_bound(int bucket)
     {
-        const int num_retries = 0;
-        CommandArgs cmd_args;
-        cmd_args.set_key(key);
-        cmd_args.set_command("MULTI");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.final();
+        if (bucket < 4)
+            return bucket;
 
-        // Simple string reply (REDIS_REPLY_STATUS):
-        // always OK.
-        redis_command(false, num_retries, key, cmd_args, which);
+        const int msb = bucket / 4;
+        const int64_t lower_bound = static_cast<int64_t>(4 + bucket%4) << (msb-2);
+        return lower_bound + (static_cast<int64_t>(1) << (msb-2)) - 1;
     }
-}
 
-const RedisReplyHelper CRedisClient::exec(const std::string& key, Node* which)
+private:
+    int64_t _num_samples;
+    int64_t _buckets[NUM_BUCKETS];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// CRedisNode
+// CRedisMasterNode
+// CRedisReplicaNode
+
+class CRedisNode
 {
-    if (cluster_mode())
+public:
+    // 熔断器状态
+    enum BreakerState
     {
-        struct ErrorInfo errinfo;
-        errinfo.errcode = ERROR_NOT_SUPPORT;
-        errinfo.errmsg = "EXEC not supported in cluster mode";
-        THROW_REDIS_EXCEPTION(errinfo);
+        BREAKER_CLOSED,   // 正常放行，统计连续失败数
+        BREAKER_OPEN,     // 连续失败达到阈值，直接拒绝请求
+        BREAKER_HALF_OPEN // 熔断期满，放行一个探测请求
+    };
+
+public:
+    CRedisNode(const NodeId& nodeid, const Node& node, redisContext* redis_context)
+        : _nodeid(nodeid),
+          _node(node),
+          _redis_context(redis_context),
+          _conn_errors(0),
+          _breaker_state(BREAKER_CLOSED),
+          _breaker_opened_time(0),
+          _probe_time(0),
+          _need_refresh_master(false),
+          _ewma_latency_us(0),
+          _latency_update_time(0),
+          _zone_generation(0),
+          _local_zone(false),
+          _outstanding_requests(get_outstanding_counter(node)),
+          _pending_replies(0),
+          _timeout_milliseconds(-1),
+          _bulk_lane(false),
+          _other_redis_context(NULL),
+          _other_pending_replies(0),
+          _other_timeout_milliseconds(-1)
+    {
+        for (int i=0; i<NUM_LATENCY_CLASSES; ++i)
+            _latency_histograms[i] = NULL;
     }
-    else
-    {
-        const int num_retries = 0;
-        CommandArgs cmd_args;
-        cmd_args.set_key(key);
-        cmd_args.set_command("EXEC");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.final();
 
-        // Array reply:
-        // each element being the reply to each of the commands in the atomic transaction.
-        return redis_command(false, num_retries, key, cmd_args, which);
+    ~CRedisNode()
+    {
+        close_bulk_lane();
+        close();
+        for (int i=0; i<NUM_LATENCY_CLASSES; ++i)
+            delete _latency_histograms[i];
     }
-}
 
-//
-// KEY/VALUE
-//
+    const NodeId& get_nodeid() const
+    {
+        return _nodeid;
+    }
 
-// Time complexity: O(1)
-// EXPIRE key seconds
-bool CRedisClient::expire(
-        const std::string& key,
-        uint32_t seconds,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("EXPIRE");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(seconds);
-    cmd_args.final();
+    const Node& get_node() const
+    {
+        return _node;
+    }
 
-    // Integer reply, specifically:
-    // 1 if the timeout was set.
-    // 0 if key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
-}
+    redisContext* get_redis_context() const
+    {
+        return _redis_context;
+    }
 
-bool CRedisClient::expireat(const std::string& key, int64_t timestamp, Node* which, int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("EXPIREAT");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(timestamp);
-    cmd_args.final();
+    void set_redis_context(redisContext* redis_context)
+    {
+        _redis_context = redis_context;
+        _timeout_milliseconds = -1;
+    }
 
-    // Integer reply, specifically:
-    // 1 if the timeout was set.
-    // 0 if key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
-}
+    // The caller takes the ownership of the connection
+    redisContext* detach_redis_context()
+    {
+        redisContext* redis_context = _redis_context;
+        _redis_context = NULL;
+        _timeout_milliseconds = -1;
+        return redis_context;
+    }
 
-// Time complexity: O(1)
-// EXISTS key [key ...]
-bool CRedisClient::exists(const std::string& key, Node* which, int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("EXISTS");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    void close()
+    {
+        if (_redis_context != NULL)
+        {
+            redisFree(_redis_context);
+            _redis_context = NULL;
+        }
+        _pending_replies = 0;
+        _timeout_milliseconds = -1;
+    }
 
-    // Integer reply, specifically:
-    // 1 if the key exists.
-    // 0 if the key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
-}
+    // Priority lanes: the connection of the lane in use is the one of all the other methods
+    void set_lane(bool bulk)
+    {
+        if (bulk != _bulk_lane)
+        {
+            std::swap(_redis_context, _other_redis_context);
+            std::swap(_pending_replies, _other_pending_replies);
+            std::swap(_timeout_milliseconds, _other_timeout_milliseconds);
+            _bulk_lane = bulk;
+        }
+    }
 
-// Time complexity:
-// O(N) where N is the number of keys that will be removed.
-// When a key to remove holds a value other than a string,
-// the individual complexity for this key is O(M) where M is the number of elements in the list, set, sorted set or hash.
-// Removing a single key that holds a string value is O(1).
-bool CRedisClient::del(const std::string& key, Node* which, int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("DEL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    void close_bulk_lane()
+    {
+        const bool bulk_lane = _bulk_lane;
+        set_lane(true);
+        close();
+        set_lane(bulk_lane);
+    }
 
-    // Integer reply:
-    // The number of keys that were removed.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
-}
+    CLatencyHistogram* get_latency_histogram(CommandClass command_class)
+    {
+        if (NULL == _latency_histograms[command_class])
+            _latency_histograms[command_class] = new CLatencyHistogram;
+        return _latency_histograms[command_class];
+    }
 
-// GET key
-// Time complexity: O(1)
-bool CRedisClient::get(
-        const std::string& key,
-        std::string* value,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("GET");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    // Changes the read/write timeout of the connection if different, 0 for no timeout
+    bool set_timeout(int timeout_milliseconds)
+    {
+        if (NULL==_redis_context || timeout_milliseconds==_timeout_milliseconds)
+            return true;
 
-    // Bulk string reply:
-    // the value of key, or nil when key does not exist.
-    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return false;
-    if (REDIS_REPLY_STRING == redis_reply->type)
-        return get_value(redis_reply.get(), value);
-    return true;
-}
+        struct timeval data_timeout;
+        data_timeout.tv_sec = timeout_milliseconds / 1000;
+        data_timeout.tv_usec = (timeout_milliseconds % 1000) * 1000;
+        if (REDIS_ERR == redisSetTimeout(_redis_context, data_timeout))
+            return false;
+        _timeout_milliseconds = timeout_milliseconds;
+        return true;
+    }
 
-// SET key value [EX seconds] [PX milliseconds] [NX|XX]
-// Time complexity: O(1)
-void CRedisClient::set(
-        const std::string& key,
-        const std::string& value,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("SET");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    int get_timeout() const
+    {
+        return _timeout_milliseconds;
+    }
 
-    // Simple string reply (REDIS_REPLY_STATUS):
-    // OK if SET was executed correctly.
+    // Restores the read/write timeout of the connections of both lanes changed by set_timeout()
+    void reset_timeout(int timeout_milliseconds)
+    {
+        const bool bulk_lane = _bulk_lane;
+        for (int i=0; i<2; ++i)
+        {
+            set_lane(1 == i);
+            if (_timeout_milliseconds >= 0)
+                set_timeout(timeout_milliseconds);
+        }
+        set_lane(bulk_lane);
+    }
 
-    // Null reply: a Null Bulk Reply is returned if the SET operation was not performed
-    // because the user specified the NX or XX option but the condition was not met.
-    //
-    // OK: redis_reply->str
-    redis_command(false, num_retries, key, cmd_args, which);
-}
+    // A hedged read won by another node leaves its reply on this connection
+    void add_pending_reply()
+    {
+        ++_pending_replies;
+    }
 
-// Time complexity: O(1)
-// SETNX key value
-bool CRedisClient::setnx(
-        const std::string& key,
-        const std::string& value,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("SETNX");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    bool has_pending_replies() const
+    {
+        return _pending_replies > 0;
+    }
 
-    // Integer reply, specifically:
-    // 1 if the key exists.
-    // 0 if the key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
-}
+    // Reads and drops the replies of hedged reads already arrived without blocking,
+    // returns false if some have not arrived yet
+    bool poll_pending_replies()
+    {
+        while (_pending_replies>0 && _redis_context!=NULL)
+        {
+            void* redis_reply = NULL;
+            if (REDIS_OK != redisGetReplyFromReader(_redis_context, &redis_reply))
+            {
+                close();
+                break;
+            }
+            if (NULL == redis_reply)
+            {
+                struct pollfd pollfd;
+                pollfd.fd = _redis_context->fd;
+                pollfd.events = POLLIN;
+                pollfd.revents = 0;
+                if (poll(&pollfd, 1, 0) <= 0)
+                    break;
+                if (REDIS_OK != redisBufferRead(_redis_context))
+                    close();
+                continue;
+            }
+            freeReplyObject(redis_reply);
+            --_pending_replies;
+            on_success(); // 对冲落败的节点也可能是熔断的探测请求
+        }
+        return 0 == _pending_replies;
+    }
 
-// Time complexity: O(1)
-// SETEX key seconds value
-void CRedisClient::setex(
-        const std::string& key,
-        const std::string& value,
-        uint32_t expired_seconds,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("SETEX");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(expired_seconds);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    // Reads and drops the replies left by hedged reads, the connection is closed on failure
+    void drain_pending_replies()
+    {
+        while (_pending_replies>0 && _redis_context!=NULL)
+        {
+            redisReply* redis_reply = NULL;
+            if (REDIS_OK != redisGetReply(_redis_context, reinterpret_cast<void**>(&redis_reply)))
+            {
+                close();
+                break;
+            }
+            freeReplyObject(redis_reply);
+            --_pending_replies;
+            on_success();
+        }
+    }
 
-    // Simple string reply (REDIS_REPLY_STATUS)
-    //
-    // OK: redis_reply->str
-    redis_command(false, num_retries, key, cmd_args, which);
-}
-
-bool CRedisClient::setnxex(
-        const std::string& key,
-        const std::string& value,
-        uint32_t expired_seconds,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("SET");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
-    cmd_args.add_arg("EX");
-    cmd_args.add_arg(expired_seconds);
-    cmd_args.add_arg("NX");
-    cmd_args.final();
-
-    // Simple string reply (REDIS_REPLY_STATUS):
-    // OK if SET was executed correctly.
-    //
-    // Null reply: a Null Bulk Reply is returned if the SET operation was not performed
-    // because the user specified the NX or XX option but the condition was not met.
-    //
-    // OK: redis_reply->str
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    return redis_reply->type != REDIS_REPLY_NIL;
-}
-
-// Time complexity: O(N) where N is the number of keys to retrieve.
-// MGET key [key ...]
-int CRedisClient::mget(
-        const std::vector<std::string>& keys,
-        std::vector<std::string>* values,
-        Node* which,
-        int num_retries)
-{
-    values->clear();
+    std::string str() const
+    {
+        return format_string("node://(connerrors:%u,breaker:%s)%s:%d",
+                _conn_errors, breaker_state2str(_breaker_state), _node.first.c_str(), _node.second);
+    }
 
-    if (!cluster_mode())
+    unsigned int get_conn_errors() const
     {
-        const std::string key;
-        CommandArgs cmd_args;
-        cmd_args.set_command("MGET");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_args(keys);
-        cmd_args.final();
+        return _conn_errors;
+    }
 
-        // Array reply:
-        // list of values at the specified keys.
-        //
-        // For every key that does not hold a string value or does not exist,
-        // the special value nil is returned. Because of this, the operation never fails.
-        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-        if (REDIS_REPLY_ARRAY == redis_reply->type)
-            return get_values(redis_reply.get(), values);
-        return 0;
+    // The state seen by the next request, an open breaker is half-open once the open period is over.
+    // Changes nothing, so candidates can be inspected with it.
+    BreakerState get_breaker_state(int64_t now_milliseconds, const CircuitBreakerOptions& options) const
+    {
+        if (BREAKER_OPEN==_breaker_state && now_milliseconds-_breaker_opened_time>=options.open_milliseconds)
+            return BREAKER_HALF_OPEN;
+        return _breaker_state;
     }
-    else
+
+    // Returns true if a request may be sent to the node:
+    // always if closed, never if open, and if half-open only while no probe is in flight.
+    bool is_available(int64_t now_milliseconds, const CircuitBreakerOptions& options) const
     {
-        values->resize(keys.size());
+        const BreakerState breaker_state = get_breaker_state(now_milliseconds, options);
+        if (BREAKER_CLOSED == breaker_state)
+            return true;
+        if (BREAKER_OPEN == breaker_state)
+            return false;
+        // 探测请求没有结果（如被准入控制拒绝）时，过了一个熔断期再放行下一个
+        return BREAKER_OPEN==_breaker_state || now_milliseconds-_probe_time>=options.open_milliseconds;
+    }
 
-        try
+    // Called right before a request is sent, returns false if it is not allowed.
+    // In half-open the request becomes the only probe until on_success() or on_failure().
+    bool try_acquire_probe(int64_t now_milliseconds, const CircuitBreakerOptions& options)
+    {
+        if (!is_available(now_milliseconds, options))
+            return false;
+        if (_breaker_state != BREAKER_CLOSED)
         {
-            for (std::vector<std::string>::size_type i=0; i<keys.size(); ++i)
-            {
-                const std::string& key = keys[i];
-                std::string& value = (*values)[i];
-                get(key, &value, NULL, num_retries);
-            }
+            _breaker_state = BREAKER_HALF_OPEN;
+            _probe_time = now_milliseconds;
         }
-        catch (CRedisException&)
+        return true;
+    }
+
+    // Returns true if the breaker is (re)opened
+    bool on_failure(int64_t now_milliseconds, const CircuitBreakerOptions& options)
+    {
+        ++_conn_errors;
+
+        // 包括熔断期满后连接失败的情况（尚未放行探测请求）
+        if ((BREAKER_CLOSED != _breaker_state) ||
+            (_conn_errors >= static_cast<unsigned int>(options.failure_threshold)))
         {
-            values->clear();
-            throw;
+            // 熔断期间可能发生了主从切换，需要刷新master
+            _breaker_state = BREAKER_OPEN;
+            _breaker_opened_time = now_milliseconds;
+            _need_refresh_master = true;
+            return true;
         }
-
-        return static_cast<int>(values->size());
+        return false;
     }
-}
-
-// Time complexity:
-// O(N) where N is the number of keys to set.
-// MSET key value [key value ...]
-int CRedisClient::mset(
-        const std::map<std::string, std::string>& kv_map,
-        Node* which,
-        int num_retries)
-{
-    int success = 0;
 
-    if (kv_map.empty())
+    void on_success()
     {
-        struct ErrorInfo errinfo;
-        errinfo.errcode = ERROR_PARAMETER;
-        errinfo.errmsg = "kv_map is empty";
-        THROW_REDIS_EXCEPTION(errinfo);
+        _conn_errors = 0;
+        _breaker_state = BREAKER_CLOSED;
     }
-    if (!cluster_mode())
-    {
-        const std::string key;
-        CommandArgs cmd_args;
-        cmd_args.set_command("MSET");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_args(kv_map);
-        cmd_args.final();
 
-        // Simple string reply:
-        // always OK since MSET can't fail.
-        redis_command(false, num_retries, key, cmd_args, which);
-        success = static_cast<int>(kv_map.size());
-    }
-    else
+    void set_nodeid(const NodeId& nodeid)
     {
-        for (std::map<std::string, std::string>::const_iterator iter=kv_map.begin(); iter!=kv_map.end(); ++iter)
-        {
-            const std::string& key = iter->first;
-            const std::string& value = iter->second;
-            set(key, value, which ,num_retries);
-            ++success;
-        }
+        _nodeid = nodeid;
     }
 
-    return success;
-}
+    // EWMA of the command cost, the new sample weighs 1/8.
+    // It starts from 0 so that a single slow sample (such as the first one of a connection) does not dominate.
+    void update_latency(int64_t cost_us, int64_t now_milliseconds)
+    {
+        _ewma_latency_us = get_latency(now_milliseconds);
+        _ewma_latency_us += (cost_us - _ewma_latency_us) / 8;
+        _latency_update_time = now_milliseconds;
+    }
 
-// Time complexity: O(1)
-// INCRBY key increment
-int64_t CRedisClient::incrby(
-        const std::string& key,
-        int64_t increment,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("INCRBY");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(increment);
-    cmd_args.final();
+    // Decays while the node gets no traffic, so a node slow once is tried again later
+    int64_t get_latency(int64_t now_milliseconds) const
+    {
+        const int64_t periods = (now_milliseconds - _latency_update_time) / LATENCY_HALF_LIFE_MILLISECONDS;
+        return (periods >= 63)? 0: (_ewma_latency_us >> periods);
+    }
 
-    // Integer reply:
-    // the value of key after the increment
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return redis_reply->integer;
-    return 0;
-}
+    // Requests in flight to the node from all clients of the process
+    void add_outstanding_request() { __sync_fetch_and_add(_outstanding_requests, 1); }
+    void remove_outstanding_request() { __sync_fetch_and_sub(_outstanding_requests, 1); }
+    int get_outstanding_requests() const { return *_outstanding_requests; }
 
-bool CRedisClient::key_type(const std::string& key, std::string* key_type, Node* which, int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("TYPE");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    // Valid only if the generation equals the zone generation of the client
+    bool is_local_zone() const { return _local_zone; }
+    unsigned int get_zone_generation() const { return _zone_generation; }
+    void set_local_zone(bool local_zone, unsigned int zone_generation)
+    {
+        _local_zone = local_zone;
+        _zone_generation = zone_generation;
+    }
 
-    // Simple string reply (REDIS_REPLY_STATUS):
-    // type of key, or none when key does not exist.
-    //
-    // (gdb) p *redis_reply._redis_reply
-    // $1 = {type = 5, integer = 0, len = 6, str = 0x742b50 "string", elements = 0, element = 0x0}
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get(), key_type);
-}
+    void set_need_refresh_master()
+    {
+        _need_refresh_master = true;
+    }
 
-int64_t CRedisClient::ttl(const std::string& key, Node* which, int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("TTL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    bool need_refresh_master() const
+    {
+        return _need_refresh_master;
+    }
 
-    // Integer reply:
-    // TTL in seconds, or a negative value in order to signal an error
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return redis_reply->integer;
-    return 0;
-}
+    void clear_need_refresh_master()
+    {
+        _need_refresh_master = false;
+    }
 
-// O(1) for every call. O(N) for a complete iteration,
-// including enough command calls for the cursor to return back to 0. N is the number of elements inside the collection.
-//
-// SCAN cursor [MATCH pattern] [COUNT count]
-int64_t CRedisClient::scan(int64_t cursor, std::vector<std::string>* values, Node* which, int num_retries)
-{
-    return scan(cursor, std::string(""), 0, values, which, num_retries);
-}
+private:
+    static const char* breaker_state2str(BreakerState breaker_state)
+    {
+        if (BREAKER_OPEN == breaker_state)
+            return "open";
+        else if (BREAKER_HALF_OPEN == breaker_state)
+            return "half-open";
+        else
+            return "closed";
+    }
 
-// SCAN cursor [MATCH pattern] [COUNT count]
-int64_t CRedisClient::scan(int64_t cursor, int count, std::vector<std::string>* values, Node* which, int num_retries)
-{
-    return scan(cursor, std::string(""), count, values, which, num_retries);
-}
+protected:
+    NodeId _nodeid;
+    Node _node;
+    redisContext* _redis_context;
+    unsigned int _conn_errors; // 连续连接失败数
+    BreakerState _breaker_state;
+    int64_t _breaker_opened_time; // 熔断开始时间（单调时钟毫秒数）
+    int64_t _probe_time; // 半开状态下放行探测请求的时间
+    bool _need_refresh_master;
+    int64_t _ewma_latency_us; // 延迟估计（微秒）
+    int64_t _latency_update_time; // 最后一次采样时间（单调时钟毫秒数）
+    unsigned int _zone_generation;
+    bool _local_zone; // 是否在所读的可用区（默认即本进程所在的）
+    volatile int* _outstanding_requests; // 本进程发往该节点、尚未收到回复的请求数
+    int _pending_replies; // 对冲读中落败的请求，回复尚未读取
+    int _timeout_milliseconds; // 自适应超时设置的读写超时，-1表示仍是连接时的
+    CLatencyHistogram* _latency_histograms[NUM_LATENCY_CLASSES]; // 各类命令的延迟，启用自适应超时后才有
+    bool _bulk_lane; // 当前使用的是否bulk连接
+    redisContext* _other_redis_context; // 另一条连接，与当前的交换使用
+    int _other_pending_replies;
+    int _other_timeout_milliseconds;
+};
 
-// SCAN cursor [MATCH pattern] [COUNT count]
-int64_t CRedisClient::scan(
-        int64_t cursor, const std::string& pattern,
-        std::vector<std::string>* values,
-        Node* which,
-        int num_retries)
-{
-    return scan(cursor, pattern, 0, values, which, num_retries);
-}
+class CRedisMasterNode;
 
-// SCAN cursor [MATCH pattern] [COUNT count]
-int64_t CRedisClient::scan(
-        int64_t cursor, const std::string& pattern, int count,
-        std::vector<std::string>* values,
-        Node* which,
-        int num_retries)
+class CRedisReplicaNode: public CRedisNode
 {
-    const std::string key;
-    CommandArgs cmd_args;
-    cmd_args.set_command("SCAN");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(cursor);
-    if (!pattern.empty())
+public:
+    CRedisReplicaNode(const NodeId& node_id, const Node& node, redisContext* redis_context)
+        : CRedisNode(node_id, node, redis_context),
+          _redis_master_node(NULL),
+          _lagging(false),
+          _replication_offset(-1)
     {
-        cmd_args.add_arg("MATCH");
-        cmd_args.add_arg(pattern);
     }
-    if (count > 0)
+
+    // Set by the replica lag check
+    bool is_lagging() const { return _lagging; }
+    void set_lagging(bool lagging) { _lagging = lagging; }
+
+    // The largest replication offset seen, -1 if unknown
+    int64_t get_replication_offset() const { return _replication_offset; }
+    void update_replication_offset(int64_t replication_offset)
     {
-        cmd_args.add_arg("COUNT");
-        cmd_args.add_arg(count);
+        if (replication_offset > _replication_offset)
+            _replication_offset = replication_offset;
     }
-    cmd_args.final();
 
-    // return value is an array of two values:
-    // the first value is the new cursor to use in the next call, the second value is an array of elements.
-    //
-    // *EMPTY*:
-    // (gdb) p *redis_reply
-    // $1 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 2, element = 0x63e450}
-    // (gdb) p *redis_reply->element[0]
-    // $3 = {type = 1, integer = 0, len = 1, str = 0x63e6f0 "0", elements = 0, element = 0x0}
-    // (gdb) p *redis_reply->element[1]
-    // $4 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 0, element = 0x0}
-    //
-    // *NON EMPTY*:
-    //
-    // redis-cli set k1 1
-    // redis-cli set k2 2
-    // redis-cli set k3 3
-    //
-    // (gdb) p *redis_reply
-    // $5 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 2, element = 0x63e450}
-    // (gdb) p *redis_reply->element[0]
-    // $6 = {type = 1, integer = 0, len = 1, str = 0x63e720 "1", elements = 0, element = 0x0}
-    // (gdb) p *redis_reply->element[1]
-    // $7 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 3, element = 0x63e780}
-    // (gdb) p *redis_reply->element[1]->element[0]
-    // $8 = {type = 1, integer = 0, len = 2, str = 0x63e820 "k2", elements = 0, element = 0x0}
-    // (gdb) p *redis_reply->element[1]->element[1]
-    // $9 = {type = 1, integer = 0, len = 2, str = 0x63e880 "k3", elements = 0, element = 0x0}
-    // (gdb) p *redis_reply->element[1]->element[2]
-    // $10 = {type = 1, integer = 0, len = 2, str = 0x63e8e0 "k1", elements = 0, element = 0x0}
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
+private:
+    CRedisMasterNode* _redis_master_node;
+    bool _lagging;
+    int64_t _replication_offset;
+};
+
+class CRedisMasterNode: public CRedisNode
+{
+public:
+    CRedisMasterNode(const NodeId& node_id, const Node& node, redisContext* redis_context)
+        : CRedisNode(node_id, node, redis_context),
+          _table_index(INVALID_NODE_INDEX)
     {
-        get_values(redis_reply->element[1], values);
-        return static_cast<int64_t>(atoll(redis_reply->element[0]->str));
     }
-    return 0;
-}
 
-//
-// EVAL
-//
+    // Position in CRedisClient::_master_node_array, which _slot2index refers to
+    uint16_t get_table_index() const { return _table_index; }
+    void set_table_index(uint16_t table_index) { _table_index = table_index; }
 
-// Time complexity: Depends on the script that is executed.
-// EVAL script numkeys key [key ...] arg [arg ...]
-const RedisReplyHelper CRedisClient::eval(
-        const std::string& key,
-        const std::string& lua_scripts,
-        Node* which,
-        int num_retries)
-{
-    const int numkeys = 1;
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("EVAL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(lua_scripts);
-    cmd_args.add_arg(numkeys);
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    ~CRedisMasterNode()
+    {
+        clear();
+    }
 
-    return redis_command(false, num_retries, key, cmd_args, which);
-}
+    void clear()
+    {
+        for (std::vector<CRedisReplicaNode*>::size_type i=0; i<_redis_replica_nodes.size(); ++i)
+            delete _redis_replica_nodes[i];
+        _redis_replica_nodes.clear();
+    }
 
-const RedisReplyHelper CRedisClient::eval(
-        const std::string& key,
-        const std::string& lua_scripts,
-        const std::vector<std::string>& parameters,
-        Node* which,
-        int num_retries)
-{
-    const int numkeys = 1;
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("EVAL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(lua_scripts);
-    cmd_args.add_arg(numkeys);
-    cmd_args.add_arg(key);
-    cmd_args.add_args(parameters);
-    cmd_args.final();
+    void add_replica_node(CRedisReplicaNode* redis_replica_node)
+    {
+        const int i = find_replica_index(redis_replica_node->get_node());
+        if (i < 0)
+        {
+            _redis_replica_nodes.push_back(redis_replica_node);
+        }
+        else
+        {
+            delete _redis_replica_nodes[i];
+            _redis_replica_nodes[i] = redis_replica_node;
+        }
+    }
 
-    return redis_command(false, num_retries, key, cmd_args, which);
-}
+    void get_replica_nodes(std::vector<CRedisReplicaNode*>* redis_replica_nodes) const
+    {
+        redis_replica_nodes->insert(redis_replica_nodes->end(), _redis_replica_nodes.begin(), _redis_replica_nodes.end());
+    }
 
-const RedisReplyHelper CRedisClient::evalsha(
-        const std::string& key,
-        const std::string& sha1,
-        const std::vector<std::string>& parameters,
-        Node* which, int num_retries)
-{
-    const int numkeys = 1;
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("EVALSHA");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(sha1);
-    cmd_args.add_arg(numkeys);
-    cmd_args.add_arg(key);
-    cmd_args.add_args(parameters);
-    cmd_args.final();
+    const std::vector<CRedisReplicaNode*>& get_replica_nodes() const
+    {
+        return _redis_replica_nodes;
+    }
 
-    return redis_command(false, num_retries, key, cmd_args, which);
-}
+    CRedisReplicaNode* find_replica_node(const Node& node) const
+    {
+        const int i = find_replica_index(node);
+        return (i < 0)? NULL: _redis_replica_nodes[i];
+    }
 
-const RedisReplyHelper CRedisClient::eval(
-        const std::string& lua_scripts,
-        const std::vector<std::string>& keys, const std::vector<std::string>& parameters,
-        Node* which,
-        int num_retries)
-{
-    if (cluster_mode() && keys_crossslots(keys))
+    // The caller takes the ownership of the returned replica
+    CRedisReplicaNode* remove_replica_node(const Node& node)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errcode = ERROR_NOT_SUPPORT;
-        errinfo.errmsg = "EVAL not supported in cluster mode";
-        THROW_REDIS_EXCEPTION(errinfo);
+        CRedisReplicaNode* redis_replica_node = NULL;
+        const int i = find_replica_index(node);
+        if (i >= 0)
+        {
+            redis_replica_node = _redis_replica_nodes[i];
+            _redis_replica_nodes.erase(_redis_replica_nodes.begin() + i);
+        }
+        return redis_replica_node;
     }
-    else
+
+    // The caller takes the ownership of all replicas
+    void detach_replica_nodes(std::vector<CRedisReplicaNode*>* redis_replica_nodes)
     {
-        const int numkeys = static_cast<int>(keys.size());
-        std::string key;
-        if (cluster_mode() && !keys.empty())
-            key = keys[0];
+        get_replica_nodes(redis_replica_nodes);
+        _redis_replica_nodes.clear();
+    }
 
-        CommandArgs cmd_args;
-        if (!key.empty())
-            cmd_args.set_key(key);
-        cmd_args.set_command("EVAL");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_arg(lua_scripts);
-        cmd_args.add_arg(numkeys);
-        cmd_args.add_args(keys);
-        cmd_args.add_args(parameters);
-        cmd_args.final();
-        return redis_command(false, num_retries, key, cmd_args, which);
+    // RP_READ_REPLICA takes the master as a candidate too, the master is returned if no candidate is available.
+    // RP_PRIORITY_LOCAL_ZONE tries the replicas in the local zone, then the master if it is local,
+    // then all replicas and the master as RP_READ_REPLICA.
+    CRedisNode* choose_node(ReadPolicy read_policy, int64_t now_milliseconds, const CircuitBreakerOptions& options)
+    {
+        CRedisNode* redis_node = NULL;
+
+        if (RP_PRIORITY_LOCAL_ZONE == read_policy)
+        {
+            redis_node = choose_two(false, true, now_milliseconds, options);
+            if (NULL==redis_node && is_local_zone() && is_available(now_milliseconds, options))
+                redis_node = this;
+        }
+        if (NULL == redis_node)
+        {
+            const bool include_master = (RP_READ_REPLICA==read_policy || RP_PRIORITY_LOCAL_ZONE==read_policy);
+            redis_node = choose_two(include_master, false, now_milliseconds, options);
+        }
+        return (NULL == redis_node)? this: redis_node;
     }
-}
 
-const RedisReplyHelper CRedisClient::evalsha(
-        const std::string& sha1,
-        const std::vector<std::string>& keys,
-        const std::vector<std::string>& parameters,
-        Node* which,
-        int num_retries)
-{
-    if (cluster_mode() && keys_crossslots(keys))
+    // Called when the master is not available, returns NULL if no replica is available
+    CRedisNode* choose_replica_node(ReadPolicy read_policy, int64_t now_milliseconds, const CircuitBreakerOptions& options)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errcode = ERROR_NOT_SUPPORT;
-        errinfo.errmsg = "EVAL not supported in cluster mode";
-        THROW_REDIS_EXCEPTION(errinfo);
+        CRedisNode* redis_node = NULL;
+
+        if (RP_PRIORITY_LOCAL_ZONE == read_policy)
+            redis_node = choose_two(false, true, now_milliseconds, options);
+        if (NULL == redis_node)
+            redis_node = choose_two(false, false, now_milliseconds, options);
+        return redis_node;
     }
-    else
+
+    // The available node with the lowest latency other than exclude_node to hedge a read on, NULL if none
+    CRedisNode* choose_hedge_node(const CRedisNode* exclude_node, int64_t now_milliseconds, const CircuitBreakerOptions& options)
     {
-        const int numkeys = static_cast<int>(keys.size());
-        std::string key;
-        if (cluster_mode() && !keys.empty())
-            key = keys[0];
+        const unsigned int num_candidates = static_cast<unsigned int>(_redis_replica_nodes.size()) + 1;
+        CRedisNode* hedge_node = NULL;
 
-        CommandArgs cmd_args;
-        if (!key.empty())
-            cmd_args.set_key(key);
-        cmd_args.set_command("EVALSHA");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_arg(sha1);
-        cmd_args.add_arg(numkeys);
-        cmd_args.add_args(keys);
-        cmd_args.add_args(parameters);
-        cmd_args.final();
-        return redis_command(false, num_retries, key, cmd_args, which);
+        for (unsigned int k=0; k<num_candidates; ++k)
+        {
+            CRedisNode* candidate = get_candidate(k);
+            if (candidate==exclude_node || !candidate->poll_pending_replies())
+                continue;
+            if (k<_redis_replica_nodes.size() && _redis_replica_nodes[k]->is_lagging())
+                continue;
+            if (hedge_node!=NULL && hedge_node->get_latency(now_milliseconds)<=candidate->get_latency(now_milliseconds))
+                continue;
+            if (candidate->is_available(now_milliseconds, options))
+                hedge_node = candidate;
+        }
+        return hedge_node;
     }
-}
 
-//
-// HASH
-//
+private:
+    int find_replica_index(const Node& node) const
+    {
+        for (std::vector<CRedisReplicaNode*>::size_type i=0; i<_redis_replica_nodes.size(); ++i)
+        {
+            if (_redis_replica_nodes[i]->get_node() == node)
+                return static_cast<int>(i);
+        }
+        return -1;
+    }
 
-// Time complexity: O(N) where N is the number of fields to be removed.
-// HDEL key field [field ...]
-bool CRedisClient::hdel(const std::string& key, const std::string& field, Node* which, int num_retries)
+    // Candidate k is the master if k equals the number of replicas
+    CRedisNode* get_candidate(unsigned int k)
+    {
+        return (k < _redis_replica_nodes.size())? static_cast<CRedisNode*>(_redis_replica_nodes[k]): this;
+    }
+
+    // The first available candidate from start on, skipping the candidate skip, -1 if none
+    int find_available(unsigned int start, unsigned int num_candidates, int skip, bool local_zone_only, int64_t now_milliseconds, const CircuitBreakerOptions& options)
+    {
+        for (unsigned int i=0; i<num_candidates; ++i)
+        {
+            const unsigned int k = (start + i) % num_candidates;
+            if (static_cast<int>(k) == skip)
+                continue;
+            if (local_zone_only && !get_candidate(k)->is_local_zone())
+                continue;
+            // 跳过熔断中、复制延迟过大或对冲读的回复还未到达的节点
+            if (k<_redis_replica_nodes.size() && _redis_replica_nodes[k]->is_lagging())
+                continue;
+            if (!get_candidate(k)->poll_pending_replies())
+                continue;
+            if (get_candidate(k)->is_available(now_milliseconds, options))
+                return static_cast<int>(k);
+        }
+        return -1;
+    }
+
+    // Power of two choices: of two random available candidates the one with the lower expected cost is chosen,
+    // the cost is the latency estimate times the requests in flight to it plus one.
+    // The estimate of a node without traffic decays, so a node slow once is tried again later.
+    CRedisNode* choose_two(bool include_master, bool local_zone_only, int64_t now_milliseconds, const CircuitBreakerOptions& options)
+    {
+        const unsigned int num_candidates = static_cast<unsigned int>(_redis_replica_nodes.size()) + (include_master? 1: 0);
+        if (0 == num_candidates)
+            return NULL;
+
+        const int first = find_available(static_cast<unsigned int>(get_thread_random_number() % num_candidates), num_candidates, -1, local_zone_only, now_milliseconds, options);
+        if (first < 0)
+            return NULL;
+        const unsigned int start = static_cast<unsigned int>(first + 1 + get_thread_random_number() % num_candidates);
+        const int second = find_available(start % num_candidates, num_candidates, first, local_zone_only, now_milliseconds, options);
+        if (second < 0)
+            return get_candidate(first);
+
+        CRedisNode* first_node = get_candidate(first);
+        CRedisNode* second_node = get_candidate(second);
+        // 延迟估计为0（尚无样本或已衰减完）时按1计，在途请求数仍起作用
+        const int64_t first_cost = std::max<int64_t>(1, first_node->get_latency(now_milliseconds)) * (first_node->get_outstanding_requests() + 1);
+        const int64_t second_cost = std::max<int64_t>(1, second_node->get_latency(now_milliseconds)) * (second_node->get_outstanding_requests() + 1);
+        if (first_cost == second_cost)
+            return (get_thread_random_number() & 1)? second_node: first_node;
+        return (first_cost < second_cost)? first_node: second_node;
+    }
+
+private:
+    std::vector<CRedisReplicaNode*> _redis_replica_nodes;
+    uint16_t _table_index;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// RedisReplyHelper
+
+RedisReplyHelper::RedisReplyHelper()
+    : _redis_reply(NULL)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HDEL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.final();
+}
 
-    // Integer reply:
-    // the number of fields that were removed from the hash, not including specified but non existing fields.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return false;
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
+RedisReplyHelper::RedisReplyHelper(const redisReply* redis_reply)
+    : _redis_reply(redis_reply)
+{
 }
 
-int CRedisClient::hdel(
-        const std::string& key,
-        const std::vector<std::string>& fields,
-        Node* which,
-        int num_retries)
+RedisReplyHelper::RedisReplyHelper(const RedisReplyHelper& other)
 {
-    return hmdel(key, fields, which, num_retries);
+    _redis_reply = other.detach();
 }
 
-int CRedisClient::hmdel(
-        const std::string& key,
-        const std::vector<std::string>& fields,
-        Node* which,
-        int num_retries)
+RedisReplyHelper::~RedisReplyHelper()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HDEL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_args(fields);
-    cmd_args.final();
-
-    // Integer reply:
-    // the number of fields that were removed from the hash, not including specified but non existing fields.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return 0;
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    free();
 }
 
-// Time complexity: O(1)
-// HEXISTS key field
-bool CRedisClient::hexists(const std::string& key, const std::string& field, Node* which, int num_retries)
+RedisReplyHelper::operator bool() const
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HEXISTS");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.final();
-
-    // Integer reply, specifically:
-    // 1 if the hash contains field.
-    // 0 if the hash does not contain field, or key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
+    return _redis_reply != NULL;
 }
 
-// Time complexity: O(1)
-// HLEN key
-int CRedisClient::hlen(const std::string& key, Node* which, int num_retries)
+void RedisReplyHelper::free()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HLEN");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
-
-    // Integer reply: number of fields in the hash, or 0 when key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    if (_redis_reply != NULL)
+    {
+        freeReplyObject((void*)_redis_reply);
+        _redis_reply = NULL;
+    }
 }
 
-// Time complexity: O(1)
-// HSET key field value
-bool CRedisClient::hset(
-        const std::string& key,
-        const std::string& field,
-        const std::string& value,
-        Node* which,
-        int num_retries)
+const redisReply* RedisReplyHelper::get() const
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HSET");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    return _redis_reply;
+}
 
-    // Integer reply, specifically:
-    // 1 if field is a new field in the hash and value was set.
-    // 0 if field already exists in the hash and the value was updated.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
+const redisReply* RedisReplyHelper::detach() const
+{
+    const redisReply* redis_reply = _redis_reply;
+    _redis_reply = NULL;
+    return redis_reply;
 }
 
-// HSETNX key field value
-// Time complexity: O(1)
-bool CRedisClient::hsetnx(
-        const std::string& key,
-        const std::string& field,
-        const std::string& value,
-        Node* which,
-        int num_retries)
+RedisReplyHelper& RedisReplyHelper::operator =(const redisReply* redis_reply)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HSETNX");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    free();
+    _redis_reply = redis_reply;
+    return *this;
+}
 
-    // Integer reply, specifically:
-    // 1 if field is a new field in the hash and value was set.
-    // 0 if field already exists in the hash and no operation was performed.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return 1 == redis_reply->integer;
-    return true;
+RedisReplyHelper& RedisReplyHelper::operator =(const RedisReplyHelper& other)
+{
+    free();
+    _redis_reply = other.detach();
+    return *this;
 }
 
-// Time complexity: O(1)
-// HGET key field
-bool CRedisClient::hget(
-        const std::string& key,
-        const std::string& field,
-        std::string* value,
-        Node* which,
-        int num_retries)
+const redisReply* RedisReplyHelper::operator ->() const
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HGET");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.final();
+    return _redis_reply;
+}
 
-    // Bulk string reply:
-    // the value associated with field, or nil when field is not present in the hash or key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return false;
-    if (REDIS_REPLY_STRING == redis_reply->type)
-        return get_value(redis_reply.get(), value);
-    return true;
+std::ostream& RedisReplyHelper::operator <<(std::ostream& os)
+{
+    os << *_redis_reply;
+    return os;
 }
 
-// Time complexity: O(1)
-// HINCRBY key field increment
-int64_t CRedisClient::hincrby(
-        const std::string& key,
-        const std::string& field,
-        int64_t increment,
-        Node* which,
-        int num_retries)
+////////////////////////////////////////////////////////////////////////////////
+// ErrorInfo
+
+ErrorInfo::ErrorInfo()
+    : errcode(0)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HINCRBY");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.add_arg(increment);
-    cmd_args.final();
+}
 
-    // Integer reply: the value at field after the increment operation.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int64_t>(redis_reply->integer);
-    return 0;
+ErrorInfo::ErrorInfo(const std::string& raw_errmsg_, const std::string& errmsg_, const std::string& errtype_, int errcode_)
+    : raw_errmsg(raw_errmsg_), errmsg(errmsg_), errtype(errtype_), errcode(errcode_)
+{
 }
 
-void CRedisClient::hset(
-        const std::string& key,
-        const std::map<std::string, std::string>& map,
-        Node* which,
-        int num_retries)
+void ErrorInfo::clear()
 {
-    hmset(key, map, which, num_retries);
+    errcode = 0;
+    errtype.clear();
+    errmsg.clear();
+    raw_errmsg.clear();
 }
 
-// Time complexity: O(N) where N is the number of fields being set.
-// HMSET key field value [field value ...]
-void CRedisClient::hmset(
-        const std::string& key,
-        const std::map<std::string, std::string>& map,
-        Node* which,
-        int num_retries)
+////////////////////////////////////////////////////////////////////////////////
+// CRedisException
+
+CRedisException::CRedisException(
+        const struct ErrorInfo& errinfo,
+        const char* file, int line,
+        const std::string& node_ip, uint16_t node_port,
+        const std::string& command, const std::string& key) throw ()
+    :  _errinfo(errinfo),
+       _line(line),
+       _node_ip(node_ip), _node_port(node_port),
+       _command(command), _key(key)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HMSET");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_args(map);
-    cmd_args.final();
+    const char* slash_position = strrchr(file, '/');
+    const std::string* file_cp = &_file;
+    std::string* file_p = const_cast<std::string*>(file_cp);
 
-    // Simple string reply (REDIS_REPLY_STATUS)
-    redis_command(false, num_retries, key, cmd_args, which);
+    if (NULL == slash_position)
+    {
+        *file_p = file;
+    }
+    else
+    {
+        *file_p = std::string(slash_position + 1);
+    }
 }
 
-int CRedisClient::hget(
-        const std::string& key,
-        const std::vector<std::string>& fields,
-        std::map<std::string, std::string>* map,
-        bool keep_null,
-        Node* which,
-        int num_retries)
+const char* CRedisException::what() const throw()
 {
-    return hmget(key, fields, map, keep_null, which, num_retries);
+    return _errinfo.errmsg.c_str();
 }
 
-// Time complexity: O(N) where N is the number of fields being requested.
-// HMGET key field [field ...]
-int CRedisClient::hmget(
-        const std::string& key,
-        const std::vector<std::string>& fields,
-        std::map<std::string, std::string>* map,
-        bool keep_null,
-        Node* which,
-        int num_retries)
+std::string CRedisException::str() const throw ()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HMGET");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_args(fields);
-    cmd_args.final();
+    const std::string& errmsg = format_string("redis_exception://%s:%d/CMD:%s/%s/(%d)%s@%s:%d/(KEY:%.*s)",
+            _node_ip.c_str(), _node_port,
+            _command.c_str(),
+            _errinfo.errtype.c_str(), _errinfo.errcode, _errinfo.errmsg.c_str(),
+            _file.c_str(), _line,
+            static_cast<int>(_key.size()), _key.c_str());
 
-    // Array reply:
-    // list of values associated with the given fields, in the same order as they are requested.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return 0;
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), fields, keep_null, map);
-    return 0;
+#if __cplusplus < 201103L
+    return errmsg;
+#else
+    return std::move(errmsg);
+#endif // __cplusplus < 201103L
 }
 
-// Time complexity: O(N) where N is the size of the hash.
-// HGETALL key
-int CRedisClient::hgetall(
-        const std::string& key,
-        std::map<std::string, std::string>* map,
-        Node* which,
-        int num_retries)
+bool is_general_error(const std::string& errtype)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HGETALL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
-
-    // Array reply:
-    // list of fields and their values stored in the hash, or an empty list when key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return 0;
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), map);
-    return 0;
+    return (errtype.size() == sizeof("ERR")-1) && (errtype == "ERR");
 }
 
-// Time complexity: O(1)
-// HSTRLEN key field
-int CRedisClient::hstrlen(const std::string& key, const std::string& field, Node* which, int num_retries)
+bool is_ask_error(const std::string& errtype)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HSTRLEN");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.final();
-
-    // Integer reply:
-    // the string length of the value associated with field,
-    // or zero when field is not present in the hash or key does not exist at all.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return 0;
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    return (errtype.size() == sizeof("ASK")-1) && (errtype == "ASK");
 }
 
-// Time complexity: O(N) where N is the size of the hash.
-// HKEYS key
-int CRedisClient::hkeys(const std::string& key, std::vector<std::string>* fields, Node* which, int num_retries)
+bool is_clusterdown_error(const std::string& errtype)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HKEYS");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
-
-    // Array reply:
-    // list of fields in the hash, or an empty list when key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return 0;
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), fields);
-    return 0;
+    // CLUSTERDOWN The cluster is down
+    // 如果在从未成为主之前，将主和从同时干掉，则即使从正常了，从也无法成为主，
+    // 这个时候必须将原来的主恢复，否则该部分slots就不能再服务
+    return (errtype.size() == sizeof("CLUSTERDOWN")-1) && (errtype == "CLUSTERDOWN");
 }
 
-// Time complexity: O(N) where N is the size of the hash.
-// HVALS key
-int CRedisClient::hvals(const std::string& key, std::vector<std::string>* vals, Node* which, int num_retries)
+bool is_moved_error(const std::string& errtype)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HVALS");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
-
-    // Array reply:
-    // list of values in the hash, or an empty list when key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return 0;
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), vals);
-    return 0;
+    return (errtype.size() == sizeof("MOVED")-1) && (errtype == "MOVED");
 }
 
-// Time complexity:
-// O(1) for every call. O(N) for a complete iteration,
-// including enough command calls for the cursor to return back to 0. N is the number of elements inside the collection..
-//
-// HSCAN key cursor [MATCH pattern] [COUNT count]
-int64_t CRedisClient::hscan(
-        const std::string& key,
-        int64_t cursor,
-        std::map<std::string, std::string>* map,
-        Node* which,
-        int num_retries)
+bool is_noauth_error(const std::string& errtype)
 {
-    return hscan(key, cursor, std::string(""), 0, map, which, num_retries);
+    // NOAUTH Authentication required.
+    return (errtype.size() == sizeof("NOAUTH")-1) && (errtype == "NOAUTH");
 }
 
-int64_t CRedisClient::hscan(
-        const std::string& key,
-        int64_t cursor, int count,
-        std::map<std::string, std::string>* map,
-        Node* which,
-        int num_retries)
+bool is_noscript_error(const std::string& errtype)
 {
-    return hscan(key, cursor, std::string(""), count, map, which, num_retries);
+    // NOSCRIPT No matching script. Please use EVAL.
+    return (errtype.size() == sizeof("NOSCRIPT")-1) && (errtype == "NOSCRIPT");
 }
 
-int64_t CRedisClient::hscan(
-        const std::string& key,
-        int64_t cursor, const std::string& pattern,
-        std::map<std::string, std::string>* map,
-        Node* which,
-        int num_retries)
+bool is_wrongtype_error(const std::string& errtype)
 {
-    return hscan(key, cursor, pattern, 0, map, which, num_retries);
+    return (errtype.size() == sizeof("WRONGTYPE")-1) && (errtype == "WRONGTYPE");
 }
 
-int64_t CRedisClient::hscan(
-        const std::string& key,
-        int64_t cursor, const std::string& pattern, int count,
-        std::map<std::string, std::string>* map,
-        Node* which,
-        int num_retries)
+bool is_busygroup_error(const std::string& errtype)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("HSCAN");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(cursor);
-    if (!pattern.empty())
-    {
-        cmd_args.add_arg("MATCH");
-        cmd_args.add_arg(pattern);
-    }
-    if (count > 0)
-    {
-        cmd_args.add_arg("COUNT");
-        cmd_args.add_arg(count);
-    }
-    cmd_args.final();
-
-    // (gdb) p *redis_reply
-    // $1 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 2, element = 0x641450}
-    // (gdb) p *redis_reply->element[0]
-    // $2 = {type = 1, integer = 0, len = 1, str = 0x641820 "0", elements = 0, element = 0x0}
-    // (gdb) p *redis_reply->element[1]
-    // $3 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 8, element = 0x6414b0}
-    // (gdb) p *redis_reply->element[1]->element[0]
-    // $4 = {type = 1, integer = 0, len = 2, str = 0x6418f0 "f1", elements = 0, element = 0x0}
-    // (gdb) p *redis_reply->element[1]->element[1]
-    // $5 = {type = 1, integer = 0, len = 2, str = 0x641950 "v1", elements = 0, element = 0x0}
-    // (gdb) p *redis_reply->element[1]->element[2]
-    // $6 = {type = 1, integer = 0, len = 2, str = 0x6419b0 "f2", elements = 0, element = 0x0}
-    // (gdb) p *redis_reply->element[1]->element[3]
-    // $7 = {type = 1, integer = 0, len = 2, str = 0x641a10 "v2", elements = 0, element = 0x0}
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-    {
-        get_values(redis_reply->element[1], map);
-        return static_cast<int64_t>(atoll(redis_reply->element[0]->str));
-    }
-    return 0;
+    return (errtype.size() == sizeof("BUSYGROUP")-1) && (errtype == "BUSYGROUP");
 }
 
-
-
-//
-// LIST
-//
-
-// Time complexity: O(1)
-// LLEN key
-int CRedisClient::llen(const std::string& key, Node* which, int num_retries)
+bool is_nogroup_error(const std::string& errtype)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LLEN");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
-
-    // Integer reply: the length of the list at key.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    return (errtype.size() == sizeof("NOGROUP")-1) && (errtype == "NOGROUP");
 }
 
-// Time complexity: O(1)
-// LPOP key
-bool CRedisClient::lpop(const std::string& key, std::string* value, Node* which, int num_retries)
+bool is_crossslot_error(const std::string& errtype)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LPOP");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
-
-    // Bulk string reply: the value of the first element, or nil when key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return false;
-    if (REDIS_REPLY_STRING == redis_reply->type)
-        return get_value(redis_reply.get(), value);
-    return true; // MULTI & EXEC the type always is REDIS_REPLY_STATUS
+    return (errtype.size() == sizeof("CROSSSLOT")-1) && (errtype == "CROSSSLOT");
 }
 
-bool CRedisClient::blpop(const std::string& key, std::string* value, uint32_t seconds, Node* which, int num_retries)
+bool is_readonly_error(const std::string& errtype)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("BLPOP");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(seconds);
-    cmd_args.final();
+    // READONLY You can't write against a read only replica.
+    return (errtype.size() == sizeof("READONLY")-1) && (errtype == "READONLY");
+}
 
-    // Array reply:
-    // 1) A nil multi-bulk when no element could be popped and the timeout expired.
-    // 2) A two-element multi-bulk with the first element being the name of the key
-    //    where an element was popped and the second element being the value of the popped element.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (redis_reply->type == REDIS_REPLY_NIL)
-        return false;
-    if (redis_reply->type != REDIS_REPLY_ARRAY)
-        return false;
-    return get_value(redis_reply->element[1], value);
+////////////////////////////////////////////////////////////////////////////////
+// CRedisClient
+
+CRedisClient::CRedisClient(
+        const std::string& raw_nodes_string,
+        int connect_timeout_milliseconds,
+        int readwrite_timeout_milliseconds,
+        const std::string& password,
+        ReadPolicy read_policy
+        )
+            : _command_monitor(NULL),
+              _raw_nodes_string(raw_nodes_string),
+              _connect_timeout_milliseconds(connect_timeout_milliseconds),
+              _readwrite_timeout_milliseconds(readwrite_timeout_milliseconds),
+              _password(password),
+              _read_policy(read_policy),
+              _sharding(false),
+              _sentinel(false),
+              _sentinel_index(0),
+              _sentinel_context(NULL),
+              _sentinel_retry_time(0),
+              _sentinel_check_time(0),
+              _sentinel_discover_time(0),
+              _warm_standby(false),
+              _background_refresh(false),
+              _replica_lag_check(false),
+              _session_token(NULL),
+              _read_route(NULL),
+              _hedged_reads(false),
+              _hedge_tokens(0),
+              _adaptive_timeouts(false),
+              _priority_lanes(false),
+              _command_priority(PRIORITY_INTERACTIVE),
+              _in_transaction(false),
+              _admission_control(false),
+              _write_buffer(false),
+              _topology_command(TOPOLOGY_SHARDS),
+              _refresh_due_time(0),
+              _last_refresh_time(0),
+              _topology_entry(NULL),
+              _topology_version(0),
+              _replication_version(0),
+              _replication_expire_time(0),
+              _num_buffered_writes(0),
+              _num_dropped_writes(0),
+              _write_buffer_flush_time(0),
+              _write_buffer_flush_interval(WRITE_BUFFER_FLUSH_INTERVAL_MILLISECONDS),
+              _buffering_write(false),
+              _flushing_writes(false),
+              _flush_blocked(false),
+              _zone_generation(0)
+{
+    init();
 }
 
-// Time complexity: O(1)
-// LPUSH key value [value ...]
-int CRedisClient::lpush(
-        const std::string& key,
-        const std::string& value,
-        Node* which,
-        int num_retries)
+CRedisClient::CRedisClient(
+        const std::string& raw_nodes_string,
+        const std::string& password,
+        int connect_timeout_milliseconds,
+        int readwrite_timeout_milliseconds,
+        ReadPolicy read_policy)
+            : _command_monitor(NULL),
+              _raw_nodes_string(raw_nodes_string),
+              _connect_timeout_milliseconds(connect_timeout_milliseconds),
+              _readwrite_timeout_milliseconds(readwrite_timeout_milliseconds),
+              _password(password),
+              _read_policy(read_policy),
+              _sharding(false),
+              _sentinel(false),
+              _sentinel_index(0),
+              _sentinel_context(NULL),
+              _sentinel_retry_time(0),
+              _sentinel_check_time(0),
+              _sentinel_discover_time(0),
+              _warm_standby(false),
+              _background_refresh(false),
+              _replica_lag_check(false),
+              _session_token(NULL),
+              _read_route(NULL),
+              _hedged_reads(false),
+              _hedge_tokens(0),
+              _adaptive_timeouts(false),
+              _priority_lanes(false),
+              _command_priority(PRIORITY_INTERACTIVE),
+              _in_transaction(false),
+              _admission_control(false),
+              _write_buffer(false),
+              _topology_command(TOPOLOGY_SHARDS),
+              _refresh_due_time(0),
+              _last_refresh_time(0),
+              _topology_entry(NULL),
+              _topology_version(0),
+              _replication_version(0),
+              _replication_expire_time(0),
+              _num_buffered_writes(0),
+              _num_dropped_writes(0),
+              _write_buffer_flush_time(0),
+              _write_buffer_flush_interval(WRITE_BUFFER_FLUSH_INTERVAL_MILLISECONDS),
+              _buffering_write(false),
+              _flushing_writes(false),
+              _flush_blocked(false),
+              _zone_generation(0)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LPUSH");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    init();
+}
 
-    // Integer reply: the length of the list after the push operations.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+CRedisClient::CRedisClient(
+        const std::string& raw_nodes_string,
+        ReadPolicy read_policy,
+        const std::string& password,
+        int connect_timeout_milliseconds,
+        int readwrite_timeout_milliseconds)
+            : _command_monitor(NULL),
+              _raw_nodes_string(raw_nodes_string),
+              _connect_timeout_milliseconds(connect_timeout_milliseconds),
+              _readwrite_timeout_milliseconds(readwrite_timeout_milliseconds),
+              _password(password),
+              _read_policy(read_policy),
+              _sharding(false),
+              _sentinel(false),
+              _sentinel_index(0),
+              _sentinel_context(NULL),
+              _sentinel_retry_time(0),
+              _sentinel_check_time(0),
+              _sentinel_discover_time(0),
+              _warm_standby(false),
+              _background_refresh(false),
+              _replica_lag_check(false),
+              _session_token(NULL),
+              _read_route(NULL),
+              _hedged_reads(false),
+              _hedge_tokens(0),
+              _adaptive_timeouts(false),
+              _priority_lanes(false),
+              _command_priority(PRIORITY_INTERACTIVE),
+              _in_transaction(false),
+              _admission_control(false),
+              _write_buffer(false),
+              _topology_command(TOPOLOGY_SHARDS),
+              _refresh_due_time(0),
+              _last_refresh_time(0),
+              _topology_entry(NULL),
+              _topology_version(0),
+              _replication_version(0),
+              _replication_expire_time(0),
+              _num_buffered_writes(0),
+              _num_dropped_writes(0),
+              _write_buffer_flush_time(0),
+              _write_buffer_flush_interval(WRITE_BUFFER_FLUSH_INTERVAL_MILLISECONDS),
+              _buffering_write(false),
+              _flushing_writes(false),
+              _flush_blocked(false),
+              _zone_generation(0)
+{
+    init();
 }
 
-// Time complexity: O(1)
-// LPUSH key value [value ...]
-int CRedisClient::lpush(
-        const std::string& key,
-        const std::vector<std::string>& values,
-        Node* which,
-        int num_retries)
+CRedisClient::~CRedisClient()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LPUSH");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_args(values);
-    cmd_args.final();
+    fini();
+}
 
-    // Integer reply: the length of the list after the push operations.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+const std::string& CRedisClient::get_raw_nodes_string() const
+{
+    return _raw_nodes_string;
 }
 
-// Inserts value at the head of the list stored at key, only if key already exists and holds a list.
-// In contrary to LPUSH, no operation will be performed when key does not yet exist.
-// Time complexity: O(1)
-int CRedisClient::lpushx(const std::string& key, const std::string& value, Node* which, int num_retries)
+const std::string& CRedisClient::get_nodes_string() const
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LPUSHX");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    return _nodes_string;
+}
 
-    // Integer reply: the length of the list after the push operation.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+std::string CRedisClient::str() const
+{
+    if (sharding_mode())
+        return std::string("redissharding://") + _nodes_string;
+    else if (sentinel_mode())
+        return std::string("redissentinel://") + _raw_nodes_string.substr(sizeof("sentinel://")-1);
+    else if (cluster_mode())
+        return std::string("rediscluster://") + _raw_nodes_string;
+    else
+        return std::string("redisstandalone://") + _raw_nodes_string;
 }
 
-// Time complexity:
-// O(S+N) where S is the distance of start offset from HEAD for small lists,
-// from nearest end (HEAD or TAIL) for large lists;
-// and N is the number of elements in the specified range.
-//
-// LRANGE key start stop
-//
-// start和end值为-1时表示最右边一个，-2表示最右边倒数第二个，依次类推。。。
-//
-// 使用示例（lpush k 1 2 3 4 5）：
-// 1）查看最右边一个：lrange k -1 -1
-// 2）查看最右边两个：lrange k -2 -1
-// 3）查看最左边一个：lrange k 0 0
-// 4）查看最左边两个：lrange k 0 1
-// 5）查看全部：lrange k 0 -1
-int CRedisClient::lrange(
-        const std::string& key,
-        int64_t start, int64_t end,
-        std::vector<std::string>* values,
-        Node* which,
-        int num_retries)
+bool CRedisClient::cluster_mode() const
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LRANGE");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(start);
-    cmd_args.add_arg(end);
-    cmd_args.final();
+    return _sharding || _nodes.size() > 1;
+}
 
-    // Array reply: list of elements in the specified range.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), values);
-    return 0;
+bool CRedisClient::sharding_mode() const
+{
+    return _sharding;
 }
 
-// Time complexity:
-// O(N) where N is the number of elements to be removed by the operation.
-//
-// LTRIM key start stop
-//
-// 注意：
-// 1）start和end值为-1时表示最右边一个，-2表示最右边倒数第二个，依次类推。。。
-// 2）start~stop 是“保留”区间而不是删除范围，两值相减的绝对值为保留的数量
-//
-// 使用示例（lpush k 1 2 3 4 5）：
-// 1）删除最右一个：ltrim k 0 -2
-// 2）删除最右两个：ltrim k 0 -3
-// 3）删除最左一个：ltrim k 1 -1
-// 4）删除最左两个：ltrim k 2 -1
-void CRedisClient::ltrim(
-        const std::string& key,
-        int64_t start, int64_t end,
-        Node* which,
-        int num_retries)
+bool CRedisClient::sentinel_mode() const
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LTRIM");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(start);
-    cmd_args.add_arg(end);
-    cmd_args.final();
+    return _sentinel;
+}
 
-    // Simple string reply (REDIS_REPLY_STATUS)
-    redis_command(false, num_retries, key, cmd_args, which);
+const char* CRedisClient::get_mode_str() const
+{
+    if (sharding_mode())
+        return "SHARDING";
+    if (sentinel_mode())
+        return "SENTINEL";
+    return cluster_mode()? "CLUSTER": "STANDALONE";
 }
 
-void CRedisClient::lset(const std::string& key, int index, const std::string& value, Node* which, int num_retries)
+void CRedisClient::set_socket_options(const SocketOptions& socket_options)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LSET");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(index);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    std::vector<CRedisNode*> redis_nodes;
 
-    // Simple string reply (REDIS_REPLY_STATUS)
-    // An error is returned for out of range indexes.
-    redis_command(false, num_retries, key, cmd_args, which);
+    _socket_options = socket_options;
+    get_all_redis_nodes(&redis_nodes);
+    for (std::vector<CRedisNode*>::size_type i=0; i<redis_nodes.size(); ++i)
+    {
+        CRedisNode* redis_node = redis_nodes[i];
+        redisContext* redis_context = redis_node->get_redis_context();
+
+        if (redis_context != NULL)
+        {
+            struct ErrorInfo errinfo;
+            if (!apply_socket_options(redis_context, redis_node->get_node(), &errinfo))
+                redis_node->close(); // Reconnect with the new options next time
+        }
+        // The bulk lane reconnects with the new options
+        redis_node->close_bulk_lane();
+    }
 }
 
-// Inserts value in the list stored at key either before or after the reference value pivot.
-//
-// Time complexity:
-// O(N) where N is the number of elements to traverse before seeing the value pivot.
-// This means that inserting somewhere on the left end on the list (head) can be considered O(1)
-// and inserting somewhere on the right end (tail) is O(N).
-int CRedisClient::linsert(const std::string& key, const std::string& pivot, const std::string& value, bool before, Node* which, int num_retries)
+void CRedisClient::enable_debug_log()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LINSERT");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    if (before)
-        cmd_args.add_arg("BEFORE");
-    else
-        cmd_args.add_arg("AFTER");
-    cmd_args.add_arg(pivot);
-    cmd_args.add_arg(value);
-    cmd_args.final();
-
-    // Integer reply:
-    // the length of the list after the insert operation,
-    // or -1 when the value pivot was not found.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    _enable_debug_log = true;
 }
 
-// Removes the first count occurrences of elements equal to value from the list stored at key.
-// Time complexity:
-// O(N) where N is the length of the list.
-int CRedisClient::lrem(const std::string& key, int count, const std::string& value, Node* which, int num_retries)
+void CRedisClient::disable_debug_log()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LREM");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(count);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    _enable_debug_log = false;
+}
 
-    // Integer reply: the number of removed elements.
-    // Returns the number of removed elements.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+void CRedisClient::enable_info_log()
+{
+    _enable_info_log = true;
 }
 
-// Time complexity:
-// O(N) where N is the number of elements to traverse to get to the element at index.
-// This makes asking for the first or the last element of the list O(1).
-bool CRedisClient::lindex(const std::string& key, int index, std::string* value, Node* which, int num_retries)
+void CRedisClient::disable_info_log()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("LINDEX");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(index);
-    cmd_args.final();
-
-    // Bulk string reply: the requested element, or nil when index is out of range.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return false;
-    if (REDIS_REPLY_STRING == redis_reply->type)
-        return get_value(redis_reply.get(), value);
-    return true;
+    _enable_info_log = false;
 }
 
-// Time complexity: O(1)
-// RPOP key
-bool CRedisClient::rpop(
-        const std::string& key,
-        std::string* value,
-        Node* which,
-        int num_retries)
+void CRedisClient::enable_error_log()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("RPOP");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    _enable_error_log = true;
+}
 
-    // Bulk string reply: the value of the last element, or nil when key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return false;
-    if (REDIS_REPLY_STRING == redis_reply->type)
-        return get_value(redis_reply.get(), value);
-    return true;
+void CRedisClient::disable_error_log()
+{
+    _enable_error_log = false;
 }
 
-int CRedisClient::rpop(const std::string& key, std::vector<std::string>* values, int n, Node* which, int num_retries)
+int CRedisClient::list_nodes(std::vector<struct NodeInfo>* nodes_info)
 {
-    values->clear();
+    struct ErrorInfo errinfo;
 
-    if (n < 1)
-    {
-        struct ErrorInfo errinfo;
-        errinfo.errcode = ERROR_PARAMETER;
-        errinfo.errmsg = "`n` is less than 1";
-        THROW_REDIS_EXCEPTION(errinfo);
-    }
-    else if (n == 1)
+    for (RedisMasterNodeTable::iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
     {
-        std::string value;
-        if (!rpop(key, &value, which, num_retries))
-        {
-            return 0;
-        }
-        else
+        const Node& node = iter->first;
+        struct CRedisNode* redis_node = iter->second;
+        redis_node->drain_pending_replies();
+        // 自适应超时只用于命令，拓扑查询用原读写超时
+        redis_node->reset_timeout((_readwrite_timeout_milliseconds>0)? _readwrite_timeout_milliseconds: 0);
+        redisContext* redis_context = redis_node->get_redis_context();
+
+        if (redis_context != NULL)
         {
-            values->push_back(value);
-            return 1;
+            if (list_cluster_nodes(nodes_info, &errinfo, redis_context, node))
+                break;
         }
     }
-    else
+    if (nodes_info->empty())
     {
-        const std::string lua_scripts =
-                "local v=redis.call('LRANGE',KEYS[1],-ARGV[1], -1);"
-                "redis.call('LTRIM',KEYS[1],0,-(ARGV[1]+1));"
-                "return v;";
-        std::vector<std::string> parameters(1);
-        parameters[0] = int2string(n);
-        const RedisReplyHelper redis_reply = eval(key, lua_scripts, parameters, which, num_retries);
-        if (REDIS_REPLY_ARRAY == redis_reply->type)
-        {
-            std::vector<std::string> v;
-            const int m = get_values(redis_reply.get(), &v);
-            // LRANGE 返回的结果是从左到右，对 r 操作需要倒过来
-            for (int i=m-1; i>-1; --i)
-                values->push_back(v[i]);
-            return m;
-        }
-        return 0;
+        THROW_REDIS_EXCEPTION(errinfo);
     }
+
+    return static_cast<int>(nodes_info->size());
 }
 
-bool CRedisClient::brpop(const std::string& key, std::string* value, uint32_t seconds, Node* which, int num_retries)
+void CRedisClient::flushall()
 {
+    const int num_retries = NUM_RETRIES;
+    const std::string key;
     CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("BRPOP");
+    cmd_args.set_command("FLUSHALL");
     cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(seconds);
     cmd_args.final();
 
-    // Array reply:
-    // 1) A nil multi-bulk when no element could be popped and the timeout expired.
-    // 2) A two-element multi-bulk with the first element being the name of the key
-    //    where an element was popped and the second element being the value of the popped element.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (redis_reply->type == REDIS_REPLY_NIL)
-        return false;
-    if (redis_reply->type != REDIS_REPLY_ARRAY)
-        return false;
-    return get_value(redis_reply->element[1], value);
+    // Simple string reply (REDIS_REPLY_STATUS)
+    redis_command(true, num_retries, key, cmd_args, NULL);
 }
 
-// Time complexity: O(1)
-bool CRedisClient::rpoppush(
-        const std::string& source,
-        const std::string& destination,
-        std::string* value,
-        Node* which, int num_retries)
+void CRedisClient::multi(const std::string& key, Node* which)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(source);
-    cmd_args.set_command("RPOPLPUSH");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(source);
-    cmd_args.add_arg(destination);
-    cmd_args.final();
+    if (cluster_mode())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errcode = ERROR_NOT_SUPPORT;
+        errinfo.errmsg = "MULTI not supported in cluster mode";
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        const int num_retries = 0;
+        CommandArgs cmd_args;
+        cmd_args.set_key(key);
+        cmd_args.set_command("MULTI");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.final();
 
-    // Bulk string reply: the value of the last element, or nil when key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, source, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return false;
-    if (REDIS_REPLY_STRING == redis_reply->type)
-        return get_value(redis_reply.get(), value);
-    return true;
+        // Simple string reply (REDIS_REPLY_STATUS):
+        // always OK.
+        redis_command(false, num_retries, key, cmd_args, which);
+    }
 }
 
-// Time complexity: O(1)
-bool CRedisClient::brpoppush(const std::string& source, const std::string& destination, std::string* value, uint32_t seconds, Node* which, int num_retries)
+const RedisReplyHelper CRedisClient::exec(const std::string& key, Node* which)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(source);
-    cmd_args.set_command("BRPOPLPUSH");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(source);
-    cmd_args.add_arg(destination);
-    cmd_args.add_arg(seconds);
-    cmd_args.final();
+    if (cluster_mode())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errcode = ERROR_NOT_SUPPORT;
+        errinfo.errmsg = "EXEC not supported in cluster mode";
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        const int num_retries = 0;
+        CommandArgs cmd_args;
+        cmd_args.set_key(key);
+        cmd_args.set_command("EXEC");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.final();
 
-    // Bulk string reply: the value of the last element, or nil when key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, source, cmd_args, which);
-    if (redis_reply->type == REDIS_REPLY_NIL)
-        return false;
-    if (redis_reply->type == REDIS_REPLY_STRING)
-        return get_value(redis_reply.get(), value);
-    return true;
+        // Array reply:
+        // each element being the reply to each of the commands in the atomic transaction.
+        return redis_command(false, num_retries, key, cmd_args, which);
+    }
 }
 
+//
+// KEY/VALUE
+//
+
 // Time complexity: O(1)
-int CRedisClient::rpush(
+// EXPIRE key seconds
+bool CRedisClient::expire(
         const std::string& key,
-        const std::string& value,
+        uint32_t seconds,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("RPUSH");
+    cmd_args.set_command("EXPIRE");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
+    cmd_args.add_arg(seconds);
     cmd_args.final();
 
-    // Integer reply: the length of the list after the push operation.
+    // Integer reply, specifically:
+    // 1 if the timeout was set.
+    // 0 if key does not exist.
     const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+        return 1 == redis_reply->integer;
+    return true;
 }
 
-// Time complexity: O(1)
-int CRedisClient::rpush(
-        const std::string& key,
-        const std::vector<std::string>& values,
-        Node* which,
-        int num_retries)
+bool CRedisClient::expireat(const std::string& key, int64_t timestamp, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("RPUSH");
+    cmd_args.set_command("EXPIREAT");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_args(values);
+    cmd_args.add_arg(timestamp);
     cmd_args.final();
 
-    // Integer reply: the length of the list after the push operation.
+    // Integer reply, specifically:
+    // 1 if the timeout was set.
+    // 0 if key does not exist.
     const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+        return 1 == redis_reply->integer;
+    return true;
 }
 
 // Time complexity: O(1)
-int CRedisClient::rpushx(
-        const std::string& key,
-        const std::string& value,
-        Node* which,
-        int num_retries)
+// EXISTS key [key ...]
+bool CRedisClient::exists(const std::string& key, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("RPUSHX");
+    cmd_args.set_command("EXISTS");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
     cmd_args.final();
 
-    // Integer reply:
-    // the length of the list after the push operation.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    // Integer reply, specifically:
+    // 1 if the key exists.
+    // 0 if the key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+        return 1 == redis_reply->integer;
+    return true;
 }
 
-//
-// SET
-//
-
 // Time complexity:
-//  O(1) for each element added, so O(N) to add N elements when the command is called with multiple arguments.
-int CRedisClient::sadd(
-        const std::string& key,
-        const std::string& value,
-        Node* which,
-        int num_retries)
+// O(N) where N is the number of keys that will be removed.
+// When a key to remove holds a value other than a string,
+// the individual complexity for this key is O(M) where M is the number of elements in the list, set, sorted set or hash.
+// Removing a single key that holds a string value is O(1).
+bool CRedisClient::del(const std::string& key, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SADD");
+    cmd_args.set_command("DEL");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
     cmd_args.final();
 
-    // Integer reply: the number of elements that were added to the set,
-    // not including all the elements already present into the set.
+    // Integer reply:
+    // The number of keys that were removed.
     const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+        return 1 == redis_reply->integer;
+    return true;
 }
 
-//  O(1) for each element added, so O(N) to add N elements when the command is called with multiple arguments.
-int CRedisClient::sadd(
+// GET key
+// Time complexity: O(1)
+bool CRedisClient::get(
         const std::string& key,
-        const std::vector<std::string>& values,
+        std::string* value,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SADD");
+    cmd_args.set_command("GET");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_args(values);
     cmd_args.final();
 
-    // Integer reply: the number of elements that were added to the set,
-    // not including all the elements already present into the set.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    // Bulk string reply:
+    // the value of key, or nil when key does not exist.
+    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return false;
+    if (REDIS_REPLY_STRING == redis_reply->type)
+        return get_value(redis_reply.get(), value);
+    return true;
 }
 
-// O(1)
-int CRedisClient::scard(const std::string& key, Node* which, int num_retries)
+// SET key value [EX seconds] [PX milliseconds] [NX|XX]
+// Time complexity: O(1)
+void CRedisClient::set(
+        const std::string& key,
+        const std::string& value,
+        Node* which,
+        int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SCARD");
+    cmd_args.set_command("SET");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
     cmd_args.final();
 
-    // Integer reply: the cardinality (number of elements) of the set, or 0 if key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    // Simple string reply (REDIS_REPLY_STATUS):
+    // OK if SET was executed correctly.
+
+    // Null reply: a Null Bulk Reply is returned if the SET operation was not performed
+    // because the user specified the NX or XX option but the condition was not met.
+    //
+    // OK: redis_reply->str
+    redis_command(false, num_retries, key, cmd_args, which);
 }
 
-// O(1)
-bool CRedisClient::sismember(
+// Time complexity: O(1)
+// SETNX key value
+bool CRedisClient::setnx(
         const std::string& key,
         const std::string& value,
         Node* which,
@@ -2489,246 +2553,266 @@ bool CRedisClient::sismember(
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SISMEMBER");
+    cmd_args.set_command("SETNX");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
     cmd_args.add_arg(value);
     cmd_args.final();
 
     // Integer reply, specifically:
-    // 1 if the element is a member of the set.
-    // 0 if the element is not a member of the set, or if key does not exist.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    // 1 if the key exists.
+    // 0 if the key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_INTEGER == redis_reply->type)
         return 1 == redis_reply->integer;
     return true;
 }
 
-// O(N) where N is the set cardinality.
-int CRedisClient::smembers(
+// Time complexity: O(1)
+// SETEX key seconds value
+void CRedisClient::setex(
         const std::string& key,
-        std::vector<std::string>* values,
+        const std::string& value,
+        uint32_t expired_seconds,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SMEMBERS");
+    cmd_args.set_command("SETEX");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
+    cmd_args.add_arg(expired_seconds);
+    cmd_args.add_arg(value);
     cmd_args.final();
 
-    // Array reply:
-    // all elements of the set.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), values);
-    return 0;
+    // Simple string reply (REDIS_REPLY_STATUS)
+    //
+    // OK: redis_reply->str
+    redis_command(false, num_retries, key, cmd_args, which);
 }
 
-int CRedisClient::smembers(
+bool CRedisClient::setnxex(
         const std::string& key,
-        std::set<std::string>* values,
+        const std::string& value,
+        uint32_t expired_seconds,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SMEMBERS");
+    cmd_args.set_command("SET");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
+    cmd_args.add_arg("EX");
+    cmd_args.add_arg(expired_seconds);
+    cmd_args.add_arg("NX");
     cmd_args.final();
 
-    // Array reply:
-    // all elements of the set.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), values);
-    return 0;
+    // Simple string reply (REDIS_REPLY_STATUS):
+    // OK if SET was executed correctly.
+    //
+    // Null reply: a Null Bulk Reply is returned if the SET operation was not performed
+    // because the user specified the NX or XX option but the condition was not met.
+    //
+    // OK: redis_reply->str
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    return redis_reply->type != REDIS_REPLY_NIL;
 }
 
-// Time complexity: O(1)
-bool CRedisClient::spop(
-        const std::string& key,
-        std::string* value,
+// Time complexity: O(N) where N is the number of keys to retrieve.
+// MGET key [key ...]
+int CRedisClient::mget(
+        const std::vector<std::string>& keys,
+        std::vector<std::string>* values,
         Node* which,
         int num_retries)
 {
-    std::vector<std::string> values;
-    const int n = spop(key, 1, &values, which, num_retries);
-    if (n > 0)
+    values->clear();
+
+    if (!cluster_mode())
     {
-        *value = value[0];
+        const std::string key;
+        CommandArgs cmd_args;
+        cmd_args.set_command("MGET");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_args(keys);
+        cmd_args.final();
+
+        // Array reply:
+        // list of values at the specified keys.
+        //
+        // For every key that does not hold a string value or does not exist,
+        // the special value nil is returned. Because of this, the operation never fails.
+        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+        if (REDIS_REPLY_ARRAY == redis_reply->type)
+            return get_values(redis_reply.get(), values);
+        return 0;
     }
-    return n > 0;
+    else
+    {
+        values->resize(keys.size());
+
+        try
+        {
+            for (std::vector<std::string>::size_type i=0; i<keys.size(); ++i)
+            {
+                const std::string& key = keys[i];
+                std::string& value = (*values)[i];
+                get(key, &value, NULL, num_retries);
+            }
+        }
+        catch (CRedisException&)
+        {
+            values->clear();
+            throw;
+        }
+
+        return static_cast<int>(values->size());
+    }
+}
+
+// Time complexity:
+// O(N) where N is the number of keys to set.
+// MSET key value [key value ...]
+int CRedisClient::mset(
+        const std::map<std::string, std::string>& kv_map,
+        Node* which,
+        int num_retries)
+{
+    int success = 0;
+
+    if (kv_map.empty())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errcode = ERROR_PARAMETER;
+        errinfo.errmsg = "kv_map is empty";
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    if (!cluster_mode())
+    {
+        const std::string key;
+        CommandArgs cmd_args;
+        cmd_args.set_command("MSET");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_args(kv_map);
+        cmd_args.final();
+
+        // Simple string reply:
+        // always OK since MSET can't fail.
+        redis_command(false, num_retries, key, cmd_args, which);
+        success = static_cast<int>(kv_map.size());
+    }
+    else
+    {
+        for (std::map<std::string, std::string>::const_iterator iter=kv_map.begin(); iter!=kv_map.end(); ++iter)
+        {
+            const std::string& key = iter->first;
+            const std::string& value = iter->second;
+            set(key, value, which ,num_retries);
+            ++success;
+        }
+    }
+
+    return success;
 }
 
 // Time complexity: O(1)
-int CRedisClient::spop(
+// INCRBY key increment
+int64_t CRedisClient::incrby(
         const std::string& key,
-        int count,
-        std::vector<std::string>* values,
+        int64_t increment,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SPOP");
+    cmd_args.set_command("INCRBY");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(count);
+    cmd_args.add_arg(increment);
     cmd_args.final();
 
-    // Bulk string reply:
-    // the removed element, or nil when key does not exist.
+    // Integer reply:
+    // the value of key after the increment
     const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), values);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return redis_reply->integer;
     return 0;
 }
 
-// Time complexity: O(1)
-bool CRedisClient::srandmember(
-        const std::string& key,
-        std::string* value,
-        Node* which,
-        int num_retries)
+bool CRedisClient::key_type(const std::string& key, std::string* key_type, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SRANDMEMBER");
+    cmd_args.set_command("TYPE");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
     cmd_args.final();
 
-    // Bulk string reply:
-    // without the additional count argument the command returns a Bulk Reply with the randomly selected element,
-    // or nil when key does not exist.
+    // Simple string reply (REDIS_REPLY_STATUS):
+    // type of key, or none when key does not exist.
+    //
+    // (gdb) p *redis_reply._redis_reply
+    // $1 = {type = 5, integer = 0, len = 6, str = 0x742b50 "string", elements = 0, element = 0x0}
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
-        return false;
-    if (REDIS_REPLY_STRING == redis_reply->type)
-        return get_value(redis_reply.get(), value);
-    return true;
+    return get_value(redis_reply.get(), key_type);
 }
 
-// Time complexity: O(N) where N is the absolute value of the passed count.
-int CRedisClient::srandmember(
-        const std::string& key,
-        int count,
-        std::vector<std::string>* values,
-        Node* which,
-        int num_retries)
+int64_t CRedisClient::ttl(const std::string& key, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SRANDMEMBER");
+    cmd_args.set_command("TTL");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(count);
     cmd_args.final();
 
-    // Array reply:
-    // when the additional count argument is passed the command returns an array of elements,
-    // or an empty array when key does not exist.
+    // Integer reply:
+    // TTL in seconds, or a negative value in order to signal an error
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), values);
-    return 0;
-}
-
-// Time complexity: O(N) where N is the number of members to be removed.
-int CRedisClient::srem(
-        const std::string& key,
-        const std::string& value,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("SREM");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(value);
-    cmd_args.final();
-
-    // Integer reply: the number of members that were removed from the set,
-    // not including non existing members.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
-}
-
-int CRedisClient::srem(
-        const std::string& key,
-        const std::vector<std::string>& values,
-        Node* which,
-        int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("SREM");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_args(values);
-    cmd_args.final();
-
-    // Integer reply: the number of members that were removed from the set,
-    // not including non existing members.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
+        return redis_reply->integer;
     return 0;
 }
 
-// Time complexity:
-// O(1) for every call.
-// O(N) for a complete iteration, including enough command calls for the cursor to return back to 0.
-// N is the number of elements inside the collection..
-int64_t CRedisClient::sscan(
-        const std::string& key,
-        int64_t cursor,
-        std::vector<std::string>* values,
-        Node* which,
-        int num_retries)
+// O(1) for every call. O(N) for a complete iteration,
+// including enough command calls for the cursor to return back to 0. N is the number of elements inside the collection.
+//
+// SCAN cursor [MATCH pattern] [COUNT count]
+int64_t CRedisClient::scan(int64_t cursor, std::vector<std::string>* values, Node* which, int num_retries)
 {
-    return sscan(key, cursor, std::string(""), 0, values, which, num_retries);
+    return scan(cursor, std::string(""), 0, values, which, num_retries);
 }
 
-int64_t CRedisClient::sscan(
-        const std::string& key,
-        int64_t cursor, int count,
-        std::vector<std::string>* values,
-        Node* which,
-        int num_retries)
+// SCAN cursor [MATCH pattern] [COUNT count]
+int64_t CRedisClient::scan(int64_t cursor, int count, std::vector<std::string>* values, Node* which, int num_retries)
 {
-    return sscan(key, cursor, std::string(""), count, values, which, num_retries);
+    return scan(cursor, std::string(""), count, values, which, num_retries);
 }
 
-int64_t CRedisClient::sscan(
-        const std::string& key,
+// SCAN cursor [MATCH pattern] [COUNT count]
+int64_t CRedisClient::scan(
         int64_t cursor, const std::string& pattern,
         std::vector<std::string>* values,
         Node* which,
         int num_retries)
 {
-    return sscan(key, cursor, pattern, 0, values, which, num_retries);
+    return scan(cursor, pattern, 0, values, which, num_retries);
 }
 
-int64_t CRedisClient::sscan(
-        const std::string& key,
+// SCAN cursor [MATCH pattern] [COUNT count]
+int64_t CRedisClient::scan(
         int64_t cursor, const std::string& pattern, int count,
         std::vector<std::string>* values,
         Node* which,
         int num_retries)
 {
-    // SSCAN key cursor [MATCH pattern] [COUNT count]
+    const std::string key;
     CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("SSCAN");
+    cmd_args.set_command("SCAN");
     cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
     cmd_args.add_arg(cursor);
     if (!pattern.empty())
     {
@@ -2742,16 +2826,35 @@ int64_t CRedisClient::sscan(
     }
     cmd_args.final();
 
+    // return value is an array of two values:
+    // the first value is the new cursor to use in the next call, the second value is an array of elements.
+    //
+    // *EMPTY*:
     // (gdb) p *redis_reply
-    // $3 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 2, element = 0x641450}
+    // $1 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 2, element = 0x63e450}
     // (gdb) p *redis_reply->element[0]
-    // $4 = {type = 1, integer = 0, len = 4, str = 0x641810 "6656", elements = 0, element = 0x0}
+    // $3 = {type = 1, integer = 0, len = 1, str = 0x63e6f0 "0", elements = 0, element = 0x0}
     // (gdb) p *redis_reply->element[1]
-    // $5 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 10, element = 0x641930}
+    // $4 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 0, element = 0x0}
+    //
+    // *NON EMPTY*:
+    //
+    // redis-cli set k1 1
+    // redis-cli set k2 2
+    // redis-cli set k3 3
+    //
+    // (gdb) p *redis_reply
+    // $5 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 2, element = 0x63e450}
+    // (gdb) p *redis_reply->element[0]
+    // $6 = {type = 1, integer = 0, len = 1, str = 0x63e720 "1", elements = 0, element = 0x0}
+    // (gdb) p *redis_reply->element[1]
+    // $7 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 3, element = 0x63e780}
     // (gdb) p *redis_reply->element[1]->element[0]
-    // $6 = {type = 1, integer = 0, len = 5, str = 0x6419d0 "f1055", elements = 0, element = 0x0}
+    // $8 = {type = 1, integer = 0, len = 2, str = 0x63e820 "k2", elements = 0, element = 0x0}
     // (gdb) p *redis_reply->element[1]->element[1]
-    // $7 = {type = 1, integer = 0, len = 5, str = 0x641a30 "f6368", elements = 0, element = 0x0}
+    // $9 = {type = 1, integer = 0, len = 2, str = 0x63e880 "k3", elements = 0, element = 0x0}
+    // (gdb) p *redis_reply->element[1]->element[2]
+    // $10 = {type = 1, integer = 0, len = 2, str = 0x63e8e0 "k1", elements = 0, element = 0x0}
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_ARRAY == redis_reply->type)
     {
@@ -2761,2401 +2864,6051 @@ int64_t CRedisClient::sscan(
     return 0;
 }
 
-int64_t CRedisClient::sscan(
+//
+// EVAL
+//
+
+// Time complexity: Depends on the script that is executed.
+// EVAL script numkeys key [key ...] arg [arg ...]
+const RedisReplyHelper CRedisClient::eval(
         const std::string& key,
-        int64_t cursor,
-        const std::string& pattern,
-        int count,
-        std::set<std::string>* values,
+        const std::string& lua_scripts,
         Node* which,
         int num_retries)
 {
-    // SSCAN key cursor [MATCH pattern] [COUNT count]
+    const int numkeys = 1;
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("SSCAN");
+    cmd_args.set_command("EVAL");
     cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(lua_scripts);
+    cmd_args.add_arg(numkeys);
     cmd_args.add_arg(key);
-    cmd_args.add_arg(cursor);
-    if (!pattern.empty())
-    {
-        cmd_args.add_arg("MATCH");
-        cmd_args.add_arg(pattern);
-    }
-    if (count > 0)
-    {
-        cmd_args.add_arg("COUNT");
-        cmd_args.add_arg(count);
-    }
     cmd_args.final();
 
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-    {
-        get_values(redis_reply->element[1], values);
-        return static_cast<int64_t>(atoll(redis_reply->element[0]->str));
-    }
-    return 0;
+    return redis_command(false, num_retries, key, cmd_args, which);
 }
 
-
-// Copies all members of source keys to destinationkey.
-// Time complexity: O(N) where N is the total number of elements in all given sets.
-// Returns the number of members that were in resulting set.
-int  CRedisClient::sunionstore(
-    const std::string& destinationkey, 
-    const std::vector<std::string>& keys, 
-    Node* which, 
-    int num_retries)
+const RedisReplyHelper CRedisClient::eval(
+        const std::string& key,
+        const std::string& lua_scripts,
+        const std::vector<std::string>& parameters,
+        Node* which,
+        int num_retries)
 {
-    
-    std::vector<std::string> allKeys;
-    allKeys=keys;
-    allKeys.push_back(destinationkey);
-    if(keys.size()<1){
-        struct ErrorInfo errinfo;
-        errinfo.errcode = ERROR_NOT_SUPPORT;
-        errinfo.errmsg = "There must be minimum one key";
-        THROW_REDIS_EXCEPTION(errinfo);        
-    }
-    else if (cluster_mode() && keys_crossslots(allKeys))
-    {
-        struct ErrorInfo errinfo;
-        errinfo.errcode = ERROR_NOT_SUPPORT;
-        errinfo.errmsg = "CROSSSLOT not supported in cluster mode";
-        THROW_REDIS_EXCEPTION(errinfo);
-    }
-    else
-    {    
-        CommandArgs cmd_args;
-        cmd_args.set_command("SUNIONSTORE");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_arg(destinationkey);
-        cmd_args.add_args(keys);
-        cmd_args.final();
+    const int numkeys = 1;
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("EVAL");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(lua_scripts);
+    cmd_args.add_arg(numkeys);
+    cmd_args.add_arg(key);
+    cmd_args.add_args(parameters);
+    cmd_args.final();
 
-        // Integer reply, specifically:
-        // Integer reply: the number of elements in the resulting set..
-        const RedisReplyHelper redis_reply = redis_command(false, num_retries, destinationkey, cmd_args, which);
-        if (REDIS_REPLY_INTEGER == redis_reply->type)
-            return static_cast<int>(redis_reply->integer);
-        return 0;
-    }
+    return redis_command(false, num_retries, key, cmd_args, which);
 }
 
-
-//
-// ZSET
-//
-
-// Time complexity:
-// O(M*log(N)) with N being the number of elements in the sorted set and M the number of elements to be removed.
-//
-// ZREM key member [member ...]
-int CRedisClient::zrem(
+const RedisReplyHelper CRedisClient::evalsha(
         const std::string& key,
-        const std::string& field,
-        Node* which,
-        int num_retries)
+        const std::string& sha1,
+        const std::vector<std::string>& parameters,
+        Node* which, int num_retries)
 {
+    const int numkeys = 1;
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZREM");
+    cmd_args.set_command("EVALSHA");
     cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(sha1);
+    cmd_args.add_arg(numkeys);
     cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
+    cmd_args.add_args(parameters);
     cmd_args.final();
 
-    // Integer reply, specifically:
-    // The number of members removed from the sorted set, not including non existing members.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    return redis_command(false, num_retries, key, cmd_args, which);
 }
 
-// Time complexity:
-// O(M*log(N)) with N being the number of elements in the sorted set and M the number of elements to be removed.
-int CRedisClient::zrem(
-        const std::string& key,
-        const std::vector<std::string>& fields,
+const RedisReplyHelper CRedisClient::eval(
+        const std::string& lua_scripts,
+        const std::vector<std::string>& keys, const std::vector<std::string>& parameters,
+        Node* which,
+        int num_retries)
+{
+    if (cluster_mode() && keys_crossslots(keys))
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errcode = ERROR_NOT_SUPPORT;
+        errinfo.errmsg = "EVAL not supported in cluster mode";
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        const int numkeys = static_cast<int>(keys.size());
+        std::string key;
+        if (cluster_mode() && !keys.empty())
+            key = keys[0];
+
+        CommandArgs cmd_args;
+        if (!key.empty())
+            cmd_args.set_key(key);
+        cmd_args.set_command("EVAL");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_arg(lua_scripts);
+        cmd_args.add_arg(numkeys);
+        cmd_args.add_args(keys);
+        cmd_args.add_args(parameters);
+        cmd_args.final();
+        return redis_command(false, num_retries, key, cmd_args, which);
+    }
+}
+
+const RedisReplyHelper CRedisClient::evalsha(
+        const std::string& sha1,
+        const std::vector<std::string>& keys,
+        const std::vector<std::string>& parameters,
         Node* which,
         int num_retries)
+{
+    if (cluster_mode() && keys_crossslots(keys))
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errcode = ERROR_NOT_SUPPORT;
+        errinfo.errmsg = "EVAL not supported in cluster mode";
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        const int numkeys = static_cast<int>(keys.size());
+        std::string key;
+        if (cluster_mode() && !keys.empty())
+            key = keys[0];
+
+        CommandArgs cmd_args;
+        if (!key.empty())
+            cmd_args.set_key(key);
+        cmd_args.set_command("EVALSHA");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_arg(sha1);
+        cmd_args.add_arg(numkeys);
+        cmd_args.add_args(keys);
+        cmd_args.add_args(parameters);
+        cmd_args.final();
+        return redis_command(false, num_retries, key, cmd_args, which);
+    }
+}
+
+//
+// HASH
+//
+
+// Time complexity: O(N) where N is the number of fields to be removed.
+// HDEL key field [field ...]
+bool CRedisClient::hdel(const std::string& key, const std::string& field, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZREM");
+    cmd_args.set_command("HDEL");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_args(fields);
+    cmd_args.add_arg(field);
     cmd_args.final();
 
-    // Integer reply, specifically:
-    // The number of members removed from the sorted set, not including non existing members.
+    // Integer reply:
+    // the number of fields that were removed from the hash, not including specified but non existing fields.
     const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return false;
     if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+        return 1 == redis_reply->integer;
+    return true;
 }
 
-// Time complexity:
-// O(log(N)) for each item added, where N is the number of elements in the sorted set.
-//
-// ZADD key [NX|XX] [CH] [INCR] score member [score member ...]
-int CRedisClient::zadd(
+int CRedisClient::hdel(
         const std::string& key,
-        const std::string& field,
-        int64_t score,
-        ZADDFLAG flag,
+        const std::vector<std::string>& fields,
         Node* which,
         int num_retries)
 {
-    std::map<std::string, int64_t> map;
-    map[field] = score;
-    return zadd(key, map, flag, which, num_retries);
+    return hmdel(key, fields, which, num_retries);
 }
 
-int CRedisClient::zadd(
+int CRedisClient::hmdel(
         const std::string& key,
-        const std::map<std::string, int64_t>& map,
-        ZADDFLAG flag,
+        const std::vector<std::string>& fields,
         Node* which,
         int num_retries)
 {
-    const std::string& flag_str = zaddflag2str(flag);
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZADD");
+    cmd_args.set_command("HDEL");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    if (!flag_str.empty())
-    {
-        cmd_args.add_arg(flag_str);
-    }
-    cmd_args.add_args(map, true);
+    cmd_args.add_args(fields);
     cmd_args.final();
 
-    // Integer reply, specifically:
-    // The number of elements added to the sorted sets, not including
-    // elements already existing for which the score was updated.
-    //
-    // If the INCR option is specified, the return value will be Bulk string reply:
-    // the new score of member (a double precision floating point number), represented as string.
+    // Integer reply:
+    // the number of fields that were removed from the hash, not including specified but non existing fields.
     const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return 0;
     if (REDIS_REPLY_INTEGER == redis_reply->type)
         return static_cast<int>(redis_reply->integer);
     return 0;
 }
 
 // Time complexity: O(1)
-int64_t CRedisClient::zcard(const std::string& key, Node* which, int num_retries)
+// HEXISTS key field
+bool CRedisClient::hexists(const std::string& key, const std::string& field, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZCARD");
+    cmd_args.set_command("HEXISTS");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
+    cmd_args.add_arg(field);
     cmd_args.final();
 
-    // Integer reply:
-    // the cardinality (number of elements) of the sorted set, or 0 if key does not exist.
+    // Integer reply, specifically:
+    // 1 if the hash contains field.
+    // 0 if the hash does not contain field, or key does not exist.
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int64_t>(redis_reply->integer);
-    return 0;
+        return 1 == redis_reply->integer;
+    return true;
 }
 
-// Time complexity:
-// O(log(N)) with N being the number of elements in the sorted set.
-//
-// ZCOUNT key min max
-int64_t CRedisClient::zcount(
-        const std::string& key,
-        int64_t min, int64_t max ,
-        Node* which,
-        int num_retries)
+// Time complexity: O(1)
+// HLEN key
+int CRedisClient::hlen(const std::string& key, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZCOUNT");
+    cmd_args.set_command("HLEN");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(min);
-    cmd_args.add_arg(max);
     cmd_args.final();
 
-    // Integer reply:
-    // the number of elements in the specified score range.
+    // Integer reply: number of fields in the hash, or 0 when key does not exist.
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
     if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int64_t>(redis_reply->integer);
+        return static_cast<int>(redis_reply->integer);
     return 0;
 }
 
-// Time complexity:
-// O(log(N)) where N is the number of elements in the sorted set.
-//
-// ZINCRBY key increment member
-int64_t CRedisClient::zincrby(
+// Time complexity: O(1)
+// HSET key field value
+bool CRedisClient::hset(
         const std::string& key,
-        const std::string& field, int64_t increment,
+        const std::string& field,
+        const std::string& value,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZINCRBY");
+    cmd_args.set_command("HSET");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(increment);
     cmd_args.add_arg(field);
+    cmd_args.add_arg(value);
     cmd_args.final();
 
-    // Bulk string reply:
-    // the new score of member (a double precision floating point number), represented as string.
-    //
-    // (gdb) p *redis_reply._redis_reply
-    // $4 = {type = 1, integer = 0, len = 2, str = 0x647860 "10", elements = 0, element = 0x0}
+    // Integer reply, specifically:
+    // 1 if field is a new field in the hash and value was set.
+    // 0 if field already exists in the hash and the value was updated.
     const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_STRING == redis_reply->type)
-        return static_cast<int64_t>(atoll(redis_reply->str));
-    return 0;
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return 1 == redis_reply->integer;
+    return true;
 }
 
-// Time complexity:
-// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements returned.
-// ZRANGE key start stop [WITHSCORES]
-//
-// ZRANGE key start stop [WITHSCORES]
-int CRedisClient::zrange(
+// HSETNX key field value
+// Time complexity: O(1)
+bool CRedisClient::hsetnx(
         const std::string& key,
-        int64_t start, int64_t end, bool withscores,
-        std::vector<std::pair<std::string, int64_t> >* vec,
+        const std::string& field,
+        const std::string& value,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZRANGE");
+    cmd_args.set_command("HSETNX");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(start);
-    cmd_args.add_arg(end);
-    if (withscores)
-    {
-        cmd_args.add_arg("WITHSCORES");
-    }
+    cmd_args.add_arg(field);
+    cmd_args.add_arg(value);
     cmd_args.final();
 
-    // Array reply:
-    // list of elements in the specified range (optionally with their scores, in case the WITHSCORES option is given).
+    // Integer reply, specifically:
+    // 1 if field is a new field in the hash and value was set.
+    // 0 if field already exists in the hash and no operation was performed.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return 1 == redis_reply->integer;
+    return true;
+}
+
+// Time complexity: O(1)
+// HGET key field
+bool CRedisClient::hget(
+        const std::string& key,
+        const std::string& field,
+        std::string* value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("HGET");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(field);
+    cmd_args.final();
+
+    // Bulk string reply:
+    // the value associated with field, or nil when field is not present in the hash or key does not exist.
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), vec, withscores);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return false;
+    if (REDIS_REPLY_STRING == redis_reply->type)
+        return get_value(redis_reply.get(), value);
+    return true;
+}
+
+// Time complexity: O(1)
+// HINCRBY key field increment
+int64_t CRedisClient::hincrby(
+        const std::string& key,
+        const std::string& field,
+        int64_t increment,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("HINCRBY");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(field);
+    cmd_args.add_arg(increment);
+    cmd_args.final();
+
+    // Integer reply: the value at field after the increment operation.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int64_t>(redis_reply->integer);
     return 0;
 }
 
-// Time complexity:
-// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements returned.
-//
-// ZREVRANGE key start stop [WITHSCORES]
-int CRedisClient::zrevrange(
+void CRedisClient::hset(
         const std::string& key,
-        int64_t start, int64_t end, bool withscores,
-        std::vector<std::pair<std::string, int64_t> >* vec,
+        const std::map<std::string, std::string>& map,
+        Node* which,
+        int num_retries)
+{
+    hmset(key, map, which, num_retries);
+}
+
+// Time complexity: O(N) where N is the number of fields being set.
+// HMSET key field value [field value ...]
+void CRedisClient::hmset(
+        const std::string& key,
+        const std::map<std::string, std::string>& map,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZREVRANGE");
+    cmd_args.set_command("HMSET");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(start);
-    cmd_args.add_arg(end);
-    if (withscores)
-    {
-        cmd_args.add_arg("WITHSCORES");
-    }
+    cmd_args.add_args(map);
+    cmd_args.final();
+
+    // Simple string reply (REDIS_REPLY_STATUS)
+    redis_command(false, num_retries, key, cmd_args, which);
+}
+
+int CRedisClient::hget(
+        const std::string& key,
+        const std::vector<std::string>& fields,
+        std::map<std::string, std::string>* map,
+        bool keep_null,
+        Node* which,
+        int num_retries)
+{
+    return hmget(key, fields, map, keep_null, which, num_retries);
+}
+
+// Time complexity: O(N) where N is the number of fields being requested.
+// HMGET key field [field ...]
+int CRedisClient::hmget(
+        const std::string& key,
+        const std::vector<std::string>& fields,
+        std::map<std::string, std::string>* map,
+        bool keep_null,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("HMGET");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_args(fields);
     cmd_args.final();
 
     // Array reply:
-    // list of elements in the specified range (optionally with their scores, in case the WITHSCORES option is given).
+    // list of values associated with the given fields, in the same order as they are requested.
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return 0;
     if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), vec, withscores);
+        return get_values(redis_reply.get(), fields, keep_null, map);
     return 0;
 }
 
-// Time complexity:
-// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements being returned.
-// If M is constant (e.g. always asking for the first 10 elements with LIMIT), you can consider it O(log(N)).
-//
-// ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
-int CRedisClient::zrangebyscore(
+// Time complexity: O(N) where N is the size of the hash.
+// HGETALL key
+int CRedisClient::hgetall(
         const std::string& key,
-        int64_t min, int64_t max, bool withscores,
-        std::vector<std::pair<std::string, int64_t> >* vec,
+        std::map<std::string, std::string>* map,
         Node* which,
         int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZRANGEBYSCORE");
+    cmd_args.set_command("HGETALL");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(min);
-    cmd_args.add_arg(max);
-    if (withscores)
-    {
-        cmd_args.add_arg("WITHSCORES");
-    }
     cmd_args.final();
 
     // Array reply:
-    // list of elements in the specified score range (optionally with their scores).
+    // list of fields and their values stored in the hash, or an empty list when key does not exist.
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return 0;
     if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), vec, withscores);
+        return get_values(redis_reply.get(), map);
     return 0;
 }
 
-// Time complexity:
-// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements being returned.
-// If M is constant (e.g. always asking for the first 10 elements with LIMIT), you can consider it O(log(N)).
-//
-// ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count]
-int CRedisClient::zrevrangebyscore(
-        const std::string& key,
-        int64_t max, int64_t min, bool withscores,
-        std::vector<std::pair<std::string, int64_t> >* vec,
-        Node* which,
-        int num_retries)
+// Time complexity: O(1)
+// HSTRLEN key field
+int CRedisClient::hstrlen(const std::string& key, const std::string& field, Node* which, int num_retries)
 {
     CommandArgs cmd_args;
     cmd_args.set_key(key);
-    cmd_args.set_command("ZREVRANGEBYSCORE");
+    cmd_args.set_command("HSTRLEN");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(field);
+    cmd_args.final();
+
+    // Integer reply:
+    // the string length of the value associated with field,
+    // or zero when field is not present in the hash or key does not exist at all.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return 0;
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity: O(N) where N is the size of the hash.
+// HKEYS key
+int CRedisClient::hkeys(const std::string& key, std::vector<std::string>* fields, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("HKEYS");
     cmd_args.add_arg(cmd_args.get_command());
     cmd_args.add_arg(key);
-    cmd_args.add_arg(max);
-    cmd_args.add_arg(min);
-    if (withscores)
-    {
-        cmd_args.add_arg("WITHSCORES");
-    }
     cmd_args.final();
 
     // Array reply:
-    // list of elements in the specified score range (optionally with their scores).
+    // list of fields in the hash, or an empty list when key does not exist.
     const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return 0;
     if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), vec, withscores);
+        return get_values(redis_reply.get(), fields);
+    return 0;
+}
+
+// Time complexity: O(N) where N is the size of the hash.
+// HVALS key
+int CRedisClient::hvals(const std::string& key, std::vector<std::string>* vals, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("HVALS");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Array reply:
+    // list of values in the hash, or an empty list when key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return 0;
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), vals);
     return 0;
 }
 
-// ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
-int CRedisClient::zrangebyscore(
-        const std::string& key,
-        int64_t min, int64_t max, int64_t offset, int64_t count, bool withscores,
-        std::vector<std::pair<std::string, int64_t> >* vec,
-        Node* which,
-        int num_retries)
+// Time complexity:
+// O(1) for every call. O(N) for a complete iteration,
+// including enough command calls for the cursor to return back to 0. N is the number of elements inside the collection..
+//
+// HSCAN key cursor [MATCH pattern] [COUNT count]
+int64_t CRedisClient::hscan(
+        const std::string& key,
+        int64_t cursor,
+        std::map<std::string, std::string>* map,
+        Node* which,
+        int num_retries)
+{
+    return hscan(key, cursor, std::string(""), 0, map, which, num_retries);
+}
+
+int64_t CRedisClient::hscan(
+        const std::string& key,
+        int64_t cursor, int count,
+        std::map<std::string, std::string>* map,
+        Node* which,
+        int num_retries)
+{
+    return hscan(key, cursor, std::string(""), count, map, which, num_retries);
+}
+
+int64_t CRedisClient::hscan(
+        const std::string& key,
+        int64_t cursor, const std::string& pattern,
+        std::map<std::string, std::string>* map,
+        Node* which,
+        int num_retries)
+{
+    return hscan(key, cursor, pattern, 0, map, which, num_retries);
+}
+
+int64_t CRedisClient::hscan(
+        const std::string& key,
+        int64_t cursor, const std::string& pattern, int count,
+        std::map<std::string, std::string>* map,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("HSCAN");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(cursor);
+    if (!pattern.empty())
+    {
+        cmd_args.add_arg("MATCH");
+        cmd_args.add_arg(pattern);
+    }
+    if (count > 0)
+    {
+        cmd_args.add_arg("COUNT");
+        cmd_args.add_arg(count);
+    }
+    cmd_args.final();
+
+    // (gdb) p *redis_reply
+    // $1 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 2, element = 0x641450}
+    // (gdb) p *redis_reply->element[0]
+    // $2 = {type = 1, integer = 0, len = 1, str = 0x641820 "0", elements = 0, element = 0x0}
+    // (gdb) p *redis_reply->element[1]
+    // $3 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 8, element = 0x6414b0}
+    // (gdb) p *redis_reply->element[1]->element[0]
+    // $4 = {type = 1, integer = 0, len = 2, str = 0x6418f0 "f1", elements = 0, element = 0x0}
+    // (gdb) p *redis_reply->element[1]->element[1]
+    // $5 = {type = 1, integer = 0, len = 2, str = 0x641950 "v1", elements = 0, element = 0x0}
+    // (gdb) p *redis_reply->element[1]->element[2]
+    // $6 = {type = 1, integer = 0, len = 2, str = 0x6419b0 "f2", elements = 0, element = 0x0}
+    // (gdb) p *redis_reply->element[1]->element[3]
+    // $7 = {type = 1, integer = 0, len = 2, str = 0x641a10 "v2", elements = 0, element = 0x0}
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+    {
+        get_values(redis_reply->element[1], map);
+        return static_cast<int64_t>(atoll(redis_reply->element[0]->str));
+    }
+    return 0;
+}
+
+
+
+//
+// LIST
+//
+
+// Time complexity: O(1)
+// LLEN key
+int CRedisClient::llen(const std::string& key, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LLEN");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Integer reply: the length of the list at key.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity: O(1)
+// LPOP key
+bool CRedisClient::lpop(const std::string& key, std::string* value, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LPOP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Bulk string reply: the value of the first element, or nil when key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return false;
+    if (REDIS_REPLY_STRING == redis_reply->type)
+        return get_value(redis_reply.get(), value);
+    return true; // MULTI & EXEC the type always is REDIS_REPLY_STATUS
+}
+
+bool CRedisClient::blpop(const std::string& key, std::string* value, uint32_t seconds, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("BLPOP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(seconds);
+    cmd_args.final();
+
+    // Array reply:
+    // 1) A nil multi-bulk when no element could be popped and the timeout expired.
+    // 2) A two-element multi-bulk with the first element being the name of the key
+    //    where an element was popped and the second element being the value of the popped element.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (redis_reply->type == REDIS_REPLY_NIL)
+        return false;
+    if (redis_reply->type != REDIS_REPLY_ARRAY)
+        return false;
+    return get_value(redis_reply->element[1], value);
+}
+
+// Time complexity: O(1)
+// LPUSH key value [value ...]
+int CRedisClient::lpush(
+        const std::string& key,
+        const std::string& value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LPUSH");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply: the length of the list after the push operations.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity: O(1)
+// LPUSH key value [value ...]
+int CRedisClient::lpush(
+        const std::string& key,
+        const std::vector<std::string>& values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LPUSH");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_args(values);
+    cmd_args.final();
+
+    // Integer reply: the length of the list after the push operations.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Inserts value at the head of the list stored at key, only if key already exists and holds a list.
+// In contrary to LPUSH, no operation will be performed when key does not yet exist.
+// Time complexity: O(1)
+int CRedisClient::lpushx(const std::string& key, const std::string& value, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LPUSHX");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply: the length of the list after the push operation.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity:
+// O(S+N) where S is the distance of start offset from HEAD for small lists,
+// from nearest end (HEAD or TAIL) for large lists;
+// and N is the number of elements in the specified range.
+//
+// LRANGE key start stop
+//
+// start和end值为-1时表示最右边一个，-2表示最右边倒数第二个，依次类推。。。
+//
+// 使用示例（lpush k 1 2 3 4 5）：
+// 1）查看最右边一个：lrange k -1 -1
+// 2）查看最右边两个：lrange k -2 -1
+// 3）查看最左边一个：lrange k 0 0
+// 4）查看最左边两个：lrange k 0 1
+// 5）查看全部：lrange k 0 -1
+int CRedisClient::lrange(
+        const std::string& key,
+        int64_t start, int64_t end,
+        std::vector<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LRANGE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(start);
+    cmd_args.add_arg(end);
+    cmd_args.final();
+
+    // Array reply: list of elements in the specified range.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), values);
+    return 0;
+}
+
+// Time complexity:
+// O(N) where N is the number of elements to be removed by the operation.
+//
+// LTRIM key start stop
+//
+// 注意：
+// 1）start和end值为-1时表示最右边一个，-2表示最右边倒数第二个，依次类推。。。
+// 2）start~stop 是“保留”区间而不是删除范围，两值相减的绝对值为保留的数量
+//
+// 使用示例（lpush k 1 2 3 4 5）：
+// 1）删除最右一个：ltrim k 0 -2
+// 2）删除最右两个：ltrim k 0 -3
+// 3）删除最左一个：ltrim k 1 -1
+// 4）删除最左两个：ltrim k 2 -1
+void CRedisClient::ltrim(
+        const std::string& key,
+        int64_t start, int64_t end,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LTRIM");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(start);
+    cmd_args.add_arg(end);
+    cmd_args.final();
+
+    // Simple string reply (REDIS_REPLY_STATUS)
+    redis_command(false, num_retries, key, cmd_args, which);
+}
+
+void CRedisClient::lset(const std::string& key, int index, const std::string& value, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LSET");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(index);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Simple string reply (REDIS_REPLY_STATUS)
+    // An error is returned for out of range indexes.
+    redis_command(false, num_retries, key, cmd_args, which);
+}
+
+// Inserts value in the list stored at key either before or after the reference value pivot.
+//
+// Time complexity:
+// O(N) where N is the number of elements to traverse before seeing the value pivot.
+// This means that inserting somewhere on the left end on the list (head) can be considered O(1)
+// and inserting somewhere on the right end (tail) is O(N).
+int CRedisClient::linsert(const std::string& key, const std::string& pivot, const std::string& value, bool before, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LINSERT");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    if (before)
+        cmd_args.add_arg("BEFORE");
+    else
+        cmd_args.add_arg("AFTER");
+    cmd_args.add_arg(pivot);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply:
+    // the length of the list after the insert operation,
+    // or -1 when the value pivot was not found.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Removes the first count occurrences of elements equal to value from the list stored at key.
+// Time complexity:
+// O(N) where N is the length of the list.
+int CRedisClient::lrem(const std::string& key, int count, const std::string& value, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LREM");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(count);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply: the number of removed elements.
+    // Returns the number of removed elements.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity:
+// O(N) where N is the number of elements to traverse to get to the element at index.
+// This makes asking for the first or the last element of the list O(1).
+bool CRedisClient::lindex(const std::string& key, int index, std::string* value, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("LINDEX");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(index);
+    cmd_args.final();
+
+    // Bulk string reply: the requested element, or nil when index is out of range.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return false;
+    if (REDIS_REPLY_STRING == redis_reply->type)
+        return get_value(redis_reply.get(), value);
+    return true;
+}
+
+// Time complexity: O(1)
+// RPOP key
+bool CRedisClient::rpop(
+        const std::string& key,
+        std::string* value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("RPOP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Bulk string reply: the value of the last element, or nil when key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return false;
+    if (REDIS_REPLY_STRING == redis_reply->type)
+        return get_value(redis_reply.get(), value);
+    return true;
+}
+
+int CRedisClient::rpop(const std::string& key, std::vector<std::string>* values, int n, Node* which, int num_retries)
+{
+    values->clear();
+
+    if (n < 1)
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errcode = ERROR_PARAMETER;
+        errinfo.errmsg = "`n` is less than 1";
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else if (n == 1)
+    {
+        std::string value;
+        if (!rpop(key, &value, which, num_retries))
+        {
+            return 0;
+        }
+        else
+        {
+            values->push_back(value);
+            return 1;
+        }
+    }
+    else
+    {
+        const std::string lua_scripts =
+                "local v=redis.call('LRANGE',KEYS[1],-ARGV[1], -1);"
+                "redis.call('LTRIM',KEYS[1],0,-(ARGV[1]+1));"
+                "return v;";
+        std::vector<std::string> parameters(1);
+        parameters[0] = int2string(n);
+        const RedisReplyHelper redis_reply = eval(key, lua_scripts, parameters, which, num_retries);
+        if (REDIS_REPLY_ARRAY == redis_reply->type)
+        {
+            std::vector<std::string> v;
+            const int m = get_values(redis_reply.get(), &v);
+            // LRANGE 返回的结果是从左到右，对 r 操作需要倒过来
+            for (int i=m-1; i>-1; --i)
+                values->push_back(v[i]);
+            return m;
+        }
+        return 0;
+    }
+}
+
+bool CRedisClient::brpop(const std::string& key, std::string* value, uint32_t seconds, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("BRPOP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(seconds);
+    cmd_args.final();
+
+    // Array reply:
+    // 1) A nil multi-bulk when no element could be popped and the timeout expired.
+    // 2) A two-element multi-bulk with the first element being the name of the key
+    //    where an element was popped and the second element being the value of the popped element.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (redis_reply->type == REDIS_REPLY_NIL)
+        return false;
+    if (redis_reply->type != REDIS_REPLY_ARRAY)
+        return false;
+    return get_value(redis_reply->element[1], value);
+}
+
+// Time complexity: O(1)
+bool CRedisClient::rpoppush(
+        const std::string& source,
+        const std::string& destination,
+        std::string* value,
+        Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(source);
+    cmd_args.set_command("RPOPLPUSH");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(source);
+    cmd_args.add_arg(destination);
+    cmd_args.final();
+
+    // Bulk string reply: the value of the last element, or nil when key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, source, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return false;
+    if (REDIS_REPLY_STRING == redis_reply->type)
+        return get_value(redis_reply.get(), value);
+    return true;
+}
+
+// Time complexity: O(1)
+bool CRedisClient::brpoppush(const std::string& source, const std::string& destination, std::string* value, uint32_t seconds, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(source);
+    cmd_args.set_command("BRPOPLPUSH");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(source);
+    cmd_args.add_arg(destination);
+    cmd_args.add_arg(seconds);
+    cmd_args.final();
+
+    // Bulk string reply: the value of the last element, or nil when key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, source, cmd_args, which);
+    if (redis_reply->type == REDIS_REPLY_NIL)
+        return false;
+    if (redis_reply->type == REDIS_REPLY_STRING)
+        return get_value(redis_reply.get(), value);
+    return true;
+}
+
+// Time complexity: O(1)
+int CRedisClient::rpush(
+        const std::string& key,
+        const std::string& value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("RPUSH");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply: the length of the list after the push operation.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity: O(1)
+int CRedisClient::rpush(
+        const std::string& key,
+        const std::vector<std::string>& values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("RPUSH");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_args(values);
+    cmd_args.final();
+
+    // Integer reply: the length of the list after the push operation.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity: O(1)
+int CRedisClient::rpushx(
+        const std::string& key,
+        const std::string& value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("RPUSHX");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply:
+    // the length of the list after the push operation.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+//
+// SET
+//
+
+// Time complexity:
+//  O(1) for each element added, so O(N) to add N elements when the command is called with multiple arguments.
+int CRedisClient::sadd(
+        const std::string& key,
+        const std::string& value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SADD");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply: the number of elements that were added to the set,
+    // not including all the elements already present into the set.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+//  O(1) for each element added, so O(N) to add N elements when the command is called with multiple arguments.
+int CRedisClient::sadd(
+        const std::string& key,
+        const std::vector<std::string>& values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SADD");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_args(values);
+    cmd_args.final();
+
+    // Integer reply: the number of elements that were added to the set,
+    // not including all the elements already present into the set.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// O(1)
+int CRedisClient::scard(const std::string& key, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SCARD");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Integer reply: the cardinality (number of elements) of the set, or 0 if key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// O(1)
+bool CRedisClient::sismember(
+        const std::string& key,
+        const std::string& value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SISMEMBER");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply, specifically:
+    // 1 if the element is a member of the set.
+    // 0 if the element is not a member of the set, or if key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return 1 == redis_reply->integer;
+    return true;
+}
+
+// O(N) where N is the set cardinality.
+int CRedisClient::smembers(
+        const std::string& key,
+        std::vector<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SMEMBERS");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Array reply:
+    // all elements of the set.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), values);
+    return 0;
+}
+
+int CRedisClient::smembers(
+        const std::string& key,
+        std::set<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SMEMBERS");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Array reply:
+    // all elements of the set.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), values);
+    return 0;
+}
+
+// Time complexity: O(1)
+bool CRedisClient::spop(
+        const std::string& key,
+        std::string* value,
+        Node* which,
+        int num_retries)
+{
+    std::vector<std::string> values;
+    const int n = spop(key, 1, &values, which, num_retries);
+    if (n > 0)
+    {
+        *value = value[0];
+    }
+    return n > 0;
+}
+
+// Time complexity: O(1)
+int CRedisClient::spop(
+        const std::string& key,
+        int count,
+        std::vector<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SPOP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(count);
+    cmd_args.final();
+
+    // Bulk string reply:
+    // the removed element, or nil when key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), values);
+    return 0;
+}
+
+// Time complexity: O(1)
+bool CRedisClient::srandmember(
+        const std::string& key,
+        std::string* value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SRANDMEMBER");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Bulk string reply:
+    // without the additional count argument the command returns a Bulk Reply with the randomly selected element,
+    // or nil when key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+        return false;
+    if (REDIS_REPLY_STRING == redis_reply->type)
+        return get_value(redis_reply.get(), value);
+    return true;
+}
+
+// Time complexity: O(N) where N is the absolute value of the passed count.
+int CRedisClient::srandmember(
+        const std::string& key,
+        int count,
+        std::vector<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SRANDMEMBER");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(count);
+    cmd_args.final();
+
+    // Array reply:
+    // when the additional count argument is passed the command returns an array of elements,
+    // or an empty array when key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), values);
+    return 0;
+}
+
+// Time complexity: O(N) where N is the number of members to be removed.
+int CRedisClient::srem(
+        const std::string& key,
+        const std::string& value,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SREM");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply: the number of members that were removed from the set,
+    // not including non existing members.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+int CRedisClient::srem(
+        const std::string& key,
+        const std::vector<std::string>& values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SREM");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_args(values);
+    cmd_args.final();
+
+    // Integer reply: the number of members that were removed from the set,
+    // not including non existing members.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity:
+// O(1) for every call.
+// O(N) for a complete iteration, including enough command calls for the cursor to return back to 0.
+// N is the number of elements inside the collection..
+int64_t CRedisClient::sscan(
+        const std::string& key,
+        int64_t cursor,
+        std::vector<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    return sscan(key, cursor, std::string(""), 0, values, which, num_retries);
+}
+
+int64_t CRedisClient::sscan(
+        const std::string& key,
+        int64_t cursor, int count,
+        std::vector<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    return sscan(key, cursor, std::string(""), count, values, which, num_retries);
+}
+
+int64_t CRedisClient::sscan(
+        const std::string& key,
+        int64_t cursor, const std::string& pattern,
+        std::vector<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    return sscan(key, cursor, pattern, 0, values, which, num_retries);
+}
+
+int64_t CRedisClient::sscan(
+        const std::string& key,
+        int64_t cursor, const std::string& pattern, int count,
+        std::vector<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    // SSCAN key cursor [MATCH pattern] [COUNT count]
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SSCAN");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(cursor);
+    if (!pattern.empty())
+    {
+        cmd_args.add_arg("MATCH");
+        cmd_args.add_arg(pattern);
+    }
+    if (count > 0)
+    {
+        cmd_args.add_arg("COUNT");
+        cmd_args.add_arg(count);
+    }
+    cmd_args.final();
+
+    // (gdb) p *redis_reply
+    // $3 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 2, element = 0x641450}
+    // (gdb) p *redis_reply->element[0]
+    // $4 = {type = 1, integer = 0, len = 4, str = 0x641810 "6656", elements = 0, element = 0x0}
+    // (gdb) p *redis_reply->element[1]
+    // $5 = {type = 2, integer = 0, len = 0, str = 0x0, elements = 10, element = 0x641930}
+    // (gdb) p *redis_reply->element[1]->element[0]
+    // $6 = {type = 1, integer = 0, len = 5, str = 0x6419d0 "f1055", elements = 0, element = 0x0}
+    // (gdb) p *redis_reply->element[1]->element[1]
+    // $7 = {type = 1, integer = 0, len = 5, str = 0x641a30 "f6368", elements = 0, element = 0x0}
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+    {
+        get_values(redis_reply->element[1], values);
+        return static_cast<int64_t>(atoll(redis_reply->element[0]->str));
+    }
+    return 0;
+}
+
+int64_t CRedisClient::sscan(
+        const std::string& key,
+        int64_t cursor,
+        const std::string& pattern,
+        int count,
+        std::set<std::string>* values,
+        Node* which,
+        int num_retries)
+{
+    // SSCAN key cursor [MATCH pattern] [COUNT count]
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SSCAN");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(cursor);
+    if (!pattern.empty())
+    {
+        cmd_args.add_arg("MATCH");
+        cmd_args.add_arg(pattern);
+    }
+    if (count > 0)
+    {
+        cmd_args.add_arg("COUNT");
+        cmd_args.add_arg(count);
+    }
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+    {
+        get_values(redis_reply->element[1], values);
+        return static_cast<int64_t>(atoll(redis_reply->element[0]->str));
+    }
+    return 0;
+}
+
+
+// Copies all members of source keys to destinationkey.
+// Time complexity: O(N) where N is the total number of elements in all given sets.
+// Returns the number of members that were in resulting set.
+int  CRedisClient::sunionstore(
+    const std::string& destinationkey, 
+    const std::vector<std::string>& keys, 
+    Node* which, 
+    int num_retries)
+{
+    
+    std::vector<std::string> allKeys;
+    allKeys=keys;
+    allKeys.push_back(destinationkey);
+    if(keys.size()<1){
+        struct ErrorInfo errinfo;
+        errinfo.errcode = ERROR_NOT_SUPPORT;
+        errinfo.errmsg = "There must be minimum one key";
+        THROW_REDIS_EXCEPTION(errinfo);        
+    }
+    else if (cluster_mode() && keys_crossslots(allKeys))
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errcode = ERROR_NOT_SUPPORT;
+        errinfo.errmsg = "CROSSSLOT not supported in cluster mode";
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {    
+        CommandArgs cmd_args;
+        cmd_args.set_command("SUNIONSTORE");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_arg(destinationkey);
+        cmd_args.add_args(keys);
+        cmd_args.final();
+
+        // Integer reply, specifically:
+        // Integer reply: the number of elements in the resulting set..
+        const RedisReplyHelper redis_reply = redis_command(false, num_retries, destinationkey, cmd_args, which);
+        if (REDIS_REPLY_INTEGER == redis_reply->type)
+            return static_cast<int>(redis_reply->integer);
+        return 0;
+    }
+}
+
+
+//
+// ZSET
+//
+
+// Time complexity:
+// O(M*log(N)) with N being the number of elements in the sorted set and M the number of elements to be removed.
+//
+// ZREM key member [member ...]
+int CRedisClient::zrem(
+        const std::string& key,
+        const std::string& field,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZREM");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(field);
+    cmd_args.final();
+
+    // Integer reply, specifically:
+    // The number of members removed from the sorted set, not including non existing members.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity:
+// O(M*log(N)) with N being the number of elements in the sorted set and M the number of elements to be removed.
+int CRedisClient::zrem(
+        const std::string& key,
+        const std::vector<std::string>& fields,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZREM");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_args(fields);
+    cmd_args.final();
+
+    // Integer reply, specifically:
+    // The number of members removed from the sorted set, not including non existing members.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity:
+// O(log(N)) for each item added, where N is the number of elements in the sorted set.
+//
+// ZADD key [NX|XX] [CH] [INCR] score member [score member ...]
+int CRedisClient::zadd(
+        const std::string& key,
+        const std::string& field,
+        int64_t score,
+        ZADDFLAG flag,
+        Node* which,
+        int num_retries)
+{
+    std::map<std::string, int64_t> map;
+    map[field] = score;
+    return zadd(key, map, flag, which, num_retries);
+}
+
+int CRedisClient::zadd(
+        const std::string& key,
+        const std::map<std::string, int64_t>& map,
+        ZADDFLAG flag,
+        Node* which,
+        int num_retries)
+{
+    const std::string& flag_str = zaddflag2str(flag);
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZADD");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    if (!flag_str.empty())
+    {
+        cmd_args.add_arg(flag_str);
+    }
+    cmd_args.add_args(map, true);
+    cmd_args.final();
+
+    // Integer reply, specifically:
+    // The number of elements added to the sorted sets, not including
+    // elements already existing for which the score was updated.
+    //
+    // If the INCR option is specified, the return value will be Bulk string reply:
+    // the new score of member (a double precision floating point number), represented as string.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity: O(1)
+int64_t CRedisClient::zcard(const std::string& key, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZCARD");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Integer reply:
+    // the cardinality (number of elements) of the sorted set, or 0 if key does not exist.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int64_t>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity:
+// O(log(N)) with N being the number of elements in the sorted set.
+//
+// ZCOUNT key min max
+int64_t CRedisClient::zcount(
+        const std::string& key,
+        int64_t min, int64_t max ,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZCOUNT");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(min);
+    cmd_args.add_arg(max);
+    cmd_args.final();
+
+    // Integer reply:
+    // the number of elements in the specified score range.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int64_t>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity:
+// O(log(N)) where N is the number of elements in the sorted set.
+//
+// ZINCRBY key increment member
+int64_t CRedisClient::zincrby(
+        const std::string& key,
+        const std::string& field, int64_t increment,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZINCRBY");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(increment);
+    cmd_args.add_arg(field);
+    cmd_args.final();
+
+    // Bulk string reply:
+    // the new score of member (a double precision floating point number), represented as string.
+    //
+    // (gdb) p *redis_reply._redis_reply
+    // $4 = {type = 1, integer = 0, len = 2, str = 0x647860 "10", elements = 0, element = 0x0}
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_STRING == redis_reply->type)
+        return static_cast<int64_t>(atoll(redis_reply->str));
+    return 0;
+}
+
+// Time complexity:
+// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements returned.
+// ZRANGE key start stop [WITHSCORES]
+//
+// ZRANGE key start stop [WITHSCORES]
+int CRedisClient::zrange(
+        const std::string& key,
+        int64_t start, int64_t end, bool withscores,
+        std::vector<std::pair<std::string, int64_t> >* vec,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZRANGE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(start);
+    cmd_args.add_arg(end);
+    if (withscores)
+    {
+        cmd_args.add_arg("WITHSCORES");
+    }
+    cmd_args.final();
+
+    // Array reply:
+    // list of elements in the specified range (optionally with their scores, in case the WITHSCORES option is given).
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), vec, withscores);
+    return 0;
+}
+
+// Time complexity:
+// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements returned.
+//
+// ZREVRANGE key start stop [WITHSCORES]
+int CRedisClient::zrevrange(
+        const std::string& key,
+        int64_t start, int64_t end, bool withscores,
+        std::vector<std::pair<std::string, int64_t> >* vec,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZREVRANGE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(start);
+    cmd_args.add_arg(end);
+    if (withscores)
+    {
+        cmd_args.add_arg("WITHSCORES");
+    }
+    cmd_args.final();
+
+    // Array reply:
+    // list of elements in the specified range (optionally with their scores, in case the WITHSCORES option is given).
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), vec, withscores);
+    return 0;
+}
+
+// Time complexity:
+// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements being returned.
+// If M is constant (e.g. always asking for the first 10 elements with LIMIT), you can consider it O(log(N)).
+//
+// ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
+int CRedisClient::zrangebyscore(
+        const std::string& key,
+        int64_t min, int64_t max, bool withscores,
+        std::vector<std::pair<std::string, int64_t> >* vec,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZRANGEBYSCORE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(min);
+    cmd_args.add_arg(max);
+    if (withscores)
+    {
+        cmd_args.add_arg("WITHSCORES");
+    }
+    cmd_args.final();
+
+    // Array reply:
+    // list of elements in the specified score range (optionally with their scores).
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), vec, withscores);
+    return 0;
+}
+
+// Time complexity:
+// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements being returned.
+// If M is constant (e.g. always asking for the first 10 elements with LIMIT), you can consider it O(log(N)).
+//
+// ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count]
+int CRedisClient::zrevrangebyscore(
+        const std::string& key,
+        int64_t max, int64_t min, bool withscores,
+        std::vector<std::pair<std::string, int64_t> >* vec,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZREVRANGEBYSCORE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(max);
+    cmd_args.add_arg(min);
+    if (withscores)
+    {
+        cmd_args.add_arg("WITHSCORES");
+    }
+    cmd_args.final();
+
+    // Array reply:
+    // list of elements in the specified score range (optionally with their scores).
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), vec, withscores);
+    return 0;
+}
+
+// ZRANGEBYSCORE key min max [WITHSCORES] [LIMIT offset count]
+int CRedisClient::zrangebyscore(
+        const std::string& key,
+        int64_t min, int64_t max, int64_t offset, int64_t count, bool withscores,
+        std::vector<std::pair<std::string, int64_t> >* vec,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZRANGEBYSCORE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(min);
+    cmd_args.add_arg(max);
+    if (withscores)
+    {
+        cmd_args.add_arg("WITHSCORES");
+    }
+    cmd_args.add_arg("LIMIT");
+    cmd_args.add_arg(offset);
+    cmd_args.add_arg(count);
+    cmd_args.final();
+
+    // Array reply:
+    // list of elements in the specified score range (optionally with their scores).
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), vec, withscores);
+    return 0;
+}
+
+// ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count]
+int CRedisClient::zrevrangebyscore(
+        const std::string& key,
+        int64_t max, int64_t min, int64_t offset, int64_t count, bool withscores,
+        std::vector<std::pair<std::string, int64_t> >* vec,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZREVRANGEBYSCORE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(max);
+    cmd_args.add_arg(min);
+    if (withscores)
+    {
+        cmd_args.add_arg("WITHSCORES");
+    }
+    cmd_args.add_arg("LIMIT");
+    cmd_args.add_arg(offset);
+    cmd_args.add_arg(count);
+    cmd_args.final();
+
+    // Array reply:
+    // list of elements in the specified score range (optionally with their scores).
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+        return get_values(redis_reply.get(), vec, withscores);
+    return 0;
+}
+
+// Time complexity:
+// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements removed by the operation.
+//
+// ZREMRANGEBYRANK key start stop
+int CRedisClient::zremrangebyrank(
+        const std::string& key,
+        int64_t start, int64_t end,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZREMRANGEBYRANK");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(start);
+    cmd_args.add_arg(end);
+    cmd_args.final();
+
+    // Integer reply:
+    // the number of elements removed.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// Time complexity: O(log(N))
+//
+// ZRANK key member
+int CRedisClient::zrank(const std::string& key, const std::string& field, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZRANK");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(field);
+    cmd_args.final();
+
+    // If member exists in the sorted set, Integer reply: the rank of member.
+    // If member does not exist in the sorted set or key does not exist, Bulk string reply: nil.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+    {
+        return -1;
+    }
+    else
+    {
+        if (REDIS_REPLY_INTEGER == redis_reply->type)
+            return static_cast<int>(redis_reply->integer);
+        return 0;
+    }
+}
+
+int CRedisClient::zrevrank(const std::string& key, const std::string& field, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZREVRANK");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(field);
+    cmd_args.final();
+
+    // If member exists in the sorted set, Integer reply: the rank of member.
+    // If member does not exist in the sorted set or key does not exist, Bulk string reply: nil.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+    {
+        return -1;
+    }
+    else
+    {
+        if (REDIS_REPLY_INTEGER == redis_reply->type)
+            return static_cast<int>(redis_reply->integer);
+        return 0;
+    }
+}
+
+// Time complexity: O(1)
+// ZSCORE key member
+int64_t CRedisClient::zscore(const std::string& key, const std::string& field, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZSCORE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(field);
+    cmd_args.final();
+
+    // Bulk string reply:
+    // the score of member (a double precision floating point number), represented as string.
+    // If member does not exist in the sorted set, or key does not exist, nil is returned.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_NIL == redis_reply->type)
+    {
+        return -1;
+    }
+    else
+    {
+        if (REDIS_REPLY_STRING == redis_reply->type)
+            return static_cast<int64_t>(atoll(redis_reply->str));
+        return 0;
+    }
+}
+
+// Time complexity:
+// O(1) for every call. O(N) for a complete iteration,
+// including enough command calls for the cursor to return back to 0. N is the number of elements inside the collection..
+//
+// ZSCAN key cursor [MATCH pattern] [COUNT count]
+int64_t CRedisClient::zscan(
+        const std::string& key,
+        int64_t cursor,
+        std::vector<std::pair<std::string, int64_t> >* values,
+        Node* which,
+        int num_retries)
+{
+    return zscan(key, cursor, std::string(""), 0, values, which, num_retries);
+}
+
+int64_t CRedisClient::zscan(
+        const std::string& key,
+        int64_t cursor, int count,
+        std::vector<std::pair<std::string, int64_t> >* values,
+        Node* which,
+        int num_retries)
+{
+    return zscan(key, cursor, std::string(""), count, values, which, num_retries);
+}
+
+int64_t CRedisClient::zscan(
+        const std::string& key,
+        int64_t cursor, const std::string& pattern,
+        std::vector<std::pair<std::string, int64_t> >* values,
+        Node* which,
+        int num_retries)
+{
+    return zscan(key, cursor, pattern, 0, values, which, num_retries);
+}
+
+int64_t CRedisClient::zscan(
+        const std::string& key,
+        int64_t cursor, const std::string& pattern, int count,
+        std::vector<std::pair<std::string, int64_t> >* values,
+        Node* which,
+        int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("ZSCAN");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(cursor);
+    if (!pattern.empty())
+    {
+        cmd_args.add_arg("MATCH");
+        cmd_args.add_arg(pattern);
+    }
+    if (count > 0)
+    {
+        cmd_args.add_arg("COUNT");
+        cmd_args.add_arg(count);
+    }
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_ARRAY == redis_reply->type)
+    {
+        get_values(redis_reply->element[1], values, true);
+        return static_cast<int64_t>(atoll(redis_reply->element[0]->str));
+    }
+    return 0;
+}
+
+//
+// STREAM
+//
+
+// 从待处理条目列表（PEL）中移除待处理条目（ids），
+// 因为一旦消息被成功处理，消费者组就不再需要跟踪它并记住消息的当前所有者
+// Time complexity: O(1) for each message ID processed.
+// XACK key group ID [ID ...]
+int CRedisClient::xack(
+        const std::string& key, const std::string& groupname,
+        const std::vector<std::string>& ids,
+        Node* which, int num_retries)
+{
+    std::string value;
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XACK");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(groupname);
+    cmd_args.add_args(ids);
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+int CRedisClient::xack(
+        const std::string& key, const std::string& groupname,
+        const std::string& id,
+        Node* which, int num_retries)
+{
+    std::vector<std::string> ids(1);
+    ids[0] = id;
+    return xack(key, groupname, ids, which, num_retries);
+}
+
+// Time complexity: O(1)
+// XADD key [MAXLEN [~|=] <count>] <ID or *> [field value] [field value] ...
+std::string CRedisClient::xadd(
+        const std::string& key, const std::string& id,
+        const std::vector<FVPair>& values,
+        int64_t maxlen, char c,
+        Node* which, int num_retries)
+{
+    std::string value;
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XADD");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg("MAXLEN");
+    cmd_args.add_arg(c);
+    cmd_args.add_arg(maxlen);
+    cmd_args.add_arg(id);
+    cmd_args.add_args(values);
+    cmd_args.final();
+
+    // The command returns the number of messages successfully acknowledged.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    //if (REDIS_REPLY_STRING == redis_reply->type)
+    (void)get_value(redis_reply.get(), &value);
+    return value;
+}
+
+std::string CRedisClient::xadd(
+        const std::string& key, const std::string& id,
+        const std::vector<FVPair>& values,
+        Node* which, int num_retries)
+{
+    std::string value;
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XADD");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(id);
+    cmd_args.add_args(values);
+    cmd_args.final();
+
+    // The command returns the number of messages successfully acknowledged.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    //if (REDIS_REPLY_STRING == redis_reply->type)
+    (void)get_value(redis_reply.get(), &value);
+    return value;
+}
+
+// Time complexity: O(1) for all the subcommands, with the exception of the
+// DESTROY subcommand which takes an additional O(M) time in order to delete
+// the M entries inside the consumer group pending entries list (PEL).
+//
+// XGROUP CREATE key(topic) groupname id-or-$
+bool CRedisClient::xgroup_create(
+        const std::string& key, const std::string& groupname, const std::string& id,
+        bool mkstream,
+        Node* which, int num_retries)
+{
+    // xgroup CREATE key groupname id-or-$
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XGROUP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg("CREATE");
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(groupname);
+    cmd_args.add_arg(id);
+    if (mkstream)
+    {
+        // ERR The XGROUP subcommand requires the key to exist.
+        // Note that for CREATE you may want to use the MKSTREAM option to create an empty stream automatically.
+        cmd_args.add_arg("MKSTREAM");
+    }
+    cmd_args.final();
+
+    try
+    {
+        // If the specified consumer group already exists, the command returns a -BUSYGROUP error.
+        // Otherwise the operation is performed and OK is returned.
+        // There are no hard limits to the number of consumer groups you can associate to a given stream.
+        //
+        // Consumers in a consumer group are auto-created every time a new consumer name is mentioned by some command.
+        //
+        // 如果key不存在，则会报如下错误：
+        // The XGROUP subcommand requires the key to exist.
+        // Note that for CREATE you may want to use the MKSTREAM option to create an empty stream automatically.
+        const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+        std::string val;
+        get_value(redis_reply.get(), &val);
+        // When a consumer group with the same name already exists, the command returns a -BUSYGROUP error.
+        return val == "OK";
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        // BUSYGROUP Consumer Group name already exists
+        if (r3c::is_busygroup_error(ex.errtype()))
+            return false;
+        else
+            throw;
+    }
+}
+
+// To just remove a given consumer from a consumer group.
+// Consumers in a consumer group are auto-created every time a new consumer name is mentioned by some command.
+//
+// XGROUP DESTROY key groupname
+bool CRedisClient::xgroup_destroy(const std::string& key, const std::string& groupname, Node* which, int num_retries)
+{
+    // xgroup DESTROY key groupname
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XGROUP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg("DESTROY");
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(groupname);
+    cmd_args.final();
+
+    // The consumer group will be destroyed even if there are active consumers
+    // and pending messages, so make sure to call this command only when really needed.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    // Integer reply: the number of destroyed consumer groups (0 or 1)
+    return get_value(redis_reply.get()) == 1;
+}
+
+// XGROUP SETID key groupname id-or-$
+void CRedisClient::xgroup_setid(const std::string& key, const std::string& id, Node* which, int num_retries)
+{
+    // xgroup SETID key id-or-$
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XGROUP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg("SETID");
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(id);
+    cmd_args.final();
+
+    (void)redis_command(false, num_retries, key, cmd_args, which);
+}
+
+// XGROUP DELCONSUMER key groupname consumername
+int64_t CRedisClient::xgroup_delconsumer(const std::string& key, const std::string& groupname, const std::string& consumername, Node* which, int num_retries)
+{
+    // xgroup DELCONSUMER key groupname consumername
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XGROUP");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg("DELCONSUMER");
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(groupname);
+    cmd_args.add_arg(consumername);
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    return get_value(redis_reply.get());
+}
+
+// XREADGROUP命令是XREAD命令的特殊版本，支持消费者组
+// 当使用XREADGROUP读取时，服务器将会记住某个给定的消息已经传递：
+// 消息会被存储在消费者组内的待处理条目列表（PEL）中，即已送达但尚未确认的消息ID列表。
+// 客户端必须使用XACK确认消息处理，以便从待处理条目列表中删除待处理条目，
+// 还可以使用XPENDING命令检查待处理条目列表。
+//
+// 特殊ID“>”，意味着消费者希望只接收从未发送给任何其他消费者的消息，即只读取新的消息
+//
+// Reads more than one keys
+//
+// Available since 5.0.0.
+// Time complexity: For each stream mentioned: O(M) with M being the number
+// of elements returned. If M is constant (e.g. always asking for the first 10
+// elements with COUNT), you can consider it O(1). On the other side when
+// XREADGROUP blocks, XADD will pay the O(N) time in order to serve the N
+// clients blocked on the stream getting new data.
+//
+// XREADGROUP GROUP group consumer [COUNT count] [BLOCK milliseconds] [NOACK] STREAMS key [key ...] ID [ID ...]
+void CRedisClient::xreadgroup(
+        const std::string& groupname, const std::string& consumername,
+        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
+        int64_t count, int64_t block_milliseconds, bool noack,
+        std::vector<Stream>* values,
+        Node* which, int num_retries)
+{
+    if (keys.empty())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "ERR";
+        errinfo.errcode = ERROR_PARAMETER;
+        errinfo.raw_errmsg = "wrong number of arguments for 'xreadgroup' command";
+        errinfo.errmsg = format_string("[R3C_XREADGROUP][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else if (keys.size() != ids.size())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "ERR";
+        errinfo.errcode = ERROR_PARAMETER;
+        errinfo.raw_errmsg = "unbalanced XREADGROUP list of streams: for each stream key an ID or '$' must be specified";
+        errinfo.errmsg = format_string("[R3C_XREADGROUP][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else if (cluster_mode() && keys_crossslots(keys))
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "CROSSSLOT";
+        errinfo.errcode = ERROR_PARAMETER;
+        errinfo.raw_errmsg = "keys in request don't hash to the same slot";
+        errinfo.errmsg = format_string("[R3C_XREADGROUP][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        const std::string key = cluster_mode()? keys[0]: std::string("");
+        std::string value;
+        CommandArgs cmd_args;
+        if (!key.empty())
+            cmd_args.set_key(key);
+        cmd_args.set_command("XREADGROUP");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_arg("GROUP");
+        cmd_args.add_arg(groupname);
+        cmd_args.add_arg(consumername);
+        cmd_args.add_arg("COUNT");
+        cmd_args.add_arg(count);
+        if (block_milliseconds >= 0) // timeout is negative
+        {
+            cmd_args.add_arg("BLOCK");
+            cmd_args.add_arg(block_milliseconds);
+        }
+        if (noack)
+        {
+            cmd_args.add_arg("NOACK");
+        }
+        cmd_args.add_arg("STREAMS");
+        cmd_args.add_args(keys);
+        cmd_args.add_args(ids);
+        cmd_args.final();
+
+        // REDIS_REPLY_ARRAY
+        const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+        get_values(redis_reply.get(), values);
+    }
+}
+
+// Reads more than one keys
+void CRedisClient::xreadgroup(
+        const std::string& groupname, const std::string& consumername,
+        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
+        int64_t count, bool noack,
+        std::vector<Stream>* values,
+        Node* which, int num_retries)
+{
+    const int64_t block_milliseconds = -1; // -1 means, no BLOCK argument given
+    xreadgroup(groupname, consumername, keys, ids, count, block_milliseconds, noack, values, which, num_retries);
+}
+
+// Reads more than one keys
+void CRedisClient::xreadgroup(
+        const std::string& groupname, const std::string& consumername,
+        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
+        bool noack,
+        std::vector<Stream>* values,
+        Node* which, int num_retries)
+{
+    const int64_t count = 0;
+    const int64_t block_milliseconds = -1; // -1 means, no BLOCK argument given
+    xreadgroup(groupname, consumername, keys, ids, count, block_milliseconds, noack, values, which, num_retries);
+}
+
+// Only read one key
+void CRedisClient::xreadgroup(
+        const std::string& groupname, const std::string& consumername,
+        const std::string& key, const std::string& id,
+        int64_t count, int64_t block_milliseconds,
+        bool noack,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    std::vector<Stream> streams;
+    std::vector<std::string> keys(1);
+    std::vector<std::string> ids(1);
+
+    keys[0] = key;
+    ids[0] = id;
+    xreadgroup(groupname, consumername, keys, ids, count, block_milliseconds, noack, &streams, which, num_retries);
+    if (!streams.empty())
+        values->swap(streams[0].entries);
+}
+
+// Only read one key
+void CRedisClient::xreadgroup(
+        const std::string& groupname, const std::string& consumername,
+        const std::string& key,
+        int64_t count, int64_t block_milliseconds,
+        bool noack,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    std::vector<Stream> streams;
+    std::vector<std::string> keys(1);
+    std::vector<std::string> ids(1);
+
+    keys[0] = key;
+    ids[0] = ">";
+    xreadgroup(groupname, consumername, keys, ids, count, block_milliseconds, noack, &streams, which, num_retries);
+    if (!streams.empty())
+        values->swap(streams[0].entries);
+}
+
+// Reads more than one keys
+// XREAD [COUNT count] [BLOCK milliseconds] STREAMS key [key ...] ID [ID ...]
+void CRedisClient::xread(
+        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
+        int64_t count, int64_t block_milliseconds,
+        std::vector<Stream>* values, Node* which, int num_retries)
+{
+    if (keys.empty())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "ERR";
+        errinfo.errcode = ERROR_PARAMETER;
+        errinfo.raw_errmsg = "wrong number of arguments for 'xread' command";
+        errinfo.errmsg = format_string("[R3C_XREAD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else if (keys.size() != ids.size())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "ERR";
+        errinfo.errcode = ERROR_PARAMETER;
+        errinfo.raw_errmsg = "unbalanced XREAD list of streams: for each stream key an ID or '$' must be specified";
+        errinfo.errmsg = format_string("[R3C_XREAD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else if (cluster_mode() && keys_crossslots(keys))
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "CROSSSLOT";
+        errinfo.errcode = ERROR_PARAMETER;
+        errinfo.raw_errmsg = "keys in request don't hash to the same slot";
+        errinfo.errmsg = format_string("[R3C_XREAD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        const std::string key = cluster_mode()? keys[0]: std::string("");
+        std::string value;
+        CommandArgs cmd_args;
+        if (!key.empty())
+            cmd_args.set_key(key);
+        cmd_args.set_command("XREAD");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_arg("COUNT");
+        cmd_args.add_arg(count);
+        if (block_milliseconds >= 0) // timeout is negative
+        {
+            cmd_args.add_arg("BLOCK");
+            cmd_args.add_arg(block_milliseconds);
+        }
+        cmd_args.add_arg("STREAMS");
+        cmd_args.add_args(keys);
+        cmd_args.add_args(ids);
+        cmd_args.final();
+
+        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+        get_values(redis_reply.get(), values);
+    }
+}
+
+// Reads more than one keys
+void CRedisClient::xread(
+        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
+        int64_t count,
+        std::vector<Stream>* values, Node* which, int num_retries)
+{
+    const int64_t block_milliseconds = -1; // -1 means, no BLOCK argument given
+    xread(keys, ids, count, block_milliseconds, values, which, num_retries);
+}
+
+// Reads more than one keys
+void CRedisClient::xread(
+        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
+        std::vector<Stream>* values, Node* which, int num_retries)
+{
+    const int64_t count = 0;
+    const int64_t block_milliseconds = -1; // -1 means, no BLOCK argument given
+    xread(keys, ids, count, block_milliseconds, values, which, num_retries);
+}
+
+// Only read one key
+void CRedisClient::xread(
+        const std::string& key, const std::string& id,
+        int64_t count, int64_t block_milliseconds,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    std::vector<Stream> streams;
+    std::vector<std::string> keys(1);
+    std::vector<std::string> ids(1);
+
+    keys[0] = key;
+    ids[0] = id;
+    xread(keys, ids, count, block_milliseconds, &streams, which, num_retries);
+    if (!streams.empty())
+        values->swap(streams[0].entries);
+}
+
+// Only read one key
+void CRedisClient::xread(
+        const std::string& key,
+        int64_t count, int64_t block_milliseconds,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    std::vector<Stream> streams;
+    std::vector<std::string> keys(1);
+    std::vector<std::string> ids(1);
+
+    keys[0] = key;
+    ids[0] = ">";
+    xread(keys, ids, count, block_milliseconds, &streams, which, num_retries);
+    if (!streams.empty())
+        values->swap(streams[0].entries);
+}
+
+// XDEL <key> [<ID1> <ID2> ... <IDN>]
+int CRedisClient::xdel(const std::string& key, const std::vector<std::string>& ids, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XDEL");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_args(ids);
+    cmd_args.final();
+
+    // Integer reply: the number of entries actually deleted.
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+int CRedisClient::xdel(const std::string& key, const std::string& id, Node* which, int num_retries)
+{
+    std::vector<std::string> ids(1);
+    ids[0] = id;
+    return xdel(key, ids, which, num_retries);
+}
+
+// XTRIM key MAXLEN [~] count
+int64_t CRedisClient::xtrim(const std::string& key, int64_t maxlen, char c, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XTRIM");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg("MAXLEN");
+    cmd_args.add_arg(c);
+    cmd_args.add_arg(maxlen);
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    return get_value(redis_reply.get());
+}
+
+int64_t CRedisClient::xtrim(const std::string& key, int64_t maxlen, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XTRIM");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg("MAXLEN");
+    cmd_args.add_arg(maxlen);
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
+    return get_value(redis_reply.get());
+}
+
+// XLEN key
+int64_t CRedisClient::xlen(const std::string& key, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XLEN");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Integer reply: the number of entries of the stream at key.
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    return get_value(redis_reply.get());
+}
+
+// XRANGE key start end [COUNT count]
+void CRedisClient::xrange(
+        const std::string& key,
+        const std::string& start, const std::string& end, int64_t count,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XRANGE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(start);
+    cmd_args.add_arg(end);
+    if (count >= 0)
+    {
+        cmd_args.add_arg("COUNT");
+        cmd_args.add_arg(count);
+    }
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    get_values(redis_reply.get(), values);
+}
+
+void CRedisClient::xrange(
+        const std::string& key,
+        const std::string& start, const std::string& end,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    const int64_t count = -1;
+    xrange(key, start, end, count, values, which, num_retries);
+}
+
+// XREVRANGE key end start [COUNT count]
+void CRedisClient::xrevrange(
+        const std::string& key,
+        const std::string& end, const std::string& start, int64_t count,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XRANGE");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(end);
+    cmd_args.add_arg(start);
+    if (count >= 0)
+    {
+        cmd_args.add_arg("COUNT");
+        cmd_args.add_arg(count);
+    }
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    get_values(redis_reply.get(), values);
+}
+
+void CRedisClient::xrevrange(
+        const std::string& key,
+        const std::string& end, const std::string& start,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    const int64_t count = -1;
+    xrevrange(key, start, end, count, values, which, num_retries);
+}
+
+// PEL: Pending Entries List (待处理条目列表)
+// XPENDING <key> <group> [<start> <stop> <count> [<consumer>]]
+int CRedisClient::xpending(
+        const std::string& key, const std::string& groupname,
+        const std::string& start, const std::string& end, int count, const std::string& consumer,
+        std::vector<struct DetailedPending>* pendings,
+        Node* which, int num_retries)
+{
+    if (start.empty() || end.empty() || consumer.empty())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "ERR";
+        errinfo.raw_errmsg = "wrong number of arguments for 'xpending' command";
+        errinfo.errmsg = format_string("[R3C_XPENDING][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        CommandArgs cmd_args;
+        cmd_args.set_key(key);
+        cmd_args.set_command("XPENDING");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_arg(key);
+        cmd_args.add_arg(groupname);
+        // 如果指定了start，则end和count也必须指定，否则会报错“syntax error”
+        cmd_args.add_arg(start); // -
+        cmd_args.add_arg(end); // +
+        cmd_args.add_arg(count);
+        if (!consumer.empty())
+            cmd_args.add_arg(consumer);
+        cmd_args.final();
+
+        // The command returns data in different format depending on the way it is called,
+        // as previously explained in this page. However the reply is always an array of items.
+        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+        return get_values(redis_reply.get(), pendings);
+    }
+}
+
+int CRedisClient::xpending(
+        const std::string& key, const std::string& groupname,
+        const std::string& start, const std::string& end, int count,
+        std::vector<struct DetailedPending>* pendings,
+        Node* which, int num_retries)
+{
+    const std::string consumer;
+    return xpending(key, groupname, start, end, count, consumer, pendings, which, num_retries);
+}
+
+int CRedisClient::xpending(
+        const std::string& key, const std::string& groupname,
+        struct GroupPending* groups,
+        Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XPENDING");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(groupname);
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    return get_values(redis_reply.get(), groups);
+}
+
+// Gets ownership of one or multiple messages in the Pending Entries List
+// of a given stream consumer group.
+//
+// If the message ID (among the specified ones) exists, and its idle
+// time greater or equal to <min-idle-time>, then the message new owner
+// becomes the specified <consumer>. If the minimum idle time specified
+// is zero, messages are claimed regardless of their idle time.
+//
+// All the messages that cannot be found inside the pending entries list
+// are ignored, but in case the FORCE option is used. In that case we
+// create the NACK (representing a not yet acknowledged message) entry in
+// the consumer group PEL.
+//
+// This command creates the consumer as side effect if it does not yet
+// exists. Moreover the command reset the idle time of the message to 0,
+// even if by using the IDLE or TIME options, the user can control the
+// new idle time.
+//
+// IDLE(IDLE和TIME为二选一关系):
+// Set the idle time (last time it was delivered) of the message.
+// If IDLE is not specified, an IDLE of 0 is assumed, that is,
+// the time count is reset because the message has now a new
+// owner trying to process it.
+//
+// TIME(IDLE和TIME为二选一关系):
+// This is the same as IDLE but instead of a relative amount of
+// milliseconds, it sets the idle time to a specific unix time
+// (in milliseconds). This is useful in order to rewrite the AOF
+// file generating XCLAIM commands.
+//
+// RETRYCOUNT:
+// Set the retry counter to the specified value. This counter is
+// incremented every time a message is delivered again. Normally
+// XCLAIM does not alter this counter, which is just served to clients
+// when the XPENDING command is called: this way clients can detect
+// anomalies, like messages that are never processed for some reason
+// after a big number of delivery attempts.
+//
+// FORCE:
+// Creates the pending message entry in the PEL even if certain
+// specified IDs are not already in the PEL assigned to a different
+// client. However the message must be exist in the stream, otherwise
+// the IDs of non existing messages are ignored.
+//
+// JUSTID:
+// Return just an array of IDs of messages successfully claimed,
+// without returning the actual message.
+//
+// LASTID:
+// Update the consumer group last ID with the specified ID if the
+// current last ID is smaller than the provided one.
+// This is used for replication / AOF, so that when we read from a
+// consumer group, the XCLAIM that gets propagated to give ownership
+// to the consumer, is also used in order to update the group current
+// ID.
+//
+// XCLAIM <key> <group> <consumer> <min-idle-time> <ID-1> <ID-2>
+//        [IDLE <milliseconds>] [TIME <mstime>] [RETRYCOUNT <count>] [FORCE] [JUSTID]
+// 改变待处理消息的所有权， 因此新的所有者是在命令参数中指定的消费者
+void CRedisClient::xclaim(
+        const std::string& key, const std::string& groupname, const std::string& consumer,
+        int64_t minidle, const std::vector<std::string>& ids,
+        int64_t idletime, int64_t unixtime, int64_t retrycount, bool force,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    if (ids.empty())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "ERR";
+        errinfo.raw_errmsg = "wrong number of arguments for 'xclaim' command";
+        errinfo.errmsg = format_string("[R3C_XPENDING][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        CommandArgs cmd_args;
+        cmd_args.set_key(key);
+        cmd_args.set_command("XCLAIM");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_arg(key);
+        cmd_args.add_arg(groupname);
+        cmd_args.add_arg(consumer);
+        if (minidle >= 0)
+        {
+            cmd_args.add_arg(minidle);
+        }
+        if (!ids.empty())
+        {
+            cmd_args.add_args(ids);
+        }
+        if (idletime >= 0)
+        {
+            cmd_args.add_arg("IDLE");
+            cmd_args.add_arg(idletime);
+        }
+        if (unixtime >= 0)
+        {
+            cmd_args.add_arg("TIME");
+            cmd_args.add_arg(unixtime);
+        }
+        if (retrycount >= 0)
+        {
+            cmd_args.add_arg(retrycount);
+        }
+        if (force)
+        {
+            cmd_args.add_arg("FORCE");
+        }
+        //cmd_args.add_arg("JUSTID");
+        cmd_args.final();
+
+        // Returns all the messages successfully claimed, in the same format as XRANGE.
+        // However if the JUSTID option was specified,
+        // only the message IDs are reported, without including the actual message.
+        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+        get_values(redis_reply.get(), values);
+    }
+}
+
+void CRedisClient::xclaim(
+        const std::string& key, const std::string& groupname, const std::string& consumer,
+        int64_t minidle, const std::vector<std::string>& ids,
+        std::vector<StreamEntry>* values,
+        Node* which, int num_retries)
+{
+    const int64_t idletime = -1;
+    const int64_t unixtime = -1;
+    const int64_t retrycount = -1;
+    bool force = false;
+    xclaim(key, groupname, consumer, minidle, ids, idletime, unixtime, retrycount, force, values, which, num_retries);
+}
+
+void CRedisClient::xclaim(
+        const std::string& key, const std::string& groupname, const std::string& consumer,
+        int64_t minidle, const std::vector<std::string>& ids,
+        int64_t idletime, int64_t unixtime, int64_t retrycount,
+        bool force,
+        std::vector<std::string>* values,
+        Node* which, int num_retries)
+{
+    if (ids.empty())
+    {
+        struct ErrorInfo errinfo;
+        errinfo.errtype = "ERR";
+        errinfo.raw_errmsg = "wrong number of arguments for 'xclaim' command";
+        errinfo.errmsg = format_string("[R3C_XCLAIM][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    else
+    {
+        CommandArgs cmd_args;
+        cmd_args.set_key(key);
+        cmd_args.set_command("XCLAIM");
+        cmd_args.add_arg(cmd_args.get_command());
+        cmd_args.add_arg(key);
+        cmd_args.add_arg(groupname);
+        cmd_args.add_arg(consumer);
+        if (minidle >= 0)
+        {
+            cmd_args.add_arg(minidle);
+        }
+        if (!ids.empty())
+        {
+            cmd_args.add_args(ids);
+        }
+        if (idletime >= 0)
+        {
+            cmd_args.add_arg("IDLE");
+            cmd_args.add_arg(idletime);
+        }
+        if (unixtime >= 0)
+        {
+            cmd_args.add_arg("TIME");
+            cmd_args.add_arg(unixtime);
+        }
+        if (retrycount >= 0)
+        {
+            cmd_args.add_arg(retrycount);
+        }
+        if (force)
+        {
+            cmd_args.add_arg("FORCE");
+        }
+        cmd_args.add_arg("JUSTID");
+        cmd_args.final();
+
+        // Returns all the messages successfully claimed, in the same format as XRANGE.
+        // However if the JUSTID option was specified,
+        // only the message IDs are reported, without including the actual message.
+        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+        get_values(redis_reply.get(), values);
+    }
+}
+
+void CRedisClient::xclaim(
+        const std::string& key, const std::string& groupname, const std::string& consumer,
+        int64_t minidle, const std::vector<std::string>& ids,
+        std::vector<std::string>* values,
+        Node* which, int num_retries)
+{
+    const int64_t idletime = -1;
+    const int64_t unixtime = -1;
+    const int64_t retrycount = -1;
+    bool force = false;
+    xclaim(key, groupname, consumer, minidle, ids, idletime, unixtime, retrycount, force, values, which, num_retries);
+}
+
+// Show consumer groups of group <groupname>.
+// XINFO CONSUMERS <key> <group>
+int CRedisClient::xinfo_consumers(
+        const std::string& key, const std::string& groupname,
+        std::vector<struct ConsumerInfo>* infos,
+        Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XINFO");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg("CONSUMERS");
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(groupname);
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    return get_values(redis_reply.get(), infos);
+}
+
+// Show the stream consumer groups.
+// XINFO GROUPS <key>
+int CRedisClient::xinfo_groups(
+        const std::string& key,
+        std::vector<struct GroupInfo>* infos,
+        Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XINFO");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg("GROUPS");
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    return get_values(redis_reply.get(), infos);
+}
+
+// Show information about the stream.
+// XINFO STREAM <key>
+void CRedisClient::xinfo_stream(
+        const std::string& key,
+        struct StreamInfo* info,
+        Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("XINFO");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg("STREAM");
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    get_value(redis_reply.get(), info);
+}
+
+// SETBIT key offset value
+// Time complexity: O(1)
+#if !defined(setbit)
+void CRedisClient::setbit(const std::string& key, uint32_t offset, uint32_t value, Node* which, int num_retries)
+#else
+#undef setbit
+void CRedisClient::setbit(const std::string& key, uint32_t offset, uint32_t value, Node* which, int num_retries)
+#endif // setbit
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("SETBIT");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(offset);
+    cmd_args.add_arg(value);
+    cmd_args.final();
+
+    // Integer reply:
+    // the original value of the bit on the specified offset.
+    redis_command(false, num_retries, key, cmd_args, which);
+}
+
+// GETBIT key offset 
+// Time complexity: O(1)
+int CRedisClient::getbit(const std::string& key, uint32_t offset, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("GETBIT");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(offset);
+    cmd_args.final();
+
+    // Integer reply:
+    // the value of the bit on the offset, return 0 if key does not exist.
+    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    if (REDIS_REPLY_INTEGER == redis_reply->type)
+        return static_cast<int>(redis_reply->integer);
+    return 0;
+}
+
+// BITCOUNT key [start end]
+// Time complexity: O(N)
+int64_t CRedisClient::bitcount(const std::string& key, int32_t start, int32_t end, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("BITCOUNT");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);       
+    cmd_args.add_arg(start);
+    cmd_args.add_arg(end);
+    cmd_args.final();
+    
+    // Integer reply:
+    // the number of bits set to 1.
+    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    return get_value(redis_reply.get());
+}
+
+// BITPOS key bit [start] [end]
+// Time complexity: O(N)
+int64_t CRedisClient::bitpos(const std::string& key, uint8_t bit, int32_t start, int32_t end, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("BITPOS");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_arg(bit);        
+    cmd_args.add_arg(start);
+    cmd_args.add_arg(end);
+    cmd_args.final();
+    
+    // Integer reply:
+    // the position of the first bit in the bitmap whose value is bit.
+    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    return get_value(redis_reply.get());
+}
+
+int64_t CRedisClient::pfadd(const std::string& key, const std::string& element, Node* which, int num_retries)
+{
+    std::vector<std::string> elements(1);
+    elements[0] = element;
+    return pfadd(key, elements, which, num_retries);
+}
+
+int64_t CRedisClient::pfadd(const std::string& key, const std::vector<std::string>& elements, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("PFADD");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.add_args(elements);
+    cmd_args.final();
+
+    // Integer reply:
+    // 1 if at least 1 HyperLogLog internal register was altered. 0 otherwise.
+    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    return get_value(redis_reply.get());
+}
+
+int64_t CRedisClient::pfcount(const std::string& key, Node* which, int num_retries)
+{
+    CommandArgs cmd_args;
+    cmd_args.set_key(key);
+    cmd_args.set_command("PFCOUNT");
+    cmd_args.add_arg(cmd_args.get_command());
+    cmd_args.add_arg(key);
+    cmd_args.final();
+
+    // Integer reply:
+    // The approximated number of unique elements observed via PFADD.
+    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
+    return get_value(redis_reply.get());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const RedisReplyHelper
+CRedisClient::redis_command(
+        bool readonly, int num_retries,
+        const std::string& key,
+        const CommandArgs& command_args,
+        Node* which)
+{
+    Node node;
+    Node* ask_node = NULL;
+    RedisReplyHelper redis_reply;
+    struct ErrorInfo errinfo;
+    int retry_sleep_milliseconds = 0;
+    bool session_fallback = false; // The replica has not reached the offset of the session token
+    const bool transaction = _in_transaction || is_transaction_command(command_args.get_command());
+    // 事务中的写须排入事务，不能缓冲后在事务外发送
+    const bool bufferable = _buffering_write && _write_buffer && !readonly && !_flushing_writes && !transaction && _write_buffer_options.commands.count(command_args.get_command())>0;
+    bool write_unavailable = false; // Set if the slot of the write is unavailable, for buffering the write
+    const CommandClass command_class = (_adaptive_timeouts || _priority_lanes)? get_command_class(command_args): COMMAND_CLASS_POINT;
+    const bool bulk = _priority_lanes && !transaction && COMMAND_CLASS_BLOCKING!=command_class &&
+                      (PRIORITY_BULK==_command_priority || (_priority_lane_options.classify_bulk_commands && COMMAND_CLASS_BULK==command_class));
+    int num_timeouts = 0; // Timeouts of this call, each doubles the adaptive timeout
+    int64_t request_bytes = 0; // Bytes of the command for admission control
+    if (_admission_control)
+    {
+        const size_t* argvlen = command_args.get_argvlen();
+        for (int i=0; i<command_args.get_argc(); ++i)
+            request_bytes += static_cast<int64_t>(argvlen[i]);
+    }
+
+    if (cluster_mode() && key.empty())
+    {
+        // 集群模式必须指定key
+        errinfo.errcode = ERROR_ZERO_KEY;
+        errinfo.raw_errmsg = format_string("[%s] key is empty in cluster node", command_args.get_command().c_str());
+        errinfo.errmsg = format_string("[R3C_CMD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+        if (_enable_error_log)
+            (*g_error_log)("%s\n", errinfo.errmsg.c_str());
+        THROW_REDIS_EXCEPTION(errinfo);
+    }
+    if (_topology_entry!=NULL && _topology_entry->version!=_topology_version)
+    {
+        // 其它client已刷新过
+        apply_shared_topology();
+    }
+    if (_refresh_due_time>0 && cluster_mode() && !_redis_master_nodes.empty())
+    {
+        // MOVED只修正了单个slot，延后的全量刷新在这里执行，而不是在收到MOVED的请求中
+        if (get_monotonic_milliseconds() >= _refresh_due_time)
+            refresh_master_node_table(&errinfo, NULL);
+    }
+    if (!_buffered_writes.empty() && !_flushing_writes && !_in_transaction && get_monotonic_milliseconds()>=_write_buffer_flush_time)
+    {
+        flush_write_buffer();
+    }
+    for (int loop_counter=0;;++loop_counter)
+    {
+        if (_sentinel && (loop_counter>0 || get_monotonic_milliseconds()>=_sentinel_check_time))
+        {
+            // 重试时不限频率，故障转移中的请求尽快转到新master
+            check_sentinel(get_monotonic_milliseconds());
+        }
+
+        const int slot = cluster_mode()? get_key_slot(&key): -1;
+        if (NULL==ask_node && !_slot_migrations.empty())
+        {
+            const Node* migrated_key_node = get_migrated_key_node(slot, key);
+            if (migrated_key_node != NULL)
+            {
+                node = *migrated_key_node;
+                ask_node = &node;
+            }
+        }
+        if (readonly && !session_fallback && _session_token!=NULL && cluster_mode() && NULL==ask_node)
+        {
+            const uint16_t table_index = _slot2index[slot];
+            if (table_index!=INVALID_NODE_INDEX && _master_node_array[table_index]!=NULL &&
+                _session_token->is_master_pinned(_master_node_array[table_index]->get_node(), get_monotonic_milliseconds()))
+                session_fallback = true;
+        }
+        CRedisNode* redis_node = get_redis_node(slot, readonly && !session_fallback, ask_node, &errinfo);
+        CRedisReplicaNode* session_replica = NULL; // Set if ROLE goes before the read to check the replica
+        const bool session_write = !readonly && _session_token!=NULL && cluster_mode() && NULL==ask_node;
+        int64_t session_offset = -1; // Replied by ROLE
+        int64_t required_offset = -1;
+        CRedisMasterNode* slot_master_node = NULL; // Set for reads which may go to a replica
+        HandleResult errcode;
+
+        if (readonly && cluster_mode() && NULL==ask_node && redis_node!=NULL)
+        {
+            const uint16_t table_index = _slot2index[slot];
+            if (table_index != INVALID_NODE_INDEX)
+                slot_master_node = _master_node_array[table_index];
+        }
+        if (_session_token!=NULL && slot_master_node!=NULL && slot_master_node!=redis_node)
+        {
+            CRedisReplicaNode* redis_replica_node = static_cast<CRedisReplicaNode*>(redis_node);
+            required_offset = _session_token->get_offset(slot_master_node->get_node());
+            if (required_offset > redis_replica_node->get_replication_offset())
+                session_replica = redis_replica_node;
+        }
+
+        if (NULL == redis_node)
+        {
+            node.first.clear(); node.second = 0;
+        }
+        else
+        {
+            node = redis_node->get_node();
+        }
+        if (which != NULL)
+        {
+            *which = node;
+        }
+        if (0==loop_counter && _command_monitor!= NULL)
+        {
+            _command_monitor->before_execute(node, command_args.get_command(), command_args, readonly);
+        }
+        if (0==loop_counter && bufferable && _buffered_writes.count(slot)>0)
+        {
+            // 保持同一slot的写顺序，slot还有缓冲的写时排在其后
+            write_unavailable = true;
+            break;
+        }
+        if (NULL == redis_node)
+        {
+            errinfo.errcode = ERROR_NO_ANY_NODE;
+            errinfo.raw_errmsg = format_string("[%s][%s][%s:%d] no any node", command_args.get_command().c_str(), get_mode_str(), node.first.c_str(), node.second);
+            errinfo.errmsg = format_string("[R3C_CMD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+            if (_enable_error_log)
+                (*g_error_log)("[NO_ANY_NODE] %s\n", errinfo.errmsg.c_str());
+            write_unavailable = true;
+            break; // 没有任何master
+        }
+        if (!redis_node->try_acquire_probe(get_monotonic_milliseconds(), _circuit_breaker_options))
+        {
+            // 熔断中快速失败，不再等待连接或读写超时
+            struct ErrorInfo refresh_errinfo;
+            errinfo.errcode = ERROR_CIRCUIT_OPEN;
+            errinfo.raw_errmsg = format_string("[%s][%s][%s] circuit breaker is open", command_args.get_command().c_str(), get_mode_str(), redis_node->str().c_str());
+            errinfo.errmsg = format_string("[R3C_CMD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
+            if (_enable_debug_log)
+                (*g_debug_log)("[CIRCUIT_OPEN] %s\n", errinfo.errmsg.c_str());
+            // 熔断后仍需发现其后的主从切换，每次熔断只刷新一次
+            refresh_on_error(redis_node, HR_RECONN_COND, node, &refresh_errinfo);
+            write_unavailable = true;
+            break;
+        }
+        redis_node->drain_pending_replies();
+        const bool admitted = _admission_control;
+        const Node admitted_node = node; // 对冲时node会换成先回复的节点，计数仍归还给这个节点
+        if (admitted && !admit_request(admitted_node, request_bytes, bulk || PRIORITY_BULK==_command_priority, &errinfo))
+        {
+            break;
+        }
+        if (bulk)
+        {
+            // bulk命令走节点的另一条连接，且限制进程内同时执行的个数
+            if (!acquire_bulk_lane(admitted_node, &errinfo))
+            {
+                if (admitted)
+                    finish_request(admitted_node, request_bytes);
+                break;
+            }
+            redis_node->set_lane(true);
+            connect_redis_node(redis_node, slot_master_node!=NULL && redis_node!=slot_master_node, get_monotonic_milliseconds(), &errinfo);
+        }
+        if (NULL == redis_node->get_redis_context())
+        {
+            // 连接master不成功
+            errcode = HR_RECONN_UNCOND;
+        }
+        else
+        {
+            struct timeval start_tv, stop_tv;
+            int64_t cost_us = 0;
+
+            // When a slot is set as MIGRATING, the node will accept all queries that are about this hash slot,
+            // but only if the key in question exists,
+            // otherwise the query is forwarded using a -ASK redirection to the node that is target of the migration.
+            // 当一个槽状态为 MIGRATING时，原来负责该哈希槽的节点仍会接受所有跟这个哈希槽有关的请求，但只处理仍然在该节点上的键，
+            // 否则类似于MOVED，返回ASK重定向到目标节点。
+            //
+            // When a slot is set as IMPORTING, the node will accept all queries that are about this hash slot,
+            // but only if the request is preceded by an ASKING command.
+            // If the ASKING command was not given by the client, the query is redirected to the real hash slot owner via a -MOVED redirection error,
+            // as would happen normally.
+            // 当一个槽状态为 IMPORTING时，只有在接受到 ASKING命令之后节点才会接受所有查询这个哈希槽的请求，
+            // 如果客户端一直没有发送 ASKING命令，那么查询都会通过MOVED重定向错误转发到真正处理这个哈希槽的节点那里。
+            if (_adaptive_timeouts)
+                redis_node->set_timeout(get_adaptive_timeout(redis_node, command_class, num_timeouts));
+            CRedisNode* const sent_node = redis_node; // 对冲时redis_node会换成先回复的节点
+            sent_node->add_outstanding_request();
+            gettimeofday(&start_tv, NULL);
+            if (ask_node != NULL)
+            {
+                redis_reply = asking_command(redis_node->get_redis_context(), command_args);
+            }
+            else if (session_replica!=NULL || session_write)
+            {
+                redis_reply = role_command(redis_node->get_redis_context(), command_args, session_replica!=NULL, &session_offset);
+            }
+            else
+            {
+                const int hedge_delay = (slot_master_node!=NULL && _session_token==NULL && !bulk && !transaction)? get_hedge_delay(command_args.get_command()): -1;
+
+                if (hedge_delay < 0)
+                {
+                    redis_reply = (redisReply*)redisCommandArgv(
+                            redis_node->get_redis_context(),
+                            command_args.get_argc(), command_args.get_argv(), command_args.get_argvlen());
+                }
+                else
+                {
+                    CRedisNode* replied_node = redis_node;
+                    redis_reply = hedged_command(redis_node, slot_master_node, command_args, hedge_delay, &replied_node);
+                    if (replied_node != redis_node)
+                    {
+                        // 对冲的请求先返回，按它处理结果
+                        redis_node = replied_node;
+                        node = redis_node->get_node();
+                        if (which != NULL)
+                            *which = node;
+                    }
+                }
+            }
+
+#if R3C_TEST // for test
+            debug_redis_reply(command_args.get_command(), redis_reply.get());
+#endif // R3C_TEST==1
+
+            gettimeofday(&stop_tv, NULL);
+            sent_node->remove_outstanding_request();
+            cost_us = calc_elapsed_time(start_tv, stop_tv);
+            redis_node->update_latency(cost_us, get_monotonic_milliseconds());
+            if (_hedged_reads && readonly)
+                add_latency_sample(command_args.get_command(), cost_us);
+            if (!redis_reply)
+                errcode = handle_redis_command_error(cost_us, redis_node, command_args, &errinfo);
+            else
+                errcode = handle_redis_reply(cost_us, redis_node, command_args, redis_reply.get(), &errinfo);
+            if (_adaptive_timeouts && command_class!=COMMAND_CLASS_BLOCKING)
+            {
+                if (redis_reply)
+                {
+                    redis_node->get_latency_histogram(command_class)->add(cost_us);
+                }
+                else if (HR_RECONN_COND == errcode)
+                {
+                    // 超时也作为样本，持续变慢的命令能逐渐放宽超时；重试时超时加倍
+                    redis_node->get_latency_histogram(command_class)->add(cost_us);
+                    ++num_timeouts;
+                }
+            }
+        }
+        if (bulk)
+        {
+            // 连接问题只关闭bulk连接
+            if (HR_RECONN_COND==errcode || HR_RECONN_UNCOND==errcode)
+                redis_node->close();
+            redis_node->set_lane(false);
+            release_bulk_lane(admitted_node);
+        }
+        if (transaction)
+        {
+            // 连接断开时服务端已丢弃事务
+            if (HR_RECONN_COND==errcode || HR_RECONN_UNCOND==errcode)
+                _in_transaction = false;
+            else if (command_args.get_command()=="EXEC" || command_args.get_command()=="DISCARD")
+                _in_transaction = false;
+            else if (command_args.get_command()=="MULTI" && HR_SUCCESS==errcode)
+                _in_transaction = true;
+        }
+        if (admitted)
+        {
+            finish_request(admitted_node, request_bytes);
+        }
+
+        ask_node = NULL;
+        if (HR_SUCCESS==errcode && session_replica!=NULL)
+        {
+            session_replica->update_replication_offset(session_offset);
+            if (session_offset < required_offset)
+            {
+                // replica还没有本会话写入的数据，改读master
+                if (_enable_debug_log)
+                {
+                    (*g_debug_log)("[SESSION][%s:%d][%s] offset %" PRId64 " behind %" PRId64 "\n",
+                            __FILE__, __LINE__, redis_node->str().c_str(), session_offset, required_offset);
+                }
+                session_fallback = true;
+                continue;
+            }
+        }
+        else if (HR_SUCCESS==errcode && session_write)
+        {
+            // ROLE失败时不知道写到了哪里，一段时间内只读master
+            if (session_offset >= 0)
+                _session_token->update_offset(node, session_offset);
+            else
+                _session_token->pin_master(node, get_monotonic_milliseconds()+SESSION_PIN_MILLISECONDS);
+        }
+        if (HR_SUCCESS == errcode)
+        {
+            // 成功立即返回
+            deposit_retry_budget();
+            if (_command_monitor!=NULL)
+                _command_monitor->after_execute(0, node, command_args.get_command(), redis_reply.get());
+            return redis_reply;
+        }
+        else if (HR_ERROR == errcode)
+        {
+            // 不需要重试的错误立即返回，比如：EVAL命令语法错误
+            if (_enable_debug_log)
+            {
+                (*g_debug_log)("[NOTRETRY][%s:%d][%s][%s:%d] loop: %d\n",
+                        __FILE__, __LINE__, get_mode_str(),
+                        redis_node->get_node().first.c_str(), redis_node->get_node().second, loop_counter);
+            }
+            break;
+        }
+        else if (HR_RECONN_COND == errcode || HR_RECONN_UNCOND == errcode)
+        {
+            // 连接问题，先调用close关闭连接（调用get_redis_node时就会执行重连接）
+            if (!bulk)
+                redis_node->close();
+        }
+        else if (HR_REDIRECT == errcode)
+        {
+            int ask_slot = -1;
+            if (!parse_moved_string(redis_reply->str, &ask_slot, &node))
+            {
+                if (_enable_error_log)
+                {
+                    (*g_error_log)("[PARSE_MOVED][%s:%d][%s][%s:%d] node string error: %s\n",
+                            __FILE__, __LINE__, get_mode_str(),
+                            redis_node->get_node().first.c_str(), redis_node->get_node().second,
+                            redis_reply->str);
+                }
+                break;
+            }
+            else
+            {
+                ask_node = &node;
+                add_migrated_key(ask_slot, node, key);
+                if (loop_counter <= 2)
+                    continue;
+                if (_enable_debug_log)
+                {
+                    (*g_debug_log)("[REDIRECT][%s:%d][%s][%s:%d] retries more than %d\n",
+                            __FILE__, __LINE__, get_mode_str(),
+                            redis_node->get_node().first.c_str(), redis_node->get_node().second, loop_counter);
+                }
+                break;
+            }
+        }
+
+        // 写缓冲时不再等待重试，MOVED仍然跟随
+        if ((bufferable || _flushing_writes) &&
+            (HR_RECONN_COND==errcode || HR_RECONN_UNCOND==errcode ||
+             (HR_RETRY_UNCOND==errcode && !is_moved_error(errinfo.errtype))))
+        {
+            refresh_on_error(redis_node, errcode, node, &errinfo);
+            write_unavailable = true;
+            break;
+        }
+        if (HR_RECONN_UNCOND == errcode)
+        {
+            // 保持至少重试一次（前提是先重新建立好连接）
+            if (loop_counter>num_retries && loop_counter>0)
+            {
+                if (_enable_debug_log)
+                {
+                    (*g_debug_log)("[NOTRECONN][%s:%d][%s][%s:%d] retries more than %d\n",
+                            __FILE__, __LINE__, get_mode_str(),
+                            redis_node->get_node().first.c_str(), redis_node->get_node().second, num_retries);
+                }
+                break;
+            }
+        }
+        else if (HR_RETRY_UNCOND == errcode)
+        {
+            // 一般replica切换成master需要几秒钟，
+            // 所以需要保证有足够的重试次数
+            if (loop_counter > num_retries)
+            {
+                if (_enable_debug_log)
+                {
+                    (*g_debug_log)("[RETRY_UNCOND][%s:%d][%s][%s:%d] retries more than %d\n",
+                            __FILE__, __LINE__, get_mode_str(),
+                            redis_node->get_node().first.c_str(), redis_node->get_node().second, num_retries);
+                }
+                break;
+            }
+        }
+        else if (loop_counter>=num_retries)
+        {
+            if (_enable_debug_log)
+            {
+                (*g_debug_log)("[OVERRETRY][%s:%d][%s][%s:%d] retries more than %d\n",
+                        __FILE__, __LINE__, get_mode_str(),
+                        redis_node->get_node().first.c_str(), redis_node->get_node().second, num_retries);
+            }
+            break;
+        }
+
+        // MOVED只是重定向，不消耗重试预算；
+        // 集群故障时，预算耗尽后快速失败，避免大量线程同时重试加重故障
+        const bool moved = (HR_RETRY_UNCOND == errcode) && is_moved_error(errinfo.errtype);
+        if (!moved && !withdraw_retry_budget())
+        {
+            if (_enable_debug_log)
+            {
+                (*g_debug_log)("[RETRY_BUDGET][%s:%d][%s][%s:%d] retry budget exhausted, loop: %d\n",
+                        __FILE__, __LINE__, get_mode_str(),
+                        redis_node->get_node().first.c_str(), redis_node->get_node().second, loop_counter);
+            }
+            break;
+        }
+
+        // 控制重试频率，以增强重试成功率（MOVED已修正slot，立即重试）
+        if ((HR_RETRY_UNCOND==errcode && !moved) || HR_RECONN_UNCOND==errcode)
+        {
+            retry_sleep_milliseconds = get_retry_sleep_milliseconds(retry_sleep_milliseconds);
+            if (retry_sleep_milliseconds > 0)
+                millisleep(retry_sleep_milliseconds);
+        }
+        refresh_on_error(redis_node, errcode, node, &errinfo);
+    }
+
+    if (write_unavailable && _flushing_writes)
+    {
+        _flush_blocked = true;
+    }
+    else if (write_unavailable && bufferable)
+    {
+        const int slot = cluster_mode()? get_key_slot(&key): -1;
+        if (buffer_write(slot, key, command_args, get_monotonic_milliseconds(), &errinfo))
+        {
+            // 写已缓冲，返回空的回复，由write_or_buffer告知调用者
+            if (_command_monitor!=NULL)
+                _command_monitor->after_execute(0, node, command_args.get_command(), NULL);
+            return RedisReplyHelper();
+        }
+    }
+
+    // 错误以异常方式抛出
+    if (_command_monitor!=NULL)
+        _command_monitor->after_execute(1, node, command_args.get_command(), redis_reply.get());
+    THROW_REDIS_EXCEPTION_WITH_NODE_AND_COMMAND(errinfo, node.first, node.second, command_args.get_command(), command_args.get_key());
+}
+
+void CRedisClient::refresh_on_error(CRedisNode* redis_node, HandleResult errcode, const Node& node, struct ErrorInfo* errinfo)
+{
+    if (cluster_mode() && !sharding_mode() && redis_node->need_refresh_master())
+    {
+        redis_node->clear_need_refresh_master();
+        // 单机模式下走到这会导致没法重连接，
+        // 因为_redis_master_nodes被清空了。
+        if (_background_refresh)
+            signal_topology_refresher();
+        else if (HR_RECONN_COND==errcode || HR_RECONN_UNCOND==errcode)
+            refresh_master_node_table(errinfo, &node);
+        else
+            refresh_master_node_table(errinfo, NULL);
+    }
+    else if (_sentinel && redis_node->need_refresh_master())
+    {
+        // 没收到+switch-master（如订阅的sentinel也不可用），主动问sentinel
+        redis_node->clear_need_refresh_master();
+        refresh_sentinel_master(NULL);
+    }
+}
+
+CRedisClient::HandleResult
+CRedisClient::handle_redis_command_error(
+        int64_t cost_us,
+        CRedisNode* redis_node,
+        const CommandArgs& command_args,
+        struct ErrorInfo* errinfo)
+{
+    redisContext* redis_context = redis_node->get_redis_context();
+
+    // REDIS_ERR_EOF (call read() return 0):
+    // redis_context->err(3)
+    // redis_context->errstr("Server closed the connection")
+    //
+    // REDIS_ERR_IO (call read() return -1):
+    // redis_context->err(1)
+    // redis_context->errstr("Bad file descriptor")
+    //
+    // REDIS_ERR_IO means there was an I/O error
+    // and you should use the "errno" variable to find out what is wrong.
+    // For other values, the "errstr" field will hold a description.
+    const int redis_errcode = redis_context->err;
+    errinfo->errcode = errno;
+    errinfo->raw_errmsg = format_string("[%s][cost:%ldus] (hiredis:%d,errno:%d)%s (%s)",
+            redis_node->str().c_str(), cost_us, redis_errcode, errinfo->errcode, redis_context->errstr, strerror(errinfo->errcode));
+    errinfo->errmsg = format_string("[R3C_CMD_ERROR][%s:%d][%s] %s",
+            __FILE__, __LINE__, command_args.get_command().c_str(), errinfo->raw_errmsg.c_str());
+    if (_enable_error_log)
+    {
+        const unsigned int conn_errors = redis_node->get_conn_errors();
+        if (conn_errors==0 || conn_errors%10==0) // Reduce duplicate error logs
+            (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+    }
+
+    // REDIS_ERR_IO (1):
+    // There was an I/O error while creating the connection, trying to write
+    // to the socket or read from the socket. If you included `errno.h` in your
+    // application, you can use the global `errno` variable to find out what is wrong.
+    //
+    // REDIS_ERR_EOF (3):
+    // The server closed the connection which resulted in an empty read.
+    //
+    // REDIS_ERR_PROTOCOL (4):
+    // There was an error while parsing the protocol.
+    //
+    // REDIS_ERR_OTHER:
+    // Any other error. Currently, it is only used when a specified hostname to connect to cannot be resolved.
+    //
+    // #define   EAGAIN          11      /* Try again */
+    // #define   EINPROGRESS     115     /* Operation now in progress */
+    // #define   ECONNRESET      104     /* Connection reset by peer */
+    if ((redis_errcode != REDIS_ERR_IO) &&
+        (redis_errcode != REDIS_ERR_EOF))
+    {
+        return HR_ERROR; // Not retry
+    }
+    else if (redis_errcode == REDIS_ERR_EOF)
+    {
+        // (3/115)Server closed the connection (Operation now in progress)
+        redis_node->on_failure(get_monotonic_milliseconds(), _circuit_breaker_options);
+        return HR_RECONN_UNCOND; // Retry unconditionally and reconnect
+    }
+    else if (redis_errcode == REDIS_ERR_IO && errinfo->errcode != EAGAIN)
+    {
+        // (1/104)Connection reset by peer (Connection reset by peer)
+        redis_node->on_failure(get_monotonic_milliseconds(), _circuit_breaker_options);
+        return HR_RECONN_UNCOND; // Retry unconditionally and reconnect
+    }
+    else
+    {
+        // $ redis-cli -p 1386 cluster nodes | grep master
+        // 49cadd758538f821b922738fd000b5a16ef64fc7 127.0.0.1:1384@11384 master - 0 1546317629187 14 connected 10923-16383
+        // 95ce22507d469ae84cb760505bba4be0283c5468 127.0.0.1:1381@11381 master - 0 1546317630190 1 connected 0-5460
+        // a27a1ce7f8c5c5f79a1d09227eb80b73919ec795 127.0.0.1:1383@11383 master,fail - 1546317518930 1546317515000 12 connected
+        // 03c4ada274ac137c710f3d514700c2e94649c131 127.0.0.1:1382@11382 master - 0 1546317631191 2 connected 5461-10922
+        // 错误期间，可能发生了主备切换，因此光重连接是不够的，
+        // 更严重的是，该master可能一直连接超时，比如进程被SIGSTOP了，
+        // 因此连续失败达到阈值后熔断该节点，并重刷新master
+        redis_node->on_failure(get_monotonic_milliseconds(), _circuit_breaker_options);
+        return HR_RECONN_COND; // Retry conditionally
+    }
+}
+
+CRedisClient::HandleResult
+CRedisClient::handle_redis_reply(
+        int64_t cost_us,
+        CRedisNode* redis_node,
+        const CommandArgs& command_args,
+        const redisReply* redis_reply,
+        struct ErrorInfo* errinfo)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("ZRANGEBYSCORE");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(min);
-    cmd_args.add_arg(max);
-    if (withscores)
-    {
-        cmd_args.add_arg("WITHSCORES");
-    }
-    cmd_args.add_arg("LIMIT");
-    cmd_args.add_arg(offset);
-    cmd_args.add_arg(count);
-    cmd_args.final();
+    redis_node->on_success();
 
-    // Array reply:
-    // list of elements in the specified score range (optionally with their scores).
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), vec, withscores);
-    return 0;
+    if (redis_reply->type != REDIS_REPLY_ERROR)
+        return HR_SUCCESS;
+    else
+        return handle_redis_replay_error(cost_us, redis_node, command_args, redis_reply, errinfo);
 }
 
-// ZREVRANGEBYSCORE key max min [WITHSCORES] [LIMIT offset count]
-int CRedisClient::zrevrangebyscore(
-        const std::string& key,
-        int64_t max, int64_t min, int64_t offset, int64_t count, bool withscores,
-        std::vector<std::pair<std::string, int64_t> >* vec,
-        Node* which,
-        int num_retries)
+CRedisClient::HandleResult
+CRedisClient::handle_redis_replay_error(
+        int64_t cost_us,
+        CRedisNode* redis_node,
+        const CommandArgs& command_args,
+        const redisReply* redis_reply,
+        struct ErrorInfo* errinfo)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("ZREVRANGEBYSCORE");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(max);
-    cmd_args.add_arg(min);
-    if (withscores)
+    // ASK
+    // NOAUTH Authentication required
+    // MOVED 6474 127.0.0.1:6380
+    // WRONGTYPE Operation against a key holding the wrong kind of value
+    // CLUSTERDOWN The cluster is down
+    // NOSCRIPT No matching script. Please use EVAL.
+    //
+    // ERR Error running script (call to f_64b2246244d60088e7351656c216c00cb1d7d2fd) : @user_script:1: @user_script: 1: Lua script attempted to access a non local key in a cluster node
+    extract_errtype(redis_reply, &errinfo->errtype);
+    errinfo->errcode = ERROR_COMMAND;
+    errinfo->raw_errmsg = format_string("[%s][cost:%ldus] %s", redis_node->str().c_str(), cost_us, redis_reply->str);
+    errinfo->errmsg = format_string("[R3C_REPLAY_ERROR][%s:%d][%s] %s", __FILE__, __LINE__, command_args.get_command().c_str(), errinfo->raw_errmsg.c_str());
+    if (_enable_error_log)
+        (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+
+    // EVAL不会返回“MOVED”的错误，需特别处理
+    if (is_clusterdown_error(errinfo->errtype))
     {
-        cmd_args.add_arg("WITHSCORES");
+        return HR_RETRY_UNCOND;
+    }
+    else if (_sentinel && is_readonly_error(errinfo->errtype))
+    {
+        // 原master已降为replica，而+switch-master消息还没收到，向sentinel重新查询
+        redis_node->set_need_refresh_master();
+        return HR_RETRY_UNCOND;
+    }
+    else if (is_ask_error(errinfo->errtype))
+    {
+        // ASK 6474 127.0.0.1:6380
+        //
+        // 如下所示，如果此时向10.212.2.72:6379请求slot为14148的keys时，将得到：
+        // ASK 6474 10.212.2.71:6381
+        // 其中ec19be9a50b5416999ac0305c744d9b6c957c18d为10.212.2.71:6381的NodeId
+        // e008649f6f8340a495fc860f7a9a8155f91fcb93 10.212.2.72:6379@16379 myself,master - 0 1547374698000 35 connected 5461-10922 14148 [14148->-ec19be9a50b5416999ac0305c744d9b6c957c18d]
+        return HR_REDIRECT;
+    }
+    else if (is_moved_error(errinfo->errtype))
+    {
+        // MOVED 6474 127.0.0.1:6380
+        //
+        // 先只修正这一个slot并立即重试，全量刷新延后且限频，
+        // 避免resharding期间每迁移一个slot都触发一次全量刷新
+        int slot = -1;
+        Node moved_node;
+        if (cluster_mode() && parse_moved_string(redis_reply->str, &slot, &moved_node))
+        {
+            _slot_migrations.erase(slot); // 迁移已完成
+            update_slot(slot, moved_node);
+        }
+        else
+            redis_node->set_need_refresh_master(); // Trigger to refresh master nodes
+        schedule_refresh_master_node_table(get_monotonic_milliseconds());
+        return HR_RETRY_UNCOND;
+    }
+    else
+    {
+        return HR_ERROR;
     }
-    cmd_args.add_arg("LIMIT");
-    cmd_args.add_arg(offset);
-    cmd_args.add_arg(count);
-    cmd_args.final();
-
-    // Array reply:
-    // list of elements in the specified score range (optionally with their scores).
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
-        return get_values(redis_reply.get(), vec, withscores);
-    return 0;
 }
 
-// Time complexity:
-// O(log(N)+M) with N being the number of elements in the sorted set and M the number of elements removed by the operation.
-//
-// ZREMRANGEBYRANK key start stop
-int CRedisClient::zremrangebyrank(
-        const std::string& key,
-        int64_t start, int64_t end,
-        Node* which,
-        int num_retries)
+void CRedisClient::fini()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("ZREMRANGEBYRANK");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(start);
-    cmd_args.add_arg(end);
-    cmd_args.final();
-
-    // Integer reply:
-    // the number of elements removed.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    disable_background_refresh();
+    disable_replica_lag_check();
+    disable_hedged_reads();
+    disable_write_buffer();
+    close_sentinel();
+    clear_all_master_nodes();
 }
 
-// Time complexity: O(log(N))
-//
-// ZRANK key member
-int CRedisClient::zrank(const std::string& key, const std::string& field, Node* which, int num_retries)
+void CRedisClient::init()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("ZRANK");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.final();
+    _enable_debug_log = true;
+    _enable_info_log = true;
+    _enable_error_log = true;
 
-    // If member exists in the sorted set, Integer reply: the rank of member.
-    // If member does not exist in the sorted set or key does not exist, Bulk string reply: nil.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
+    try
     {
-        return -1;
+        static const std::string sharding_prefix("shard://");
+        static const std::string sentinel_prefix("sentinel://");
+        std::vector<int> weights;
+        struct ErrorInfo errinfo;
+        int num_nodes = 0;
+
+        if (0 == _raw_nodes_string.compare(0, sharding_prefix.size(), sharding_prefix))
+        {
+            _sharding = true;
+            _nodes_string = _raw_nodes_string.substr(sharding_prefix.size());
+            num_nodes = parse_nodes(&_nodes, _nodes_string, &weights);
+        }
+        else if (0 == _raw_nodes_string.compare(0, sentinel_prefix.size(), sentinel_prefix))
+        {
+            // sentinel://mymaster@127.0.0.1:26379,127.0.0.1:26380
+            const std::string::size_type at_pos = _raw_nodes_string.find('@', sentinel_prefix.size());
+            _sentinel = true;
+            if (at_pos != std::string::npos)
+            {
+                _sentinel_master_name = _raw_nodes_string.substr(sentinel_prefix.size(), at_pos - sentinel_prefix.size());
+                if (!_sentinel_master_name.empty())
+                    num_nodes = parse_nodes(&_sentinel_nodes, _raw_nodes_string.substr(at_pos + 1));
+            }
+        }
+        else
+        {
+            num_nodes = parse_nodes(&_nodes, _raw_nodes_string);
+        }
+        if (0 == num_nodes)
+        {
+            errinfo.errcode = ERROR_PARAMETER;
+            errinfo.errmsg = format_string("[R3C_INIT][%s:%d] parameter[nodes] error: %s", __FILE__, __LINE__, _raw_nodes_string.c_str());
+            errinfo.raw_errmsg = format_string("parameter[nodes] error: %s", _raw_nodes_string.c_str());
+            if (_enable_error_log)
+                (*g_error_log)("%s\n", errinfo.errmsg.c_str());
+            THROW_REDIS_EXCEPTION(errinfo);
+        }
+        else if (_sharding)
+        {
+            if (!init_sharding(weights, &errinfo))
+                THROW_REDIS_EXCEPTION(errinfo);
+        }
+        else if (_sentinel)
+        {
+            if (!init_sentinel(&errinfo))
+                THROW_REDIS_EXCEPTION(errinfo);
+        }
+        else if (1 == num_nodes)
+        {
+            if (!init_standlone(&errinfo))
+                THROW_REDIS_EXCEPTION(errinfo);
+        }
+        else
+        {
+            _topology_entry = get_topology_entry(_raw_nodes_string);
+            if (!init_cluster(&errinfo))
+                THROW_REDIS_EXCEPTION(errinfo);
+        }
     }
-    else
+    catch (...)
     {
-        if (REDIS_REPLY_INTEGER == redis_reply->type)
-            return static_cast<int>(redis_reply->integer);
-        return 0;
+        close_sentinel();
+        clear_all_master_nodes();
+        throw;
     }
 }
 
-int CRedisClient::zrevrank(const std::string& key, const std::string& field, Node* which, int num_retries)
+bool CRedisClient::init_standlone(struct ErrorInfo* errinfo)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("ZREVRANK");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.final();
+    const Node& node = _nodes[0];
+    _nodes_string = _raw_nodes_string;
 
-    // If member exists in the sorted set, Integer reply: the rank of member.
-    // If member does not exist in the sorted set or key does not exist, Bulk string reply: nil.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
+    redisContext* redis_context = connect_redis_node(node, errinfo, false);
+    if (NULL == redis_context)
     {
-        return -1;
+        return false;
     }
     else
     {
-        if (REDIS_REPLY_INTEGER == redis_reply->type)
-            return static_cast<int>(redis_reply->integer);
-        return 0;
+        CRedisMasterNode* redis_node = new CRedisMasterNode(std::string(""), node, redis_context);
+        const std::pair<RedisMasterNodeTable::iterator, bool> ret =
+                _redis_master_nodes.insert(std::make_pair(node, redis_node));
+        R3C_ASSERT(ret.second);
+        insert_master_node_array(redis_node);
+        return true;
     }
 }
 
-// Time complexity: O(1)
-// ZSCORE key member
-int64_t CRedisClient::zscore(const std::string& key, const std::string& field, Node* which, int num_retries)
+bool CRedisClient::init_sharding(const std::vector<int>& weights, struct ErrorInfo* errinfo)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("ZSCORE");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(field);
-    cmd_args.final();
+    const int64_t now_milliseconds = get_monotonic_milliseconds();
+    std::set<Node> nodes;
+    int num_connected = 0;
 
-    // Bulk string reply:
-    // the score of member (a double precision floating point number), represented as string.
-    // If member does not exist in the sorted set, or key does not exist, nil is returned.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_NIL == redis_reply->type)
+    for (std::vector<int>::size_type i=0; i<weights.size(); ++i)
     {
-        return -1;
+        if (weights[i] < 1)
+        {
+            errinfo->errcode = ERROR_PARAMETER;
+            errinfo->errmsg = format_string("[R3C_INIT][%s:%d] parameter[nodes] weight error: %s", __FILE__, __LINE__, _raw_nodes_string.c_str());
+            errinfo->raw_errmsg = format_string("parameter[nodes] weight error: %s", _raw_nodes_string.c_str());
+            if (_enable_error_log)
+                (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+            return false;
+        }
+        if (!nodes.insert(_nodes[i]).second)
+        {
+            // 重复的节点会改变权重，也多半是配置错误
+            errinfo->errcode = ERROR_PARAMETER;
+            errinfo->errmsg = format_string("[R3C_INIT][%s:%d] parameter[nodes] duplicate node %s: %s", __FILE__, __LINE__, node2string(_nodes[i]).c_str(), _raw_nodes_string.c_str());
+            errinfo->raw_errmsg = format_string("parameter[nodes] duplicate node %s: %s", node2string(_nodes[i]).c_str(), _raw_nodes_string.c_str());
+            if (_enable_error_log)
+                (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+            return false;
+        }
     }
-    else
+    _slot2index.assign(static_cast<size_t>(CLUSTER_SLOTS), static_cast<uint16_t>(INVALID_NODE_INDEX));
+    for (std::vector<Node>::size_type i=0; i<_nodes.size(); ++i)
     {
-        if (REDIS_REPLY_STRING == redis_reply->type)
-            return static_cast<int64_t>(atoll(redis_reply->str));
-        return 0;
+        const Node& node = _nodes[i];
+
+        // 连不上的节点也加入，熔断后再从环上摘除，而不是让整个client初始化失败
+        redisContext* redis_context = connect_redis_node(node, errinfo, false);
+        CRedisMasterNode* redis_node = new CRedisMasterNode(std::string(""), node, redis_context);
+        if (NULL == redis_context)
+            redis_node->on_failure(now_milliseconds, _circuit_breaker_options);
+        else
+            ++num_connected;
+        _redis_master_nodes.insert(std::make_pair(node, redis_node));
+        insert_master_node_array(redis_node);
+        _shard_weights[node] = weights[i];
     }
+    if (0 == num_connected)
+        return false;
+    rebuild_shard_slots();
+    return true;
 }
 
-// Time complexity:
-// O(1) for every call. O(N) for a complete iteration,
-// including enough command calls for the cursor to return back to 0. N is the number of elements inside the collection..
-//
-// ZSCAN key cursor [MATCH pattern] [COUNT count]
-int64_t CRedisClient::zscan(
-        const std::string& key,
-        int64_t cursor,
-        std::vector<std::pair<std::string, int64_t> >* values,
-        Node* which,
-        int num_retries)
+static uint32_t shard_hash(const void* data, size_t size)
 {
-    return zscan(key, cursor, std::string(""), 0, values, which, num_retries);
+    // crc64打散不够均匀，再用murmur3的fmix64混合
+    uint64_t h = crc64(0, static_cast<const unsigned char*>(data), size);
+    h ^= h >> 33;
+    h *= UINT64_C(0xff51afd7ed558ccd);
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return static_cast<uint32_t>(h >> 32);
 }
 
-int64_t CRedisClient::zscan(
-        const std::string& key,
-        int64_t cursor, int count,
-        std::vector<std::pair<std::string, int64_t> >* values,
-        Node* which,
-        int num_retries)
+// Assigns each slot to the first point of the non-ejected shards clockwise on the ring,
+// the points of a shard depend only on its node and weight, so ejecting one moves only its slots.
+void CRedisClient::rebuild_shard_slots()
 {
-    return zscan(key, cursor, std::string(""), count, values, which, num_retries);
-}
+    std::vector<std::pair<uint32_t, uint16_t> > ring; // Point -> index of _master_node_array
 
-int64_t CRedisClient::zscan(
-        const std::string& key,
-        int64_t cursor, const std::string& pattern,
-        std::vector<std::pair<std::string, int64_t> >* values,
-        Node* which,
-        int num_retries)
-{
-    return zscan(key, cursor, pattern, 0, values, which, num_retries);
+    for (std::vector<CRedisMasterNode*>::size_type i=0; i<_master_node_array.size(); ++i)
+    {
+        const CRedisMasterNode* redis_node = _master_node_array[i];
+        if (NULL==redis_node || _ejected_shards.count(redis_node->get_node())>0)
+            continue;
+
+        const std::string prefix = node2string(redis_node->get_node()) + std::string("-");
+        const int num_points = SHARD_POINTS_PER_WEIGHT * _shard_weights[redis_node->get_node()];
+        for (int j=0; j<num_points; ++j)
+        {
+            const std::string point = prefix + int2string(static_cast<int32_t>(j));
+            ring.push_back(std::make_pair(shard_hash(point.data(), point.size()), static_cast<uint16_t>(i)));
+        }
+    }
+    std::sort(ring.begin(), ring.end());
+    for (int slot=0; slot<CLUSTER_SLOTS; ++slot)
+    {
+        if (ring.empty())
+        {
+            _slot2index[slot] = static_cast<uint16_t>(INVALID_NODE_INDEX);
+        }
+        else
+        {
+            const unsigned char slot_bytes[2] = { static_cast<unsigned char>(slot >> 8), static_cast<unsigned char>(slot & 0xFF) };
+            const std::pair<uint32_t, uint16_t> point(shard_hash(slot_bytes, sizeof(slot_bytes)), 0);
+            std::vector<std::pair<uint32_t, uint16_t> >::const_iterator iter = std::lower_bound(ring.begin(), ring.end(), point);
+            if (iter == ring.end())
+                iter = ring.begin();
+            _slot2index[slot] = iter->second;
+        }
+    }
 }
 
-int64_t CRedisClient::zscan(
-        const std::string& key,
-        int64_t cursor, const std::string& pattern, int count,
-        std::vector<std::pair<std::string, int64_t> >* values,
-        Node* which,
-        int num_retries)
+// Ejects the shard of the slot if its breaker is open, and takes back the ejected shards whose open period is over
+// (the breaker turns to half-open, and the next request to the shard is the probe)
+void CRedisClient::update_ejected_shards(int slot, int64_t now_milliseconds)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("ZSCAN");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(cursor);
-    if (!pattern.empty())
+    const uint16_t table_index = _slot2index[slot];
+    struct TopologyView old_topology_view;
+    bool changed = false;
+
+    for (std::set<Node>::iterator iter=_ejected_shards.begin(); iter!=_ejected_shards.end();)
     {
-        cmd_args.add_arg("MATCH");
-        cmd_args.add_arg(pattern);
+        const RedisMasterNodeTable::const_iterator node_iter = _redis_master_nodes.find(*iter);
+        if (node_iter!=_redis_master_nodes.end() && !node_iter->second->is_available(now_milliseconds, _circuit_breaker_options))
+        {
+            ++iter;
+        }
+        else
+        {
+            if (_enable_info_log)
+                (*g_info_log)("[R3C_SHARD][%s:%d] %s taken back\n", __FILE__, __LINE__, node2string(*iter).c_str());
+            _ejected_shards.erase(iter++);
+            changed = true;
+        }
     }
-    if (count > 0)
+    if (table_index != INVALID_NODE_INDEX)
     {
-        cmd_args.add_arg("COUNT");
-        cmd_args.add_arg(count);
+        CRedisMasterNode* redis_node = _master_node_array[table_index];
+        if (!redis_node->is_available(now_milliseconds, _circuit_breaker_options))
+        {
+            if (_enable_info_log)
+                (*g_info_log)("[R3C_SHARD][%s:%d] %s ejected\n", __FILE__, __LINE__, redis_node->str().c_str());
+            _ejected_shards.insert(redis_node->get_node());
+            changed = true;
+        }
     }
-    cmd_args.final();
-
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_ARRAY == redis_reply->type)
+    if (changed)
     {
-        get_values(redis_reply->element[1], values, true);
-        return static_cast<int64_t>(atoll(redis_reply->element[0]->str));
+        // _slot2index还未改变
+        if (!_topology_listeners.empty())
+            get_topology_view(&old_topology_view);
+        rebuild_shard_slots();
+        if (!_topology_listeners.empty())
+            notify_topology_listeners(old_topology_view);
     }
-    return 0;
 }
 
-//
-// STREAM
-//
-
-// 从待处理条目列表（PEL）中移除待处理条目（ids），
-// 因为一旦消息被成功处理，消费者组就不再需要跟踪它并记住消息的当前所有者
-// Time complexity: O(1) for each message ID processed.
-// XACK key group ID [ID ...]
-int CRedisClient::xack(
-        const std::string& key, const std::string& groupname,
-        const std::vector<std::string>& ids,
-        Node* which, int num_retries)
+bool CRedisClient::init_sentinel(struct ErrorInfo* errinfo)
 {
-    std::string value;
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XACK");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(groupname);
-    cmd_args.add_args(ids);
-    cmd_args.final();
-
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
-}
+    Node master_node;
+    std::vector<Node> replica_nodes;
 
-int CRedisClient::xack(
-        const std::string& key, const std::string& groupname,
-        const std::string& id,
-        Node* which, int num_retries)
-{
-    std::vector<std::string> ids(1);
-    ids[0] = id;
-    return xack(key, groupname, ids, which, num_retries);
+    // 先订阅再查询，不会错过两者之间的切换
+    subscribe_sentinel();
+    if (!discover_sentinel_master(&master_node, &replica_nodes, errinfo))
+        return false;
+    apply_sentinel_master(master_node, replica_nodes);
+    return connect_redis_node(_redis_master_nodes.begin()->second, false, get_monotonic_milliseconds(), errinfo) != NULL;
 }
 
-// Time complexity: O(1)
-// XADD key [MAXLEN [~|=] <count>] <ID or *> [field value] [field value] ...
-std::string CRedisClient::xadd(
-        const std::string& key, const std::string& id,
-        const std::vector<FVPair>& values,
-        int64_t maxlen, char c,
-        Node* which, int num_retries)
+// Sentinels are connected without AUTH
+redisContext* CRedisClient::connect_sentinel(const Node& node, struct ErrorInfo* errinfo) const
 {
-    std::string value;
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XADD");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg("MAXLEN");
-    cmd_args.add_arg(c);
-    cmd_args.add_arg(maxlen);
-    cmd_args.add_arg(id);
-    cmd_args.add_args(values);
-    cmd_args.final();
+    redisContext* redis_context = NULL;
+    struct timeval connect_timeout, data_timeout;
+    std::string ip;
 
-    // The command returns the number of messages successfully acknowledged.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    //if (REDIS_REPLY_STRING == redis_reply->type)
-    (void)get_value(redis_reply.get(), &value);
-    return value;
+    errinfo->clear();
+    connect_timeout.tv_sec = _connect_timeout_milliseconds / 1000;
+    connect_timeout.tv_usec = (_connect_timeout_milliseconds % 1000) * 1000;
+    data_timeout.tv_sec = _readwrite_timeout_milliseconds / 1000;
+    data_timeout.tv_usec = (_readwrite_timeout_milliseconds % 1000) * 1000;
+    if (!resolve_host(node.first, &ip, &errinfo->raw_errmsg))
+    {
+        errinfo->errcode = ERROR_INIT_REDIS_CONN;
+    }
+    else
+    {
+        if (_connect_timeout_milliseconds <= 0)
+            redis_context = redisConnect(ip.c_str(), node.second);
+        else
+            redis_context = redisConnectWithTimeout(ip.c_str(), node.second, connect_timeout);
+        if (NULL == redis_context)
+        {
+            errinfo->errcode = ERROR_REDIS_CONTEXT;
+            errinfo->raw_errmsg = "can not allocate redis context";
+        }
+        else if (redis_context->err!=0 ||
+                 (_readwrite_timeout_milliseconds>0 && REDIS_ERR==redisSetTimeout(redis_context, data_timeout)))
+        {
+            errinfo->errcode = ERROR_INIT_REDIS_CONN;
+            errinfo->raw_errmsg = redis_context->errstr;
+            redisFree(redis_context);
+            redis_context = NULL;
+        }
+        else if (!apply_socket_options(redis_context, node, errinfo))
+        {
+            // errinfo已是setsockopt的错误
+            redisFree(redis_context);
+            redis_context = NULL;
+        }
+    }
+    if (NULL == redis_context)
+    {
+        errinfo->errmsg = format_string("[R3C_SENTINEL][%s:%d][%s:%d] %s",
+                __FILE__, __LINE__, node.first.c_str(), node.second, errinfo->raw_errmsg.c_str());
+        if (_enable_error_log)
+            (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+    }
+    return redis_context;
 }
 
-std::string CRedisClient::xadd(
-        const std::string& key, const std::string& id,
-        const std::vector<FVPair>& values,
-        Node* which, int num_retries)
+// Asks the sentinels in turn from the one last answered
+bool CRedisClient::discover_sentinel_master(Node* master_node, std::vector<Node>* replica_nodes, struct ErrorInfo* errinfo)
 {
-    std::string value;
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XADD");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(id);
-    cmd_args.add_args(values);
-    cmd_args.final();
+    for (std::vector<Node>::size_type i=0; i<_sentinel_nodes.size(); ++i)
+    {
+        const std::vector<Node>::size_type sentinel_index = (_sentinel_index + i) % _sentinel_nodes.size();
+        redisContext* redis_context = connect_sentinel(_sentinel_nodes[sentinel_index], errinfo);
 
-    // The command returns the number of messages successfully acknowledged.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    //if (REDIS_REPLY_STRING == redis_reply->type)
-    (void)get_value(redis_reply.get(), &value);
-    return value;
+        if (redis_context != NULL)
+        {
+            const bool queried = query_sentinel(redis_context, master_node, replica_nodes, errinfo);
+            redisFree(redis_context);
+            if (queried)
+            {
+                _sentinel_index = sentinel_index;
+                return true;
+            }
+        }
+    }
+    return false;
 }
 
-// Time complexity: O(1) for all the subcommands, with the exception of the
-// DESTROY subcommand which takes an additional O(M) time in order to delete
-// the M entries inside the consumer group pending entries list (PEL).
-//
-// XGROUP CREATE key(topic) groupname id-or-$
-bool CRedisClient::xgroup_create(
-        const std::string& key, const std::string& groupname, const std::string& id,
-        bool mkstream,
-        Node* which, int num_retries)
+bool CRedisClient::query_sentinel(redisContext* redis_context, Node* master_node, std::vector<Node>* replica_nodes, struct ErrorInfo* errinfo) const
 {
-    // xgroup CREATE key groupname id-or-$
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XGROUP");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg("CREATE");
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(groupname);
-    cmd_args.add_arg(id);
-    if (mkstream)
-    {
-        // ERR The XGROUP subcommand requires the key to exist.
-        // Note that for CREATE you may want to use the MKSTREAM option to create an empty stream automatically.
-        cmd_args.add_arg("MKSTREAM");
-    }
-    cmd_args.final();
-
-    try
+    // 1) "127.0.0.1"
+    // 2) "6379"
+    const RedisReplyHelper master_reply = (redisReply*)redisCommand(redis_context, "SENTINEL get-master-addr-by-name %s", _sentinel_master_name.c_str());
+    if (!master_reply || REDIS_REPLY_ARRAY!=master_reply->type || master_reply->elements!=2)
     {
-        // If the specified consumer group already exists, the command returns a -BUSYGROUP error.
-        // Otherwise the operation is performed and OK is returned.
-        // There are no hard limits to the number of consumer groups you can associate to a given stream.
-        //
-        // Consumers in a consumer group are auto-created every time a new consumer name is mentioned by some command.
-        //
-        // 如果key不存在，则会报如下错误：
-        // The XGROUP subcommand requires the key to exist.
-        // Note that for CREATE you may want to use the MKSTREAM option to create an empty stream automatically.
-        const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-        std::string val;
-        get_value(redis_reply.get(), &val);
-        // When a consumer group with the same name already exists, the command returns a -BUSYGROUP error.
-        return val == "OK";
+        errinfo->errcode = ERROR_COMMAND;
+        errinfo->raw_errmsg = !master_reply? std::string(redis_context->errstr): format_string("master %s unknown", _sentinel_master_name.c_str());
+        errinfo->errmsg = format_string("[R3C_SENTINEL][%s:%d] %s", __FILE__, __LINE__, errinfo->raw_errmsg.c_str());
+        if (_enable_error_log)
+            (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+        return false;
     }
-    catch (r3c::CRedisException& ex)
+    master_node->first.assign(master_reply->element[0]->str, master_reply->element[0]->len);
+    master_node->second = static_cast<uint16_t>(atoi(master_reply->element[1]->str));
+
+    replica_nodes->clear();
+    if (need_replica_nodes())
     {
-        // BUSYGROUP Consumer Group name already exists
-        if (r3c::is_busygroup_error(ex.errtype()))
-            return false;
-        else
-            throw;
+        // Field-value pairs of each replica: name, ip, port, runid, flags ...
+        // SENTINEL replicas is since 5.0, SENTINEL slaves for older sentinels
+        RedisReplyHelper replicas_reply = (redisReply*)redisCommand(redis_context, "SENTINEL replicas %s", _sentinel_master_name.c_str());
+        if (replicas_reply && REDIS_REPLY_ERROR==replicas_reply->type)
+            replicas_reply = (redisReply*)redisCommand(redis_context, "SENTINEL slaves %s", _sentinel_master_name.c_str());
+        if (replicas_reply && REDIS_REPLY_ARRAY==replicas_reply->type)
+        {
+            for (size_t i=0; i<replicas_reply->elements; ++i)
+            {
+                const redisReply* fields = replicas_reply->element[i];
+                std::string ip, port, flags;
+
+                if (fields->type != REDIS_REPLY_ARRAY)
+                    continue;
+                for (size_t j=0; j+1<fields->elements; j+=2)
+                {
+                    const std::string field(fields->element[j]->str, fields->element[j]->len);
+                    const std::string value(fields->element[j+1]->str, fields->element[j+1]->len);
+                    if (field == "ip")
+                        ip = value;
+                    else if (field == "port")
+                        port = value;
+                    else if (field == "flags")
+                        flags = value;
+                }
+                // 跳过主观或客观下线、以及sentinel连不上的replica
+                if (ip.empty() || flags.find("_down")!=std::string::npos || flags.find("disconnected")!=std::string::npos)
+                    continue;
+                replica_nodes->push_back(std::make_pair(ip, static_cast<uint16_t>(atoi(port.c_str()))));
+            }
+        }
     }
+    return true;
 }
 
-// To just remove a given consumer from a consumer group.
-// Consumers in a consumer group are auto-created every time a new consumer name is mentioned by some command.
-//
-// XGROUP DESTROY key groupname
-bool CRedisClient::xgroup_destroy(const std::string& key, const std::string& groupname, Node* which, int num_retries)
+// Replaces the master if it changed, and updates its replicas keeping the connections of the unchanged ones
+void CRedisClient::apply_sentinel_master(const Node& master_node, const std::vector<Node>& replica_nodes)
 {
-    // xgroup DESTROY key groupname
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XGROUP");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg("DESTROY");
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(groupname);
-    cmd_args.final();
+    CRedisMasterNode* redis_master_node = _redis_master_nodes.empty()? NULL: _redis_master_nodes.begin()->second;
+    struct TopologyView old_topology_view;
 
-    // The consumer group will be destroyed even if there are active consumers
-    // and pending messages, so make sure to call this command only when really needed.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    // Integer reply: the number of destroyed consumer groups (0 or 1)
-    return get_value(redis_reply.get()) == 1;
-}
+    if (!_topology_listeners.empty())
+        get_topology_view(&old_topology_view);
+    if (NULL==redis_master_node || redis_master_node->get_node()!=master_node)
+    {
+        redisContext* redis_context = NULL;
 
-// XGROUP SETID key groupname id-or-$
-void CRedisClient::xgroup_setid(const std::string& key, const std::string& id, Node* which, int num_retries)
-{
-    // xgroup SETID key id-or-$
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XGROUP");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg("SETID");
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(id);
-    cmd_args.final();
+        if (redis_master_node != NULL)
+        {
+            if (_enable_info_log)
+                (*g_info_log)("[R3C_SENTINEL][%s:%d] master of %s switched from %s to %s\n", __FILE__, __LINE__,
+                        _sentinel_master_name.c_str(), node2string(redis_master_node->get_node()).c_str(), node2string(master_node).c_str());
+            // 被提升为master的replica，直接使用已建立好的连接
+            CRedisReplicaNode* promoted_node = redis_master_node->remove_replica_node(master_node);
+            if (promoted_node != NULL)
+            {
+                if (!promoted_node->has_pending_replies())
+                    redis_context = promoted_node->detach_redis_context();
+                delete promoted_node;
+            }
+        }
+        clear_all_master_nodes();
+        redis_master_node = new CRedisMasterNode(std::string(""), master_node, redis_context);
+        _redis_master_nodes.insert(std::make_pair(master_node, redis_master_node));
+        insert_master_node_array(redis_master_node);
+        _nodes.assign(1, master_node);
+        _nodes_string = node2string(master_node);
+    }
 
-    (void)redis_command(false, num_retries, key, cmd_args, which);
+    std::vector<CRedisReplicaNode*> old_replica_nodes = redis_master_node->get_replica_nodes();
+    for (std::vector<CRedisReplicaNode*>::size_type i=0; i<old_replica_nodes.size(); ++i)
+    {
+        const Node& node = old_replica_nodes[i]->get_node();
+        if (std::find(replica_nodes.begin(), replica_nodes.end(), node) == replica_nodes.end())
+            delete redis_master_node->remove_replica_node(node);
+    }
+    for (std::vector<Node>::size_type i=0; i<replica_nodes.size(); ++i)
+    {
+        if (NULL == redis_master_node->find_replica_node(replica_nodes[i]))
+            redis_master_node->add_replica_node(new CRedisReplicaNode(std::string(""), replica_nodes[i], NULL));
+    }
+    if (!_topology_listeners.empty())
+        notify_topology_listeners(old_topology_view);
 }
 
-// XGROUP DELCONSUMER key groupname consumername
-int64_t CRedisClient::xgroup_delconsumer(const std::string& key, const std::string& groupname, const std::string& consumername, Node* which, int num_retries)
+// switched_master_node is the new master in the +switch-master message if any,
+// used when no sentinel answers
+void CRedisClient::refresh_sentinel_master(const Node* switched_master_node)
 {
-    // xgroup DELCONSUMER key groupname consumername
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XGROUP");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg("DELCONSUMER");
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(groupname);
-    cmd_args.add_arg(consumername);
-    cmd_args.final();
+    Node master_node;
+    std::vector<Node> replica_nodes;
+    struct ErrorInfo errinfo;
 
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get());
+    if (discover_sentinel_master(&master_node, &replica_nodes, &errinfo))
+        apply_sentinel_master(master_node, replica_nodes);
+    else if (switched_master_node != NULL)
+        apply_sentinel_master(*switched_master_node, std::vector<Node>());
 }
 
-// XREADGROUP命令是XREAD命令的特殊版本，支持消费者组
-// 当使用XREADGROUP读取时，服务器将会记住某个给定的消息已经传递：
-// 消息会被存储在消费者组内的待处理条目列表（PEL）中，即已送达但尚未确认的消息ID列表。
-// 客户端必须使用XACK确认消息处理，以便从待处理条目列表中删除待处理条目，
-// 还可以使用XPENDING命令检查待处理条目列表。
-//
-// 特殊ID“>”，意味着消费者希望只接收从未发送给任何其他消费者的消息，即只读取新的消息
-//
-// Reads more than one keys
-//
-// Available since 5.0.0.
-// Time complexity: For each stream mentioned: O(M) with M being the number
-// of elements returned. If M is constant (e.g. always asking for the first 10
-// elements with COUNT), you can consider it O(1). On the other side when
-// XREADGROUP blocks, XADD will pay the O(N) time in order to serve the N
-// clients blocked on the stream getting new data.
-//
-// XREADGROUP GROUP group consumer [COUNT count] [BLOCK milliseconds] [NOACK] STREAMS key [key ...] ID [ID ...]
-void CRedisClient::xreadgroup(
-        const std::string& groupname, const std::string& consumername,
-        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
-        int64_t count, int64_t block_milliseconds, bool noack,
-        std::vector<Stream>* values,
-        Node* which, int num_retries)
+bool CRedisClient::subscribe_sentinel()
 {
-    if (keys.empty())
+    for (std::vector<Node>::size_type i=0; i<_sentinel_nodes.size(); ++i)
     {
+        const std::vector<Node>::size_type sentinel_index = (_sentinel_index + i) % _sentinel_nodes.size();
         struct ErrorInfo errinfo;
-        errinfo.errtype = "ERR";
-        errinfo.errcode = ERROR_PARAMETER;
-        errinfo.raw_errmsg = "wrong number of arguments for 'xreadgroup' command";
-        errinfo.errmsg = format_string("[R3C_XREADGROUP][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        redisContext* redis_context = connect_sentinel(_sentinel_nodes[sentinel_index], &errinfo);
+
+        if (redis_context != NULL)
+        {
+            // 1) "subscribe"
+            // 2) "+switch-master"
+            // 3) (integer) 1
+            const RedisReplyHelper redis_reply = (redisReply*)redisCommand(redis_context, "SUBSCRIBE +switch-master");
+            if (redis_reply && REDIS_REPLY_ARRAY==redis_reply->type)
+            {
+                if (_enable_debug_log)
+                    (*g_debug_log)("[R3C_SENTINEL][%s:%d] subscribed to %s\n", __FILE__, __LINE__, node2string(_sentinel_nodes[sentinel_index]).c_str());
+                _sentinel_index = sentinel_index;
+                _sentinel_context = redis_context;
+                return true;
+            }
+            redisFree(redis_context);
+        }
     }
-    else if (keys.size() != ids.size())
+    return false;
+}
+
+// Reads the +switch-master messages already arrived without blocking,
+// and subscribes again (then asks the sentinels, as messages may be lost) if the subscription was lost.
+// The master announced by +switch-master is switched to at once, the sentinels are asked for its replicas later.
+void CRedisClient::check_sentinel(int64_t now_milliseconds)
+{
+    Node switched_master_node;
+    bool switched = false;
+
+    _sentinel_check_time = now_milliseconds + SENTINEL_CHECK_INTERVAL_MILLISECONDS;
+    if (_sentinel_discover_time>0 && now_milliseconds>=_sentinel_discover_time)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errtype = "ERR";
-        errinfo.errcode = ERROR_PARAMETER;
-        errinfo.raw_errmsg = "unbalanced XREADGROUP list of streams: for each stream key an ID or '$' must be specified";
-        errinfo.errmsg = format_string("[R3C_XREADGROUP][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        _sentinel_discover_time = 0;
+        refresh_sentinel_master(NULL);
     }
-    else if (cluster_mode() && keys_crossslots(keys))
+    if (NULL == _sentinel_context)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errtype = "CROSSSLOT";
-        errinfo.errcode = ERROR_PARAMETER;
-        errinfo.raw_errmsg = "keys in request don't hash to the same slot";
-        errinfo.errmsg = format_string("[R3C_XREADGROUP][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        if (now_milliseconds < _sentinel_retry_time)
+            return;
+        _sentinel_retry_time = now_milliseconds + SENTINEL_RETRY_INTERVAL_MILLISECONDS;
+        if (subscribe_sentinel())
+            refresh_sentinel_master(NULL);
+        return;
     }
-    else
+
+    struct pollfd pollfd;
+    pollfd.fd = _sentinel_context->fd;
+    pollfd.events = POLLIN;
+    pollfd.revents = 0;
+    if (poll(&pollfd, 1, 0) <= 0)
+        return;
+    if (REDIS_OK != redisBufferRead(_sentinel_context))
     {
-        const std::string key = cluster_mode()? keys[0]: std::string("");
-        std::string value;
-        CommandArgs cmd_args;
-        if (!key.empty())
-            cmd_args.set_key(key);
-        cmd_args.set_command("XREADGROUP");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_arg("GROUP");
-        cmd_args.add_arg(groupname);
-        cmd_args.add_arg(consumername);
-        cmd_args.add_arg("COUNT");
-        cmd_args.add_arg(count);
-        if (block_milliseconds >= 0) // timeout is negative
+        if (_enable_error_log)
+            (*g_error_log)("[R3C_SENTINEL][%s:%d] subscription to %s lost: %s\n", __FILE__, __LINE__,
+                    node2string(_sentinel_nodes[_sentinel_index]).c_str(), _sentinel_context->errstr);
+        close_sentinel();
+        _sentinel_index = (_sentinel_index + 1) % _sentinel_nodes.size();
+        return;
+    }
+    for (;;)
+    {
+        // 1) "message"
+        // 2) "+switch-master"
+        // 3) "mymaster 127.0.0.1 6379 127.0.0.1 6380"
+        void* reply = NULL;
+        if (REDIS_OK!=redisGetReplyFromReader(_sentinel_context, &reply) || NULL==reply)
+            break;
+
+        const RedisReplyHelper redis_reply = static_cast<redisReply*>(reply);
+        if (REDIS_REPLY_ARRAY==redis_reply->type && 3==redis_reply->elements && REDIS_REPLY_STRING==redis_reply->element[2]->type)
         {
-            cmd_args.add_arg("BLOCK");
-            cmd_args.add_arg(block_milliseconds);
+            std::vector<std::string> tokens;
+            if (5==split(&tokens, std::string(redis_reply->element[2]->str, redis_reply->element[2]->len), " ") &&
+                tokens[0]==_sentinel_master_name)
+            {
+                switched_master_node = std::make_pair(tokens[3], static_cast<uint16_t>(atoi(tokens[4].c_str())));
+                switched = true;
+            }
         }
-        if (noack)
+    }
+    if (switched)
+    {
+        // 先切到消息中的新master（沿用其余replica），请求不必等待询问sentinel
+        CRedisMasterNode* redis_master_node = _redis_master_nodes.empty()? NULL: _redis_master_nodes.begin()->second;
+        std::vector<Node> replica_nodes;
+        if (redis_master_node != NULL)
         {
-            cmd_args.add_arg("NOACK");
+            const std::vector<CRedisReplicaNode*>& old_replica_nodes = redis_master_node->get_replica_nodes();
+            for (std::vector<CRedisReplicaNode*>::size_type i=0; i<old_replica_nodes.size(); ++i)
+            {
+                if (old_replica_nodes[i]->get_node() != switched_master_node)
+                    replica_nodes.push_back(old_replica_nodes[i]->get_node());
+            }
         }
-        cmd_args.add_arg("STREAMS");
-        cmd_args.add_args(keys);
-        cmd_args.add_args(ids);
-        cmd_args.final();
-
-        // REDIS_REPLY_ARRAY
-        const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-        get_values(redis_reply.get(), values);
+        apply_sentinel_master(switched_master_node, replica_nodes);
+        _sentinel_discover_time = now_milliseconds + SENTINEL_RETRY_INTERVAL_MILLISECONDS;
     }
 }
 
-// Reads more than one keys
-void CRedisClient::xreadgroup(
-        const std::string& groupname, const std::string& consumername,
-        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
-        int64_t count, bool noack,
-        std::vector<Stream>* values,
-        Node* which, int num_retries)
+void CRedisClient::close_sentinel()
 {
-    const int64_t block_milliseconds = -1; // -1 means, no BLOCK argument given
-    xreadgroup(groupname, consumername, keys, ids, count, block_milliseconds, noack, values, which, num_retries);
+    if (_sentinel_context != NULL)
+    {
+        redisFree(_sentinel_context);
+        _sentinel_context = NULL;
+    }
 }
 
-// Reads more than one keys
-void CRedisClient::xreadgroup(
-        const std::string& groupname, const std::string& consumername,
-        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
-        bool noack,
-        std::vector<Stream>* values,
-        Node* which, int num_retries)
+bool CRedisClient::init_cluster(struct ErrorInfo* errinfo)
 {
-    const int64_t count = 0;
-    const int64_t block_milliseconds = -1; // -1 means, no BLOCK argument given
-    xreadgroup(groupname, consumername, keys, ids, count, block_milliseconds, noack, values, which, num_retries);
-}
+    const int num_nodes = static_cast<int>(_nodes.size());
+    const uint64_t base = reinterpret_cast<uint64_t>(this);
+    uint64_t seed = get_random_number(base);
 
-// Only read one key
-void CRedisClient::xreadgroup(
-        const std::string& groupname, const std::string& consumername,
-        const std::string& key, const std::string& id,
-        int64_t count, int64_t block_milliseconds,
-        bool noack,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
-{
-    std::vector<Stream> streams;
-    std::vector<std::string> keys(1);
-    std::vector<std::string> ids(1);
+    // 到这里时_redis_master_nodes为空，_master_node_array中只剩空洞
+    _master_node_array.clear();
+    _slot2index.assign(static_cast<size_t>(CLUSTER_SLOTS), static_cast<uint16_t>(INVALID_NODE_INDEX));
+    if (_topology_entry != NULL)
+    {
+        // 同一进程中已有client发现过拓扑，不必再请求集群
+        TopologyPtr topology;
+        const uint64_t version = get_topology(_topology_entry, &topology);
+        if (topology)
+        {
+            std::vector<struct NodeInfo> replication_nodes_info;
+            if (init_master_nodes(topology->nodes_info, &replication_nodes_info, errinfo))
+            {
+                _topology_version = version;
+                if (need_replica_nodes())
+                    init_replica_nodes(replication_nodes_info, true);
+                return true;
+            }
+            clear_all_master_nodes();
+        }
+    }
+    for (int i=0; i<num_nodes; ++i)
+    {
+        const int j = static_cast<int>(++seed % num_nodes);
+        const Node& node = _nodes[j];
+        std::vector<struct NodeInfo> nodes_info;
 
-    keys[0] = key;
-    ids[0] = id;
-    xreadgroup(groupname, consumername, keys, ids, count, block_milliseconds, noack, &streams, which, num_retries);
-    if (!streams.empty())
-        values->swap(streams[0].entries);
-}
+        redisContext* redis_context = connect_redis_node(node, errinfo, false);
+        if (NULL == redis_context)
+        {
+            continue;
+        }
+        if (!discover_cluster_nodes(&nodes_info, errinfo, redis_context, node))
+        {
+            redisFree(redis_context);
+            continue;
+        }
+        else
+        {
+            std::vector<struct NodeInfo> replication_nodes_info;
 
-// Only read one key
-void CRedisClient::xreadgroup(
-        const std::string& groupname, const std::string& consumername,
-        const std::string& key,
-        int64_t count, int64_t block_milliseconds,
-        bool noack,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
-{
-    std::vector<Stream> streams;
-    std::vector<std::string> keys(1);
-    std::vector<std::string> ids(1);
+            redisFree(redis_context);
+            redis_context = NULL;
+            if (_topology_entry != NULL)
+                _topology_version = publish_topology(_topology_entry, &nodes_info, false);
+            if (init_master_nodes(nodes_info, &replication_nodes_info, errinfo))
+            {
+                if (need_replica_nodes())
+                    init_replica_nodes(replication_nodes_info, true);
+                break;
+            }
+        }
+    }
 
-    keys[0] = key;
-    ids[0] = ">";
-    xreadgroup(groupname, consumername, keys, ids, count, block_milliseconds, noack, &streams, which, num_retries);
-    if (!streams.empty())
-        values->swap(streams[0].entries);
+    return !_redis_master_nodes.empty();
 }
 
-// Reads more than one keys
-// XREAD [COUNT count] [BLOCK milliseconds] STREAMS key [key ...] ID [ID ...]
-void CRedisClient::xread(
-        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
-        int64_t count, int64_t block_milliseconds,
-        std::vector<Stream>* values, Node* which, int num_retries)
+bool CRedisClient::init_master_nodes(
+        const std::vector<struct NodeInfo>& nodes_info,
+        std::vector<struct NodeInfo>* replication_nodes_info,
+        struct ErrorInfo* errinfo)
 {
-    if (keys.empty())
-    {
-        struct ErrorInfo errinfo;
-        errinfo.errtype = "ERR";
-        errinfo.errcode = ERROR_PARAMETER;
-        errinfo.raw_errmsg = "wrong number of arguments for 'xread' command";
-        errinfo.errmsg = format_string("[R3C_XREAD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
-    }
-    else if (keys.size() != ids.size())
+    int connected = 0; // 成功连接的master个数
+
+    if (nodes_info.size() > 1)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errtype = "ERR";
-        errinfo.errcode = ERROR_PARAMETER;
-        errinfo.raw_errmsg = "unbalanced XREAD list of streams: for each stream key an ID or '$' must be specified";
-        errinfo.errmsg = format_string("[R3C_XREAD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        _nodes_string.clear();
     }
-    else if (cluster_mode() && keys_crossslots(keys))
+    else
     {
-        struct ErrorInfo errinfo;
-        errinfo.errtype = "CROSSSLOT";
-        errinfo.errcode = ERROR_PARAMETER;
-        errinfo.raw_errmsg = "keys in request don't hash to the same slot";
-        errinfo.errmsg = format_string("[R3C_XREAD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        _nodes_string = _raw_nodes_string;
     }
-    else
+    for (std::vector<struct NodeInfo>::size_type i=0; i<nodes_info.size(); ++i) // Traversing all master nodes
     {
-        const std::string key = cluster_mode()? keys[0]: std::string("");
-        std::string value;
-        CommandArgs cmd_args;
-        if (!key.empty())
-            cmd_args.set_key(key);
-        cmd_args.set_command("XREAD");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_arg("COUNT");
-        cmd_args.add_arg(count);
-        if (block_milliseconds >= 0) // timeout is negative
+        const struct NodeInfo& nodeinfo = nodes_info[i];
+
+        if (nodes_info.size() > 1)
         {
-            cmd_args.add_arg("BLOCK");
-            cmd_args.add_arg(block_milliseconds);
+            update_nodes_string(nodeinfo);
+        }
+        if (nodeinfo.is_master() && !nodeinfo.is_fail())
+        {
+            if (add_master_node(nodeinfo, true, errinfo))
+                ++connected;
+            update_slots(nodeinfo);
+        }
+        else if (nodeinfo.is_replica() && !nodeinfo.is_fail())
+        {
+            replication_nodes_info->push_back(nodeinfo);
         }
-        cmd_args.add_arg("STREAMS");
-        cmd_args.add_args(keys);
-        cmd_args.add_args(ids);
-        cmd_args.final();
-
-        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-        get_values(redis_reply.get(), values);
     }
-}
 
-// Reads more than one keys
-void CRedisClient::xread(
-        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
-        int64_t count,
-        std::vector<Stream>* values, Node* which, int num_retries)
-{
-    const int64_t block_milliseconds = -1; // -1 means, no BLOCK argument given
-    xread(keys, ids, count, block_milliseconds, values, which, num_retries);
+    update_slot_migrations(nodes_info);
+    // 至少要有一个能够连接上
+    return connected > 0;
 }
 
-// Reads more than one keys
-void CRedisClient::xread(
-        const std::vector<std::string>& keys, const std::vector<std::string>& ids,
-        std::vector<Stream>* values, Node* which, int num_retries)
+void CRedisClient::init_replica_nodes(const std::vector<struct NodeInfo>& replication_nodes_info, bool connect_nodes)
 {
-    const int64_t count = 0;
-    const int64_t block_milliseconds = -1; // -1 means, no BLOCK argument given
-    xread(keys, ids, count, block_milliseconds, values, which, num_retries);
-}
+    for (std::vector<struct NodeInfo>::size_type i=0; i<replication_nodes_info.size(); ++i)
+    {
+        const struct NodeInfo& nodeinfo = replication_nodes_info[i];
+        const NodeId& master_nodeid = nodeinfo.master_id;
+        const NodeId& replica_nodeid = nodeinfo.id;
+        const Node& replica_node = nodeinfo.node;
 
-// Only read one key
-void CRedisClient::xread(
-        const std::string& key, const std::string& id,
-        int64_t count, int64_t block_milliseconds,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
-{
-    std::vector<Stream> streams;
-    std::vector<std::string> keys(1);
-    std::vector<std::string> ids(1);
+        CRedisMasterNode* redis_master_node = get_redis_master_node(master_nodeid);
+        if (redis_master_node != NULL)
+        {
+            const CRedisReplicaNode* old_replica_node = redis_master_node->find_replica_node(replica_node);
+            if (old_replica_node!=NULL && (old_replica_node->get_redis_context()!=NULL || !connect_nodes))
+            {
+                // 已连接的replica保持不变，不必每次刷新都重连
+                continue;
+            }
 
-    keys[0] = key;
-    ids[0] = id;
-    xread(keys, ids, count, block_milliseconds, &streams, which, num_retries);
-    if (!streams.empty())
-        values->swap(streams[0].entries);
-}
+            // 优先复用原master下的连接（如主从切换后replica换了master）
+            CRedisReplicaNode* redis_replica_node = take_replica_node(replica_node);
+            if (redis_replica_node!=NULL && (redis_replica_node->get_redis_context()!=NULL || !connect_nodes))
+            {
+                redis_master_node->add_replica_node(redis_replica_node);
+                continue;
+            }
+            delete redis_replica_node;
 
-// Only read one key
-void CRedisClient::xread(
-        const std::string& key,
-        int64_t count, int64_t block_milliseconds,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
-{
-    std::vector<Stream> streams;
-    std::vector<std::string> keys(1);
-    std::vector<std::string> ids(1);
+            if (!connect_nodes)
+            {
+                // 读到该replica时再连接
+                redis_replica_node = new CRedisReplicaNode(replica_nodeid, replica_node, NULL);
+                redis_master_node->add_replica_node(redis_replica_node);
+                continue;
+            }
 
-    keys[0] = key;
-    ids[0] = ">";
-    xread(keys, ids, count, block_milliseconds, &streams, which, num_retries);
-    if (!streams.empty())
-        values->swap(streams[0].entries);
+            struct ErrorInfo errinfo;
+            redisContext* redis_context = connect_redis_node(replica_node, &errinfo, true);
+            if (redis_context != NULL)
+            {
+                redis_replica_node = new CRedisReplicaNode(replica_nodeid, replica_node, redis_context);
+                redis_master_node->add_replica_node(redis_replica_node);
+            }
+        }
+    }
+    // 新replica的延迟未知，下次读前重新判定
+    _replication_expire_time = 0;
 }
 
-// XDEL <key> [<ID1> <ID2> ... <IDN>]
-int CRedisClient::xdel(const std::string& key, const std::vector<std::string>& ids, Node* which, int num_retries)
+// Called after the master node of nodeinfo is added
+void CRedisClient::update_slots(const struct NodeInfo& nodeinfo)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XDEL");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_args(ids);
-    cmd_args.final();
+    const RedisMasterNodeTable::const_iterator iter = _redis_master_nodes.find(nodeinfo.node);
 
-    // Integer reply: the number of entries actually deleted.
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
-}
+    if (iter != _redis_master_nodes.end())
+    {
+        const uint16_t table_index = iter->second->get_table_index();
 
-int CRedisClient::xdel(const std::string& key, const std::string& id, Node* which, int num_retries)
-{
-    std::vector<std::string> ids(1);
-    ids[0] = id;
-    return xdel(key, ids, which, num_retries);
+        for (SlotSegment::size_type i=0; i<nodeinfo.slots.size(); ++i)
+        {
+            const std::pair<int, int>& slot_segment = nodeinfo.slots[i];
+            std::fill(_slot2index.begin()+slot_segment.first, _slot2index.begin()+slot_segment.second+1, table_index);
+        }
+    }
 }
 
-// XTRIM key MAXLEN [~] count
-int64_t CRedisClient::xtrim(const std::string& key, int64_t maxlen, char c, Node* which, int num_retries)
+// Points a single slot to the node replied by MOVED,
+// a master not known yet is added and its NodeId is filled by the next full refresh
+void CRedisClient::update_slot(int slot, const Node& node)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XTRIM");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg("MAXLEN");
-    cmd_args.add_arg(c);
-    cmd_args.add_arg(maxlen);
-    cmd_args.final();
+    RedisMasterNodeTable::const_iterator iter = _redis_master_nodes.find(node);
+    struct TopologyView old_topology_view;
 
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get());
+    if (slot<0 || slot>=CLUSTER_SLOTS)
+        return;
+    if (!_topology_listeners.empty())
+        get_topology_view(&old_topology_view);
+    if (iter == _redis_master_nodes.end())
+    {
+        struct NodeInfo nodeinfo;
+        struct ErrorInfo errinfo;
+        nodeinfo.node = node;
+        add_master_node(nodeinfo, true, &errinfo);
+        iter = _redis_master_nodes.find(node);
+    }
+    if (iter != _redis_master_nodes.end())
+    {
+        if (_enable_debug_log)
+            (*g_debug_log)("[R3C_UPDATE_SLOT][%s:%d] slot %d is moved to %s\n",
+                    __FILE__, __LINE__, slot, node2string(node).c_str());
+        _slot2index[slot] = iter->second->get_table_index();
+    }
+    if (!_topology_listeners.empty())
+        notify_topology_listeners(old_topology_view);
 }
 
-int64_t CRedisClient::xtrim(const std::string& key, int64_t maxlen, Node* which, int num_retries)
+// The full refresh runs at most once per TOPOLOGY_REFRESH_INTERVAL_MILLISECONDS
+void CRedisClient::schedule_refresh_master_node_table(int64_t now_milliseconds)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XTRIM");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg("MAXLEN");
-    cmd_args.add_arg(maxlen);
-    cmd_args.final();
-
-    const RedisReplyHelper redis_reply = redis_command(false, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get());
+    if (_background_refresh)
+    {
+        // 限频由后台线程负责
+        signal_topology_refresher();
+    }
+    else if (0 == _refresh_due_time)
+    {
+        _refresh_due_time = _last_refresh_time + TOPOLOGY_REFRESH_INTERVAL_MILLISECONDS;
+        if (_refresh_due_time < now_milliseconds)
+            _refresh_due_time = now_milliseconds;
+    }
 }
 
-// XLEN key
-int64_t CRedisClient::xlen(const std::string& key, Node* which, int num_retries)
+// 几种需要刷新master情况：
+// 1) 遇到MOVED错误（可立即重刷）
+// 2) master挂起（能够连接，但不能服务，立即重刷一般无效，得等主从切换后）
+void CRedisClient::refresh_master_node_table(struct ErrorInfo* errinfo, const Node* error_node)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XLEN");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
-
-    // Integer reply: the number of entries of the stream at key.
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get());
-}
+    const int num_nodes = static_cast<int>(_redis_master_nodes.size());
+    bool fetched = false;
+    _refresh_due_time = 0;
+    _last_refresh_time = get_monotonic_milliseconds();
+    if (0 == num_nodes)
+    {
+        return;
+    }
+    if (_topology_entry!=NULL && !begin_fetch_topology(_topology_entry, _topology_version))
+    {
+        // 其它client已经或正在刷新，直接用它的结果
+        apply_shared_topology();
+        return;
+    }
 
-// XRANGE key start end [COUNT count]
-void CRedisClient::xrange(
-        const std::string& key,
-        const std::string& start, const std::string& end, int64_t count,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
-{
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XRANGE");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(start);
-    cmd_args.add_arg(end);
-    if (count >= 0)
+    uint64_t seed = reinterpret_cast<uint64_t>(this) - num_nodes;
+    const int k = static_cast<int>(seed % num_nodes);
+    RedisMasterNodeTable::iterator iter = _redis_master_nodes.begin();
+
+    for (int i=0; i<k; ++i)
     {
-        cmd_args.add_arg("COUNT");
-        cmd_args.add_arg(count);
+        ++iter;
+        if (iter == _redis_master_nodes.end())
+            iter = _redis_master_nodes.begin();
     }
-    cmd_args.final();
+    for (int i=0; i<num_nodes; ++i)
+    {
+        const Node& node = iter->first;
+        CRedisMasterNode* redis_node = iter->second;
+        ++iter;
 
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    get_values(redis_reply.get(), values);
-}
+        // error_node可能已是一个有问题的节点，所以最好避开它
+        if ((NULL==error_node) || (node!=*error_node))
+        {
+            redisContext* redis_context = connect_redis_node(redis_node, false, get_monotonic_milliseconds(), errinfo);
 
-void CRedisClient::xrange(
-        const std::string& key,
-        const std::string& start, const std::string& end,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
-{
-    const int64_t count = -1;
-    xrange(key, start, end, count, values, which, num_retries);
+            if (redis_context != NULL)
+            {
+                std::vector<struct NodeInfo> nodes_info;
+
+                if (discover_cluster_nodes(&nodes_info, errinfo, redis_context, node))
+                {
+                    fetched = true;
+                    apply_nodes_info(nodes_info, true, errinfo);
+                    if (_topology_entry != NULL)
+                        _topology_version = publish_topology(_topology_entry, &nodes_info, true);
+                    break; // Continue is not safe, because `clear_and_update_master_nodes` will modify _redis_master_nodes
+                }
+            }
+        }
+        if (iter == _redis_master_nodes.end())
+        {
+            iter = _redis_master_nodes.begin();
+        }
+    }
+    if (!fetched && _topology_entry!=NULL)
+    {
+        publish_topology(_topology_entry, NULL, true);
+    }
 }
 
-// XREVRANGE key end start [COUNT count]
-void CRedisClient::xrevrange(
-        const std::string& key,
-        const std::string& end, const std::string& start, int64_t count,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
+void CRedisClient::apply_shared_topology()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XRANGE");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(end);
-    cmd_args.add_arg(start);
-    if (count >= 0)
+    TopologyPtr topology;
+    const uint64_t version = get_topology(_topology_entry, &topology);
+
+    if (topology && version!=_topology_version)
     {
-        cmd_args.add_arg("COUNT");
-        cmd_args.add_arg(count);
+        // 在请求路径上，新节点留到首次使用时再连接
+        struct ErrorInfo errinfo;
+        apply_nodes_info(topology->nodes_info, false, &errinfo);
     }
-    cmd_args.final();
-
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    get_values(redis_reply.get(), values);
+    _topology_version = version;
 }
 
-void CRedisClient::xrevrange(
-        const std::string& key,
-        const std::string& end, const std::string& start,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
+void CRedisClient::apply_nodes_info(const std::vector<struct NodeInfo>& nodes_info, bool connect_nodes, struct ErrorInfo* errinfo)
 {
-    const int64_t count = -1;
-    xrevrange(key, start, end, count, values, which, num_retries);
+    std::vector<struct NodeInfo> replication_nodes_info;
+    struct TopologyView old_topology_view;
+
+    if (!_topology_listeners.empty())
+        get_topology_view(&old_topology_view);
+    clear_and_update_master_nodes(nodes_info, connect_nodes, &replication_nodes_info, errinfo);
+    if (need_replica_nodes())
+        init_replica_nodes(replication_nodes_info, connect_nodes);
+    clear_orphan_replica_nodes();
+    update_slot_migrations(nodes_info);
+    if (!_topology_listeners.empty())
+        notify_topology_listeners(old_topology_view);
 }
 
-// PEL: Pending Entries List (待处理条目列表)
-// XPENDING <key> <group> [<start> <stop> <count> [<consumer>]]
-int CRedisClient::xpending(
-        const std::string& key, const std::string& groupname,
-        const std::string& start, const std::string& end, int count, const std::string& consumer,
-        std::vector<struct DetailedPending>* pendings,
-        Node* which, int num_retries)
+// Seeds the slots marked migrating by CLUSTER NODES,
+// and forgets the slots whose migration is done (the importing node owns the slot now)
+void CRedisClient::update_slot_migrations(const std::vector<struct NodeInfo>& nodes_info)
 {
-    if (start.empty() || end.empty() || consumer.empty())
+    for (std::vector<struct NodeInfo>::size_type i=0; i<nodes_info.size(); ++i)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errtype = "ERR";
-        errinfo.raw_errmsg = "wrong number of arguments for 'xpending' command";
-        errinfo.errmsg = format_string("[R3C_XPENDING][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        const struct NodeInfo& nodeinfo = nodes_info[i];
+        for (std::vector<std::pair<int, NodeId> >::size_type j=0; j<nodeinfo.migrating_slots.size(); ++j)
+        {
+            const int slot = nodeinfo.migrating_slots[j].first;
+            const RedisMasterNodeIdTable::const_iterator iter = _redis_master_nodes_id.find(nodeinfo.migrating_slots[j].second);
+            if (iter!=_redis_master_nodes_id.end() && slot>=0 && slot<CLUSTER_SLOTS)
+            {
+                struct SlotMigration& slot_migration = _slot_migrations[slot];
+                if (slot_migration.importing_node != iter->second)
+                {
+                    slot_migration.importing_node = iter->second;
+                    slot_migration.migrated_keys.clear();
+                }
+            }
+        }
     }
-    else
+    for (std::map<int, struct SlotMigration>::iterator iter=_slot_migrations.begin(); iter!=_slot_migrations.end();)
     {
-        CommandArgs cmd_args;
-        cmd_args.set_key(key);
-        cmd_args.set_command("XPENDING");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_arg(key);
-        cmd_args.add_arg(groupname);
-        // 如果指定了start，则end和count也必须指定，否则会报错“syntax error”
-        cmd_args.add_arg(start); // -
-        cmd_args.add_arg(end); // +
-        cmd_args.add_arg(count);
-        if (!consumer.empty())
-            cmd_args.add_arg(consumer);
-        cmd_args.final();
-
-        // The command returns data in different format depending on the way it is called,
-        // as previously explained in this page. However the reply is always an array of items.
-        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-        return get_values(redis_reply.get(), pendings);
+        const uint16_t table_index = _slot2index[iter->first];
+        if (table_index<_master_node_array.size() && _master_node_array[table_index]!=NULL &&
+            _master_node_array[table_index]->get_node()==iter->second.importing_node)
+            _slot_migrations.erase(iter++);
+        else
+            ++iter;
     }
 }
 
-int CRedisClient::xpending(
-        const std::string& key, const std::string& groupname,
-        const std::string& start, const std::string& end, int count,
-        std::vector<struct DetailedPending>* pendings,
-        Node* which, int num_retries)
+// Called on ASK
+void CRedisClient::add_migrated_key(int slot, const Node& importing_node, const std::string& key)
 {
-    const std::string consumer;
-    return xpending(key, groupname, start, end, count, consumer, pendings, which, num_retries);
+    if (slot<0 || slot>=CLUSTER_SLOTS || key.empty())
+        return;
+
+    struct SlotMigration& slot_migration = _slot_migrations[slot];
+    if (slot_migration.importing_node!=importing_node || slot_migration.migrated_keys.size()>=MAX_MIGRATED_KEYS_PER_SLOT)
+    {
+        slot_migration.importing_node = importing_node;
+        slot_migration.migrated_keys.clear();
+    }
+    slot_migration.migrated_keys.insert(key);
 }
 
-int CRedisClient::xpending(
-        const std::string& key, const std::string& groupname,
-        struct GroupPending* groups,
-        Node* which, int num_retries)
+// Returns the importing node if the key is known to be migrated, or NULL
+const Node* CRedisClient::get_migrated_key_node(int slot, const std::string& key) const
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XPENDING");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(groupname);
-    cmd_args.final();
-
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_values(redis_reply.get(), groups);
+    const std::map<int, struct SlotMigration>::const_iterator iter = _slot_migrations.find(slot);
+    if (iter!=_slot_migrations.end() && iter->second.migrated_keys.count(key)>0)
+        return &iter->second.importing_node;
+    return NULL;
 }
 
-// Gets ownership of one or multiple messages in the Pending Entries List
-// of a given stream consumer group.
-//
-// If the message ID (among the specified ones) exists, and its idle
-// time greater or equal to <min-idle-time>, then the message new owner
-// becomes the specified <consumer>. If the minimum idle time specified
-// is zero, messages are claimed regardless of their idle time.
-//
-// All the messages that cannot be found inside the pending entries list
-// are ignored, but in case the FORCE option is used. In that case we
-// create the NACK (representing a not yet acknowledged message) entry in
-// the consumer group PEL.
-//
-// This command creates the consumer as side effect if it does not yet
-// exists. Moreover the command reset the idle time of the message to 0,
-// even if by using the IDLE or TIME options, the user can control the
-// new idle time.
-//
-// IDLE(IDLE和TIME为二选一关系):
-// Set the idle time (last time it was delivered) of the message.
-// If IDLE is not specified, an IDLE of 0 is assumed, that is,
-// the time count is reset because the message has now a new
-// owner trying to process it.
-//
-// TIME(IDLE和TIME为二选一关系):
-// This is the same as IDLE but instead of a relative amount of
-// milliseconds, it sets the idle time to a specific unix time
-// (in milliseconds). This is useful in order to rewrite the AOF
-// file generating XCLAIM commands.
-//
-// RETRYCOUNT:
-// Set the retry counter to the specified value. This counter is
-// incremented every time a message is delivered again. Normally
-// XCLAIM does not alter this counter, which is just served to clients
-// when the XPENDING command is called: this way clients can detect
-// anomalies, like messages that are never processed for some reason
-// after a big number of delivery attempts.
-//
-// FORCE:
-// Creates the pending message entry in the PEL even if certain
-// specified IDs are not already in the PEL assigned to a different
-// client. However the message must be exist in the stream, otherwise
-// the IDs of non existing messages are ignored.
-//
-// JUSTID:
-// Return just an array of IDs of messages successfully claimed,
-// without returning the actual message.
-//
-// LASTID:
-// Update the consumer group last ID with the specified ID if the
-// current last ID is smaller than the provided one.
-// This is used for replication / AOF, so that when we read from a
-// consumer group, the XCLAIM that gets propagated to give ownership
-// to the consumer, is also used in order to update the group current
-// ID.
-//
-// XCLAIM <key> <group> <consumer> <min-idle-time> <ID-1> <ID-2>
-//        [IDLE <milliseconds>] [TIME <mstime>] [RETRYCOUNT <count>] [FORCE] [JUSTID]
-// 改变待处理消息的所有权， 因此新的所有者是在命令参数中指定的消费者
-void CRedisClient::xclaim(
-        const std::string& key, const std::string& groupname, const std::string& consumer,
-        int64_t minidle, const std::vector<std::string>& ids,
-        int64_t idletime, int64_t unixtime, int64_t retrycount, bool force,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
+void CRedisClient::get_topology_view(struct TopologyView* topology_view) const
 {
-    if (ids.empty())
+    topology_view->slot2index = _slot2index;
+    topology_view->index2node.resize(_master_node_array.size());
+    for (std::vector<CRedisMasterNode*>::size_type i=0; i<_master_node_array.size(); ++i)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errtype = "ERR";
-        errinfo.raw_errmsg = "wrong number of arguments for 'xclaim' command";
-        errinfo.errmsg = format_string("[R3C_XPENDING][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        const CRedisMasterNode* master_node = _master_node_array[i];
+        if (master_node != NULL)
+            topology_view->index2node[i] = master_node->get_node();
     }
-    else
+    for (RedisMasterNodeTable::const_iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
     {
-        CommandArgs cmd_args;
-        cmd_args.set_key(key);
-        cmd_args.set_command("XCLAIM");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_arg(key);
-        cmd_args.add_arg(groupname);
-        cmd_args.add_arg(consumer);
-        if (minidle >= 0)
-        {
-            cmd_args.add_arg(minidle);
-        }
-        if (!ids.empty())
-        {
-            cmd_args.add_args(ids);
-        }
-        if (idletime >= 0)
-        {
-            cmd_args.add_arg("IDLE");
-            cmd_args.add_arg(idletime);
-        }
-        if (unixtime >= 0)
-        {
-            cmd_args.add_arg("TIME");
-            cmd_args.add_arg(unixtime);
-        }
-        if (retrycount >= 0)
-        {
-            cmd_args.add_arg(retrycount);
-        }
-        if (force)
-        {
-            cmd_args.add_arg("FORCE");
-        }
-        //cmd_args.add_arg("JUSTID");
-        cmd_args.final();
+        std::vector<CRedisReplicaNode*> replica_nodes;
+        topology_view->masters.insert(iter->first);
+        iter->second->get_replica_nodes(&replica_nodes);
+        for (std::vector<CRedisReplicaNode*>::size_type i=0; i<replica_nodes.size(); ++i)
+            topology_view->replicas.insert(replica_nodes[i]->get_node());
+    }
+}
 
-        // Returns all the messages successfully claimed, in the same format as XRANGE.
-        // However if the JUSTID option was specified,
-        // only the message IDs are reported, without including the actual message.
-        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-        get_values(redis_reply.get(), values);
+void CRedisClient::notify_topology_listeners(const struct TopologyView& old_topology_view)
+{
+    struct TopologyView new_topology_view;
+    struct TopologyDiff diff;
+
+    get_topology_view(&new_topology_view);
+    diff_topology(old_topology_view, new_topology_view, &diff);
+    if (!diff.empty())
+    {
+        if (_enable_info_log)
+            (*g_info_log)("[R3C_TOPOLOGY_CHANGED][%s:%d] %s\n", __FILE__, __LINE__, diff.str().c_str());
+        for (std::vector<TopologyListener*>::size_type i=0; i<_topology_listeners.size(); ++i)
+            _topology_listeners[i]->on_topology_changed(diff);
     }
 }
 
-void CRedisClient::xclaim(
-        const std::string& key, const std::string& groupname, const std::string& consumer,
-        int64_t minidle, const std::vector<std::string>& ids,
-        std::vector<StreamEntry>* values,
-        Node* which, int num_retries)
+void CRedisClient::add_topology_listener(TopologyListener* topology_listener)
 {
-    const int64_t idletime = -1;
-    const int64_t unixtime = -1;
-    const int64_t retrycount = -1;
-    bool force = false;
-    xclaim(key, groupname, consumer, minidle, ids, idletime, unixtime, retrycount, force, values, which, num_retries);
+    if (std::find(_topology_listeners.begin(), _topology_listeners.end(), topology_listener) == _topology_listeners.end())
+        _topology_listeners.push_back(topology_listener);
 }
 
-void CRedisClient::xclaim(
-        const std::string& key, const std::string& groupname, const std::string& consumer,
-        int64_t minidle, const std::vector<std::string>& ids,
-        int64_t idletime, int64_t unixtime, int64_t retrycount,
-        bool force,
-        std::vector<std::string>* values,
-        Node* which, int num_retries)
+void CRedisClient::remove_topology_listener(TopologyListener* topology_listener)
 {
-    if (ids.empty())
+    _topology_listeners.erase(std::remove(_topology_listeners.begin(), _topology_listeners.end(), topology_listener), _topology_listeners.end());
+}
+
+void CRedisClient::clear_and_update_master_nodes(
+        const std::vector<struct NodeInfo>& nodes_info,
+        bool connect_nodes,
+        std::vector<struct NodeInfo>* replication_nodes_info,
+        struct ErrorInfo* errinfo)
+{
+    NodeInfoTable master_nodeinfo_table;
+    std::string nodes_string;
+
+    if (nodes_info.size() > 1)
     {
-        struct ErrorInfo errinfo;
-        errinfo.errtype = "ERR";
-        errinfo.raw_errmsg = "wrong number of arguments for 'xclaim' command";
-        errinfo.errmsg = format_string("[R3C_XCLAIM][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        _nodes_string.clear();
     }
-    else
+    for (std::vector<struct NodeInfo>::size_type i=0; i<nodes_info.size(); ++i) // Traversing all master nodes
     {
-        CommandArgs cmd_args;
-        cmd_args.set_key(key);
-        cmd_args.set_command("XCLAIM");
-        cmd_args.add_arg(cmd_args.get_command());
-        cmd_args.add_arg(key);
-        cmd_args.add_arg(groupname);
-        cmd_args.add_arg(consumer);
-        if (minidle >= 0)
-        {
-            cmd_args.add_arg(minidle);
-        }
-        if (!ids.empty())
+        const struct NodeInfo& nodeinfo = nodes_info[i];
+
+        if (nodes_info.size() > 1)
         {
-            cmd_args.add_args(ids);
+            update_nodes_string(nodeinfo);
         }
-        if (idletime >= 0)
+        if (nodeinfo.is_master() && !nodeinfo.is_fail())
         {
-            cmd_args.add_arg("IDLE");
-            cmd_args.add_arg(idletime);
+            // 可能只是一个或多个slot从一个master迁到另一个master，
+            // 简单的全量更新slot和node间的关系，
+            // 如果一对master和replica同时异常，则_slot2index会出现空洞
+            master_nodeinfo_table.insert(std::make_pair(nodeinfo.node, nodeinfo));
+
+            const RedisMasterNodeTable::const_iterator iter = _redis_master_nodes.find(nodeinfo.node);
+            if (iter == _redis_master_nodes.end())
+            {
+                // New master
+                add_master_node(nodeinfo, connect_nodes, errinfo);
+            }
+            else if (iter->second->get_nodeid() != nodeinfo.id)
+            {
+                // Added by update_slot without NodeId, or the node was reset
+                _redis_master_nodes_id.erase(iter->second->get_nodeid());
+                iter->second->set_nodeid(nodeinfo.id);
+                _redis_master_nodes_id[nodeinfo.id] = nodeinfo.node;
+            }
+            update_slots(nodeinfo);
         }
-        if (unixtime >= 0)
+        else if (nodeinfo.is_replica() && !nodeinfo.is_fail())
         {
-            cmd_args.add_arg("TIME");
-            cmd_args.add_arg(unixtime);
+            replication_nodes_info->push_back(nodeinfo);
         }
-        if (retrycount >= 0)
+    }
+
+    clear_invalid_master_nodes(master_nodeinfo_table);
+}
+
+void CRedisClient::clear_invalid_master_nodes(const NodeInfoTable& master_nodeinfo_table)
+{
+    for (RedisMasterNodeTable::iterator node_iter=_redis_master_nodes.begin(); node_iter!=_redis_master_nodes.end();)
+    {
+        const Node& node = node_iter->first;
+        const NodeInfoTable::const_iterator info_iter = master_nodeinfo_table.find(node);
+
+        if (info_iter != master_nodeinfo_table.end())
         {
-            cmd_args.add_arg(retrycount);
+            // 保持不变，仍然是master
+            ++node_iter;
         }
-        if (force)
+        else
         {
-            cmd_args.add_arg("FORCE");
-        }
-        cmd_args.add_arg("JUSTID");
-        cmd_args.final();
+            CRedisMasterNode* master_node = node_iter->second;
+            const NodeId nodeid = master_node->get_nodeid();
+            if (_enable_info_log)
+                (*g_info_log)("[R3C_CLEAR_INVALID][%s:%d] %s is removed because it is not a master now\n", __FILE__, __LINE__, master_node->str().c_str());
 
-        // Returns all the messages successfully claimed, in the same format as XRANGE.
-        // However if the JUSTID option was specified,
-        // only the message IDs are reported, without including the actual message.
-        const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-        get_values(redis_reply.get(), values);
+            // replica的连接留给init_replica_nodes复用
+            std::vector<CRedisReplicaNode*> replica_nodes;
+            master_node->detach_replica_nodes(&replica_nodes);
+            for (std::vector<CRedisReplicaNode*>::size_type i=0; i<replica_nodes.size(); ++i)
+                _orphan_replica_nodes.push_back(replica_nodes[i]);
+
+#if __cplusplus < 201103L
+            _redis_master_nodes.erase(node_iter++);
+#else
+            node_iter = _redis_master_nodes.erase(node_iter);
+#endif
+            erase_master_node_array(master_node);
+            delete master_node;
+            _redis_master_nodes_id.erase(nodeid);
+        }
     }
 }
 
-void CRedisClient::xclaim(
-        const std::string& key, const std::string& groupname, const std::string& consumer,
-        int64_t minidle, const std::vector<std::string>& ids,
-        std::vector<std::string>* values,
-        Node* which, int num_retries)
+bool CRedisClient::add_master_node(const NodeInfo& nodeinfo, bool connect_node, struct ErrorInfo* errinfo)
 {
-    const int64_t idletime = -1;
-    const int64_t unixtime = -1;
-    const int64_t retrycount = -1;
-    bool force = false;
-    xclaim(key, groupname, consumer, minidle, ids, idletime, unixtime, retrycount, force, values, which, num_retries);
+    const NodeId& nodeid = nodeinfo.id;
+    const Node& node = nodeinfo.node;
+    redisContext* redis_context = take_replica_redis_context(node);
+    if (NULL==redis_context && connect_node)
+        redis_context = connect_redis_node(node, errinfo, false);
+    CRedisMasterNode* master_node = new CRedisMasterNode(nodeid, node, redis_context);
+
+    const std::pair<RedisMasterNodeTable::iterator, bool> ret =
+            _redis_master_nodes.insert(std::make_pair(node, master_node));
+    R3C_ASSERT(ret.second);
+    if (!ret.second)
+        delete master_node;
+    else
+        insert_master_node_array(master_node);
+    if (!nodeid.empty())
+        _redis_master_nodes_id[nodeid] = node;
+    return redis_context != NULL;
 }
 
-// Show consumer groups of group <groupname>.
-// XINFO CONSUMERS <key> <group>
-int CRedisClient::xinfo_consumers(
-        const std::string& key, const std::string& groupname,
-        std::vector<struct ConsumerInfo>* infos,
-        Node* which, int num_retries)
+// Reuses the first hole left by a removed master
+void CRedisClient::insert_master_node_array(CRedisMasterNode* master_node)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XINFO");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg("CONSUMERS");
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(groupname);
-    cmd_args.final();
+    std::vector<CRedisMasterNode*>::size_type table_index = 0;
 
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_values(redis_reply.get(), infos);
+    while (table_index<_master_node_array.size() && _master_node_array[table_index]!=NULL)
+        ++table_index;
+    R3C_ASSERT(table_index < INVALID_NODE_INDEX);
+    if (table_index == _master_node_array.size())
+        _master_node_array.push_back(master_node);
+    else
+        _master_node_array[table_index] = master_node;
+    master_node->set_table_index(static_cast<uint16_t>(table_index));
 }
 
-// Show the stream consumer groups.
-// XINFO GROUPS <key>
-int CRedisClient::xinfo_groups(
-        const std::string& key,
-        std::vector<struct GroupInfo>* infos,
-        Node* which, int num_retries)
+// Slots still referring to the removed master become holes
+void CRedisClient::erase_master_node_array(CRedisMasterNode* master_node)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XINFO");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg("GROUPS");
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    const uint16_t table_index = master_node->get_table_index();
 
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_values(redis_reply.get(), infos);
+    if (table_index < _master_node_array.size())
+    {
+        _master_node_array[table_index] = NULL;
+        std::replace(_slot2index.begin(), _slot2index.end(), table_index, static_cast<uint16_t>(INVALID_NODE_INDEX));
+    }
+    master_node->set_table_index(INVALID_NODE_INDEX);
 }
 
-// Show information about the stream.
-// XINFO STREAM <key>
-void CRedisClient::xinfo_stream(
-        const std::string& key,
-        struct StreamInfo* info,
-        Node* which, int num_retries)
+void CRedisClient::get_all_redis_nodes(std::vector<CRedisNode*>* redis_nodes) const
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("XINFO");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg("STREAM");
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    redis_nodes->clear();
+    for (RedisMasterNodeTable::const_iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
+    {
+        std::vector<CRedisReplicaNode*> replica_nodes;
 
-    const RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    get_value(redis_reply.get(), info);
+        iter->second->get_replica_nodes(&replica_nodes);
+        redis_nodes->push_back(iter->second);
+        redis_nodes->insert(redis_nodes->end(), replica_nodes.begin(), replica_nodes.end());
+    }
 }
 
-// SETBIT key offset value
-// Time complexity: O(1)
-#if !defined(setbit)
-void CRedisClient::setbit(const std::string& key, uint32_t offset, uint32_t value, Node* which, int num_retries)
-#else
-#undef setbit
-void CRedisClient::setbit(const std::string& key, uint32_t offset, uint32_t value, Node* which, int num_retries)
-#endif // setbit
+void CRedisClient::clear_all_master_nodes()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("SETBIT");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(offset);
-    cmd_args.add_arg(value);
-    cmd_args.final();
+    for (RedisMasterNodeTable::iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
+    {
+        CRedisMasterNode* master_node = iter->second;
+        delete master_node;
+    }
+    _redis_master_nodes.clear();
+    _redis_master_nodes_id.clear();
+    _master_node_array.clear();
+    std::fill(_slot2index.begin(), _slot2index.end(), static_cast<uint16_t>(INVALID_NODE_INDEX));
+    _slot_migrations.clear();
+    clear_orphan_replica_nodes();
+}
 
-    // Integer reply:
-    // the original value of the bit on the specified offset.
-    redis_command(false, num_retries, key, cmd_args, which);
+CRedisReplicaNode* CRedisClient::take_replica_node(const Node& node)
+{
+    for (std::vector<CRedisReplicaNode*>::iterator iter=_orphan_replica_nodes.begin(); iter!=_orphan_replica_nodes.end(); ++iter)
+    {
+        CRedisReplicaNode* redis_replica_node = *iter;
+        if (redis_replica_node->get_node() == node)
+        {
+            _orphan_replica_nodes.erase(iter);
+            return redis_replica_node;
+        }
+    }
+    for (RedisMasterNodeTable::iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
+    {
+        CRedisMasterNode* master_node = iter->second;
+        CRedisReplicaNode* redis_replica_node = master_node->remove_replica_node(node);
+        if (redis_replica_node != NULL)
+            return redis_replica_node;
+    }
+    return NULL;
 }
 
-// GETBIT key offset 
-// Time complexity: O(1)
-int CRedisClient::getbit(const std::string& key, uint32_t offset, Node* which, int num_retries)
+redisContext* CRedisClient::take_replica_redis_context(const Node& node)
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("GETBIT");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(offset);
-    cmd_args.final();
+    CRedisReplicaNode* redis_replica_node = take_replica_node(node);
+    redisContext* redis_context = NULL;
 
-    // Integer reply:
-    // the value of the bit on the offset, return 0 if key does not exist.
-    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    if (REDIS_REPLY_INTEGER == redis_reply->type)
-        return static_cast<int>(redis_reply->integer);
-    return 0;
+    if (redis_replica_node != NULL)
+    {
+        redis_context = redis_replica_node->detach_redis_context();
+        delete redis_replica_node;
+    }
+    if (redis_context != NULL)
+    {
+        // 被提升为master的replica，直接使用已认证好的备用连接
+        const RedisReplyHelper redis_reply = (redisReply*)redisCommand(redis_context, "READWRITE");
+        if (redis_reply && REDIS_REPLY_ERROR!=redis_reply->type)
+        {
+            if (_enable_info_log)
+                (*g_info_log)("[R3C_PROMOTE][%s:%d] Reuse the standby connection of %s\n", __FILE__, __LINE__, node2string(node).c_str());
+        }
+        else
+        {
+            redisFree(redis_context);
+            redis_context = NULL;
+        }
+    }
+    return redis_context;
 }
 
-// BITCOUNT key [start end]
-// Time complexity: O(N)
-int64_t CRedisClient::bitcount(const std::string& key, int32_t start, int32_t end, Node* which, int num_retries)
+void CRedisClient::clear_orphan_replica_nodes()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("BITCOUNT");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);       
-    cmd_args.add_arg(start);
-    cmd_args.add_arg(end);
-    cmd_args.final();
-    
-    // Integer reply:
-    // the number of bits set to 1.
-    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get());
+    for (std::vector<CRedisReplicaNode*>::size_type i=0; i<_orphan_replica_nodes.size(); ++i)
+        delete _orphan_replica_nodes[i];
+    _orphan_replica_nodes.clear();
 }
 
-// BITPOS key bit [start] [end]
-// Time complexity: O(N)
-int64_t CRedisClient::bitpos(const std::string& key, uint8_t bit, int32_t start, int32_t end, Node* which, int num_retries)
+void CRedisClient::enable_warm_standby()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("BITPOS");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_arg(bit);        
-    cmd_args.add_arg(start);
-    cmd_args.add_arg(end);
-    cmd_args.final();
-    
-    // Integer reply:
-    // the position of the first bit in the bitmap whose value is bit.
-    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get());
+    _warm_standby = true;
+    if (cluster_mode() && !sharding_mode() && !_redis_master_nodes.empty())
+    {
+        struct ErrorInfo errinfo;
+        refresh_master_node_table(&errinfo, NULL);
+    }
+    else if (sentinel_mode())
+    {
+        refresh_sentinel_master(NULL);
+    }
 }
 
-int64_t CRedisClient::pfadd(const std::string& key, const std::string& element, Node* which, int num_retries)
+void CRedisClient::disable_warm_standby()
 {
-    std::vector<std::string> elements(1);
-    elements[0] = element;
-    return pfadd(key, elements, which, num_retries);
+    _warm_standby = false;
 }
 
-int64_t CRedisClient::pfadd(const std::string& key, const std::vector<std::string>& elements, Node* which, int num_retries)
+void CRedisClient::enable_background_refresh()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("PFADD");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.add_args(elements);
-    cmd_args.final();
-
-    // Integer reply:
-    // 1 if at least 1 HyperLogLog internal register was altered. 0 otherwise.
-    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get());
+    if (_topology_entry!=NULL && !_background_refresh)
+    {
+        _background_refresh = true;
+        pthread_mutex_lock(&_topology_entry->mutex);
+        ++_topology_entry->num_refresh_clients;
+        start_topology_refresher();
+        pthread_mutex_unlock(&_topology_entry->mutex);
+    }
 }
 
-int64_t CRedisClient::pfcount(const std::string& key, Node* which, int num_retries)
+void CRedisClient::disable_background_refresh()
 {
-    CommandArgs cmd_args;
-    cmd_args.set_key(key);
-    cmd_args.set_command("PFCOUNT");
-    cmd_args.add_arg(cmd_args.get_command());
-    cmd_args.add_arg(key);
-    cmd_args.final();
+    if (_topology_entry!=NULL && _background_refresh)
+    {
+        // 不等待线程退出，它可能正阻塞在网络请求上
+        _background_refresh = false;
+        pthread_mutex_lock(&_topology_entry->mutex);
+        --_topology_entry->num_refresh_clients;
+        pthread_cond_signal(&_topology_entry->cond);
+        pthread_mutex_unlock(&_topology_entry->mutex);
+    }
+}
 
-    // Integer reply:
-    // The approximated number of unique elements observed via PFADD.
-    RedisReplyHelper redis_reply = redis_command(true, num_retries, key, cmd_args, which);
-    return get_value(redis_reply.get());
+void CRedisClient::enable_replica_lag_check(const ReplicaLagOptions& replica_lag_options)
+{
+    _replica_lag_options = replica_lag_options;
+    _replication_expire_time = 0;
+    if (_topology_entry!=NULL && !_replica_lag_check)
+    {
+        _replica_lag_check = true;
+        pthread_mutex_lock(&_topology_entry->mutex);
+        ++_topology_entry->num_lag_clients;
+        start_topology_refresher();
+        pthread_cond_signal(&_topology_entry->cond);
+        pthread_mutex_unlock(&_topology_entry->mutex);
+    }
 }
 
-////////////////////////////////////////////////////////////////////////////////
+void CRedisClient::disable_replica_lag_check()
+{
+    if (_topology_entry!=NULL && _replica_lag_check)
+    {
+        _replica_lag_check = false;
+        pthread_mutex_lock(&_topology_entry->mutex);
+        --_topology_entry->num_lag_clients;
+        pthread_cond_signal(&_topology_entry->cond);
+        pthread_mutex_unlock(&_topology_entry->mutex);
+        apply_replication(get_monotonic_milliseconds());
+    }
+}
 
-const RedisReplyHelper
-CRedisClient::redis_command(
-        bool readonly, int num_retries,
-        const std::string& key,
-        const CommandArgs& command_args,
-        Node* which)
+// Called with the mutex of _topology_entry held
+void CRedisClient::start_topology_refresher()
 {
-    Node node;
-    Node* ask_node = NULL;
-    RedisReplyHelper redis_reply;
-    struct ErrorInfo errinfo;
+    struct TopologyEntry* topology_entry = _topology_entry;
 
-    if (cluster_mode() && key.empty())
+    if (!topology_entry->refresher_running)
     {
-        // 集群模式必须指定key
-        errinfo.errcode = ERROR_ZERO_KEY;
-        errinfo.raw_errmsg = format_string("[%s] key is empty in cluster node", command_args.get_command().c_str());
-        errinfo.errmsg = format_string("[R3C_CMD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
-        if (_enable_error_log)
-            (*g_error_log)("%s\n", errinfo.errmsg.c_str());
-        THROW_REDIS_EXCEPTION(errinfo);
+        pthread_t thread;
+        pthread_attr_t attr;
+
+        topology_entry->password = _password;
+        topology_entry->connect_timeout_milliseconds = _connect_timeout_milliseconds;
+        topology_entry->readwrite_timeout_milliseconds = _readwrite_timeout_milliseconds;
+        topology_entry->socket_options = _socket_options;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (0 == pthread_create(&thread, &attr, topology_refresher, topology_entry))
+            topology_entry->refresher_running = true;
+        else if (_enable_error_log)
+            (*g_error_log)("[R3C_REFRESHER][%s:%d] create thread failed: %s\n", __FILE__, __LINE__, strerror(errno));
+        pthread_attr_destroy(&attr);
     }
-    for (int loop_counter=0;;++loop_counter)
+}
+
+static unsigned int new_zone_generation()
+{
+    static volatile unsigned int s_zone_generation = 0;
+    return __sync_add_and_fetch(&s_zone_generation, 1);
+}
+
+void CRedisClient::set_zone_options(const ZoneOptions& zone_options)
+{
+    _zone_options = zone_options;
+    _subnet_zones.clear();
+    for (std::vector<std::pair<std::string, std::string> >::size_type i=0; i<zone_options.subnet_zones.size(); ++i)
     {
-        const int slot = cluster_mode()? get_key_slot(&key): -1;
-        CRedisNode* redis_node = get_redis_node(slot, readonly, ask_node, &errinfo);
-        HandleResult errcode;
+        const std::string& cidr = zone_options.subnet_zones[i].first;
+        const std::string::size_type slash_pos = cidr.find('/');
+        const int prefix_length = (slash_pos == std::string::npos)? 32: atoi(cidr.c_str() + slash_pos + 1);
+        struct in_addr addr;
 
-        if (NULL == redis_node)
-        {
-            node.first.clear(); node.second = 0;
-        }
-        else
+        if (prefix_length<0 || prefix_length>32 ||
+            inet_pton(AF_INET, cidr.substr(0, slash_pos).c_str(), &addr) != 1)
         {
-            node = redis_node->get_node();
-        }
-        if (which != NULL)
-        {
-            *which = node;
-        }
-        if (0==loop_counter && _command_monitor!= NULL)
-        {
-            _command_monitor->before_execute(node, command_args.get_command(), command_args, readonly);
-        }
-        if (NULL == redis_node)
-        {
-            errinfo.errcode = ERROR_NO_ANY_NODE;
-            errinfo.raw_errmsg = format_string("[%s][%s][%s:%d] no any node", command_args.get_command().c_str(), get_mode_str(), node.first.c_str(), node.second);
-            errinfo.errmsg = format_string("[R3C_CMD][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
             if (_enable_error_log)
-                (*g_error_log)("[NO_ANY_NODE] %s\n", errinfo.errmsg.c_str());
-            break; // 没有任何master
+                (*g_error_log)("[R3C_ZONE][%s:%d] invalid subnet: %s\n", __FILE__, __LINE__, cidr.c_str());
+            continue;
         }
-        if (NULL == redis_node->get_redis_context())
+
+        struct SubnetZone subnet_zone;
+        subnet_zone.netmask = (0 == prefix_length)? 0: (0xFFFFFFFFu << (32 - prefix_length));
+        subnet_zone.network = ntohl(addr.s_addr) & subnet_zone.netmask;
+        subnet_zone.zone = zone_options.subnet_zones[i].second;
+        _subnet_zones.push_back(subnet_zone);
+    }
+    // 各client的代次互不相同，节点上缓存的结果随之失效
+    _matched_zone = zone_options.local_zone;
+    _zone_generation = new_zone_generation();
+}
+
+bool CRedisClient::in_zone(const Node& node, const std::string& zone) const
+{
+    const std::map<Node, std::string>::const_iterator iter = _zone_options.node_zones.find(node);
+    struct in_addr addr;
+
+    if (iter != _zone_options.node_zones.end())
+        return iter->second == zone;
+    if (inet_pton(AF_INET, node.first.c_str(), &addr) == 1)
+    {
+        const uint32_t ip = ntohl(addr.s_addr);
+        for (std::vector<struct SubnetZone>::size_type i=0; i<_subnet_zones.size(); ++i)
         {
-            // 连接master不成功
-            errcode = HR_RECONN_UNCOND;
+            if ((ip & _subnet_zones[i].netmask) == _subnet_zones[i].network)
+                return _subnet_zones[i].zone == zone;
         }
-        else
-        {
-            struct timeval start_tv, stop_tv;
-            int64_t cost_us = 0;
+    }
+    return false;
+}
 
-            // When a slot is set as MIGRATING, the node will accept all queries that are about this hash slot,
-            // but only if the key in question exists,
-            // otherwise the query is forwarded using a -ASK redirection to the node that is target of the migration.
-            // 当一个槽状态为 MIGRATING时，原来负责该哈希槽的节点仍会接受所有跟这个哈希槽有关的请求，但只处理仍然在该节点上的键，
-            // 否则类似于MOVED，返回ASK重定向到目标节点。
-            //
-            // When a slot is set as IMPORTING, the node will accept all queries that are about this hash slot,
-            // but only if the request is preceded by an ASKING command.
-            // If the ASKING command was not given by the client, the query is redirected to the real hash slot owner via a -MOVED redirection error,
-            // as would happen normally.
-            // 当一个槽状态为 IMPORTING时，只有在接受到 ASKING命令之后节点才会接受所有查询这个哈希槽的请求，
-            // 如果客户端一直没有发送 ASKING命令，那么查询都会通过MOVED重定向错误转发到真正处理这个哈希槽的节点那里。
-            gettimeofday(&start_tv, NULL);
-            if (ask_node != NULL)
-            {
-                redis_reply = (redisReply*)redisCommand(redis_node->get_redis_context(), "ASKING");
-                if (redis_reply)
-                {
-                    redis_reply = (redisReply*)redisCommandArgv(
-                            redis_node->get_redis_context(),
-                            command_args.get_argc(), command_args.get_argv(), command_args.get_argvlen());
-                }
-            }
-            else
-            {
-                redis_reply = (redisReply*)redisCommandArgv(
-                        redis_node->get_redis_context(),
-                        command_args.get_argc(), command_args.get_argv(), command_args.get_argvlen());
-            }
+// Matches the master and its replicas against zone if not matched since the last change,
+// a route to another zone than the last matched one matches the nodes again.
+void CRedisClient::update_local_zones(CRedisMasterNode* redis_master_node, const std::string& zone)
+{
+    const std::vector<CRedisReplicaNode*>& redis_replica_nodes = redis_master_node->get_replica_nodes();
 
-#if R3C_TEST // for test
-            debug_redis_reply(command_args.get_command(), redis_reply.get());
-#endif // R3C_TEST==1
+    if (zone != _matched_zone)
+    {
+        _matched_zone = zone;
+        _zone_generation = new_zone_generation();
+    }
+    if (redis_master_node->get_zone_generation() != _zone_generation)
+        redis_master_node->set_local_zone(in_zone(redis_master_node->get_node(), zone), _zone_generation);
+    for (std::vector<CRedisReplicaNode*>::size_type i=0; i<redis_replica_nodes.size(); ++i)
+    {
+        CRedisReplicaNode* redis_replica_node = redis_replica_nodes[i];
+        if (redis_replica_node->get_zone_generation() != _zone_generation)
+            redis_replica_node->set_local_zone(in_zone(redis_replica_node->get_node(), zone), _zone_generation);
+    }
+}
 
-            gettimeofday(&stop_tv, NULL);
-            cost_us = calc_elapsed_time(start_tv, stop_tv);
-            if (!redis_reply)
-                errcode = handle_redis_command_error(cost_us, redis_node, command_args, &errinfo);
-            else
-                errcode = handle_redis_reply(cost_us, redis_node, command_args, redis_reply.get(), &errinfo);
-        }
+ReadPolicy CRedisClient::get_call_read_policy() const
+{
+    if (NULL == _read_route)
+        return _read_policy;
+    if (!_read_route->zone.empty())
+        return RP_PRIORITY_LOCAL_ZONE;
+    return _read_route->read_policy;
+}
 
-        ask_node = NULL;
-        if (HR_SUCCESS == errcode)
-        {
-            // 成功立即返回
-            if (_command_monitor!=NULL)
-                _command_monitor->after_execute(0, node, command_args.get_command(), redis_reply.get());
-            return redis_reply;
-        }
-        else if (HR_ERROR == errcode)
-        {
-            // 不需要重试的错误立即返回，比如：EVAL命令语法错误
-            if (_enable_debug_log)
-            {
-                (*g_debug_log)("[NOTRETRY][%s:%d][%s][%s:%d] loop: %d\n",
-                        __FILE__, __LINE__, get_mode_str(),
-                        redis_node->get_node().first.c_str(), redis_node->get_node().second, loop_counter);
-            }
-            break;
-        }
-        else if (HR_RECONN_COND == errcode || HR_RECONN_UNCOND == errcode)
-        {
-            // 连接问题，先调用close关闭连接（调用get_redis_node时就会执行重连接）
-            redis_node->close();
-        }
-        else if (HR_REDIRECT == errcode)
+const std::string& CRedisClient::get_call_zone() const
+{
+    if (_read_route!=NULL && !_read_route->zone.empty())
+        return _read_route->zone;
+    return _zone_options.local_zone;
+}
+
+// The node of the route if it is the master or a replica of redis_master_node and usable, else NULL
+CRedisNode* CRedisClient::get_route_node(CRedisMasterNode* redis_master_node, int64_t now_milliseconds, struct ErrorInfo* errinfo)
+{
+    CRedisNode* redis_node = NULL;
+
+    if (redis_master_node->get_node() == _read_route->node)
+    {
+        redis_node = redis_master_node;
+    }
+    else
+    {
+        CRedisReplicaNode* redis_replica_node = redis_master_node->find_replica_node(_read_route->node);
+        if (redis_replica_node!=NULL && !redis_replica_node->is_lagging())
+            redis_node = redis_replica_node;
+    }
+    if (redis_node!=NULL &&
+        (!redis_node->is_available(now_milliseconds, _circuit_breaker_options) ||
+         NULL==connect_redis_node(redis_node, redis_node!=redis_master_node, now_milliseconds, errinfo)))
+    {
+        redis_node = NULL;
+    }
+    return redis_node;
+}
+
+void CRedisClient::enable_hedged_reads(const HedgeOptions& hedge_options)
+{
+    _hedge_options = hedge_options;
+    if (!_hedged_reads)
+    {
+        _hedged_reads = true;
+        _hedge_tokens = 0;
+    }
+}
+
+void CRedisClient::disable_hedged_reads()
+{
+    _hedged_reads = false;
+    for (std::map<std::string, CLatencyHistogram*>::iterator iter=_latency_histograms.begin(); iter!=_latency_histograms.end(); ++iter)
+        delete iter->second;
+    _latency_histograms.clear();
+}
+
+int CRedisClient::get_hedge_delay(const std::string& command)
+{
+    if (!_hedged_reads || RP_ONLY_MASTER==get_call_read_policy())
+        return -1;
+    if (_read_route!=NULL && !_read_route->node.first.empty())
+        return -1;
+
+    // 对冲预算：每次读积累budget_percent/100个令牌，对冲一次消耗1个
+    const int64_t max_hedge_tokens = 10 * 1000;
+    if (_hedge_tokens < max_hedge_tokens)
+        _hedge_tokens += _hedge_options.budget_percent * 10;
+
+    const std::map<std::string, CLatencyHistogram*>::const_iterator iter = _latency_histograms.find(command);
+    if (iter==_latency_histograms.end() || iter->second->get_num_samples()<_hedge_options.min_samples)
+        return -1;
+
+    const int64_t percentile_us = iter->second->get_percentile(_hedge_options.percentile);
+    const int delay_milliseconds = static_cast<int>((percentile_us + 999) / 1000);
+    return (delay_milliseconds < _hedge_options.min_delay_milliseconds)? _hedge_options.min_delay_milliseconds: delay_milliseconds;
+}
+
+void CRedisClient::add_latency_sample(const std::string& command, int64_t cost_us)
+{
+    CLatencyHistogram*& latency_histogram = _latency_histograms[command];
+    if (NULL == latency_histogram)
+        latency_histogram = new CLatencyHistogram;
+    latency_histogram->add(cost_us);
+}
+
+// Sends the read to redis_node, and also to another node of the same master if no reply arrives within delay_milliseconds.
+// Returns the first reply, *replied_node is the node replied. Returns NULL if redis_node failed and no hedged reply arrived.
+redisReply* CRedisClient::hedged_command(
+        CRedisNode* redis_node, CRedisMasterNode* redis_master_node,
+        const CommandArgs& command_args, int delay_milliseconds, CRedisNode** replied_node)
+{
+    redisContext* redis_contexts[2] = {redis_node->get_redis_context(), NULL};
+    CRedisNode* redis_nodes[2] = {redis_node, NULL};
+    redisReply* redis_reply = NULL;
+    struct pollfd pollfds[2];
+    struct ErrorInfo errinfo;
+
+    *replied_node = redis_node;
+    if (!send_command(redis_contexts[0], command_args))
+        return NULL;
+    pollfds[0].fd = redis_contexts[0]->fd;
+    pollfds[0].events = POLLIN;
+    if (poll(pollfds, 1, delay_milliseconds) != 0 || _hedge_tokens < 1000)
+    {
+        // 在对冲延迟内有回复（或出错），或者预算不足
+        if (REDIS_OK != redisGetReply(redis_contexts[0], reinterpret_cast<void**>(&redis_reply)))
+            return NULL;
+        return redis_reply;
+    }
+
+    const int64_t now_milliseconds = get_monotonic_milliseconds();
+    // 只选可用的节点，但对冲不占用熔断的探测请求，落败时无人结束探测
+    redis_nodes[1] = redis_master_node->choose_hedge_node(redis_node, now_milliseconds, _circuit_breaker_options);
+    if (redis_nodes[1] != NULL)
+        redis_contexts[1] = connect_redis_node(redis_nodes[1], redis_nodes[1]!=redis_master_node, now_milliseconds, &errinfo);
+    if (NULL==redis_contexts[1] || !send_command(redis_contexts[1], command_args))
+    {
+        if (redis_contexts[1] != NULL)
         {
-            if (!parse_moved_string(redis_reply->str, &node))
-            {
-                if (_enable_error_log)
-                {
-                    (*g_error_log)("[PARSE_MOVED][%s:%d][%s][%s:%d] node string error: %s\n",
-                            __FILE__, __LINE__, get_mode_str(),
-                            redis_node->get_node().first.c_str(), redis_node->get_node().second,
-                            redis_reply->str);
-                }
-                break;
-            }
-            else
-            {
-                ask_node = &node;
-                if (loop_counter <= 2)
-                    continue;
-                if (_enable_debug_log)
-                {
-                    (*g_debug_log)("[REDIRECT][%s:%d][%s][%s:%d] retries more than %d\n",
-                            __FILE__, __LINE__, get_mode_str(),
-                            redis_node->get_node().first.c_str(), redis_node->get_node().second, loop_counter);
-                }
-                break;
-            }
+            redis_nodes[1]->on_failure(get_monotonic_milliseconds(), _circuit_breaker_options);
+            redis_nodes[1]->close();
         }
+        if (REDIS_OK != redisGetReply(redis_contexts[0], reinterpret_cast<void**>(&redis_reply)))
+            return NULL;
+        return redis_reply;
+    }
+    _hedge_tokens -= 1000;
+    redis_nodes[1]->add_outstanding_request();
+    if (_enable_debug_log)
+    {
+        (*g_debug_log)("[R3C_HEDGE][%s:%d][%s] no reply from %s in %dms, hedged to %s\n",
+                __FILE__, __LINE__, command_args.get_command().c_str(),
+                redis_nodes[0]->str().c_str(), delay_milliseconds, redis_nodes[1]->str().c_str());
+    }
 
-        if (HR_RECONN_UNCOND == errcode)
+    // 先到的回复胜出，另一个连接上的回复留待下次使用前读掉；
+    // 总的等待与不对冲时相同，用主请求节点当前的读写超时（可能是自适应的），不大于0表示不超时
+    const int readwrite_timeout = (redis_node->get_timeout() >= 0)? redis_node->get_timeout(): _readwrite_timeout_milliseconds;
+    const int64_t deadline = now_milliseconds - delay_milliseconds + readwrite_timeout;
+    bool failed[2] = {false, false};
+    int winner = -1;
+    while (winner<0 && !(failed[0] && failed[1]))
+    {
+        const int64_t timeout_milliseconds = (readwrite_timeout > 0)? deadline-get_monotonic_milliseconds(): -1;
+        int num_pollfds = 0;
+        int indexes[2];
+
+        if (readwrite_timeout>0 && timeout_milliseconds<=0)
+            break;
+        for (int i=0; i<2; ++i)
         {
-            // 保持至少重试一次（前提是先重新建立好连接）
-            if (loop_counter>num_retries && loop_counter>0)
+            if (!failed[i])
             {
-                if (_enable_debug_log)
-                {
-                    (*g_debug_log)("[NOTRECONN][%s:%d][%s][%s:%d] retries more than %d\n",
-                            __FILE__, __LINE__, get_mode_str(),
-                            redis_node->get_node().first.c_str(), redis_node->get_node().second, num_retries);
-                }
-                break;
+                pollfds[num_pollfds].fd = redis_contexts[i]->fd;
+                pollfds[num_pollfds].events = POLLIN;
+                pollfds[num_pollfds].revents = 0;
+                indexes[num_pollfds++] = i;
             }
         }
-        else if (HR_RETRY_UNCOND == errcode)
+        if (poll(pollfds, num_pollfds, static_cast<int>(timeout_milliseconds)) < 0)
         {
-            // 一般replica切换成master需要几秒钟，
-            // 所以需要保证有足够的重试次数
-            if (loop_counter > num_retries)
-            {
-                if (_enable_debug_log)
-                {
-                    (*g_debug_log)("[RETRY_UNCOND][%s:%d][%s][%s:%d] retries more than %d\n",
-                            __FILE__, __LINE__, get_mode_str(),
-                            redis_node->get_node().first.c_str(), redis_node->get_node().second, num_retries);
-                }
-                break;
-            }
+            if (EINTR == errno)
+                continue;
+            break;
         }
-        else if (loop_counter>=num_retries)
+        for (int j=0; j<num_pollfds && winner<0; ++j)
         {
-            if (_enable_debug_log)
+            const int i = indexes[j];
+            void* reply = NULL;
+
+            if (0 == pollfds[j].revents)
+                continue;
+            if (REDIS_OK!=redisBufferRead(redis_contexts[i]) || REDIS_OK!=redisGetReplyFromReader(redis_contexts[i], &reply))
+                failed[i] = true;
+            else if (reply != NULL)
             {
-                (*g_debug_log)("[OVERRETRY][%s:%d][%s][%s:%d] retries more than %d\n",
-                        __FILE__, __LINE__, get_mode_str(),
-                        redis_node->get_node().first.c_str(), redis_node->get_node().second, num_retries);
+                winner = i;
+                redis_reply = static_cast<redisReply*>(reply);
             }
-            break;
         }
+    }
+    if (winner<0 && !failed[0])
+    {
+        // 与阻塞读超时一致，由调用者按连接错误处理
+        errno = EAGAIN;
+        redis_contexts[0]->err = REDIS_ERR_IO;
+        snprintf(redis_contexts[0]->errstr, sizeof(redis_contexts[0]->errstr), "%s", strerror(EAGAIN));
+    }
 
-        // 控制重试频率，以增强重试成功率
-        if (HR_RETRY_UNCOND == errcode || HR_RECONN_UNCOND == errcode)
+    const int64_t cost_milliseconds = get_monotonic_milliseconds() - now_milliseconds + delay_milliseconds;
+    for (int i=0; i<2; ++i)
+    {
+        if (i == winner)
+            continue;
+        if (failed[i] || winner<0)
         {
-            const int retry_sleep_milliseconds = get_retry_sleep_milliseconds(loop_counter);
-            if (retry_sleep_milliseconds > 0)
-                millisleep(retry_sleep_milliseconds);
+            // 都没有回复时，主请求交由调用者按连接错误处理，
+            // 其它情况调用者看不到这个节点的失败，在这里计入熔断
+            if (winner>=0 || i!=0)
+            {
+                redis_nodes[i]->on_failure(get_monotonic_milliseconds(), _circuit_breaker_options);
+                redis_nodes[i]->close();
+            }
         }
-        if (cluster_mode() && redis_node->need_refresh_master())
+        else
         {
-            // 单机模式下走到这会导致没法重连接，
-            // 因为_redis_master_nodes被清空了。
-            if (HR_RECONN_COND==errcode || HR_RECONN_UNCOND==errcode)
-                refresh_master_node_table(&errinfo, &node);
-            else
-                refresh_master_node_table(&errinfo, NULL);
+            // 落败者至少这么慢
+            redis_nodes[i]->update_latency(cost_milliseconds * 1000, get_monotonic_milliseconds());
+            redis_nodes[i]->add_pending_reply();
         }
     }
+    redis_nodes[1]->remove_outstanding_request();
+    if (winner >= 0)
+        *replied_node = redis_nodes[winner];
+    return redis_reply;
+}
 
-    // 错误以异常方式抛出
-    if (_command_monitor!=NULL)
-        _command_monitor->after_execute(1, node, command_args.get_command(), redis_reply.get());
-    THROW_REDIS_EXCEPTION_WITH_NODE_AND_COMMAND(errinfo, node.first, node.second, command_args.get_command(), command_args.get_key());
+void CRedisClient::enable_admission_control(const AdmissionOptions& admission_options)
+{
+    _admission_options = admission_options;
+    _admission_control = true;
 }
 
-CRedisClient::HandleResult
-CRedisClient::handle_redis_command_error(
-        int64_t cost_us,
-        CRedisNode* redis_node,
-        const CommandArgs& command_args,
-        struct ErrorInfo* errinfo)
+void CRedisClient::disable_admission_control()
 {
-    redisContext* redis_context = redis_node->get_redis_context();
+    _admission_control = false;
+}
 
-    // REDIS_ERR_EOF (call read() return 0):
-    // redis_context->err(3)
-    // redis_context->errstr("Server closed the connection")
-    //
-    // REDIS_ERR_IO (call read() return -1):
-    // redis_context->err(1)
-    // redis_context->errstr("Bad file descriptor")
-    //
-    // REDIS_ERR_IO means there was an I/O error
-    // and you should use the "errno" variable to find out what is wrong.
-    // For other values, the "errstr" field will hold a description.
-    const int redis_errcode = redis_context->err;
-    errinfo->errcode = errno;
-    errinfo->raw_errmsg = format_string("[%s][cost:%ldus] (hiredis:%d,errno:%d)%s (%s)",
-            redis_node->str().c_str(), cost_us, redis_errcode, errinfo->errcode, redis_context->errstr, strerror(errinfo->errcode));
-    errinfo->errmsg = format_string("[R3C_CMD_ERROR][%s:%d][%s] %s",
-            __FILE__, __LINE__, command_args.get_command().c_str(), errinfo->raw_errmsg.c_str());
-    if (_enable_error_log)
-    {
-        const unsigned int conn_errors = redis_node->get_conn_errors();
-        if (conn_errors==0 || conn_errors%10==0) // Reduce duplicate error logs
-            (*g_error_log)("%s\n", errinfo->errmsg.c_str());
-    }
+bool CRedisClient::admit_request(const Node& node, int64_t bytes, bool low_priority, struct ErrorInfo* errinfo)
+{
+    // ADMISSION_SHED：低优先级的只能用到bulk_percent的限额
+    const bool shed = ADMISSION_SHED==_admission_options.policy && low_priority;
+    const int64_t percent = shed? _admission_options.bulk_percent: 100;
+    const int64_t max_requests = (_admission_options.max_inflight_requests>0)? std::max<int64_t>(1, _admission_options.max_inflight_requests*percent/100): 0;
+    const int64_t max_bytes = (_admission_options.max_inflight_bytes>0)? std::max<int64_t>(1, _admission_options.max_inflight_bytes*percent/100): 0;
+    const int64_t max_total_requests = (_admission_options.max_total_inflight_requests>0)? std::max<int64_t>(1, _admission_options.max_total_inflight_requests*percent/100): 0;
+    bool wait = !shed && ADMISSION_FAIL_FAST!=_admission_options.policy;
+    bool admitted = false;
+    bool waiting = false;
+    struct timespec ts;
 
-    // REDIS_ERR_IO (1):
-    // There was an I/O error while creating the connection, trying to write
-    // to the socket or read from the socket. If you included `errno.h` in your
-    // application, you can use the global `errno` variable to find out what is wrong.
-    //
-    // REDIS_ERR_EOF (3):
-    // The server closed the connection which resulted in an empty read.
-    //
-    // REDIS_ERR_PROTOCOL (4):
-    // There was an error while parsing the protocol.
-    //
-    // REDIS_ERR_OTHER:
-    // Any other error. Currently, it is only used when a specified hostname to connect to cannot be resolved.
-    //
-    // #define   EAGAIN          11      /* Try again */
-    // #define   EINPROGRESS     115     /* Operation now in progress */
-    // #define   ECONNRESET      104     /* Connection reset by peer */
-    if ((redis_errcode != REDIS_ERR_IO) &&
-        (redis_errcode != REDIS_ERR_EOF))
+    if (wait)
+        get_timedwait_deadline(_admission_options.max_wait_milliseconds, &ts);
+
+    pthread_mutex_lock(&g_admission_mutex);
+    struct AdmissionStats& admission_stats = (*g_admission_stats)[node];
+    for (;;)
     {
-        return HR_ERROR; // Not retry
+        admitted = (max_requests<=0 || admission_stats.inflight_requests<max_requests) &&
+                   (max_bytes<=0 || 0==admission_stats.inflight_bytes || admission_stats.inflight_bytes+bytes<=max_bytes) &&
+                   (max_total_requests<=0 || g_total_inflight_requests<max_total_requests);
+        if (admitted || !wait)
+            break;
+        if (!waiting)
+        {
+            waiting = true;
+            ++admission_stats.waiting_requests;
+        }
+        if (ETIMEDOUT == pthread_cond_timedwait(&g_admission_cond, &g_admission_mutex, &ts))
+            wait = false; // 超时后再检查一次
     }
-    else if (redis_errcode == REDIS_ERR_EOF)
+    if (waiting)
+        --admission_stats.waiting_requests;
+    if (admitted)
     {
-        // (3/115)Server closed the connection (Operation now in progress)
-        redis_node->inc_conn_errors();
-        return HR_RECONN_UNCOND; // Retry unconditionally and reconnect
+        ++admission_stats.inflight_requests;
+        admission_stats.inflight_bytes += bytes;
+        ++admission_stats.admitted_requests;
+        ++g_total_inflight_requests;
     }
-    else if (redis_errcode == REDIS_ERR_IO && errinfo->errcode != EAGAIN)
+    else if (shed)
     {
-        // (1/104)Connection reset by peer (Connection reset by peer)
-        redis_node->inc_conn_errors();
-        return HR_RECONN_UNCOND; // Retry unconditionally and reconnect
+        ++admission_stats.shed_requests;
     }
     else
     {
-        // $ redis-cli -p 1386 cluster nodes | grep master
-        // 49cadd758538f821b922738fd000b5a16ef64fc7 127.0.0.1:1384@11384 master - 0 1546317629187 14 connected 10923-16383
-        // 95ce22507d469ae84cb760505bba4be0283c5468 127.0.0.1:1381@11381 master - 0 1546317630190 1 connected 0-5460
-        // a27a1ce7f8c5c5f79a1d09227eb80b73919ec795 127.0.0.1:1383@11383 master,fail - 1546317518930 1546317515000 12 connected
-        // 03c4ada274ac137c710f3d514700c2e94649c131 127.0.0.1:1382@11382 master - 0 1546317631191 2 connected 5461-10922
-        // 错误期间，可能发生了主备切换，因此光重连接是不够的，
-        // 更严重的是，该master可能一直连接超时，比如进程被SIGSTOP了，
-        // 因此重试几次后，应当重刷新master
-        redis_node->inc_conn_errors();
-        return HR_RECONN_COND; // Retry conditionally
+        ++admission_stats.rejected_requests;
     }
+    const int inflight_requests = admission_stats.inflight_requests;
+    const int64_t inflight_bytes = admission_stats.inflight_bytes;
+    pthread_mutex_unlock(&g_admission_mutex);
+    if (admitted)
+        return true;
+
+    errinfo->errcode = ERROR_ADMISSION_REJECTED;
+    errinfo->raw_errmsg = format_string("[%s][%s:%d] %s with %d requests and %" PRId64 " bytes in flight",
+            get_mode_str(), node.first.c_str(), node.second, shed? "shed": "rejected", inflight_requests, inflight_bytes);
+    errinfo->errmsg = format_string("[R3C_CMD][%s:%d] %s", __FILE__, __LINE__, errinfo->raw_errmsg.c_str());
+    if (_enable_debug_log)
+        (*g_debug_log)("[ADMISSION] %s\n", errinfo->errmsg.c_str());
+    return false;
 }
 
-CRedisClient::HandleResult
-CRedisClient::handle_redis_reply(
-        int64_t cost_us,
-        CRedisNode* redis_node,
-        const CommandArgs& command_args,
-        const redisReply* redis_reply,
-        struct ErrorInfo* errinfo)
+void CRedisClient::finish_request(const Node& node, int64_t bytes)
 {
-    redis_node->reset_conn_errors();
+    pthread_mutex_lock(&g_admission_mutex);
+    struct AdmissionStats& admission_stats = (*g_admission_stats)[node];
+    --admission_stats.inflight_requests;
+    admission_stats.inflight_bytes -= bytes;
+    --g_total_inflight_requests;
+    pthread_cond_broadcast(&g_admission_cond);
+    pthread_mutex_unlock(&g_admission_mutex);
+}
 
-    if (redis_reply->type != REDIS_REPLY_ERROR)
-        return HR_SUCCESS;
-    else
-        return handle_redis_replay_error(cost_us, redis_node, command_args, redis_reply, errinfo);
+void CRedisClient::enable_priority_lanes(const PriorityLaneOptions& priority_lane_options)
+{
+    _priority_lane_options = priority_lane_options;
+    _priority_lanes = true;
 }
 
-CRedisClient::HandleResult
-CRedisClient::handle_redis_replay_error(
-        int64_t cost_us,
-        CRedisNode* redis_node,
-        const CommandArgs& command_args,
-        const redisReply* redis_reply,
-        struct ErrorInfo* errinfo)
+void CRedisClient::disable_priority_lanes()
 {
-    // ASK
-    // NOAUTH Authentication required
-    // MOVED 6474 127.0.0.1:6380
-    // WRONGTYPE Operation against a key holding the wrong kind of value
-    // CLUSTERDOWN The cluster is down
-    // NOSCRIPT No matching script. Please use EVAL.
-    //
-    // ERR Error running script (call to f_64b2246244d60088e7351656c216c00cb1d7d2fd) : @user_script:1: @user_script: 1: Lua script attempted to access a non local key in a cluster node
-    extract_errtype(redis_reply, &errinfo->errtype);
-    errinfo->errcode = ERROR_COMMAND;
-    errinfo->raw_errmsg = format_string("[%s][cost:%ldus] %s", redis_node->str().c_str(), cost_us, redis_reply->str);
-    errinfo->errmsg = format_string("[R3C_REPLAY_ERROR][%s:%d][%s] %s", __FILE__, __LINE__, command_args.get_command().c_str(), errinfo->raw_errmsg.c_str());
-    if (_enable_error_log)
-        (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+    std::vector<CRedisNode*> redis_nodes;
 
-    // EVAL不会返回“MOVED”的错误，需特别处理
-    if (is_clusterdown_error(errinfo->errtype))
-    {
-        return HR_RETRY_UNCOND;
-    }
-    else if (is_ask_error(errinfo->errtype))
-    {
-        // ASK 6474 127.0.0.1:6380
-        //
-        // 如下所示，如果此时向10.212.2.72:6379请求slot为14148的keys时，将得到：
-        // ASK 6474 10.212.2.71:6381
-        // 其中ec19be9a50b5416999ac0305c744d9b6c957c18d为10.212.2.71:6381的NodeId
-        // e008649f6f8340a495fc860f7a9a8155f91fcb93 10.212.2.72:6379@16379 myself,master - 0 1547374698000 35 connected 5461-10922 14148 [14148->-ec19be9a50b5416999ac0305c744d9b6c957c18d]
-        return HR_REDIRECT;
-    }
-    else if (is_moved_error(errinfo->errtype))
+    _priority_lanes = false;
+    get_all_redis_nodes(&redis_nodes);
+    for (std::vector<CRedisNode*>::size_type i=0; i<redis_nodes.size(); ++i)
+        redis_nodes[i]->close_bulk_lane();
+}
+
+bool CRedisClient::acquire_bulk_lane(const Node& node, struct ErrorInfo* errinfo)
+{
+    const int max_inflight_bulk_commands = _priority_lane_options.max_inflight_bulk_commands;
+    if (max_inflight_bulk_commands <= 0)
     {
-        // MOVED 6474 127.0.0.1:6380
-        //
-        //Node ask_node;
-        //parse_moved_string(redis_reply->str, &ask_node);
-        redis_node->set_conn_errors(2019); // Trigger to refresh master nodes
-        return HR_RETRY_UNCOND;
+        // 不限时也计数，以便release时对称
+        pthread_mutex_lock(&g_bulk_commands_mutex);
+        ++(*g_bulk_commands)[node];
+        pthread_mutex_unlock(&g_bulk_commands_mutex);
+        return true;
     }
-    else
+
+    struct timespec ts;
+    get_timedwait_deadline(_priority_lane_options.max_wait_milliseconds, &ts);
+
+    int inflight_bulk_commands = 0;
+    pthread_mutex_lock(&g_bulk_commands_mutex);
+    for (;;)
     {
-        return HR_ERROR;
+        // 等待期间计数可能被删除，每次重新查找
+        int& num_bulk_commands = (*g_bulk_commands)[node];
+        inflight_bulk_commands = num_bulk_commands;
+        if (num_bulk_commands < max_inflight_bulk_commands)
+        {
+            ++num_bulk_commands;
+            break;
+        }
+        if (ETIMEDOUT == pthread_cond_timedwait(&g_bulk_commands_cond, &g_bulk_commands_mutex, &ts))
+            break;
     }
+    pthread_mutex_unlock(&g_bulk_commands_mutex);
+    if (inflight_bulk_commands < max_inflight_bulk_commands)
+        return true;
+
+    errinfo->errcode = ERROR_BULK_LANE_BUSY;
+    errinfo->raw_errmsg = format_string("[%s][%s:%d] %d bulk commands in flight", get_mode_str(), node.first.c_str(), node.second, inflight_bulk_commands);
+    errinfo->errmsg = format_string("[R3C_CMD][%s:%d] %s", __FILE__, __LINE__, errinfo->raw_errmsg.c_str());
+    if (_enable_error_log)
+        (*g_error_log)("[BULK_LANE_BUSY] %s\n", errinfo->errmsg.c_str());
+    return false;
 }
 
-void CRedisClient::fini()
+void CRedisClient::release_bulk_lane(const Node& node)
 {
-    clear_all_master_nodes();
+    pthread_mutex_lock(&g_bulk_commands_mutex);
+    std::map<Node, int>::iterator iter = g_bulk_commands->find(node);
+    if (iter != g_bulk_commands->end() && --iter->second <= 0)
+        g_bulk_commands->erase(iter);
+    pthread_cond_broadcast(&g_bulk_commands_cond);
+    pthread_mutex_unlock(&g_bulk_commands_mutex);
 }
 
-void CRedisClient::init()
+void CRedisClient::enable_adaptive_timeouts(const AdaptiveTimeoutOptions& adaptive_timeout_options)
 {
-    _enable_debug_log = true;
-    _enable_info_log = true;
-    _enable_error_log = true;
+    _adaptive_timeout_options = adaptive_timeout_options;
+    _adaptive_timeouts = true;
+}
 
-    try
-    {
-        const int num_nodes = parse_nodes(&_nodes, _raw_nodes_string);
-        struct ErrorInfo errinfo;
+void CRedisClient::disable_adaptive_timeouts()
+{
+    std::vector<CRedisNode*> redis_nodes;
 
-        if (0 == num_nodes)
+    _adaptive_timeouts = false;
+    // 恢复连接时的读写超时
+    get_all_redis_nodes(&redis_nodes);
+    for (std::vector<CRedisNode*>::size_type i=0; i<redis_nodes.size(); ++i)
+        redis_nodes[i]->reset_timeout((_readwrite_timeout_milliseconds>0)? _readwrite_timeout_milliseconds: 0);
+}
+
+int CRedisClient::get_adaptive_timeout(CRedisNode* redis_node, int command_class, int num_timeouts)
+{
+    const int readwrite_timeout_milliseconds = (_readwrite_timeout_milliseconds>0)? _readwrite_timeout_milliseconds: 0;
+    const int max_timeout_milliseconds = (_adaptive_timeout_options.max_timeout_milliseconds>0)? _adaptive_timeout_options.max_timeout_milliseconds: readwrite_timeout_milliseconds;
+    if (COMMAND_CLASS_BLOCKING == command_class)
+        return readwrite_timeout_milliseconds;
+
+    const CLatencyHistogram* latency_histogram = redis_node->get_latency_histogram(static_cast<CommandClass>(command_class));
+    if (latency_histogram->get_num_samples() < _adaptive_timeout_options.min_samples)
+        return max_timeout_milliseconds;
+
+    const int64_t percentile_us = latency_histogram->get_percentile(_adaptive_timeout_options.percentile);
+    int64_t timeout_milliseconds = (percentile_us * _adaptive_timeout_options.multiplier + 999) / 1000;
+    if (timeout_milliseconds < _adaptive_timeout_options.min_timeout_milliseconds)
+        timeout_milliseconds = _adaptive_timeout_options.min_timeout_milliseconds;
+    timeout_milliseconds <<= std::min(num_timeouts, 16);
+    if (max_timeout_milliseconds>0 && timeout_milliseconds>max_timeout_milliseconds)
+        timeout_milliseconds = max_timeout_milliseconds;
+    return static_cast<int>(std::min<int64_t>(timeout_milliseconds, std::numeric_limits<int>::max()));
+}
+
+void CRedisClient::enable_write_buffer(const WriteBufferOptions& write_buffer_options)
+{
+    for (std::set<std::string>::const_iterator iter=write_buffer_options.commands.begin(); iter!=write_buffer_options.commands.end(); ++iter)
+    {
+        if (is_repeat_unsafe_command(*iter))
         {
+            struct ErrorInfo errinfo;
             errinfo.errcode = ERROR_PARAMETER;
-            errinfo.errmsg = format_string("[R3C_INIT][%s:%d] parameter[nodes] error: %s", __FILE__, __LINE__, _raw_nodes_string.c_str());
-            errinfo.raw_errmsg = format_string("parameter[nodes] error: %s", _raw_nodes_string.c_str());
+            errinfo.raw_errmsg = format_string("%s is not safe to repeat and can not be buffered", iter->c_str());
+            errinfo.errmsg = format_string("[R3C_WRITE_BUFFER][%s:%d] %s", __FILE__, __LINE__, errinfo.raw_errmsg.c_str());
             if (_enable_error_log)
                 (*g_error_log)("%s\n", errinfo.errmsg.c_str());
             THROW_REDIS_EXCEPTION(errinfo);
         }
-        else if (1 == num_nodes)
-        {
-            if (!init_standlone(&errinfo))
-                THROW_REDIS_EXCEPTION(errinfo);
-        }
-        else
-        {
-            if (!init_cluster(&errinfo))
-                THROW_REDIS_EXCEPTION(errinfo);
-        }
-    }
-    catch (...)
-    {
-        clear_all_master_nodes();
-        throw;
     }
+    _write_buffer_options = write_buffer_options;
+    _write_buffer = true;
 }
 
-bool CRedisClient::init_standlone(struct ErrorInfo* errinfo)
+void CRedisClient::disable_write_buffer()
 {
-    const Node& node = _nodes[0];
-    _nodes_string = _raw_nodes_string;
-
-    redisContext* redis_context = connect_redis_node(node, errinfo, false);
-    if (NULL == redis_context)
+    if (_num_buffered_writes > 0)
     {
-        return false;
+        // 尽量送出，超出时间的才丢弃
+        flush_write_buffer(_write_buffer_options.final_flush_milliseconds);
     }
-    else
+    _write_buffer = false;
+    if (_num_buffered_writes > 0)
     {
-        CRedisMasterNode* redis_node = new CRedisMasterNode(std::string(""), node, redis_context);
-        const std::pair<RedisMasterNodeTable::iterator, bool> ret =
-                _redis_master_nodes.insert(std::make_pair(node, redis_node));
-        R3C_ASSERT(ret.second);
-        return true;
+        if (_enable_error_log)
+            (*g_error_log)("[R3C_WRITE_BUFFER][%s:%d][%s] %d buffered writes dropped\n", __FILE__, __LINE__, get_mode_str(), _num_buffered_writes);
+        _num_dropped_writes += _num_buffered_writes;
+        _num_buffered_writes = 0;
     }
+    _buffered_writes.clear();
 }
 
-bool CRedisClient::init_cluster(struct ErrorInfo* errinfo)
+int CRedisClient::flush_write_buffer(int timeout_milliseconds)
 {
-    const int num_nodes = static_cast<int>(_nodes.size());
-    const uint64_t base = reinterpret_cast<uint64_t>(this);
-    uint64_t seed = get_random_number(base);
+    if (_flushing_writes)
+        return _num_buffered_writes;
 
-    _slot2node.resize(CLUSTER_SLOTS);
-    for (int i=0; i<num_nodes; ++i)
+    const int64_t now_milliseconds = get_monotonic_milliseconds();
+    std::set<Node> blocked_nodes; // 本次已不可用的node，它的其它slot不再去等待超时
+    bool timed_out = false;
+    _flushing_writes = true;
+    for (std::map<int, std::deque<struct BufferedWrite> >::iterator iter=_buffered_writes.begin(); iter!=_buffered_writes.end();)
     {
-        const int j = static_cast<int>(++seed % num_nodes);
-        const Node& node = _nodes[j];
-        std::vector<struct NodeInfo> nodes_info;
+        std::deque<struct BufferedWrite>& buffered_writes = iter->second;
 
-        redisContext* redis_context = connect_redis_node(node, errinfo, false);
-        if (NULL == redis_context)
-        {
-            continue;
-        }
-        if (!list_cluster_nodes(&nodes_info, errinfo, redis_context, node))
+        bool blocked = false;
+
+        drop_expired_writes(&buffered_writes, now_milliseconds);
+        if (!blocked_nodes.empty() && iter->first>=0)
         {
-            redisFree(redis_context);
-            continue;
+            const uint16_t table_index = _slot2index[iter->first];
+            blocked = table_index!=INVALID_NODE_INDEX && blocked_nodes.count(_master_node_array[table_index]->get_node())>0;
         }
-        else
+        while (!blocked && !buffered_writes.empty())
         {
-            std::vector<struct NodeInfo> replication_nodes_info;
-
-            redisFree(redis_context);
-            redis_context = NULL;
-            if (init_master_nodes(nodes_info, &replication_nodes_info, errinfo))
+            const struct BufferedWrite& buffered_write = buffered_writes.front();
+            CommandArgs cmd_args;
+            Node node;
+            cmd_args.set_key(buffered_write.key);
+            cmd_args.set_command(buffered_write.args[0]);
+            cmd_args.add_args(buffered_write.args);
+            cmd_args.final();
+
+            if (timeout_milliseconds>=0 && get_monotonic_milliseconds()-now_milliseconds>=timeout_milliseconds)
             {
-                if (_read_policy != RP_ONLY_MASTER)
-                    init_replica_nodes(replication_nodes_info);
+                timed_out = true;
                 break;
             }
+            _flush_blocked = false;
+            try
+            {
+                redis_command(false, 0, buffered_write.key, cmd_args, &node);
+            }
+            catch (CRedisException& ex)
+            {
+                // slot仍不可用，保留它及其后的写
+                if (_flush_blocked)
+                {
+                    blocked_nodes.insert(node);
+                    break;
+                }
+                // 写本身出错（如WRONGTYPE），调用者已不再等待回复，只能记录后丢弃
+                if (_enable_error_log)
+                    (*g_error_log)("[R3C_WRITE_BUFFER][%s:%d] buffered write dropped: %s\n", __FILE__, __LINE__, ex.str().c_str());
+                ++_num_dropped_writes;
+            }
+            buffered_writes.pop_front();
+            --_num_buffered_writes;
         }
+        if (buffered_writes.empty())
+            _buffered_writes.erase(iter++);
+        else
+            ++iter;
+        if (timed_out)
+            break;
     }
-
-    return !_redis_master_nodes.empty();
+    _flushing_writes = false;
+    _flush_blocked = false;
+    // 仍不可用时，逐次加倍重发间隔，避免请求频繁去等待连接超时
+    if (_buffered_writes.empty())
+        _write_buffer_flush_interval = WRITE_BUFFER_FLUSH_INTERVAL_MILLISECONDS;
+    else if (!blocked_nodes.empty())
+        _write_buffer_flush_interval = std::min<int>(_write_buffer_flush_interval*2, WRITE_BUFFER_MAX_FLUSH_INTERVAL_MILLISECONDS);
+    _write_buffer_flush_time = _buffered_writes.empty()? 0: get_monotonic_milliseconds()+_write_buffer_flush_interval;
+    return _num_buffered_writes;
 }
 
-bool CRedisClient::init_master_nodes(
-        const std::vector<struct NodeInfo>& nodes_info,
-        std::vector<struct NodeInfo>* replication_nodes_info,
-        struct ErrorInfo* errinfo)
+bool CRedisClient::write_or_buffer(const std::string& key, const std::vector<std::string>& args, RedisReplyHelper* redis_reply, Node* which, int num_retries)
 {
-    int connected = 0; // 成功连接的master个数
+    CommandArgs cmd_args;
+    RedisReplyHelper reply;
+    cmd_args.set_key(key);
+    cmd_args.set_command(args.empty()? std::string(): args[0]);
+    cmd_args.add_args(args);
+    cmd_args.final();
 
-    if (nodes_info.size() > 1)
+    _buffering_write = true;
+    try
     {
-        _nodes_string.clear();
+        reply = redis_command(false, num_retries, key, cmd_args, which);
     }
-    else
+    catch (CRedisException&)
     {
-        _nodes_string = _raw_nodes_string;
+        _buffering_write = false;
+        throw;
     }
-    for (std::vector<struct NodeInfo>::size_type i=0; i<nodes_info.size(); ++i) // Traversing all master nodes
-    {
-        const struct NodeInfo& nodeinfo = nodes_info[i];
+    _buffering_write = false;
+    if (!reply)
+        return false;
+    if (redis_reply != NULL)
+        *redis_reply = reply;
+    return true;
+}
 
-        if (nodes_info.size() > 1)
-        {
-            update_nodes_string(nodeinfo);
-        }
-        if (nodeinfo.is_master() && !nodeinfo.is_fail())
-        {
-            update_slots(nodeinfo);
-            if (add_master_node(nodeinfo, errinfo))
-                ++connected;
-        }
-        else if (nodeinfo.is_replica() && !nodeinfo.is_fail())
-        {
-            replication_nodes_info->push_back(nodeinfo);
-        }
+bool CRedisClient::buffer_write(int slot, const std::string& key, const CommandArgs& command_args, int64_t now_milliseconds, struct ErrorInfo* errinfo)
+{
+    std::deque<struct BufferedWrite>& buffered_writes = _buffered_writes[slot];
+
+    drop_expired_writes(&buffered_writes, now_milliseconds);
+    if (_num_buffered_writes >= _write_buffer_options.max_commands)
+    {
+        if (buffered_writes.empty())
+            _buffered_writes.erase(slot);
+        errinfo->errcode = ERROR_WRITE_BUFFER_FULL;
+        errinfo->raw_errmsg = format_string("[%s][%s] write buffer is full with %d writes", command_args.get_command().c_str(), get_mode_str(), _num_buffered_writes);
+        errinfo->errmsg = format_string("[R3C_CMD][%s:%d] %s", __FILE__, __LINE__, errinfo->raw_errmsg.c_str());
+        if (_enable_error_log)
+            (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+        return false;
     }
 
-    // 至少要有一个能够连接上
-    return connected > 0;
+    const int argc = command_args.get_argc();
+    const char** argv = command_args.get_argv();
+    const size_t* argvlen = command_args.get_argvlen();
+    buffered_writes.push_back(BufferedWrite());
+    struct BufferedWrite& buffered_write = buffered_writes.back();
+    buffered_write.key = key;
+    buffered_write.args.resize(argc);
+    for (int i=0; i<argc; ++i)
+        buffered_write.args[i].assign(argv[i], argvlen[i]);
+    buffered_write.buffered_time = now_milliseconds;
+    if (0 == _num_buffered_writes++)
+        _write_buffer_flush_time = now_milliseconds + _write_buffer_flush_interval;
+    if (_enable_debug_log)
+    {
+        (*g_debug_log)("[R3C_WRITE_BUFFER][%s:%d][%s][%s][slot:%d] buffered, %d writes\n",
+                __FILE__, __LINE__, get_mode_str(), command_args.get_command().c_str(), slot, _num_buffered_writes);
+    }
+    return true;
 }
 
-void CRedisClient::init_replica_nodes(const std::vector<struct NodeInfo>& replication_nodes_info)
+void CRedisClient::drop_expired_writes(std::deque<struct BufferedWrite>* buffered_writes, int64_t now_milliseconds)
 {
-    for (std::vector<struct NodeInfo>::size_type i=0; i<replication_nodes_info.size(); ++i)
+    while (!buffered_writes->empty() &&
+           now_milliseconds-buffered_writes->front().buffered_time > _write_buffer_options.max_delay_milliseconds)
     {
-        const struct NodeInfo& nodeinfo = replication_nodes_info[i];
-        const NodeId& master_nodeid = nodeinfo.master_id;
-        const NodeId& replica_nodeid = nodeinfo.id;
-        const Node& replica_node = nodeinfo.node;
-
-        CRedisMasterNode* redis_master_node = get_redis_master_node(master_nodeid);
-        if (redis_master_node != NULL)
+        if (_enable_error_log)
         {
-            struct ErrorInfo errinfo;
-            redisContext* redis_context = connect_redis_node(replica_node, &errinfo, true);
-            if (redis_context != NULL)
-            {
-                CRedisReplicaNode* redis_replica_node = new CRedisReplicaNode(replica_nodeid, replica_node, redis_context);
-                redis_master_node->add_replica_node(redis_replica_node);
-            }
+            (*g_error_log)("[R3C_WRITE_BUFFER][%s:%d][%s][%s] buffered write dropped after %dms\n",
+                    __FILE__, __LINE__, buffered_writes->front().args[0].c_str(), buffered_writes->front().key.c_str(),
+                    _write_buffer_options.max_delay_milliseconds);
         }
+        buffered_writes->pop_front();
+        --_num_buffered_writes;
+        ++_num_dropped_writes;
     }
 }
 
-void CRedisClient::update_slots(const struct NodeInfo& nodeinfo)
+void CRedisClient::signal_topology_refresher()
 {
-    for (SlotSegment::size_type i=0; i<nodeinfo.slots.size(); ++i)
+    pthread_mutex_lock(&_topology_entry->mutex);
+    if (!_topology_entry->refresh_signaled)
     {
-        const std::pair<int, int>& slot_segment = nodeinfo.slots[i];
-        for (int slot=slot_segment.first; slot<=slot_segment.second; ++slot)
-            _slot2node[slot] = nodeinfo.node;
+        _topology_entry->refresh_signaled = true;
+        pthread_cond_signal(&_topology_entry->cond);
     }
+    pthread_mutex_unlock(&_topology_entry->mutex);
 }
 
-// 几种需要刷新master情况：
-// 1) 遇到MOVED错误（可立即重刷）
-// 2) master挂起（能够连接，但不能服务，立即重刷一般无效，得等主从切换后）
-void CRedisClient::refresh_master_node_table(struct ErrorInfo* errinfo, const Node* error_node)
+// cluster_current_epoch increases on every failover and slot ownership change,
+// so an unchanged value means the topology need not be fetched
+bool CRedisClient::get_cluster_current_epoch(int64_t* current_epoch, struct ErrorInfo* errinfo)
 {
-    const int num_nodes = static_cast<int>(_redis_master_nodes.size());
-    uint64_t seed = reinterpret_cast<uint64_t>(this) - num_nodes;
-    const int k = static_cast<int>(seed % num_nodes);
-    RedisMasterNodeTable::iterator iter = _redis_master_nodes.begin();
+    CRedisMasterNode* redis_node = random_redis_master_node();
+    redisContext* redis_context = (NULL==redis_node)? NULL: connect_redis_node(redis_node, false, get_monotonic_milliseconds(), errinfo);
 
-    for (int i=0; i<k; ++i)
+    if (redis_context != NULL)
     {
-        ++iter;
-        if (iter == _redis_master_nodes.end())
-            iter = _redis_master_nodes.begin();
+        const RedisReplyHelper redis_reply = (redisReply*)redisCommand(redis_context, "CLUSTER INFO");
+
+        if (!redis_reply)
+        {
+            redis_node->close();
+        }
+        else if (REDIS_REPLY_STRING == redis_reply->type)
+        {
+            const char* epoch_str = strstr(redis_reply->str, "cluster_current_epoch:");
+            if (epoch_str != NULL)
+            {
+                *current_epoch = static_cast<int64_t>(atoll(epoch_str + sizeof("cluster_current_epoch:") - 1));
+                return true;
+            }
+        }
     }
-    for (int i=0; i<num_nodes; ++i)
+    return false;
+}
+
+// One thread per TopologyEntry, it refreshes through a client of its own
+// and publishes to the entry as any client does.
+// It also polls the replica offsets while any client enables replica lag check.
+void* CRedisClient::topology_refresher(void* arg)
+{
+    struct TopologyEntry* topology_entry = static_cast<struct TopologyEntry*>(arg);
+    CRedisClient* redis_client = NULL;
+    int64_t last_epoch = -1;
+    int64_t last_refresh_time = 0;
+    int64_t next_topology_poll_time = 0;
+    int64_t next_replication_poll_time = 0;
+
+    pthread_mutex_lock(&topology_entry->mutex);
+    while (topology_entry->num_refresh_clients>0 || topology_entry->num_lag_clients>0)
     {
-        const Node& node = iter->first;
-        CRedisMasterNode* redis_node = iter->second;
-        ++iter;
+        int64_t now = get_monotonic_milliseconds();
+        const bool refresh_topology = topology_entry->num_refresh_clients>0 && (topology_entry->refresh_signaled || next_topology_poll_time<=now);
+        const bool poll_replication = topology_entry->num_lag_clients>0 && next_replication_poll_time<=now;
+        if (!refresh_topology && !poll_replication)
+        {
+            // 醒来后重新检查，等待时长取两种轮询中较早的一个
+            int64_t wait_milliseconds = TOPOLOGY_POLL_INTERVAL_MILLISECONDS;
+            if (topology_entry->num_refresh_clients > 0)
+                wait_milliseconds = next_topology_poll_time - now;
+            if (topology_entry->num_lag_clients>0 && next_replication_poll_time-now<wait_milliseconds)
+                wait_milliseconds = next_replication_poll_time - now;
+
+            struct timespec ts;
+            get_timedwait_deadline(wait_milliseconds, &ts);
+            pthread_cond_timedwait(&topology_entry->cond, &topology_entry->mutex, &ts);
+            continue;
+        }
 
-        // error_node可能已是一个有问题的节点，所以最好避开它
-        if ((NULL==error_node) || (node!=*error_node))
+        const bool signaled = topology_entry->refresh_signaled;
+        const std::string raw_nodes_string = topology_entry->raw_nodes_string;
+        const std::string password = topology_entry->password;
+        const int connect_timeout_milliseconds = topology_entry->connect_timeout_milliseconds;
+        const int readwrite_timeout_milliseconds = topology_entry->readwrite_timeout_milliseconds;
+        const SocketOptions socket_options = topology_entry->socket_options;
+        if (refresh_topology)
+        {
+            // 清除信号须在拉取前，拉取期间的新信号留给下一轮
+            topology_entry->refresh_signaled = false;
+        }
+        pthread_mutex_unlock(&topology_entry->mutex);
+
+        try
         {
-            redisContext* redis_context = redis_node->get_redis_context();
+            struct ErrorInfo errinfo;
 
-            if (NULL == redis_context)
+            if (NULL == redis_client)
             {
-                redis_context = connect_redis_node(node, errinfo, false);
+                redis_client = new CRedisClient(raw_nodes_string, password, connect_timeout_milliseconds, readwrite_timeout_milliseconds, RP_ONLY_MASTER);
+                redis_client->disable_debug_log();
+                redis_client->set_socket_options(socket_options);
             }
-            if (redis_context != NULL)
+            if (refresh_topology)
             {
-                std::vector<struct NodeInfo> nodes_info;
+                // 限频：信号再多，两次刷新间隔也不小于TOPOLOGY_REFRESH_INTERVAL_MILLISECONDS
+                const int64_t wait_milliseconds = last_refresh_time + TOPOLOGY_REFRESH_INTERVAL_MILLISECONDS - get_monotonic_milliseconds();
+                int64_t current_epoch = -1;
+
+                if (wait_milliseconds > 0)
+                    millisleep(static_cast<int>(wait_milliseconds));
+                redis_client->get_cluster_current_epoch(&current_epoch, &errinfo);
+                if (signaled || current_epoch!=last_epoch || -1==current_epoch)
+                {
+                    redis_client->apply_shared_topology();
+                    redis_client->refresh_master_node_table(&errinfo, NULL);
+                    last_refresh_time = get_monotonic_milliseconds();
+                    last_epoch = current_epoch;
+                }
+                next_topology_poll_time = get_monotonic_milliseconds() + TOPOLOGY_POLL_INTERVAL_MILLISECONDS;
+            }
+            if (poll_replication)
+            {
+                struct Replication* replication = new struct Replication;
 
-                redis_node->set_redis_context(redis_context);
-                if (list_cluster_nodes(&nodes_info, errinfo, redis_context, node))
+                // 未开启后台刷新时，也要跟上其它client发布的拓扑
+                redis_client->apply_shared_topology();
+                if (!redis_client->poll_replication(replication))
                 {
-                    std::vector<struct NodeInfo> replication_nodes_info;
-                    clear_and_update_master_nodes(nodes_info, &replication_nodes_info, errinfo);
-                    if (_read_policy != RP_ONLY_MASTER)
-                        init_replica_nodes(replication_nodes_info);
-                    break; // Continue is not safe, because `clear_and_update_master_nodes` will modify _redis_master_nodes
+                    delete replication;
                 }
+                else
+                {
+                    pthread_mutex_lock(&topology_entry->mutex);
+                    topology_entry->replication.reset(replication);
+                    __sync_fetch_and_add(&topology_entry->replication_version, 1);
+                    pthread_mutex_unlock(&topology_entry->mutex);
+                }
+                next_replication_poll_time = get_monotonic_milliseconds() + REPLICATION_POLL_INTERVAL_MILLISECONDS;
             }
         }
-        if (iter == _redis_master_nodes.end())
+        catch (CRedisException& ex)
         {
-            iter = _redis_master_nodes.begin();
+            // 集群不可用时new CRedisClient会抛异常，下一轮再试
+            (*g_error_log)("[R3C_REFRESHER][%s:%d] %s\n", __FILE__, __LINE__, ex.str().c_str());
+            now = get_monotonic_milliseconds();
+            if (refresh_topology)
+            {
+                last_refresh_time = now;
+                next_topology_poll_time = now + TOPOLOGY_REFRESH_INTERVAL_MILLISECONDS;
+            }
+            if (poll_replication)
+                next_replication_poll_time = now + REPLICATION_POLL_INTERVAL_MILLISECONDS;
         }
+        pthread_mutex_lock(&topology_entry->mutex);
     }
+    topology_entry->refresher_running = false;
+    pthread_mutex_unlock(&topology_entry->mutex);
+
+    delete redis_client;
+    return NULL;
 }
 
-void CRedisClient::clear_and_update_master_nodes(
-        const std::vector<struct NodeInfo>& nodes_info,
-        std::vector<struct NodeInfo>* replication_nodes_info,
-        struct ErrorInfo* errinfo)
+// Parses INFO replication of every master, for example:
+// slave0:ip=127.0.0.1,port=6380,state=online,offset=1024,lag=0
+// master_repl_offset:1024
+// Returns false if no master replied.
+bool CRedisClient::poll_replication(struct Replication* replication)
 {
-    NodeInfoTable master_nodeinfo_table;
-    std::string nodes_string;
+    int num_replied = 0;
 
-    if (nodes_info.size() > 1)
-    {
-        _nodes_string.clear();
-    }
-    for (std::vector<struct NodeInfo>::size_type i=0; i<nodes_info.size(); ++i) // Traversing all master nodes
+    for (RedisMasterNodeTable::iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
     {
-        const struct NodeInfo& nodeinfo = nodes_info[i];
+        CRedisMasterNode* redis_master_node = iter->second;
+        struct ErrorInfo errinfo;
+        redisContext* redis_context = connect_redis_node(redis_master_node, false, get_monotonic_milliseconds(), &errinfo);
+        if (NULL == redis_context)
+            continue;
 
-        if (nodes_info.size() > 1)
+        const RedisReplyHelper redis_reply = (redisReply*)redisCommand(redis_context, "INFO replication");
+        if (!redis_reply)
         {
-            update_nodes_string(nodeinfo);
+            redis_master_node->close();
+            continue;
         }
-        if (nodeinfo.is_master() && !nodeinfo.is_fail())
+        if (redis_reply->type != REDIS_REPLY_STRING)
+            continue;
+
+        std::vector<std::string> lines;
+        std::vector<Node> replica_nodes;
+        int64_t master_offset = 0;
+        split(&lines, std::string(redis_reply->str, redis_reply->len), "\r\n");
+        for (std::vector<std::string>::size_type i=0; i<lines.size(); ++i)
         {
-            // 可能只是一个或多个slot从一个master迁到另一个master，
-            // 简单的全量更新slot和node间的关系，
-            // 如果一对master和replica同时异常，则_slot2node会出现空洞
-            update_slots(nodeinfo);
-            master_nodeinfo_table.insert(std::make_pair(nodeinfo.node, nodeinfo));
+            const std::string& line = lines[i];
 
-            if (_redis_master_nodes.count(nodeinfo.node) <= 0)
+            if (0 == line.compare(0, sizeof("master_repl_offset:")-1, "master_repl_offset:"))
             {
-                // New master
-                add_master_node(nodeinfo, errinfo);
+                master_offset = static_cast<int64_t>(atoll(line.c_str() + sizeof("master_repl_offset:") - 1));
+            }
+            else if (0==line.compare(0, sizeof("slave")-1, "slave") && line.find(":ip=")!=std::string::npos)
+            {
+                std::vector<std::string> fields;
+                struct ReplicaOffset replica_offset;
+                Node node;
+
+                replica_offset.offset = 0;
+                replica_offset.lag_seconds = 0;
+                split(&fields, line.substr(line.find(':')+1), ",");
+                for (std::vector<std::string>::size_type j=0; j<fields.size(); ++j)
+                {
+                    const std::string::size_type pos = fields[j].find('=');
+                    if (pos == std::string::npos)
+                        continue;
+                    const std::string name = fields[j].substr(0, pos);
+                    const std::string value = fields[j].substr(pos+1);
+
+                    if (name == "ip")
+                        node.first = value;
+                    else if (name == "port")
+                        node.second = static_cast<uint16_t>(atoi(value.c_str()));
+                    else if (name == "state")
+                        replica_offset.state = value;
+                    else if (name == "offset")
+                        replica_offset.offset = static_cast<int64_t>(atoll(value.c_str()));
+                    else if (name == "lag")
+                        replica_offset.lag_seconds = atoi(value.c_str());
+                }
+                replication->replicas[node] = replica_offset;
+                replica_nodes.push_back(node);
             }
         }
-        else if (nodeinfo.is_replica() && !nodeinfo.is_fail())
-        {
-            replication_nodes_info->push_back(nodeinfo);
-        }
+        for (std::vector<Node>::size_type i=0; i<replica_nodes.size(); ++i)
+            replication->replicas[replica_nodes[i]].master_offset = master_offset;
+        ++num_replied;
     }
 
-    clear_invalid_master_nodes(master_nodeinfo_table);
+    replication->poll_time = get_monotonic_milliseconds();
+    return num_replied > 0;
 }
 
-void CRedisClient::clear_invalid_master_nodes(const NodeInfoTable& master_nodeinfo_table)
+// Marks the replicas beyond the lag bound, or clears the marks if the check is disabled
+void CRedisClient::apply_replication(int64_t now_milliseconds)
 {
-    for (RedisMasterNodeTable::iterator node_iter=_redis_master_nodes.begin(); node_iter!=_redis_master_nodes.end();)
-    {
-        const Node& node = node_iter->first;
-        const NodeInfoTable::const_iterator info_iter = master_nodeinfo_table.find(node);
+    const int64_t stale_milliseconds = 3 * static_cast<int64_t>(REPLICATION_POLL_INTERVAL_MILLISECONDS);
+    ReplicationPtr replication;
+    bool stale = true;
 
-        if (info_iter != master_nodeinfo_table.end())
-        {
-            // 保持不变，仍然是master
-            ++node_iter;
-        }
-        else
-        {
-            CRedisMasterNode* master_node = node_iter->second;
-            const NodeId nodeid = master_node->get_nodeid();
-            if (_enable_info_log)
-                (*g_info_log)("[R3C_CLEAR_INVALID][%s:%d] %s is removed because it is not a master now\n", __FILE__, __LINE__, master_node->str().c_str());
+    pthread_mutex_lock(&_topology_entry->mutex);
+    replication = _topology_entry->replication;
+    _replication_version = _topology_entry->replication_version;
+    pthread_mutex_unlock(&_topology_entry->mutex);
 
-#if __cplusplus < 201103L
-            _redis_master_nodes.erase(node_iter++);
-#else
-            node_iter = _redis_master_nodes.erase(node_iter);
-#endif
-            delete master_node;
-            _redis_master_nodes_id.erase(nodeid);
-        }
+    if (replication && now_milliseconds-replication->poll_time<=stale_milliseconds)
+    {
+        stale = false;
+        _replication_expire_time = replication->poll_time + stale_milliseconds + 1;
+    }
+    else
+    {
+        // 轮询跟不上时所有replica都视为延迟过大，定期重新检查
+        _replication_expire_time = now_milliseconds + REPLICATION_POLL_INTERVAL_MILLISECONDS;
     }
-}
 
-bool CRedisClient::add_master_node(const NodeInfo& nodeinfo, struct ErrorInfo* errinfo)
-{
-    const NodeId& nodeid = nodeinfo.id;
-    const Node& node = nodeinfo.node;
-    redisContext* redis_context = connect_redis_node(node, errinfo, false);
-    CRedisMasterNode* master_node = new CRedisMasterNode(nodeid, node, redis_context);
+    for (RedisMasterNodeTable::iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
+    {
+        std::vector<CRedisReplicaNode*> redis_replica_nodes;
+        iter->second->get_replica_nodes(&redis_replica_nodes);
 
-    const std::pair<RedisMasterNodeTable::iterator, bool> ret =
-            _redis_master_nodes.insert(std::make_pair(node, master_node));
-    R3C_ASSERT(ret.second);
-    if (!ret.second)
-        delete master_node;
-    _redis_master_nodes_id[nodeid] = node;
-    return redis_context != NULL;
+        for (std::vector<CRedisReplicaNode*>::size_type i=0; i<redis_replica_nodes.size(); ++i)
+        {
+            CRedisReplicaNode* redis_replica_node = redis_replica_nodes[i];
+            bool lagging = false;
+
+            if (_replica_lag_check)
+            {
+                std::map<Node, struct ReplicaOffset>::const_iterator offset_iter;
+
+                if (stale || (offset_iter=replication->replicas.find(redis_replica_node->get_node()))==replication->replicas.end())
+                {
+                    lagging = true;
+                }
+                else
+                {
+                    const struct ReplicaOffset& replica_offset = offset_iter->second;
+                    redis_replica_node->update_replication_offset(replica_offset.offset);
+                    lagging = (replica_offset.state != "online") ||
+                              (_replica_lag_options.max_lag_bytes>=0 && replica_offset.master_offset-replica_offset.offset>_replica_lag_options.max_lag_bytes) ||
+                              (_replica_lag_options.max_lag_seconds>=0 && replica_offset.lag_seconds>_replica_lag_options.max_lag_seconds);
+                }
+            }
+            if (lagging!=redis_replica_node->is_lagging() && _enable_debug_log)
+            {
+                (*g_debug_log)("[R3C_LAG][%s:%d] %s lagging: %d\n",
+                        __FILE__, __LINE__, node2string(redis_replica_node->get_node()).c_str(), lagging? 1: 0);
+            }
+            redis_replica_node->set_lagging(lagging);
+        }
+    }
 }
 
-void CRedisClient::clear_all_master_nodes()
+bool CRedisClient::need_replica_nodes() const
 {
-    for (RedisMasterNodeTable::iterator iter=_redis_master_nodes.begin(); iter!=_redis_master_nodes.end(); ++iter)
-    {
-        CRedisMasterNode* master_node = iter->second;
-        delete master_node;
-    }
-    _redis_master_nodes.clear();
-    _redis_master_nodes_id.clear();
+    return _warm_standby || (_read_policy != RP_ONLY_MASTER);
 }
 
 void CRedisClient::update_nodes_string(const NodeInfo& nodeinfo)
@@ -5170,6 +8923,7 @@ void CRedisClient::update_nodes_string(const NodeInfo& nodeinfo)
 redisContext* CRedisClient::connect_redis_node(const Node& node, struct ErrorInfo* errinfo, bool readonly) const
 {
     redisContext* redis_context = NULL;
+    std::string ip;
 
     errinfo->clear();
     if (_enable_debug_log)
@@ -5177,16 +8931,32 @@ redisContext* CRedisClient::connect_redis_node(const Node& node, struct ErrorInf
         (*g_debug_log)("[R3C_CONN][%s:%d] To connect %s with timeout: %dms\n",
                 __FILE__, __LINE__, node2string(node).c_str(), _connect_timeout_milliseconds);
     }
+    if (!is_unix_socket_node(node) && !resolve_host(node.first, &ip, &errinfo->raw_errmsg))
+    {
+        // hiredis不再自己解析域名，解析结果由进程级缓存提供
+        errinfo->errcode = ERROR_INIT_REDIS_CONN;
+        errinfo->errmsg = format_string("[R3C_CONN][%s:%d][%s:%d] %s",
+                __FILE__, __LINE__, node.first.c_str(), node.second, errinfo->raw_errmsg.c_str());
+        if (_enable_error_log)
+            (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+        return NULL;
+    }
     if (_connect_timeout_milliseconds <= 0)
     {
-        redis_context = redisConnect(node.first.c_str(), node.second);
+        if (is_unix_socket_node(node))
+            redis_context = redisConnectUnix(node.first.c_str());
+        else
+            redis_context = redisConnect(ip.c_str(), node.second);
     }
     else
     {
         struct timeval timeout;
         timeout.tv_sec = _connect_timeout_milliseconds / 1000;
         timeout.tv_usec = (_connect_timeout_milliseconds % 1000) * 1000;
-        redis_context = redisConnectWithTimeout(node.first.c_str(), node.second, timeout);
+        if (is_unix_socket_node(node))
+            redis_context = redisConnectUnixWithTimeout(node.first.c_str(), timeout);
+        else
+            redis_context = redisConnectWithTimeout(ip.c_str(), node.second, timeout);
     }
 
     if (NULL == redis_context)
@@ -5230,6 +9000,11 @@ redisContext* CRedisClient::connect_redis_node(const Node& node, struct ErrorInf
         }
         redisFree(redis_context);
         redis_context = NULL;
+        if (ip != node.first)
+        {
+            // The address of the host may have changed, such as a restarted pod
+            invalidate_resolved_host(node.first);
+        }
     }
     else
     {
@@ -5238,7 +9013,12 @@ redisContext* CRedisClient::connect_redis_node(const Node& node, struct ErrorInf
             (*g_debug_log)("[R3C_CONN][%s:%d] Connect %s successfully with readwrite timeout: %dms\n",
                     __FILE__, __LINE__, node2string(node).c_str(), _readwrite_timeout_milliseconds);
         }
-        if (_readwrite_timeout_milliseconds > 0)
+        if (!apply_socket_options(redis_context, node, errinfo))
+        {
+            redisFree(redis_context);
+            redis_context = NULL;
+        }
+        else if (_readwrite_timeout_milliseconds > 0)
         {
             struct timeval data_timeout;
             data_timeout.tv_sec = _readwrite_timeout_milliseconds / 1000;
@@ -5293,7 +9073,7 @@ redisContext* CRedisClient::connect_redis_node(const Node& node, struct ErrorInf
             }
         }
     }
-    if (readonly && redis_context!=NULL)
+    if (readonly && redis_context!=NULL && cluster_mode())
     {
         const RedisReplyHelper redis_reply = (redisReply*)redisCommand(redis_context, "READONLY");
 
@@ -5331,27 +9111,125 @@ redisContext* CRedisClient::connect_redis_node(const Node& node, struct ErrorInf
     return redis_context;
 }
 
+bool CRedisClient::apply_socket_options(redisContext* redis_context, const Node& node, struct ErrorInfo* errinfo) const
+{
+    const int fd = redis_context->fd;
+    const char* option_name = NULL;
+    int errcode = 0;
+
+    if (is_unix_socket_node(node))
+    {
+        return true;
+    }
+    do
+    {
+        // hiredis always turns TCP_NODELAY on
+        const int nodelay = _socket_options.tcp_nodelay? 1: 0;
+        if (-1 == setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay)))
+        {
+            errcode = errno;
+            option_name = "TCP_NODELAY";
+            break;
+        }
+        if (_socket_options.keepalive_idle_seconds > 0)
+        {
+            const int keepalive = 1;
+            if (-1 == setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)))
+            {
+                errcode = errno;
+                option_name = "SO_KEEPALIVE";
+                break;
+            }
+#if defined(TCP_KEEPIDLE)
+            if (-1 == setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, &_socket_options.keepalive_idle_seconds, sizeof(int)))
+            {
+                errcode = errno;
+                option_name = "TCP_KEEPIDLE";
+                break;
+            }
+#elif defined(TCP_KEEPALIVE)
+            // macOS names the idle time TCP_KEEPALIVE
+            if (-1 == setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, &_socket_options.keepalive_idle_seconds, sizeof(int)))
+            {
+                errcode = errno;
+                option_name = "TCP_KEEPALIVE";
+                break;
+            }
+#endif // TCP_KEEPIDLE
+#ifdef TCP_KEEPINTVL
+            if (_socket_options.keepalive_interval_seconds > 0 &&
+                -1 == setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, &_socket_options.keepalive_interval_seconds, sizeof(int)))
+            {
+                errcode = errno;
+                option_name = "TCP_KEEPINTVL";
+                break;
+            }
+#endif // TCP_KEEPINTVL
+#ifdef TCP_KEEPCNT
+            if (_socket_options.keepalive_count > 0 &&
+                -1 == setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, &_socket_options.keepalive_count, sizeof(int)))
+            {
+                errcode = errno;
+                option_name = "TCP_KEEPCNT";
+                break;
+            }
+#endif // TCP_KEEPCNT
+        }
+        if (_socket_options.send_buffer_bytes > 0 &&
+            -1 == setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &_socket_options.send_buffer_bytes, sizeof(int)))
+        {
+            errcode = errno;
+            option_name = "SO_SNDBUF";
+            break;
+        }
+        if (_socket_options.receive_buffer_bytes > 0 &&
+            -1 == setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &_socket_options.receive_buffer_bytes, sizeof(int)))
+        {
+            errcode = errno;
+            option_name = "SO_RCVBUF";
+            break;
+        }
+#ifdef TCP_USER_TIMEOUT
+        if (_socket_options.user_timeout_milliseconds > 0 &&
+            -1 == setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &_socket_options.user_timeout_milliseconds, sizeof(int)))
+        {
+            errcode = errno;
+            option_name = "TCP_USER_TIMEOUT";
+            break;
+        }
+#endif // TCP_USER_TIMEOUT
+        return true;
+    } while(false);
+
+    errinfo->errcode = ERROR_INIT_REDIS_CONN;
+    errinfo->raw_errmsg = format_string("setsockopt(%s) failed: %s", option_name, strerror(errcode));
+    errinfo->errmsg = format_string("[R3C_CONN][%s:%d][%s:%d] (errno:%d)%s",
+            __FILE__, __LINE__, node.first.c_str(), node.second,
+            errcode, errinfo->raw_errmsg.c_str());
+    if (_enable_error_log)
+        (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+    return false;
+}
+
 CRedisNode* CRedisClient::get_redis_node(
         int slot, bool readonly,
         const Node* ask_node, struct ErrorInfo* errinfo)
 {
+    const int64_t now_milliseconds = get_monotonic_milliseconds();
     CRedisNode* redis_node = NULL;
-    redisContext* redis_context = NULL;
 
     do
     {
         if (-1 == slot)
         {
-            // Standalone（单机redis）
+            // Standalone（单机redis），Sentinel模式下读请求同样按读策略选择replica
             R3C_ASSERT(!_redis_master_nodes.empty());
             redis_node = _redis_master_nodes.begin()->second;
-            redis_context = redis_node->get_redis_context();
-            if (NULL == redis_context)
+            if (!_sentinel)
             {
-                redis_context = connect_redis_node(redis_node->get_node(), errinfo, false);
-                redis_node->set_redis_context(redis_context);
+                connect_redis_node(redis_node, false, now_milliseconds, errinfo);
+                break;
             }
-            break;
         }
         else
         {
@@ -5369,9 +9247,18 @@ CRedisNode* CRedisClient::get_redis_node(
                     break;
                 }
             }
+            if (NULL == ask_node)
+            {
+                if (_sharding)
+                    update_ejected_shards(slot, now_milliseconds);
+
+                const uint16_t table_index = _slot2index[slot];
+                if (table_index != INVALID_NODE_INDEX)
+                    redis_node = _master_node_array[table_index];
+            }
+            else
             {
-                const Node& node = (NULL==ask_node)? _slot2node[slot]: *ask_node;
-                const RedisMasterNodeTable::const_iterator iter = _redis_master_nodes.find(node);
+                const RedisMasterNodeTable::const_iterator iter = _redis_master_nodes.find(*ask_node);
                 if (iter != _redis_master_nodes.end())
                 {
                     redis_node = iter->second;
@@ -5386,31 +9273,51 @@ CRedisNode* CRedisClient::get_redis_node(
         }
         if (redis_node != NULL)
         {
-            redis_context = redis_node->get_redis_context();
+            CRedisMasterNode* redis_master_node = (CRedisMasterNode*)redis_node;
+            const ReadPolicy read_policy = get_call_read_policy();
 
-            if (NULL == redis_context)
+            if (_replica_lag_check && readonly &&
+                (now_milliseconds>=_replication_expire_time || _topology_entry->replication_version!=_replication_version))
             {
-                redis_context = connect_redis_node(redis_node->get_node(), errinfo, false);
-                redis_node->set_redis_context(redis_context);
+                apply_replication(now_milliseconds);
             }
-            if (!readonly || RP_ONLY_MASTER==_read_policy)
+            if (readonly && _read_route!=NULL && !_read_route->node.first.empty() && NULL==ask_node)
             {
-                break;
+                CRedisNode* route_node = get_route_node(redis_master_node, now_milliseconds, errinfo);
+                if (route_node != NULL)
+                {
+                    redis_node = route_node;
+                    break;
+                }
             }
-            if (redis_context!=NULL && RP_PRIORITY_MASTER==_read_policy)
+            if (readonly && RP_PRIORITY_LOCAL_ZONE==read_policy)
             {
+                update_local_zones(redis_master_node, get_call_zone());
+            }
+            if (!redis_master_node->is_available(now_milliseconds, _circuit_breaker_options))
+            {
+                // master熔断中，读请求转到replica，写请求由调用者快速失败
+                if (readonly && read_policy!=RP_ONLY_MASTER)
+                {
+                    CRedisNode* redis_replica_node = redis_master_node->choose_replica_node(read_policy, now_milliseconds, _circuit_breaker_options);
+                    if (redis_replica_node!=NULL && connect_redis_node(redis_replica_node, true, now_milliseconds, errinfo)!=NULL)
+                        redis_node = redis_replica_node;
+                }
                 break;
             }
 
-            CRedisMasterNode* redis_master_node = (CRedisMasterNode*)redis_node;
-            redis_node = redis_master_node->choose_node(_read_policy);
-            redis_context = redis_node->get_redis_context();
-            if (NULL == redis_context)
+            redisContext* redis_context = connect_redis_node(redis_node, false, now_milliseconds, errinfo);
+            if (!readonly || RP_ONLY_MASTER==read_policy)
+            {
+                break;
+            }
+            if (redis_context!=NULL && RP_PRIORITY_MASTER==read_policy)
             {
-                redis_context = connect_redis_node(redis_node->get_node(), errinfo, false);
-                redis_node->set_redis_context(redis_context);
+                break;
             }
-            if (NULL == redis_context)
+
+            redis_node = redis_master_node->choose_node(read_policy, now_milliseconds, _circuit_breaker_options);
+            if (redis_node!=redis_master_node && NULL==connect_redis_node(redis_node, true, now_milliseconds, errinfo))
             {
                 redis_node = redis_master_node;
             }
@@ -5420,6 +9327,23 @@ CRedisNode* CRedisClient::get_redis_node(
     return redis_node;
 }
 
+redisContext* CRedisClient::connect_redis_node(
+        CRedisNode* redis_node, bool readonly,
+        int64_t now_milliseconds, struct ErrorInfo* errinfo)
+{
+    redisContext* redis_context = redis_node->get_redis_context();
+
+    // 熔断中不再尝试连接，避免每次都付出连接超时的代价
+    if (NULL==redis_context && redis_node->is_available(now_milliseconds, _circuit_breaker_options))
+    {
+        redis_context = connect_redis_node(redis_node->get_node(), errinfo, readonly);
+        redis_node->set_redis_context(redis_context);
+        if (NULL == redis_context)
+            redis_node->on_failure(get_monotonic_milliseconds(), _circuit_breaker_options);
+    }
+    return redis_context;
+}
+
 CRedisMasterNode* CRedisClient::get_redis_master_node(const NodeId& nodeid) const
 {
     CRedisMasterNode* redis_master_node = NULL;
@@ -5574,6 +9498,18 @@ CRedisClient::list_cluster_nodes(
                 }
                 else
                 {
+                    // Since redis-7.0 with cluster-announce-hostname:
+                    // 127.0.0.1:1381@11381,redis-1.redis.svc,shard-id=...
+                    // The hostname stays the same when the IP of a pod changes, so it is preferred as the node.
+                    const std::string::size_type comma_pos = tokens[1].find(',');
+                    if (comma_pos != std::string::npos)
+                    {
+                        const std::string::size_type next_comma_pos = tokens[1].find(',', comma_pos+1);
+                        const std::string& hostname = tokens[1].substr(comma_pos+1, (next_comma_pos==std::string::npos)? std::string::npos: next_comma_pos-comma_pos-1);
+                        if (!hostname.empty() && hostname.find('=')==std::string::npos)
+                            nodeinfo.node.first = hostname;
+                    }
+
                     nodeinfo.flags = tokens[2];
                     nodeinfo.master_id = tokens[3];
                     nodeinfo.ping_sent = atoi(tokens[4].c_str());
@@ -5589,14 +9525,25 @@ CRedisClient::list_cluster_nodes(
                         {
                             const std::string& token = tokens[col];
 
-                            // 排除掉正在迁移的：
+                            // 正在迁移的单独记录：
                             // [14148->-ec19be9a50b5416999ac0305c744d9b6c957c18d]
+                            // 导入中的（[14148-<-...]）由迁出方记录即可
                             if (token[0] != '[')
                             {
                                 std::pair<int, int> slot;
                                 parse_slot_string(token, &slot.first, &slot.second);
                                 nodeinfo.slots.push_back(slot);
                             }
+                            else
+                            {
+                                const std::string::size_type arrow_pos = token.find("->-");
+                                if (arrow_pos!=std::string::npos && token[token.size()-1]==']')
+                                {
+                                    const int slot = atoi(token.c_str()+1);
+                                    const NodeId& importing_nodeid = token.substr(arrow_pos+3, token.size()-arrow_pos-4);
+                                    nodeinfo.migrating_slots.push_back(std::make_pair(slot, importing_nodeid));
+                                }
+                            }
                         }
                     }
 
@@ -5612,6 +9559,348 @@ CRedisClient::list_cluster_nodes(
     return !nodes_info->empty();
 }
 
+// ERR Unknown subcommand or wrong number of arguments for 'SHARDS'. Try CLUSTER HELP.
+// ERR unknown subcommand 'SHARDS'. Try CLUSTER HELP.
+static bool is_unknown_command_error(const struct ErrorInfo* errinfo)
+{
+    return (ERROR_COMMAND == errinfo->errcode) && (errinfo->raw_errmsg.find("nknown ") != std::string::npos);
+}
+
+bool
+CRedisClient::discover_cluster_nodes(
+        std::vector<struct NodeInfo>* nodes_info,
+        struct ErrorInfo* errinfo,
+        redisContext* redis_context,
+        const Node& node)
+{
+    if (TOPOLOGY_SHARDS == _topology_command)
+    {
+        if (list_cluster_shards(nodes_info, errinfo, redis_context, node))
+            return true;
+        if (!is_unknown_command_error(errinfo))
+            return false;
+        _topology_command = TOPOLOGY_SLOTS;
+    }
+    if (TOPOLOGY_SLOTS == _topology_command)
+    {
+        if (list_cluster_slots(nodes_info, errinfo, redis_context, node))
+            return true;
+        if (!is_unknown_command_error(errinfo))
+            return false;
+        _topology_command = TOPOLOGY_NODES;
+    }
+    return list_cluster_nodes(nodes_info, errinfo, redis_context, node);
+}
+
+bool CRedisClient::check_topology_reply(
+        const redisReply* redis_reply,
+        const char* command,
+        struct ErrorInfo* errinfo,
+        redisContext* redis_context,
+        const Node& node) const
+{
+    errinfo->clear();
+    if (NULL == redis_reply)
+    {
+        const int sys_errcode = errno;
+        const int redis_errcode = redis_context->err;
+        errinfo->errcode = ERROR_COMMAND;
+        if (redis_errcode != 0)
+            errinfo->raw_errmsg = redis_context->errstr;
+        else
+            errinfo->raw_errmsg = "redisCommand failed";
+        errinfo->errmsg = format_string("[R3C_LIST_NODES][%s:%d][NODE:%s][%s] (sys:%d,redis:%d)%s",
+                __FILE__, __LINE__, node2string(node).c_str(), command, sys_errcode, redis_errcode, errinfo->raw_errmsg.c_str());
+    }
+    else if (REDIS_REPLY_ERROR == redis_reply->type)
+    {
+        errinfo->errcode = ERROR_COMMAND;
+        errinfo->raw_errmsg = redis_reply->str;
+        errinfo->errmsg = format_string("[R3C_LIST_NODES][%s:%d][NODE:%s][%s] %s",
+                __FILE__, __LINE__, node2string(node).c_str(), command, redis_reply->str);
+        if (is_unknown_command_error(errinfo))
+        {
+            // Expected on older servers, falls back to the next command
+            if (_enable_info_log)
+                (*g_info_log)("%s\n", errinfo->errmsg.c_str());
+            return false;
+        }
+    }
+    else if (redis_reply->type != REDIS_REPLY_ARRAY)
+    {
+        errinfo->errcode = ERROR_UNEXCEPTED_REPLY_TYPE;
+        errinfo->raw_errmsg = "unexpected reply type";
+        errinfo->errmsg = format_string("[R3C_LIST_NODES][%s:%d][NODE:%s][%s] (type:%d)%s",
+                __FILE__, __LINE__, node2string(node).c_str(), command, redis_reply->type, errinfo->raw_errmsg.c_str());
+    }
+    else
+    {
+        return true;
+    }
+
+    if (_enable_error_log)
+        (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+    return false;
+}
+
+// Valid ranges are appended to nodeinfo->slots
+static void add_slot_segment(int64_t start_slot, int64_t end_slot, struct NodeInfo* nodeinfo)
+{
+    if ((start_slot>=0) && (start_slot<=end_slot) && (end_slot<CLUSTER_SLOTS))
+        nodeinfo->slots.push_back(std::make_pair(static_cast<int>(start_slot), static_cast<int>(end_slot)));
+}
+
+static void init_nodeinfo(struct NodeInfo* nodeinfo)
+{
+    nodeinfo->master_id = "-";
+    nodeinfo->ping_sent = 0;
+    nodeinfo->pong_recv = 0;
+    nodeinfo->epoch = 0;
+    nodeinfo->connected = true;
+}
+
+// RESP2 returns a map as a flat array: key1 value1 key2 value2 ...
+static const redisReply* get_map_value(const redisReply* map_reply, const char* key)
+{
+    if (map_reply->type == REDIS_REPLY_ARRAY)
+    {
+        for (size_t i=0; i+1<map_reply->elements; i+=2)
+        {
+            const redisReply* key_reply = map_reply->element[i];
+            if ((REDIS_REPLY_STRING==key_reply->type || REDIS_REPLY_STATUS==key_reply->type) &&
+                (0 == strcmp(key_reply->str, key)))
+                return map_reply->element[i+1];
+        }
+    }
+    return NULL;
+}
+
+static bool get_map_string(const redisReply* map_reply, const char* key, std::string* value)
+{
+    const redisReply* value_reply = get_map_value(map_reply, key);
+    if ((NULL==value_reply) || (value_reply->type!=REDIS_REPLY_STRING && value_reply->type!=REDIS_REPLY_STATUS))
+        return false;
+    value->assign(value_reply->str, value_reply->len);
+    return true;
+}
+
+static int64_t get_map_integer(const redisReply* map_reply, const char* key)
+{
+    const redisReply* value_reply = get_map_value(map_reply, key);
+    if ((NULL==value_reply) || (value_reply->type!=REDIS_REPLY_INTEGER))
+        return -1;
+    return value_reply->integer;
+}
+
+/*
+ * 1) 1) "slots"
+ *    2) 1) (integer) 0
+ *       2) (integer) 5460
+ *    3) "nodes"
+ *    4) 1)  1) "id"
+ *           2) "e10b7051d6bf2d5febd39a2be297bbaea6084111"
+ *           3) "port"
+ *           4) (integer) 30001
+ *           5) "ip"
+ *           6) "127.0.0.1"
+ *           7) "endpoint"
+ *           8) "127.0.0.1"
+ *           9) "hostname"
+ *          10) ""
+ *          11) "role"
+ *          12) "master"
+ *          13) "replication-offset"
+ *          14) (integer) 72156
+ *          15) "health"
+ *          16) "online"
+ */
+bool
+CRedisClient::list_cluster_shards(
+        std::vector<struct NodeInfo>* nodes_info,
+        struct ErrorInfo* errinfo,
+        redisContext* redis_context,
+        const Node& node)
+{
+    const RedisReplyHelper redis_reply = (redisReply*)redisCommand(redis_context, "CLUSTER SHARDS");
+
+    if (!check_topology_reply(redis_reply.get(), "CLUSTER SHARDS", errinfo, redis_context, node))
+        return false;
+
+    for (size_t i=0; i<redis_reply->elements; ++i)
+    {
+        const redisReply* shard_reply = redis_reply->element[i];
+        const redisReply* slots_reply = get_map_value(shard_reply, "slots");
+        const redisReply* nodes_reply = get_map_value(shard_reply, "nodes");
+        if ((NULL==nodes_reply) || (nodes_reply->type!=REDIS_REPLY_ARRAY))
+            continue;
+
+        std::string master_id = "-";
+        for (size_t j=0; j<nodes_reply->elements; ++j)
+        {
+            std::string role;
+            if (get_map_string(nodes_reply->element[j], "role", &role) && role=="master")
+                get_map_string(nodes_reply->element[j], "id", &master_id);
+        }
+        for (size_t j=0; j<nodes_reply->elements; ++j)
+        {
+            const redisReply* node_reply = nodes_reply->element[j];
+            struct NodeInfo nodeinfo;
+            std::string role, health;
+            int64_t port = get_map_integer(node_reply, "port");
+
+            if (port <= 0)
+                port = get_map_integer(node_reply, "tls-port");
+            init_nodeinfo(&nodeinfo);
+            get_map_string(node_reply, "id", &nodeinfo.id);
+            get_map_string(node_reply, "role", &role);
+            get_map_string(node_reply, "health", &health);
+            // The hostname stays the same when the IP of a pod changes, so it is preferred
+            if (!get_map_string(node_reply, "hostname", &nodeinfo.node.first) || nodeinfo.node.first.empty())
+                get_map_string(node_reply, "ip", &nodeinfo.node.first);
+            if (nodeinfo.id.empty() || nodeinfo.node.first.empty() || port<=0 || port>65535)
+                continue;
+            nodeinfo.node.second = static_cast<uint16_t>(port);
+
+            if (role == "master")
+            {
+                nodeinfo.flags = "master";
+                if ((slots_reply!=NULL) && (REDIS_REPLY_ARRAY==slots_reply->type))
+                {
+                    for (size_t k=0; k+1<slots_reply->elements; k+=2)
+                        add_slot_segment(slots_reply->element[k]->integer, slots_reply->element[k+1]->integer, &nodeinfo);
+                }
+            }
+            else
+            {
+                nodeinfo.flags = "slave";
+                nodeinfo.master_id = master_id;
+            }
+            // health: online, failed or loading (a loading replica can not serve reads)
+            if ((health == "failed") || (health!="online" && role!="master"))
+                nodeinfo.flags += ",fail";
+
+            if (_enable_debug_log)
+                (*g_debug_log)("[R3C_LIST_NODES][%s:%d][NODE:%s] %s\n",
+                        __FILE__, __LINE__, node2string(node).c_str(), nodeinfo.str().c_str());
+            nodes_info->push_back(nodeinfo);
+        }
+    }
+    if (nodes_info->empty())
+    {
+        errinfo->errcode = ERROR_REPLY_FORMAT;
+        errinfo->raw_errmsg = "reply nothing";
+        errinfo->errmsg = format_string("[R3C_LIST_NODES][%s:%d][NODE:%s][CLUSTER SHARDS] %s",
+                __FILE__, __LINE__, node2string(node).c_str(), "reply nothing");
+        if (_enable_error_log)
+            (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+    }
+
+    return !nodes_info->empty();
+}
+
+/*
+ * 1) 1) (integer) 0
+ *    2) (integer) 5460
+ *    3) 1) "127.0.0.1"
+ *       2) (integer) 30001
+ *       3) "09dbe9720cda62f7865eabc5fd8857c5d2678366"
+ *       4) 1) hostname
+ *          2) "host-1.redis.example.com"
+ *    4) 1) "127.0.0.1"
+ *       2) (integer) 30004
+ *       3) "821d8ca00d7ccf931ed3ffc7e3db0599d2271abf"
+ *
+ * A master appears once per slot range, replicas follow their master.
+ */
+bool
+CRedisClient::list_cluster_slots(
+        std::vector<struct NodeInfo>* nodes_info,
+        struct ErrorInfo* errinfo,
+        redisContext* redis_context,
+        const Node& node)
+{
+    const RedisReplyHelper redis_reply = (redisReply*)redisCommand(redis_context, "CLUSTER SLOTS");
+    std::map<std::string, size_t> id2index; // NodeId -> index of nodes_info
+
+    if (!check_topology_reply(redis_reply.get(), "CLUSTER SLOTS", errinfo, redis_context, node))
+        return false;
+
+    for (size_t i=0; i<redis_reply->elements; ++i)
+    {
+        const redisReply* range_reply = redis_reply->element[i];
+        if ((range_reply->type!=REDIS_REPLY_ARRAY) || (range_reply->elements<3))
+            continue;
+
+        std::string master_id;
+        for (size_t j=2; j<range_reply->elements; ++j)
+        {
+            const redisReply* node_reply = range_reply->element[j];
+            if ((node_reply->type!=REDIS_REPLY_ARRAY) || (node_reply->elements<2) ||
+                (node_reply->element[0]->type!=REDIS_REPLY_STRING) ||
+                (node_reply->element[1]->type!=REDIS_REPLY_INTEGER))
+                continue;
+
+            struct NodeInfo nodeinfo;
+            const int64_t port = node_reply->element[1]->integer;
+            init_nodeinfo(&nodeinfo);
+            std::string hostname;
+            if ((node_reply->elements>3) && get_map_string(node_reply->element[3], "hostname", &hostname) && !hostname.empty())
+                nodeinfo.node.first = hostname;
+            else
+                nodeinfo.node.first.assign(node_reply->element[0]->str, node_reply->element[0]->len);
+            if (nodeinfo.node.first.empty())
+                nodeinfo.node.first = node.first; // The node replied does not know its own IP
+            if ((nodeinfo.node.first=="?") || (port<=0) || (port>65535))
+                continue; // Unknown endpoint
+            nodeinfo.node.second = static_cast<uint16_t>(port);
+            // The node ID is not replied by redis-3.0
+            if ((node_reply->elements>2) && (REDIS_REPLY_STRING==node_reply->element[2]->type))
+                nodeinfo.id.assign(node_reply->element[2]->str, node_reply->element[2]->len);
+            else
+                nodeinfo.id = node2string(nodeinfo.node);
+            if (2 == j)
+                master_id = nodeinfo.id;
+
+            std::map<std::string, size_t>::iterator iter = id2index.find(nodeinfo.id);
+            if (iter == id2index.end())
+            {
+                if (2 == j)
+                {
+                    nodeinfo.flags = "master";
+                }
+                else
+                {
+                    nodeinfo.flags = "slave";
+                    nodeinfo.master_id = master_id;
+                }
+                iter = id2index.insert(std::make_pair(nodeinfo.id, nodes_info->size())).first;
+                nodes_info->push_back(nodeinfo);
+            }
+            if (2 == j)
+            {
+                add_slot_segment(range_reply->element[0]->integer, range_reply->element[1]->integer, &(*nodes_info)[iter->second]);
+            }
+        }
+    }
+    if (_enable_debug_log)
+    {
+        for (std::vector<struct NodeInfo>::size_type i=0; i<nodes_info->size(); ++i)
+            (*g_debug_log)("[R3C_LIST_NODES][%s:%d][NODE:%s] %s\n",
+                    __FILE__, __LINE__, node2string(node).c_str(), (*nodes_info)[i].str().c_str());
+    }
+    if (nodes_info->empty())
+    {
+        errinfo->errcode = ERROR_REPLY_FORMAT;
+        errinfo->raw_errmsg = "reply nothing";
+        errinfo->errmsg = format_string("[R3C_LIST_NODES][%s:%d][NODE:%s][CLUSTER SLOTS] %s",
+                __FILE__, __LINE__, node2string(node).c_str(), "reply nothing");
+        if (_enable_error_log)
+            (*g_error_log)("%s\n", errinfo->errmsg.c_str());
+    }
+
+    return !nodes_info->empty();
+}
+
 // Extract error type, such as ERR, MOVED, WRONGTYPE, ...
 void CRedisClient::extract_errtype(const redisReply* redis_reply, std::string* errtype) const
 {
@@ -5,6 +5,7 @@
 #include <hiredis/hiredis.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <deque>
 #include <map>
 #include <set>
 #include <string>
@@ -25,13 +26,21 @@ namespace r3c {
 extern int NUM_RETRIES /*=15*/; // The default number of retries is 15 (CLUSTERDOWN cost more than 6s)
 extern int CONNECT_TIMEOUT_MILLISECONDS /*=2000*/; // Connection timeout in milliseconds
 extern int READWRITE_TIMEOUT_MILLISECONDS /*=2000*/; // Receive and send timeout in milliseconds
+extern int RETRY_BASE_SLEEP_MILLISECONDS /*=10*/; // The minimum sleep between two retries
+extern int RETRY_MAX_SLEEP_MILLISECONDS /*=1000*/; // The maximum sleep between two retries
+extern int DNS_CACHE_TTL_SECONDS /*=30*/; // How long a resolved hostname is used before it is refreshed in background
+extern int TOPOLOGY_REFRESH_INTERVAL_MILLISECONDS /*=1000*/; // The minimum interval between two full topology refreshes triggered by MOVED
+extern int TOPOLOGY_POLL_INTERVAL_MILLISECONDS /*=10000*/; // How often the background refresher checks the cluster epoch
+extern int REPLICATION_POLL_INTERVAL_MILLISECONDS /*=1000*/; // How often replica offsets are polled when replica lag check is enabled
+extern int SHARD_POINTS_PER_WEIGHT /*=160*/; // Points of a node on the hash ring of the sharding mode per weight
 
 enum ReadPolicy
 {
     RP_ONLY_MASTER, // Always read from master
     RP_PRIORITY_MASTER,
     RP_PRIORITY_REPLICA,
-    RP_READ_REPLICA
+    RP_READ_REPLICA,
+    RP_PRIORITY_LOCAL_ZONE // Replicas in the local zone, then the master if it is local, then any node (see ZoneOptions)
 };
 
 enum ZADDFLAG
@@ -57,6 +66,25 @@ struct NodeHasher
 std::string& node2string(const Node& node, std::string* str);
 std::string node2string(const Node& node);
 
+// A node given as "unix:/tmp/redis.sock" is kept as ("/tmp/redis.sock", 0)
+bool is_unix_socket_node(const Node& node);
+
+// Options applied to every TCP connection, ignored by unix domain sockets.
+// Zero means keeping the system default,
+// options not supported by the platform are silently skipped.
+struct SocketOptions
+{
+    bool tcp_nodelay;               // TCP_NODELAY, default: true
+    int keepalive_idle_seconds;     // TCP_KEEPIDLE (TCP_KEEPALIVE on macOS), SO_KEEPALIVE is enabled if greater than 0
+    int keepalive_interval_seconds; // TCP_KEEPINTVL
+    int keepalive_count;            // TCP_KEEPCNT
+    int send_buffer_bytes;          // SO_SNDBUF
+    int receive_buffer_bytes;       // SO_RCVBUF
+    int user_timeout_milliseconds;  // TCP_USER_TIMEOUT
+
+    SocketOptions();
+};
+
 struct NodeInfo
 {
     Node node;
@@ -68,6 +96,7 @@ struct NodeInfo
     int epoch;              // The configuration epoch (or version) of the current node (or of the current master if the node is a slave). Each time there is a failover, a new, unique, monotonically increasing configuration epoch is created. If multiple nodes claim to serve the same hash slots, the one with higher configuration epoch wins
     bool connected;         // The state of the link used for the node-to-node cluster bus
     SlotSegment slots;      // A hash slot number or range
+    std::vector<std::pair<int, NodeId> > migrating_slots; // [slot->-importing node id], only listed by CLUSTER NODES
 
     std::string str() const;
     bool is_master() const;
@@ -83,6 +112,31 @@ struct NodeInfo
 
 extern std::ostream& operator <<(std::ostream& os, const struct NodeInfo& nodeinfo);
 
+// Slots [begin_slot, end_slot] moved from old_node to new_node,
+// old_node.first is empty if the slots were not covered before, new_node.first is empty if they are not covered now
+struct SlotOwnerChange
+{
+    int begin_slot;
+    int end_slot;
+    Node old_node;
+    Node new_node;
+};
+
+// What changed between two topologies as seen by a client,
+// replicas are only tracked when the client keeps replica connections (read policy or warm standby)
+struct TopologyDiff
+{
+    std::vector<struct SlotOwnerChange> slot_changes;
+    std::vector<Node> added_masters;    // Including promoted_masters
+    std::vector<Node> removed_masters;
+    std::vector<Node> promoted_masters; // Replicas became masters (failover)
+    std::vector<Node> added_replicas;
+    std::vector<Node> removed_replicas;
+
+    bool empty() const;
+    std::string str() const;
+};
+
 // The helper for freeing redisReply automatically
 // DO NOT use RedisReplyHelper for any nested redisReply
 class RedisReplyHelper
@@ -115,6 +169,175 @@ bool is_wrongtype_error(const std::string& errtype);
 bool is_busygroup_error(const std::string& errtype);
 bool is_nogroup_error(const std::string& errtype);
 bool is_crossslot_error(const std::string& errtype);
+bool is_readonly_error(const std::string& errtype);
+
+// Per-node circuit breaker
+// closed: requests pass through, consecutive failures are counted;
+// open: after failure_threshold consecutive failures, requests to the node are rejected immediately
+//       (reads go to a replica if there is one) for open_milliseconds;
+// half-open: after the open period one probe request is let through,
+//            success closes the breaker and failure opens it again.
+struct CircuitBreakerOptions
+{
+    int failure_threshold; // Default: 3
+    int open_milliseconds; // Default: 1000
+
+    CircuitBreakerOptions();
+};
+
+// Reads skip replicas too far behind their master.
+// The background thread polls INFO replication on the masters every REPLICATION_POLL_INTERVAL_MILLISECONDS,
+// a replica whose lag is unknown (not reported by its master, not online, or the last poll is too old) is skipped too.
+struct ReplicaLagOptions
+{
+    int64_t max_lag_bytes; // master_repl_offset minus the offset of the replica, negative to not check. Default: -1
+    int max_lag_seconds;   // Seconds since the last ack of the replica, negative to not check. Default: -1
+
+    ReplicaLagOptions();
+};
+
+// Read-your-writes for replica reads.
+// A write through a client with the token records the replication offset of the master (ROLE pipelined after the write),
+// a read goes to a replica only if ROLE pipelined before the read shows the replica has reached that offset,
+// otherwise the read is sent again to the master.
+// The token can be carried between clients, but not used by two of them at the same time.
+// A failover between the write and the read loses the guarantee, as it may lose the write itself.
+// Cost: every write sends ROLE in the same round trip, and so does a read from a replica not known to be caught up.
+// If the ROLE of a write fails, reads of that master go to the master for SESSION_PIN_MILLISECONDS (1s).
+class SessionToken
+{
+public:
+    // Returns -1 if nothing is written to the master through the token
+    int64_t get_offset(const Node& master_node) const;
+    // Keeps the larger offset
+    void update_offset(const Node& master_node, int64_t offset);
+    // Reads of the master's slots go to the master until the time (monotonic milliseconds)
+    void pin_master(const Node& master_node, int64_t until_milliseconds);
+    bool is_master_pinned(const Node& master_node, int64_t now_milliseconds) const;
+    void clear() { _offsets.clear(); _pinned_masters.clear(); }
+    bool empty() const { return _offsets.empty() && _pinned_masters.empty(); }
+    std::string str() const;
+
+private:
+    std::map<Node, int64_t> _offsets; // Master -> replication offset after the last write
+    std::map<Node, int64_t> _pinned_masters; // Master -> pinned until, the offset of a write is unknown
+};
+
+// Hedged reads: a read without reply within the given percentile of the latency of its command
+// is sent to another replica or the master too, and the first reply wins.
+// The loser's reply is read and dropped before its connection is used again.
+struct HedgeOptions
+{
+    int percentile;             // Default: 95
+    int min_delay_milliseconds; // The minimum hedge delay, the delay is waited by poll() in milliseconds. Default: 1
+    int budget_percent;         // Hedged reads are at most this percent of all reads. Default: 5
+    int min_samples;            // A command is not hedged until its latency has this many samples. Default: 100
+
+    HedgeOptions();
+};
+
+// Availability zones of the nodes for RP_PRIORITY_LOCAL_ZONE,
+// a node matching neither node_zones nor subnet_zones is taken as in another zone.
+struct ZoneOptions
+{
+    std::string local_zone; // The zone of this process
+    std::map<Node, std::string> node_zones; // Explicit zone of a node, takes precedence over subnet_zones
+    std::vector<std::pair<std::string, std::string> > subnet_zones; // IPv4 CIDR (e.g. "10.0.1.0/24") -> zone, the first match wins
+};
+
+// Buffering of writes sent by write_or_buffer() while their slot is briefly unavailable
+// (CLUSTERDOWN, failover, connection errors or circuit open), they are sent in order when the slot is available again.
+// Other calls such as set() and hset() are never buffered and fail as usual, nor wait for the buffered writes of their slot.
+// A write failed by a connection error may have been executed, so only commands safe to repeat can be listed,
+// enable_write_buffer() rejects INCR*, LPUSH, RPUSH, APPEND and the like with ERROR_PARAMETER.
+//
+// Buffered writes are kept in memory only and are lost (counted by get_num_dropped_writes() and logged) if:
+// - they are older than max_delay_milliseconds when sent,
+// - the write fails when sent, such as WRONGTYPE, as nobody is waiting for its reply,
+// - they are still buffered after final_flush_milliseconds of disable_write_buffer() or the destructor,
+// - the process exits or crashes.
+struct WriteBufferOptions
+{
+    std::set<std::string> commands; // Commands to buffer in upper case, such as "SET", "HSET" and "DEL". Default: empty
+    int max_commands;               // Writes beyond fail with ERROR_WRITE_BUFFER_FULL. Default: 10000
+    int max_delay_milliseconds;     // Buffered writes older than this are dropped. Default: 5000
+    int final_flush_milliseconds;   // Time to send the buffered writes when disabled or destroyed, plus one timeout. Default: 1000
+
+    WriteBufferOptions();
+};
+
+// Per-node read/write timeouts adapted to the observed latency of each command class
+// (commands on a few elements, commands whose cost grows with the data), so a hung node is detected in milliseconds
+// while a large HGETALL still finishes. Blocking commands such as BLPOP always use the readwrite timeout.
+// A command timed out is retried with its timeout doubled, and the timeout counts as a latency sample of its class.
+struct AdaptiveTimeoutOptions
+{
+    int percentile;               // Default: 99
+    int multiplier;               // The timeout is the latency percentile of the class on the node times this. Default: 4
+    int min_timeout_milliseconds; // Floor. Default: 20
+    int max_timeout_milliseconds; // Ceiling, not greater than 0 for the readwrite timeout of the client. Default: 0
+    int min_samples;              // The ceiling is used until the class has this many samples on the node. Default: 100
+
+    AdaptiveTimeoutOptions();
+};
+
+// Priority of the commands of a client or a call (see CCommandPriorityGuard)
+enum CommandPriority
+{
+    PRIORITY_INTERACTIVE = 0, // Latency-critical commands, the default
+    PRIORITY_BULK = 1         // Commands of bulk jobs such as a nightly rebuild
+};
+
+// Priority lanes: bulk commands go over a second connection of each node, and at most
+// max_inflight_bulk_commands of them run on a node at the same time in the process,
+// so bulk jobs sharing the clients or the process do not hold up latency-critical commands.
+// Blocking commands such as BLPOP, MULTI, EXEC, DISCARD, WATCH and the commands of a transaction
+// always go over the first connection.
+struct PriorityLaneOptions
+{
+    bool classify_bulk_commands;    // Commands whose cost grows with the data (HGETALL, LRANGE, XRANGE, EVAL, etc.) are bulk even with PRIORITY_INTERACTIVE. Default: true
+    int max_inflight_bulk_commands; // Per node in the process, not greater than 0 for no limit. Default: 4
+    int max_wait_milliseconds;      // A bulk command waiting longer for its turn fails with ERROR_BULK_LANE_BUSY. Default: 1000
+
+    PriorityLaneOptions();
+};
+
+// What a request does when its node is at the limits of AdmissionOptions
+enum AdmissionPolicy
+{
+    ADMISSION_BLOCK = 0,     // Waits up to max_wait_milliseconds for a request in flight to finish
+    ADMISSION_FAIL_FAST = 1, // Fails immediately
+    ADMISSION_SHED = 2       // PRIORITY_BULK and bulk lane commands fail as soon as the node is over bulk_percent of the limits, others wait as ADMISSION_BLOCK
+};
+
+// Admission control: limits of the requests in flight to each node from the process, shared by all clients,
+// so a degraded node holds a bounded number of threads and bytes instead of all of them.
+// The bytes are those of the commands sent, a command larger than the limit is still admitted when the node has none in flight.
+// The counters are exported by get_admission_stats().
+struct AdmissionOptions
+{
+    int max_inflight_requests;       // Per node, not greater than 0 for no limit. Default: 0
+    int64_t max_inflight_bytes;      // Per node, not greater than 0 for no limit. Default: 0
+    int max_total_inflight_requests; // All nodes, not greater than 0 for no limit. Default: 0
+    AdmissionPolicy policy;          // Default: ADMISSION_BLOCK
+    int max_wait_milliseconds;       // Default: 100
+    int bulk_percent;                // Used by ADMISSION_SHED. Default: 50
+
+    AdmissionOptions();
+};
+
+// Routing of the reads of a call, overriding the read policy of the client (see CReadRouteGuard).
+// Writes always go to the master.
+struct ReadRoute
+{
+    ReadPolicy read_policy; // RP_ONLY_MASTER for master only, RP_PRIORITY_REPLICA to prefer a replica, etc.
+    Node node;              // If not empty, the master or a replica of the slot to read from, read_policy applies if it is unavailable or lagging
+    std::string zone;       // If not empty, read as RP_PRIORITY_LOCAL_ZONE with this zone taken as the local zone (see ZoneOptions)
+
+    ReadRoute(ReadPolicy read_policy=RP_ONLY_MASTER);
+    ReadRoute(const Node& node, ReadPolicy read_policy=RP_PRIORITY_MASTER);
+    ReadRoute(const std::string& zone);
+};
 
 // NOTICE: not thread safe
 // A redis client than support redis cluster
@@ -147,7 +370,11 @@ struct SlotInfo;
 class CRedisNode;
 class CRedisMasterNode;
 class CRedisReplicaNode;
+class CLatencyHistogram;
 class CommandMonitor;
+class TopologyListener;
+struct TopologyEntry;
+struct TopologyView;
 
 // Redis命令参数
 class CommandArgs
@@ -322,9 +549,25 @@ public:
     // raw_nodes_string - Redis cluster nodes separated by comma,
     //                    EXAMPLE: 127.0.0.1:6379,127.0.0.1:6380,127.0.0.2:6379,127.0.0.3:6379,
     //                    standalone mode if only one node, else cluster mode.
+    //                    A unix domain socket is given as unix:/tmp/redis.sock,
+    //                    and hostnames are resolved through a process-wide cache.
     //
     // Particularly same nodes are allowed for cluster mode:
     // const std::string nodes = "127.0.0.1:6379,127.0.0.1:6379";
+    //
+    // Client-side sharding over standalone nodes if prefixed with shard://, a node may be followed by its weight
+    // (a positive integer, 1 if not given), duplicate nodes are rejected:
+    // const std::string nodes = "shard://127.0.0.1:6379:2,127.0.0.1:6380,127.0.0.1:6381";
+    // A key goes to the node its slot (CRC16 with {hashtag} as in cluster mode) falls on in a consistent hash ring,
+    // with SHARD_POINTS_PER_WEIGHT points per weight of a node. A node whose circuit breaker opens is ejected from the ring,
+    // its keys go to the next nodes, and it is taken back after the open period of the breaker.
+    //
+    // Standalone mode with the master and replicas discovered from Redis Sentinel if prefixed with sentinel://,
+    // followed by the master name and the sentinels:
+    // const std::string nodes = "sentinel://mymaster@127.0.0.1:26379,127.0.0.1:26380,127.0.0.1:26381";
+    // The client subscribes +switch-master on a sentinel and follows failovers before its next request,
+    // and asks the sentinels again when the breaker of the master opens. Reads go to replicas by the read policy.
+    // The password is for the redis nodes, not for the sentinels.
     CRedisClient(
             const std::string& raw_nodes_string,
             int connect_timeout_milliseconds=CONNECT_TIMEOUT_MILLISECONDS,
@@ -353,9 +596,89 @@ public:
 
     // Returns true if parameter nodes of ctor is composed of two or more nodes,
     // or false when only a node for standlone mode.
+    // The sharding mode is taken as cluster mode too, as keys are distributed the same way.
     bool cluster_mode() const;
+    bool sharding_mode() const;
+    bool sentinel_mode() const;
     const char* get_mode_str() const;
 
+public:
+    // Takes effect on the connections already established and all later ones
+    void set_socket_options(const SocketOptions& socket_options);
+    const SocketOptions& get_socket_options() const { return _socket_options; }
+    void set_circuit_breaker_options(const CircuitBreakerOptions& circuit_breaker_options) { _circuit_breaker_options = circuit_breaker_options; }
+    const CircuitBreakerOptions& get_circuit_breaker_options() const { return _circuit_breaker_options; }
+
+    // Takes effect for RP_PRIORITY_LOCAL_ZONE
+    void set_zone_options(const ZoneOptions& zone_options);
+    const ZoneOptions& get_zone_options() const { return _zone_options; }
+
+    // The client does not take the ownership, NULL to read without the token
+    void set_session_token(SessionToken* session_token) { _session_token = session_token; }
+    SessionToken* get_session_token() const { return _session_token; }
+
+    // Reads of the calls use the route instead of the read policy until it is set to NULL,
+    // the client does not take the ownership.
+    // Routes to replicas need the replicas known: a read policy other than RP_ONLY_MASTER or enable_warm_standby(),
+    // otherwise the reads go to the master.
+    void set_read_route(const ReadRoute* read_route) { _read_route = read_route; }
+    const ReadRoute* get_read_route() const { return _read_route; }
+
+    // Priority of the following calls, used with enable_priority_lanes()
+    void set_command_priority(CommandPriority command_priority) { _command_priority = command_priority; }
+    CommandPriority get_command_priority() const { return _command_priority; }
+
+public:
+    // Keep authenticated idle connections to the replicas of every master even with RP_ONLY_MASTER,
+    // so a replica promoted by a failover is swapped in as master without connecting again.
+    void enable_warm_standby();
+    void disable_warm_standby();
+
+    // Refresh the topology in a background thread shared by the clients of the same cluster in the process.
+    // The thread polls the cluster epoch every TOPOLOGY_POLL_INTERVAL_MILLISECONDS and is woken up by MOVED or connection errors,
+    // requests only apply the topology it publishes instead of fetching the topology inline.
+    // Nodes new to the client in a topology fetched by another client or the thread are connected on first use.
+    void enable_background_refresh();
+    void disable_background_refresh();
+
+    // Exclude lagging replicas from reads, see ReplicaLagOptions.
+    // The polling shares the thread of the background refresh, not supported in standalone mode.
+    void enable_replica_lag_check(const ReplicaLagOptions& replica_lag_options);
+    void disable_replica_lag_check();
+
+    // Hedge reads when the read policy is not RP_ONLY_MASTER and no session token is set, see HedgeOptions
+    void enable_hedged_reads(const HedgeOptions& hedge_options);
+    void disable_hedged_reads();
+
+    // Adapt the read/write timeout of each command to the latency of its node and command class, see AdaptiveTimeoutOptions
+    void enable_adaptive_timeouts(const AdaptiveTimeoutOptions& adaptive_timeout_options);
+    void disable_adaptive_timeouts();
+
+    // Send bulk commands over a second connection of each node, see PriorityLaneOptions
+    void enable_priority_lanes(const PriorityLaneOptions& priority_lane_options);
+    void disable_priority_lanes();
+
+    // Limit the requests in flight to each node from the process, see AdmissionOptions.
+    // Requests rejected fail with ERROR_ADMISSION_REJECTED.
+    void enable_admission_control(const AdmissionOptions& admission_options);
+    void disable_admission_control();
+
+    // Buffer writes while their slot is briefly unavailable, see WriteBufferOptions.
+    // Buffered writes are sent by the following calls (at most every few hundred milliseconds) or flush_write_buffer(),
+    // disable_write_buffer() and the destructor send them for up to final_flush_milliseconds and drop the rest.
+    void enable_write_buffer(const WriteBufferOptions& write_buffer_options);
+    void disable_write_buffer();
+    // Send the buffered writes of the slots available again, for up to timeout_milliseconds if not negative,
+    // returns the number of writes still buffered
+    int flush_write_buffer(int timeout_milliseconds=-1);
+    // Send a write such as {"SET", key, value}, or buffer it if its slot is unavailable.
+    // Returns true if sent (redis_reply is its reply if not NULL),
+    // false if buffered (queued): it is sent later and its reply is never available.
+    // Writes not in WriteBufferOptions::commands, or with the buffer disabled, are sent as redis_command().
+    bool write_or_buffer(const std::string& key, const std::vector<std::string>& args, RedisReplyHelper* redis_reply=NULL, Node* which=NULL, int num_retries=NUM_RETRIES);
+    int get_num_buffered_writes() const { return _num_buffered_writes; }
+    int64_t get_num_dropped_writes() const { return _num_dropped_writes; }
+
 public: // Control logs
     void enable_debug_log();
     void disable_debug_log();
@@ -1205,26 +1528,101 @@ private:
     HandleResult handle_redis_reply(int64_t cost_us, CRedisNode* redis_node, const CommandArgs& command_args, const redisReply* redis_reply, struct ErrorInfo* errinfo);
     HandleResult handle_redis_replay_error(int64_t cost_us, CRedisNode* redis_node, const CommandArgs& command_args, const redisReply* redis_reply, struct ErrorInfo* errinfo);
 
+private:
+    // Returns the hedge delay of the command, -1 if the read should not be hedged
+    int get_hedge_delay(const std::string& command);
+    void add_latency_sample(const std::string& command, int64_t cost_us);
+    redisReply* hedged_command(CRedisNode* redis_node, CRedisMasterNode* redis_master_node, const CommandArgs& command_args, int delay_milliseconds, CRedisNode** replied_node);
+
+private:
+    // Returns the read/write timeout of a command of the class on the node, 0 for no timeout
+    int get_adaptive_timeout(CRedisNode* redis_node, int command_class, int num_timeouts);
+
+private:
+    // Waits for the turn of a bulk command on the node, see PriorityLaneOptions::max_inflight_bulk_commands
+    bool acquire_bulk_lane(const Node& node, struct ErrorInfo* errinfo);
+    void release_bulk_lane(const Node& node);
+
+private:
+    // Waits for the admission of a request to the node according to AdmissionOptions
+    bool admit_request(const Node& node, int64_t bytes, bool low_priority, struct ErrorInfo* errinfo);
+    void finish_request(const Node& node, int64_t bytes);
+
+private:
+    // Refresh the topology if the error of the node requires
+    void refresh_on_error(CRedisNode* redis_node, HandleResult errcode, const Node& node, struct ErrorInfo* errinfo);
+
 private:
     void fini();
     void init();
     bool init_standlone(struct ErrorInfo* errinfo);
     bool init_cluster(struct ErrorInfo* errinfo);
+    bool init_sharding(const std::vector<int>& weights, struct ErrorInfo* errinfo);
+    void rebuild_shard_slots();
+    void update_ejected_shards(int slot, int64_t now_milliseconds);
+    bool init_sentinel(struct ErrorInfo* errinfo);
+    redisContext* connect_sentinel(const Node& node, struct ErrorInfo* errinfo) const;
+    bool discover_sentinel_master(Node* master_node, std::vector<Node>* replica_nodes, struct ErrorInfo* errinfo);
+    bool query_sentinel(redisContext* redis_context, Node* master_node, std::vector<Node>* replica_nodes, struct ErrorInfo* errinfo) const;
+    void apply_sentinel_master(const Node& master_node, const std::vector<Node>& replica_nodes);
+    void refresh_sentinel_master(const Node* switched_master_node);
+    bool subscribe_sentinel();
+    void check_sentinel(int64_t now_milliseconds);
+    void close_sentinel();
     bool init_master_nodes(const std::vector<struct NodeInfo>& nodes_info, std::vector<struct NodeInfo>* replication_nodes_info, struct ErrorInfo* errinfo);
-    void init_replica_nodes(const std::vector<struct NodeInfo>& replication_nodes_info);
+    void init_replica_nodes(const std::vector<struct NodeInfo>& replication_nodes_info, bool connect_nodes);
     void update_slots(const struct NodeInfo& nodeinfo);
+    void update_slot(int slot, const Node& node);
+    void schedule_refresh_master_node_table(int64_t now_milliseconds);
     void refresh_master_node_table(struct ErrorInfo* errinfo, const Node* error_node);
-    void clear_and_update_master_nodes(const std::vector<struct NodeInfo>& nodes_info, std::vector<struct NodeInfo>* replication_nodes_info, struct ErrorInfo* errinfo);
+    void apply_shared_topology();
+    void signal_topology_refresher();
+    bool get_cluster_current_epoch(int64_t* current_epoch, struct ErrorInfo* errinfo);
+    static void* topology_refresher(void* arg);
+    void start_topology_refresher();
+    bool poll_replication(struct Replication* replication);
+    void apply_replication(int64_t now_milliseconds);
+    ReadPolicy get_call_read_policy() const;
+    const std::string& get_call_zone() const;
+    CRedisNode* get_route_node(CRedisMasterNode* redis_master_node, int64_t now_milliseconds, struct ErrorInfo* errinfo);
+    void update_local_zones(CRedisMasterNode* redis_master_node, const std::string& zone);
+    bool in_zone(const Node& node, const std::string& zone) const;
+    // New nodes are connected on first use if connect_nodes is false
+    void apply_nodes_info(const std::vector<struct NodeInfo>& nodes_info, bool connect_nodes, struct ErrorInfo* errinfo);
+    void get_topology_view(struct TopologyView* topology_view) const;
+    void notify_topology_listeners(const struct TopologyView& old_topology_view);
+    void update_slot_migrations(const std::vector<struct NodeInfo>& nodes_info);
+    void add_migrated_key(int slot, const Node& importing_node, const std::string& key);
+    const Node* get_migrated_key_node(int slot, const std::string& key) const;
+    void clear_and_update_master_nodes(const std::vector<struct NodeInfo>& nodes_info, bool connect_nodes, std::vector<struct NodeInfo>* replication_nodes_info, struct ErrorInfo* errinfo);
     void clear_invalid_master_nodes(const NodeInfoTable& master_nodeinfo_table);
-    bool add_master_node(const NodeInfo& nodeinfo, struct ErrorInfo* errinfo);
+    bool add_master_node(const NodeInfo& nodeinfo, bool connect_node, struct ErrorInfo* errinfo);
     void clear_all_master_nodes();
+    // The masters followed by their replicas
+    void get_all_redis_nodes(std::vector<CRedisNode*>* redis_nodes) const;
+    void insert_master_node_array(CRedisMasterNode* master_node);
+    void erase_master_node_array(CRedisMasterNode* master_node);
     void update_nodes_string(const NodeInfo& nodeinfo);
+    CRedisReplicaNode* take_replica_node(const Node& node);
+    redisContext* take_replica_redis_context(const Node& node);
+    void clear_orphan_replica_nodes();
+    bool need_replica_nodes() const;
     redisContext* connect_redis_node(const Node& node, struct ErrorInfo* errinfo, bool readonly) const;
+    bool apply_socket_options(redisContext* redis_context, const Node& node, struct ErrorInfo* errinfo) const;
+    redisContext* connect_redis_node(CRedisNode* redis_node, bool readonly, int64_t now_milliseconds, struct ErrorInfo* errinfo);
     CRedisNode* get_redis_node(int slot, bool readonly, const Node* ask_node, struct ErrorInfo* errinfo);
     CRedisMasterNode* get_redis_master_node(const NodeId& nodeid) const;
     CRedisMasterNode* random_redis_master_node() const;
 
 private:
+    // Discover the cluster topology,
+    // CLUSTER SHARDS (redis-7.0) is tried first, then CLUSTER SLOTS, and CLUSTER NODES as the last resort.
+    // A command the server does not support is not tried again by this client.
+    bool discover_cluster_nodes(std::vector<struct NodeInfo>* nodes_info, struct ErrorInfo* errinfo, redisContext* redis_context, const Node& node);
+    bool list_cluster_shards(std::vector<struct NodeInfo>* nodes_info, struct ErrorInfo* errinfo, redisContext* redis_context, const Node& node);
+    bool list_cluster_slots(std::vector<struct NodeInfo>* nodes_info, struct ErrorInfo* errinfo, redisContext* redis_context, const Node& node);
+    bool check_topology_reply(const redisReply* redis_reply, const char* command, struct ErrorInfo* errinfo, redisContext* redis_context, const Node& node) const;
+
     // List the information of all cluster nodes
     bool list_cluster_nodes(std::vector<struct NodeInfo>* nodes_info, struct ErrorInfo* errinfo, redisContext* redis_context, const Node& node);
 
@@ -1233,6 +1631,10 @@ private:
 
 public:
     void set_command_monitor(CommandMonitor* command_monitor) { _command_monitor = command_monitor; }
+
+    // Listeners are called in the registration order, the client does not take the ownership
+    void add_topology_listener(TopologyListener* topology_listener);
+    void remove_topology_listener(TopologyListener* topology_listener);
     CommandMonitor* get_command_monitor() const { return _command_monitor; }
 
 public:
@@ -1293,12 +1695,62 @@ private:
 
 private:
     CommandMonitor* _command_monitor;
+    std::vector<TopologyListener*> _topology_listeners;
     std::string _raw_nodes_string; // 最原始的
     std::string _nodes_string; // 长时间运行后，最原始的节点可能都不在了
     int _connect_timeout_milliseconds; // The connect timeout in milliseconds
     int _readwrite_timeout_milliseconds; // The receive and send timeout in milliseconds
     std::string _password;
     ReadPolicy _read_policy;
+    bool _sharding; // Client-side sharding over standalone nodes
+    std::map<Node, int> _shard_weights;
+    std::set<Node> _ejected_shards; // Shards out of the ring while their breakers are open
+    bool _sentinel; // Standalone mode following the master monitored by Redis Sentinel
+    std::string _sentinel_master_name;
+    std::vector<Node> _sentinel_nodes;
+    std::vector<Node>::size_type _sentinel_index; // The sentinel last answered
+    redisContext* _sentinel_context; // Subscribed to +switch-master
+    int64_t _sentinel_retry_time; // When to subscribe again after the subscription was lost
+    int64_t _sentinel_check_time; // When to read the subscription again
+    int64_t _sentinel_discover_time; // When to ask the sentinels for the replicas after a +switch-master, 0 if not needed
+    SocketOptions _socket_options;
+    CircuitBreakerOptions _circuit_breaker_options;
+    bool _warm_standby; // Default: false
+    bool _background_refresh; // Default: false
+    bool _replica_lag_check; // Default: false
+    ReplicaLagOptions _replica_lag_options;
+    SessionToken* _session_token;
+    const ReadRoute* _read_route;
+    ZoneOptions _zone_options;
+    bool _hedged_reads; // Default: false
+    HedgeOptions _hedge_options;
+    int64_t _hedge_tokens; // In thousandths, a hedged read takes 1000
+    std::map<std::string, CLatencyHistogram*> _latency_histograms; // Command -> latency, kept while hedged reads are enabled
+    bool _adaptive_timeouts; // Default: false
+    AdaptiveTimeoutOptions _adaptive_timeout_options;
+    bool _priority_lanes; // Default: false
+    PriorityLaneOptions _priority_lane_options;
+    CommandPriority _command_priority; // Default: PRIORITY_INTERACTIVE
+    bool _in_transaction; // From MULTI to EXEC or DISCARD, when the commands stay on the first connection
+    bool _admission_control; // Default: false
+    AdmissionOptions _admission_options;
+    bool _write_buffer; // Default: false
+    WriteBufferOptions _write_buffer_options;
+
+private:
+    enum TopologyCommand
+    {
+        TOPOLOGY_SHARDS = 0, // CLUSTER SHARDS
+        TOPOLOGY_SLOTS = 1,  // CLUSTER SLOTS
+        TOPOLOGY_NODES = 2   // CLUSTER NODES
+    };
+    TopologyCommand _topology_command; // Default: TOPOLOGY_SHARDS, downgraded when not supported
+    int64_t _refresh_due_time; // When the scheduled full refresh runs (monotonic milliseconds), 0 if none is scheduled
+    int64_t _last_refresh_time; // Monotonic milliseconds of the last full refresh
+    struct TopologyEntry* _topology_entry; // Shared by the clients of the same cluster in the process, NULL in standalone mode
+    uint64_t _topology_version; // Version of the shared topology applied by this client
+    uint64_t _replication_version; // Version of the shared replica offsets applied by this client
+    int64_t _replication_expire_time; // When the applied replica offsets are too old (monotonic milliseconds)
 
 private:
 #if __cplusplus < 201103L
@@ -1311,9 +1763,57 @@ private:
     RedisMasterNodeTable _redis_master_nodes; // Node -> CMasterNode
     RedisMasterNodeIdTable _redis_master_nodes_id; // NodeId -> Node
 
+private:
+    // A slot being migrated and the keys learned from ASK to be on the importing node already,
+    // commands for these keys go to the importing node with ASKING directly instead of being redirected each time.
+    struct SlotMigration
+    {
+        Node importing_node;
+        std::set<std::string> migrated_keys;
+    };
+    std::map<int, struct SlotMigration> _slot_migrations; // Slot -> SlotMigration
+
+private:
+    // A write accepted while its slot is unavailable,
+    // the arguments are copied as CommandArgs only refers to them.
+    struct BufferedWrite
+    {
+        std::string key;
+        std::vector<std::string> args;
+        int64_t buffered_time; // Monotonic milliseconds
+    };
+    std::map<int, std::deque<struct BufferedWrite> > _buffered_writes; // Slot -> writes in order, slot is -1 in standalone mode
+    int _num_buffered_writes;
+    int64_t _num_dropped_writes;
+    int64_t _write_buffer_flush_time; // When the buffered writes are sent again (monotonic milliseconds)
+    int _write_buffer_flush_interval; // Doubled while the buffered writes are still blocked
+    bool _buffering_write; // Set while write_or_buffer() is sending
+    bool _flushing_writes; // Set while flush_write_buffer() is sending
+    bool _flush_blocked; // Set if the write being flushed found its slot still unavailable
+
+    // Returns true if the write is buffered, false if the buffer is full
+    bool buffer_write(int slot, const std::string& key, const CommandArgs& command_args, int64_t now_milliseconds, struct ErrorInfo* errinfo);
+    void drop_expired_writes(std::deque<struct BufferedWrite>* buffered_writes, int64_t now_milliseconds);
+
+private:
+    // Parsed from ZoneOptions::subnet_zones
+    struct SubnetZone
+    {
+        uint32_t network; // Host byte order
+        uint32_t netmask;
+        std::string zone;
+    };
+    std::vector<struct SubnetZone> _subnet_zones;
+    std::string _matched_zone; // The zone the nodes are matched against, the local zone unless a route sets another
+    unsigned int _zone_generation; // Changed when the zone options or _matched_zone change, nodes of an older generation are matched again
+
 private:
     std::vector<Node> _nodes; // All nodes array
-    std::vector<Node> _slot2node; // Slot -> Node
+    // Slot -> index of _master_node_array, INVALID_NODE_INDEX for an uncovered slot,
+    // 16 bits per slot instead of a Node, and routing is one array load without hashing.
+    std::vector<uint16_t> _slot2index;
+    std::vector<CRedisMasterNode*> _master_node_array; // NULL for the hole left by a removed master
+    std::vector<CRedisReplicaNode*> _orphan_replica_nodes; // Replicas whose master was removed, to be reused
 
 private:
     std::string _hincrby_shastr1;
@@ -1336,9 +1836,81 @@ public:
 
     // Called after each command is executed
     // result The result of the execution of the command (0 success, 1 error, 2 timeout)
+    // reply is NULL for a write buffered by write_or_buffer()
     virtual void after_execute(int result, const Node& node, const std::string& command, const redisReply* reply) = 0;
 };
 
+// Be notified of topology changes by adding a TopologyListener,
+// e.g. to invalidate caches keyed by slot or rebalance workers sharded by node.
+class TopologyListener
+{
+public:
+    virtual ~TopologyListener() {}
+
+    // Called after the client applied a changed topology (refresh or MOVED) in the thread using the client,
+    // the client must not be used inside.
+    virtual void on_topology_changed(const struct TopologyDiff& diff) = 0;
+};
+
+// Sets a read route of the client within a scope, and restores the previous one on leaving.
+// EXAMPLE:
+// {
+//     r3c::CReadRouteGuard read_route_guard(redis_client, r3c::ReadRoute(r3c::RP_ONLY_MASTER));
+//     redis_client->get(key, &value); // Read from the master whatever the read policy of the client
+// }
+class CReadRouteGuard
+{
+public:
+    CReadRouteGuard(CRedisClient* redis_client, const ReadRoute& read_route)
+        : _redis_client(redis_client), _read_route(read_route), _old_read_route(redis_client->get_read_route())
+    {
+        _redis_client->set_read_route(&_read_route);
+    }
+
+    ~CReadRouteGuard()
+    {
+        _redis_client->set_read_route(_old_read_route);
+    }
+
+private:
+    CReadRouteGuard(const CReadRouteGuard&);
+    CReadRouteGuard& operator =(const CReadRouteGuard&);
+
+private:
+    CRedisClient* _redis_client;
+    ReadRoute _read_route;
+    const ReadRoute* _old_read_route;
+};
+
+// Sets the command priority of the client within a scope, and restores the previous one on leaving.
+// EXAMPLE:
+// {
+//     r3c::CCommandPriorityGuard command_priority_guard(redis_client, r3c::PRIORITY_BULK);
+//     redis_client->get(key, &value); // Sent over the bulk connection of the node
+// }
+class CCommandPriorityGuard
+{
+public:
+    CCommandPriorityGuard(CRedisClient* redis_client, CommandPriority command_priority)
+        : _redis_client(redis_client), _old_command_priority(redis_client->get_command_priority())
+    {
+        _redis_client->set_command_priority(command_priority);
+    }
+
+    ~CCommandPriorityGuard()
+    {
+        _redis_client->set_command_priority(_old_command_priority);
+    }
+
+private:
+    CCommandPriorityGuard(const CCommandPriorityGuard&);
+    CCommandPriorityGuard& operator =(const CCommandPriorityGuard&);
+
+private:
+    CRedisClient* _redis_client;
+    CommandPriority _old_command_priority;
+};
+
 // Error code
 enum
 {
@@ -1359,7 +1931,11 @@ enum
     ERROR_UNEXCEPTED_REPLY_TYPE = -15, // Unexcepted reply type
     ERROR_REPLY_FORMAT = -16,          // Reply format error
     ERROR_REDIS_READONLY = -17,
-    ERROR_NO_ANY_NODE = -18
+    ERROR_NO_ANY_NODE = -18,
+    ERROR_CIRCUIT_OPEN = -19,          // Circuit breaker of the node is open
+    ERROR_WRITE_BUFFER_FULL = -20,     // Too many buffered writes, see WriteBufferOptions
+    ERROR_BULK_LANE_BUSY = -21,        // Too many bulk commands in flight on the node, see PriorityLaneOptions
+    ERROR_ADMISSION_REJECTED = -22     // The node is at the limits of AdmissionOptions
 };
 
 // Set NULL to discard log
@@ -1368,6 +1944,36 @@ void set_error_log_write(LOG_WRITE error_log);
 void set_info_log_write(LOG_WRITE info_log);
 void set_debug_log_write(LOG_WRITE debug_log);
 
+// Process-wide retry budget shared by all CRedisClient instances, a token bucket:
+// every successful request deposits retry_ratio tokens (up to max_tokens),
+// every retry withdraws one token, and requests fail without retrying once it is empty.
+// min_retries_per_second retries are always allowed so that a quiet process can still retry.
+// A retry_ratio not greater than 0 disables the budget.
+// Default: retry_ratio=0.1, min_retries_per_second=10, max_tokens=100
+void set_retry_budget(double retry_ratio, int min_retries_per_second, int max_tokens);
+
+// Keep a topology snapshot per cluster in dir, written after each refresh that changes the topology.
+// A process loads it when its first client of the cluster is created and starts routing without discovery,
+// a stale snapshot is corrected by the first MOVED or refresh.
+// Should be called before creating any CRedisClient, an empty dir disables it (default).
+void set_topology_snapshot_dir(const std::string& dir);
+
+// Requests in flight to a node from the process, see AdmissionOptions
+struct AdmissionStats
+{
+    int inflight_requests;
+    int64_t inflight_bytes;
+    int waiting_requests;      // Queue depth, requests waiting for admission
+    int64_t admitted_requests;
+    int64_t rejected_requests; // Rejected at the limits
+    int64_t shed_requests;     // Rejected by ADMISSION_SHED over bulk_percent of the limits
+
+    AdmissionStats();
+};
+
+// Snapshot of the admission counters of the nodes requested by clients with admission control
+void get_admission_stats(std::map<Node, struct AdmissionStats>* admission_stats);
+
 std::string strsha1(const std::string& str);
 void debug_redis_reply(const char* command, const redisReply* redis_reply, int depth=0, int index=0);
 uint16_t crc16(const char *buf, int len);
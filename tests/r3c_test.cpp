@@ -4,6 +4,9 @@
 // Usage2: set enviroment variable REDIS_CLUSTER_NODES, example: export REDIS_CLUSTER_NODES=127.0.0.1:6379,127.0.0.1:6380,
 //         and run without any parameter.
 // To test slots, please set environment varialbe TEST_SLOSTS to 1.
+// To test MOVED, please set environment variable TEST_MOVED to 1, a slot is moved to another master and back.
+// To test shard://, please set environment variable REDIS_SHARD_NODES to standalone nodes, example: export REDIS_SHARD_NODES=127.0.0.1:6379:2,127.0.0.1:6380
+// To test sentinel://, please set environment variable REDIS_SENTINEL_NODES, example: export REDIS_SENTINEL_NODES=mymaster@127.0.0.1:26379
 #include "r3c.h"
 #include "utils.h"
 #include <math.h>
@@ -11,6 +14,7 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
 
 #define PRECISION 0.000001
 
@@ -35,6 +39,7 @@ static void test_slots(const std::string& redis_cluster_nodes, const std::string
 
 // TRANSACTION (MULTI & EXEC)
 static void test_transaction(const std::string& redis_cluster_nodes, const std::string& redis_password);
+static void test_transaction_lanes(const std::string& redis_cluster_nodes, const std::string& redis_password);
 
 ////////////////////////////////////////////////////////////////////////////
 // KEY VALUE
@@ -85,6 +90,30 @@ static void test_zremrangebyrank(const std::string& redis_cluster_nodes, const s
 // SORTED HyperLogLog
 static void test_hyper_log_log(const std::string& redis_cluster_nodes, const std::string& redis_password);
 
+////////////////////////////////////////////////////////////////////////////
+// TOPOLOGY
+static void test_cluster_topology(const std::string& redis_cluster_nodes, const std::string& redis_password);
+static void test_moved_slot(const std::string& redis_cluster_nodes, const std::string& redis_password);
+
+////////////////////////////////////////////////////////////////////////////
+// WRITE BUFFER
+static void test_write_buffer_order(const std::string& redis_cluster_nodes, const std::string& redis_password);
+static void test_write_buffer_expiry(const std::string& redis_cluster_nodes, const std::string& redis_password);
+static void test_write_buffer_transaction(const std::string& redis_cluster_nodes, const std::string& redis_password);
+
+////////////////////////////////////////////////////////////////////////////
+// HEDGED READS
+static void test_hedge_admission(const std::string& redis_cluster_nodes, const std::string& redis_password);
+
+////////////////////////////////////////////////////////////////////////////
+// SHARDING
+static void test_shard_config(const std::string& redis_shard_nodes, const std::string& redis_password);
+static void test_shard_ring(const std::string& redis_shard_nodes, const std::string& redis_password);
+
+////////////////////////////////////////////////////////////////////////////
+// SENTINEL
+static void test_sentinel_config(const std::string& redis_sentinel_nodes, const std::string& redis_password);
+
 static void my_log_write(const char* format, ...)
 {
     time_t seconds = time(NULL);
@@ -127,6 +156,7 @@ if (false) {
 
     // TRANSACTION (MULTI & EXEC)
     test_transaction(redis_cluster_nodes, redis_password);
+    test_transaction_lanes(redis_cluster_nodes, redis_password);
 
     ////////////////////////////////////////////////////////////////////////////
     // KEY VALUE
@@ -183,6 +213,39 @@ if (false) {
     if ((test_slots_env != NULL) && (0 == strcmp(test_slots_env, "1")))
         test_slots(redis_cluster_nodes, redis_password);
 
+    ////////////////////////////////////////////////////////////////////////////
+    // TOPOLOGY
+    test_cluster_topology(redis_cluster_nodes, redis_password);
+    // Moves a slot between masters with CLUSTER SETSLOT, and moves it back
+    const char* test_moved_env = getenv("TEST_MOVED");
+    if ((test_moved_env != NULL) && (0 == strcmp(test_moved_env, "1")))
+        test_moved_slot(redis_cluster_nodes, redis_password);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // WRITE BUFFER
+    test_write_buffer_order(redis_cluster_nodes, redis_password);
+    test_write_buffer_expiry(redis_cluster_nodes, redis_password);
+    test_write_buffer_transaction(redis_cluster_nodes, redis_password);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // HEDGED READS
+    test_hedge_admission(redis_cluster_nodes, redis_password);
+
+    ////////////////////////////////////////////////////////////////////////////
+    // SHARDING
+    const char* redis_shard_nodes = getenv("REDIS_SHARD_NODES");
+    if (redis_shard_nodes != NULL)
+    {
+        test_shard_config(redis_shard_nodes, redis_password);
+        test_shard_ring(redis_shard_nodes, redis_password);
+    }
+
+    ////////////////////////////////////////////////////////////////////////////
+    // SENTINEL
+    const char* redis_sentinel_nodes = getenv("REDIS_SENTINEL_NODES");
+    if (redis_sentinel_nodes != NULL)
+        test_sentinel_config(redis_sentinel_nodes, redis_password);
+
     printf("\n");
     for (std::vector<std::string>::size_type i=0; i<sg_faild_cases.size(); ++i)
     {
@@ -226,6 +289,84 @@ struct X
     }
 };
 
+// Records the node each command is sent to first
+class CRouteMonitor: public r3c::CommandMonitor
+{
+public:
+    virtual void before_execute(const r3c::Node& node, const std::string&, const r3c::CommandArgs&, bool)
+    {
+        nodes.push_back(node);
+    }
+
+    virtual void after_execute(int, const r3c::Node&, const std::string&, const redisReply*)
+    {
+    }
+
+    std::vector<r3c::Node> nodes;
+};
+
+// A key of each slot
+static void get_slot_keys(std::vector<std::string>* slot_keys)
+{
+    int num_slots = 0;
+
+    slot_keys->assign(16384, std::string(""));
+    for (unsigned int i=0; num_slots<16384; ++i)
+    {
+        const std::string key = std::string("r3c_") + r3c::int2string(i);
+        const unsigned int slot = r3c::get_key_slot(&key);
+        if ((*slot_keys)[slot].empty())
+        {
+            (*slot_keys)[slot] = key;
+            ++num_slots;
+        }
+    }
+}
+
+// Sends a command to the given node directly
+static redisReply* node_command(const r3c::Node& node, const std::string& redis_password, const char* format, ...)
+{
+    redisReply* redis_reply = NULL;
+    redisContext* redis_context = redisConnect(node.first.c_str(), node.second);
+
+    if (redis_context != NULL && 0 == redis_context->err)
+    {
+        if (!redis_password.empty())
+            freeReplyObject(redisCommand(redis_context, "AUTH %s", redis_password.c_str()));
+
+        va_list ap;
+        va_start(ap, format);
+        redis_reply = static_cast<redisReply*>(redisvCommand(redis_context, format, ap));
+        va_end(ap);
+    }
+    if (redis_context != NULL)
+        redisFree(redis_context);
+    return redis_reply;
+}
+
+// Each of the nodes strings must be rejected with ERROR_PARAMETER
+static bool expect_bad_nodes(const std::string* nodes, size_t num_nodes, const std::string& redis_password, std::string* errmsg)
+{
+    for (size_t i=0; i<num_nodes; ++i)
+    {
+        try
+        {
+            r3c::CRedisClient rc(nodes[i], redis_password);
+            *errmsg = nodes[i] + std::string(" accepted");
+            return false;
+        }
+        catch (r3c::CRedisException& ex)
+        {
+            if (ex.errcode() != r3c::ERROR_PARAMETER)
+            {
+                *errmsg = nodes[i] + std::string(" ERROR: ") + ex.str();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 void tips_print(const char* function)
 {
     fprintf(stdout, "\n========%s========\n", function);
@@ -354,6 +495,53 @@ void test_transaction(const std::string& redis_cluster_nodes, const std::string&
     }
 }
 
+// With priority lanes, the commands of a transaction stay on the connection of MULTI even if bulk
+void test_transaction_lanes(const std::string& redis_cluster_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    try
+    {
+        const int retry_times = 0;
+        r3c::CRedisClient rc(redis_cluster_nodes, redis_password);
+        r3c::PriorityLaneOptions priority_lane_options;
+        const std::string key = "r3c_kk";
+        std::string value;
+
+        rc.enable_priority_lanes(priority_lane_options);
+        rc.del(key);
+        rc.multi(key);
+        rc.incrby(key, 2, NULL, retry_times);
+        {
+            // bulk命令仍在事务的连接上执行
+            r3c::CCommandPriorityGuard command_priority_guard(&rc, r3c::PRIORITY_BULK);
+            rc.incrby(key, 7, NULL, retry_times);
+        }
+
+        const r3c::RedisReplyHelper redis_reply = rc.exec(key);
+        if (!redis_reply || redis_reply->type != REDIS_REPLY_ARRAY || redis_reply->elements != 2)
+        {
+            ERROR_PRINT("%s", "EXEC did not return the replies of the transaction");
+            return;
+        }
+
+        if (!rc.get(key, &value) || value != "9")
+        {
+            ERROR_PRINT("%s HAVE ERROR VALUE: %s", key.c_str(), value.c_str());
+            return;
+        }
+        rc.del(key);
+        SUCCESS_PRINT("%s", "OK");
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        if (ex.errcode() != r3c::ERROR_NOT_SUPPORT)
+            ERROR_PRINT("ERROR: %s", ex.str().c_str());
+        else
+            SUCCESS_PRINT("%s", ex.str().c_str());
+    }
+}
+
 ////////////////////////////////////////////////////////////////////////////
 // KEY VALUE
 
@@ -2749,3 +2937,581 @@ void test_hyper_log_log(const std::string& redis_cluster_nodes, const std::strin
         ERROR_PRINT("ERROR: %s", ex.str().c_str());
     }
 }
+
+////////////////////////////////////////////////////////////////////////////
+// TOPOLOGY
+
+// The slots discovered by CLUSTER SHARDS (or CLUSTER SLOTS) must route as CLUSTER NODES says
+void test_cluster_topology(const std::string& redis_cluster_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    try
+    {
+        r3c::CRedisClient rc(redis_cluster_nodes, redis_password);
+        std::vector<struct r3c::NodeInfo> nodes_info;
+        std::vector<std::string> slot_keys;
+        CRouteMonitor route_monitor;
+        std::string value;
+        int num_checked = 0;
+
+        if (!rc.cluster_mode())
+        {
+            SUCCESS_PRINT("%s", "not cluster");
+            return;
+        }
+        if (rc.list_nodes(&nodes_info) <= 0)
+        {
+            ERROR_PRINT("%s", "list_nodes error");
+            return;
+        }
+
+        get_slot_keys(&slot_keys);
+        rc.set_command_monitor(&route_monitor);
+        for (std::vector<struct r3c::NodeInfo>::size_type i=0; i<nodes_info.size(); ++i)
+        {
+            const struct r3c::NodeInfo& nodeinfo = nodes_info[i];
+            if (!nodeinfo.is_master() || nodeinfo.is_fail())
+                continue;
+
+            for (r3c::SlotSegment::size_type j=0; j<nodeinfo.slots.size(); ++j)
+            {
+                const int slots[2] = { nodeinfo.slots[j].first, nodeinfo.slots[j].second };
+                for (int k=0; k<2; ++k)
+                {
+                    route_monitor.nodes.clear();
+                    rc.get(slot_keys[slots[k]], &value);
+                    if (route_monitor.nodes.empty() || route_monitor.nodes[0]!=nodeinfo.node)
+                    {
+                        ERROR_PRINT("slot %d routed to %s, expected %s", slots[k],
+                                route_monitor.nodes.empty()? "none": r3c::node2string(route_monitor.nodes[0]).c_str(),
+                                r3c::node2string(nodeinfo.node).c_str());
+                        rc.set_command_monitor(NULL);
+                        return;
+                    }
+                    ++num_checked;
+                }
+            }
+        }
+
+        rc.set_command_monitor(NULL);
+        SUCCESS_PRINT("OK, %d slots checked", num_checked);
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        ERROR_PRINT("ERROR: %s", ex.str().c_str());
+    }
+}
+
+// After a MOVED the slot must be sent to the new owner directly
+void test_moved_slot(const std::string& redis_cluster_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    try
+    {
+        r3c::CRedisClient rc(redis_cluster_nodes, redis_password);
+        std::vector<struct r3c::NodeInfo> nodes_info;
+        std::vector<struct r3c::NodeInfo> masters_info;
+        std::vector<std::string> slot_keys;
+        CRouteMonitor route_monitor;
+        std::string value;
+
+        if (!rc.cluster_mode())
+        {
+            SUCCESS_PRINT("%s", "not cluster");
+            return;
+        }
+        rc.list_nodes(&nodes_info);
+        for (std::vector<struct r3c::NodeInfo>::size_type i=0; i<nodes_info.size(); ++i)
+        {
+            if (nodes_info[i].is_master() && !nodes_info[i].is_fail() && !nodes_info[i].slots.empty())
+                masters_info.push_back(nodes_info[i]);
+        }
+        if (masters_info.size() < 2)
+        {
+            SUCCESS_PRINT("%s", "less than 2 masters");
+            return;
+        }
+
+        // 挑一个空的slot，CLUSTER SETSLOT不能移走有key的slot
+        const struct r3c::NodeInfo& old_master = masters_info[0];
+        const struct r3c::NodeInfo& new_master = masters_info[1];
+        int slot = -1;
+        get_slot_keys(&slot_keys);
+        for (int s=old_master.slots[0].first; s<=old_master.slots[0].second && slot<0; ++s)
+        {
+            redisReply* redis_reply = node_command(old_master.node, redis_password, "CLUSTER COUNTKEYSINSLOT %d", s);
+            if (redis_reply!=NULL && REDIS_REPLY_INTEGER==redis_reply->type && 0==redis_reply->integer)
+                slot = s;
+            if (redis_reply != NULL)
+                freeReplyObject(redis_reply);
+        }
+        if (slot < 0)
+        {
+            ERROR_PRINT("no empty slot on %s", r3c::node2string(old_master.node).c_str());
+            return;
+        }
+
+        rc.get(slot_keys[slot], &value); // 确保client已按旧的拓扑路由
+        for (std::vector<struct r3c::NodeInfo>::size_type i=0; i<masters_info.size(); ++i)
+            freeReplyObject(node_command(masters_info[i].node, redis_password, "CLUSTER SETSLOT %d NODE %s", slot, new_master.id.c_str()));
+
+        rc.set_command_monitor(&route_monitor);
+        rc.get(slot_keys[slot], &value); // MOVED
+        route_monitor.nodes.clear();
+        rc.get(slot_keys[slot], &value);
+        rc.set_command_monitor(NULL);
+
+        for (std::vector<struct r3c::NodeInfo>::size_type i=0; i<masters_info.size(); ++i)
+            freeReplyObject(node_command(masters_info[i].node, redis_password, "CLUSTER SETSLOT %d NODE %s", slot, old_master.id.c_str()));
+        if (route_monitor.nodes.empty() || route_monitor.nodes[0]!=new_master.node)
+        {
+            ERROR_PRINT("slot %d routed to %s after MOVED, expected %s", slot,
+                    route_monitor.nodes.empty()? "none": r3c::node2string(route_monitor.nodes[0]).c_str(),
+                    r3c::node2string(new_master.node).c_str());
+            return;
+        }
+
+        SUCCESS_PRINT("OK, slot %d", slot);
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        ERROR_PRINT("ERROR: %s", ex.str().c_str());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// WRITE BUFFER
+
+static bool set_or_buffer(r3c::CRedisClient& rc, const std::string& key, const std::string& value)
+{
+    std::vector<std::string> args;
+    args.push_back("SET");
+    args.push_back(key);
+    args.push_back(value);
+    return rc.write_or_buffer(key, args);
+}
+
+// Writes buffered while the node is paused are sent in order, repeat-unsafe commands are rejected
+void test_write_buffer_order(const std::string& redis_cluster_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    try
+    {
+        const std::string key = "r3c_write_buffer";
+        const int num_writes = 5;
+        r3c::CRedisClient rc(redis_cluster_nodes, redis_password, r3c::CONNECT_TIMEOUT_MILLISECONDS, 100);
+        r3c::WriteBufferOptions write_buffer_options;
+        r3c::Node which;
+        std::string value;
+        int num_buffered = 0;
+
+        write_buffer_options.commands.insert("INCRBY");
+        try
+        {
+            rc.enable_write_buffer(write_buffer_options);
+            ERROR_PRINT("%s", "INCRBY accepted");
+            return;
+        }
+        catch (r3c::CRedisException& ex)
+        {
+            if (ex.errcode() != r3c::ERROR_PARAMETER)
+            {
+                ERROR_PRINT("INCRBY ERROR: %s", ex.str().c_str());
+                return;
+            }
+        }
+
+        write_buffer_options.commands.clear();
+        write_buffer_options.commands.insert("SET");
+        rc.enable_write_buffer(write_buffer_options);
+        rc.set(key, "0", &which);
+
+        // 暂停期间写超时，后续的写排在已缓冲的写之后
+        freeReplyObject(node_command(which, redis_password, "CLIENT PAUSE %d", 500));
+        for (int i=1; i<=num_writes; ++i)
+        {
+            if (!set_or_buffer(rc, key, r3c::int2string(i)))
+                ++num_buffered;
+        }
+        if (num_buffered != num_writes || rc.get_num_buffered_writes() != num_writes)
+        {
+            ERROR_PRINT("%d writes buffered, %d in the buffer, expected %d", num_buffered, rc.get_num_buffered_writes(), num_writes);
+            return;
+        }
+
+        r3c::millisleep(600);
+        if (rc.flush_write_buffer() != 0)
+        {
+            ERROR_PRINT("%d writes still buffered", rc.get_num_buffered_writes());
+            return;
+        }
+        if (!rc.get(key, &value) || value != r3c::int2string(num_writes))
+        {
+            ERROR_PRINT("%s is %s, expected %d", key.c_str(), value.c_str(), num_writes);
+            return;
+        }
+        if (rc.get_num_dropped_writes() != 0)
+        {
+            ERROR_PRINT("%d writes dropped", static_cast<int>(rc.get_num_dropped_writes()));
+            return;
+        }
+        rc.del(key);
+        SUCCESS_PRINT("%s", "OK");
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        ERROR_PRINT("ERROR: %s", ex.str().c_str());
+    }
+}
+
+// Writes buffered longer than max_delay_milliseconds are dropped instead of sent
+void test_write_buffer_expiry(const std::string& redis_cluster_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    try
+    {
+        const std::string key = "r3c_write_buffer";
+        r3c::CRedisClient rc(redis_cluster_nodes, redis_password, r3c::CONNECT_TIMEOUT_MILLISECONDS, 100);
+        r3c::WriteBufferOptions write_buffer_options;
+        r3c::Node which;
+
+        write_buffer_options.commands.insert("SET");
+        write_buffer_options.max_delay_milliseconds = 100;
+        rc.enable_write_buffer(write_buffer_options);
+        rc.set(key, "0", &which);
+
+        freeReplyObject(node_command(which, redis_password, "CLIENT PAUSE %d", 1000));
+        if (set_or_buffer(rc, key, "1"))
+        {
+            ERROR_PRINT("%s", "write sent while the node is paused");
+            return;
+        }
+        r3c::millisleep(300);
+        if (rc.flush_write_buffer() != 0 || rc.get_num_dropped_writes() != 1)
+        {
+            ERROR_PRINT("%d writes buffered, %d dropped, expected 0 and 1",
+                    rc.get_num_buffered_writes(), static_cast<int>(rc.get_num_dropped_writes()));
+            return;
+        }
+
+        r3c::millisleep(800);
+        rc.del(key);
+        SUCCESS_PRINT("%s", "OK");
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        ERROR_PRINT("ERROR: %s", ex.str().c_str());
+    }
+}
+
+// Buffered writes are not sent inside a MULTI transaction, nor are the writes of the transaction buffered
+void test_write_buffer_transaction(const std::string& redis_cluster_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    try
+    {
+        const int retry_times = 0;
+        const std::string key = "r3c_write_buffer";
+        const std::string txn_key = "r3c_kk";
+        r3c::CRedisClient rc(redis_cluster_nodes, redis_password, r3c::CONNECT_TIMEOUT_MILLISECONDS, 100);
+        r3c::WriteBufferOptions write_buffer_options;
+        r3c::CircuitBreakerOptions circuit_breaker_options;
+        r3c::Node which;
+        std::string value;
+
+        if (rc.cluster_mode())
+        {
+            SUCCESS_PRINT("%s", "MULTI not supported in cluster mode");
+            return;
+        }
+        // 暂停期间的超时不打开熔断
+        circuit_breaker_options.failure_threshold = 100;
+        rc.set_circuit_breaker_options(circuit_breaker_options);
+        write_buffer_options.commands.insert("SET");
+        rc.enable_write_buffer(write_buffer_options);
+        rc.set(key, "0", &which);
+        rc.del(txn_key);
+
+        freeReplyObject(node_command(which, redis_password, "CLIENT PAUSE %d", 1000));
+        if (set_or_buffer(rc, key, "1"))
+        {
+            ERROR_PRINT("%s", "write sent while the node is paused");
+            return;
+        }
+        // 每次发送不成功，下次发送的间隔加倍
+        for (int i=0; i<4; ++i)
+            rc.flush_write_buffer();
+        r3c::millisleep(600);
+
+        // 事务中到了发送时间，缓冲的写仍不发送
+        rc.multi(txn_key);
+        rc.incrby(txn_key, 2, NULL, retry_times);
+        r3c::millisleep(1700);
+        if (!set_or_buffer(rc, txn_key, "5"))
+        {
+            ERROR_PRINT("%s", "write of the transaction buffered");
+            return;
+        }
+        const r3c::RedisReplyHelper redis_reply = rc.exec(txn_key);
+        if (!redis_reply || redis_reply->type != REDIS_REPLY_ARRAY || redis_reply->elements != 2)
+        {
+            ERROR_PRINT("EXEC returned %d replies, expected 2", redis_reply? static_cast<int>(redis_reply->elements): -1);
+            return;
+        }
+        if (rc.get_num_buffered_writes() != 1)
+        {
+            ERROR_PRINT("%d writes buffered after EXEC, expected 1", rc.get_num_buffered_writes());
+            return;
+        }
+
+        if (rc.flush_write_buffer() != 0 || !rc.get(key, &value) || value != "1")
+        {
+            ERROR_PRINT("%s is %s after flush, expected 1", key.c_str(), value.c_str());
+            return;
+        }
+        rc.del(key);
+        rc.del(txn_key);
+        SUCCESS_PRINT("%s", "OK");
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        ERROR_PRINT("ERROR: %s", ex.str().c_str());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// HEDGED READS
+
+// A hedged read won by a replica returns the admission of the master it was admitted to
+void test_hedge_admission(const std::string& redis_cluster_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    try
+    {
+        const std::string key = "r3c_hedge";
+        r3c::CRedisClient rc(redis_cluster_nodes, redis_password, r3c::CONNECT_TIMEOUT_MILLISECONDS, r3c::READWRITE_TIMEOUT_MILLISECONDS, r3c::RP_PRIORITY_MASTER);
+        r3c::HedgeOptions hedge_options;
+        r3c::AdmissionOptions admission_options;
+        std::map<r3c::Node, struct r3c::AdmissionStats> admission_stats;
+        r3c::Node master_node;
+        r3c::Node which;
+        std::string value;
+
+        hedge_options.percentile = 50;
+        hedge_options.budget_percent = 100;
+        hedge_options.min_samples = 1;
+        rc.enable_hedged_reads(hedge_options);
+        rc.enable_admission_control(admission_options);
+        rc.set(key, "1", &master_node);
+        r3c::millisleep(100); // 等待复制到replica
+        for (int i=0; i<10; ++i)
+            rc.get(key, &value);
+
+        // master暂停期间，对冲到replica的读先返回
+        freeReplyObject(node_command(master_node, redis_password, "CLIENT PAUSE %d", 300));
+        rc.get(key, &value, &which);
+        r3c::millisleep(400);
+
+        r3c::get_admission_stats(&admission_stats);
+        for (std::map<r3c::Node, struct r3c::AdmissionStats>::const_iterator iter=admission_stats.begin(); iter!=admission_stats.end(); ++iter)
+        {
+            if (iter->second.inflight_requests!=0 || iter->second.inflight_bytes!=0)
+            {
+                ERROR_PRINT("%s has %d requests and %d bytes in flight", r3c::node2string(iter->first).c_str(),
+                        iter->second.inflight_requests, static_cast<int>(iter->second.inflight_bytes));
+                return;
+            }
+        }
+        rc.del(key);
+        if (which == master_node)
+            SUCCESS_PRINT("%s", "OK, not hedged without replicas");
+        else
+            SUCCESS_PRINT("OK, won by %s", r3c::node2string(which).c_str());
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        ERROR_PRINT("ERROR: %s", ex.str().c_str());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// SHARDING
+
+// Duplicate nodes and weights not positive integers are rejected
+void test_shard_config(const std::string& redis_shard_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    std::vector<r3c::Node> nodes;
+    r3c::parse_nodes(&nodes, redis_shard_nodes);
+    if (nodes.empty())
+    {
+        ERROR_PRINT("no node: %s", redis_shard_nodes.c_str());
+        return;
+    }
+
+    const std::string node = r3c::node2string(nodes[0]);
+    std::string errmsg;
+    const std::string bad_nodes[] =
+    {
+        std::string("shard://") + node + std::string(",") + node,
+        std::string("shard://") + node + std::string(":0"),
+        std::string("shard://") + node + std::string(":-1"),
+        std::string("shard://") + node + std::string(":2x")
+    };
+    if (!expect_bad_nodes(bad_nodes, sizeof(bad_nodes)/sizeof(bad_nodes[0]), redis_password, &errmsg))
+    {
+        ERROR_PRINT("%s", errmsg.c_str());
+        return;
+    }
+
+    SUCCESS_PRINT("%s", "OK");
+}
+
+// Keys are spread by weight, and a node down is ejected from the ring
+void test_shard_ring(const std::string& redis_shard_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    try
+    {
+        const int num_keys = 4000;
+        std::vector<r3c::Node> nodes;
+        std::vector<int> weights;
+        int total_weight = 0;
+
+        r3c::parse_nodes(&nodes, redis_shard_nodes, &weights);
+        for (std::vector<int>::size_type i=0; i<weights.size(); ++i)
+            total_weight += weights[i];
+
+        // Distribution by weight
+        {
+            r3c::CRedisClient rc(std::string("shard://") + redis_shard_nodes, redis_password);
+            CRouteMonitor route_monitor;
+            std::map<r3c::Node, int> node_keys;
+
+            rc.set_command_monitor(&route_monitor);
+            for (int i=0; i<num_keys; ++i)
+                rc.set(std::string("r3c_shard_") + r3c::int2string(i), "1");
+            rc.set_command_monitor(NULL);
+            for (std::vector<r3c::Node>::size_type i=0; i<route_monitor.nodes.size(); ++i)
+                ++node_keys[route_monitor.nodes[i]];
+            for (std::vector<r3c::Node>::size_type i=0; i<nodes.size(); ++i)
+            {
+                // 一致性哈希不是精确按权重分配，偏差在一半以内即可
+                const int expected = num_keys * weights[i] / total_weight;
+                if (node_keys[nodes[i]]<expected/2 || node_keys[nodes[i]]>expected*3/2)
+                {
+                    ERROR_PRINT("%s has %d keys, expected about %d", r3c::node2string(nodes[i]).c_str(), node_keys[nodes[i]], expected);
+                    return;
+                }
+            }
+            for (int i=0; i<num_keys; ++i)
+                rc.del(std::string("r3c_shard_") + r3c::int2string(i));
+        }
+
+        // Ejection, 127.0.0.1:1 refuses connections
+        {
+            const r3c::Node dead_node("127.0.0.1", 1);
+            r3c::CRedisClient rc(std::string("shard://") + redis_shard_nodes + std::string(",127.0.0.1:1"), redis_password);
+            r3c::CircuitBreakerOptions circuit_breaker_options;
+            CRouteMonitor route_monitor;
+            int num_errors = 0;
+
+            // 测试期间不放回
+            circuit_breaker_options.failure_threshold = 1;
+            circuit_breaker_options.open_milliseconds = 60000;
+            rc.set_circuit_breaker_options(circuit_breaker_options);
+
+            for (int i=0; i<num_keys; ++i)
+            {
+                try
+                {
+                    rc.set(std::string("r3c_shard_") + r3c::int2string(i), "1");
+                }
+                catch (r3c::CRedisException& ex)
+                {
+                    ++num_errors;
+                }
+            }
+            rc.set_command_monitor(&route_monitor);
+            for (int i=0; i<num_keys; ++i)
+                rc.set(std::string("r3c_shard_") + r3c::int2string(i), "1");
+            rc.set_command_monitor(NULL);
+            if (std::find(route_monitor.nodes.begin(), route_monitor.nodes.end(), dead_node) != route_monitor.nodes.end())
+            {
+                ERROR_PRINT("%s", "the dead node is not ejected");
+                return;
+            }
+            for (int i=0; i<num_keys; ++i)
+                rc.del(std::string("r3c_shard_") + r3c::int2string(i));
+            SUCCESS_PRINT("OK, %d errors before ejected", num_errors);
+        }
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        ERROR_PRINT("ERROR: %s", ex.str().c_str());
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////
+// SENTINEL
+
+// Malformed sentinel:// is rejected, and the master is found by its name
+void test_sentinel_config(const std::string& redis_sentinel_nodes, const std::string& redis_password)
+{
+    TIPS_PRINT();
+
+    const std::string::size_type at_pos = redis_sentinel_nodes.find('@');
+    if (at_pos == std::string::npos)
+    {
+        ERROR_PRINT("no master name: %s", redis_sentinel_nodes.c_str());
+        return;
+    }
+
+    const std::string master_name = redis_sentinel_nodes.substr(0, at_pos);
+    const std::string sentinels = redis_sentinel_nodes.substr(at_pos + 1);
+    std::string errmsg;
+    const std::string bad_nodes[] =
+    {
+        std::string("sentinel://") + sentinels,
+        std::string("sentinel://@") + sentinels,
+        std::string("sentinel://") + master_name + std::string("@")
+    };
+    if (!expect_bad_nodes(bad_nodes, sizeof(bad_nodes)/sizeof(bad_nodes[0]), redis_password, &errmsg))
+    {
+        ERROR_PRINT("%s", errmsg.c_str());
+        return;
+    }
+
+    try
+    {
+        const std::string key = "r3c_sentinel";
+        std::string value;
+        r3c::CRedisClient rc(std::string("sentinel://") + redis_sentinel_nodes, redis_password);
+
+        if (!rc.sentinel_mode() || rc.cluster_mode())
+        {
+            ERROR_PRINT("%s", "not in sentinel mode");
+            return;
+        }
+        rc.set(key, "1");
+        if (!rc.get(key, &value) || value != "1")
+        {
+            ERROR_PRINT("get %s: %s", key.c_str(), value.c_str());
+            return;
+        }
+        rc.del(key);
+        SUCCESS_PRINT("%s", "OK");
+    }
+    catch (r3c::CRedisException& ex)
+    {
+        ERROR_PRINT("ERROR: %s", ex.str().c_str());
+    }
+}
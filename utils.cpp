@@ -2,13 +2,17 @@
 #include "utils.h"
 #include "r3c.h"
 #include "sha1.h"
+#include <arpa/inet.h>
 #include <limits.h>
+#include <netdb.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
 #include <time.h>
+#include <map>
 #include <ostream>
 
 std::ostream& operator <<(std::ostream& os, const struct redisReply& redis_reply)
@@ -648,13 +652,16 @@ std::string format_string(const char* format, ...)
 #endif // __cplusplus < 201103L
 }
 
-int parse_nodes(std::vector<std::pair<std::string, uint16_t> >* nodes, const std::string& nodes_string)
+// A node can be followed by its weight as host:port:weight, the weight is 1 if not given
+int parse_nodes(std::vector<std::pair<std::string, uint16_t> >* nodes, const std::string& nodes_string, std::vector<int>* weights)
 {
     std::string::size_type len = 0;
     std::string::size_type pos = 0;
     std::string::size_type comma_pos = 0;
 
     nodes->clear();
+    if (weights != NULL)
+        weights->clear();
     while (comma_pos != std::string::npos)
     {
         comma_pos = nodes_string.find(',', pos);
@@ -667,11 +674,32 @@ int parse_nodes(std::vector<std::pair<std::string, uint16_t> >* nodes, const std
         {
             const std::string& str = nodes_string.substr(pos, len);
             const std::string::size_type colon_pos = str.find(':');
-            if (colon_pos != std::string::npos)
+            if (0 == str.compare(0, sizeof("unix:")-1, "unix:"))
+            {
+                // unix:/tmp/redis.sock, port 0 marks a unix domain socket
+                nodes->push_back(std::make_pair(str.substr(sizeof("unix:")-1), (uint16_t)0));
+                if (weights != NULL)
+                    weights->push_back(1);
+            }
+            else if (colon_pos != std::string::npos)
             {
                 const std::string& ip_str = str.substr(0, colon_pos);
                 const std::string& port_str = str.substr(colon_pos + 1);
+                const std::string::size_type weight_pos = port_str.find(':');
                 nodes->push_back(std::make_pair(ip_str, (uint16_t)atoi(port_str.c_str())));
+                if (weights != NULL)
+                {
+                    // 不是正整数的权重记为0，由调用者拒绝
+                    int weight = 1;
+                    if (weight_pos != std::string::npos)
+                    {
+                        const char* weight_str = port_str.c_str() + weight_pos + 1;
+                        char* end = NULL;
+                        const long value = strtol(weight_str, &end, 10);
+                        weight = (end!=weight_str && '\0'==*end && value>0 && value<=INT_MAX)? static_cast<int>(value): 0;
+                    }
+                    weights->push_back(weight);
+                }
             }
         }
 
@@ -765,6 +793,14 @@ void parse_slot_string(const std::string& slot_string, int* start_slot, int* end
 
 // MOVED 9166 10.240.84.140:6379
 bool parse_moved_string(const std::string& moved_string, std::pair<std::string, uint16_t>* node)
+{
+    int slot;
+    return parse_moved_string(moved_string, &slot, node);
+}
+
+// MOVED 9166 10.240.84.140:6379
+// ASK 9166 10.240.84.140:6379
+bool parse_moved_string(const std::string& moved_string, int* slot, std::pair<std::string, uint16_t>* node)
 {
     do
     {
@@ -772,8 +808,13 @@ bool parse_moved_string(const std::string& moved_string, std::pair<std::string,
         if (space_pos == std::string::npos)
             break;
 
+        const std::string::size_type slot_pos = moved_string.find(' ');
+        if (slot_pos == space_pos)
+            break;
+        *slot = atoi(moved_string.c_str()+slot_pos+1);
+
         const std::string& ip_and_port_string = moved_string.substr(space_pos+1);
-        const std::string::size_type colon_pos = ip_and_port_string.find(':');
+        const std::string::size_type colon_pos = ip_and_port_string.rfind(':');
         if (colon_pos == std::string::npos)
             break;
 
@@ -1038,4 +1079,182 @@ uint64_t get_random_number(uint64_t base)
     return base + random();
 }
 
+uint64_t get_thread_random_number()
+{
+    static __thread uint64_t stg_state = 0;
+
+    if (0 == stg_state)
+    {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        stg_state = (static_cast<uint64_t>(tv.tv_sec) << 20) ^ static_cast<uint64_t>(tv.tv_usec) ^ reinterpret_cast<uint64_t>(&stg_state);
+        if (0 == stg_state)
+            stg_state = 0x9E3779B97F4A7C15ULL;
+    }
+
+    // xorshift64*
+    stg_state ^= stg_state >> 12;
+    stg_state ^= stg_state << 25;
+    stg_state ^= stg_state >> 27;
+    return stg_state * 0x2545F4914F6CDD1DULL;
+}
+
+int64_t get_monotonic_milliseconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<int64_t>(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+void get_timedwait_deadline(int64_t milliseconds, struct timespec* ts)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    const int64_t deadline = static_cast<int64_t>(tv.tv_sec)*1000 + tv.tv_usec/1000 + milliseconds;
+    ts->tv_sec = static_cast<time_t>(deadline / 1000);
+    ts->tv_nsec = static_cast<long>((deadline % 1000) * 1000000);
+}
+
+struct ResolvedHost
+{
+    std::string ip;
+    int64_t expire_time; // Monotonic milliseconds
+    bool refreshing;
+};
+
+static pthread_mutex_t g_resolved_hosts_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, struct ResolvedHost>* g_resolved_hosts = new std::map<std::string, struct ResolvedHost>; // Never freed, used by detached threads
+
+bool is_ip_address(const std::string& host)
+{
+    struct in6_addr addr;
+    return (1 == inet_pton(AF_INET, host.c_str(), &addr)) ||
+           (1 == inet_pton(AF_INET6, host.c_str(), &addr));
+}
+
+static bool getaddrinfo_host(const std::string& host, std::string* ip, std::string* errmsg)
+{
+    struct addrinfo hints;
+    struct addrinfo* result = NULL;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    const int errcode = getaddrinfo(host.c_str(), NULL, &hints, &result);
+    if (errcode != 0)
+    {
+        *errmsg = format_string("getaddrinfo(%s) failed: %s", host.c_str(), gai_strerror(errcode));
+        return false;
+    }
+    else
+    {
+        char buf[INET6_ADDRSTRLEN];
+        const void* addr = NULL;
+
+        if (AF_INET6 == result->ai_family)
+            addr = &reinterpret_cast<struct sockaddr_in6*>(result->ai_addr)->sin6_addr;
+        else
+            addr = &reinterpret_cast<struct sockaddr_in*>(result->ai_addr)->sin_addr;
+        const bool ok = (inet_ntop(result->ai_family, addr, buf, sizeof(buf)) != NULL);
+        if (ok)
+            *ip = buf;
+        else
+            *errmsg = format_string("inet_ntop(%s) failed: %s", host.c_str(), strerror(errno));
+        freeaddrinfo(result);
+        return ok;
+    }
+}
+
+static void update_resolved_host(const std::string& host, const std::string* ip)
+{
+    pthread_mutex_lock(&g_resolved_hosts_mutex);
+    struct ResolvedHost& resolved_host = (*g_resolved_hosts)[host];
+    resolved_host.refreshing = false;
+    if (ip != NULL)
+    {
+        resolved_host.ip = *ip;
+        resolved_host.expire_time = get_monotonic_milliseconds() + static_cast<int64_t>(DNS_CACHE_TTL_SECONDS) * 1000;
+    }
+    pthread_mutex_unlock(&g_resolved_hosts_mutex);
+}
+
+static void* refresh_resolved_host(void* arg)
+{
+    std::string* host = static_cast<std::string*>(arg);
+    std::string ip;
+    std::string errmsg;
+
+    // Keep the stale address if the resolver fails
+    if (getaddrinfo_host(*host, &ip, &errmsg))
+        update_resolved_host(*host, &ip);
+    else
+        update_resolved_host(*host, NULL);
+    delete host;
+    return NULL;
+}
+
+bool resolve_host(const std::string& host, std::string* ip, std::string* errmsg)
+{
+    bool refresh = false;
+    bool found = false;
+
+    if (is_ip_address(host))
+    {
+        *ip = host;
+        return true;
+    }
+
+    pthread_mutex_lock(&g_resolved_hosts_mutex);
+    std::map<std::string, struct ResolvedHost>::iterator iter = g_resolved_hosts->find(host);
+    if (iter != g_resolved_hosts->end() && !iter->second.ip.empty())
+    {
+        struct ResolvedHost& resolved_host = iter->second;
+        *ip = resolved_host.ip;
+        found = true;
+        if (!resolved_host.refreshing && resolved_host.expire_time<=get_monotonic_milliseconds())
+        {
+            resolved_host.refreshing = true;
+            refresh = true;
+        }
+    }
+    pthread_mutex_unlock(&g_resolved_hosts_mutex);
+
+    if (refresh)
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+        std::string* arg = new std::string(host);
+
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, refresh_resolved_host, arg) != 0)
+        {
+            delete arg;
+            update_resolved_host(host, NULL);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    if (found)
+    {
+        return true;
+    }
+    else
+    {
+        // Only the first lookup of a host blocks
+        if (!getaddrinfo_host(host, ip, errmsg))
+            return false;
+        update_resolved_host(host, ip);
+        return true;
+    }
+}
+
+void invalidate_resolved_host(const std::string& host)
+{
+    pthread_mutex_lock(&g_resolved_hosts_mutex);
+    std::map<std::string, struct ResolvedHost>::iterator iter = g_resolved_hosts->find(host);
+    if (iter != g_resolved_hosts->end())
+        iter->second.expire_time = 0;
+    pthread_mutex_unlock(&g_resolved_hosts_mutex);
+}
+
 } // namespace r3c {
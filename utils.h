@@ -42,11 +42,21 @@ namespace r3c {
     extern void r3c_log_write(const char* format, ...) __attribute__((format(printf, 1, 2))); // Ouput log to stdout
 
     extern int keyHashSlot(const char *key, size_t keylen);
-    extern int parse_nodes(std::vector<std::pair<std::string, uint16_t> >* nodes, const std::string& nodes_string);
+    extern int parse_nodes(std::vector<std::pair<std::string, uint16_t> >* nodes, const std::string& nodes_string, std::vector<int>* weights=NULL);
     extern bool parse_node_string(const std::string& node_string, std::string* ip, uint16_t* port);
     extern void parse_slot_string(const std::string& slot_string, int* start_slot, int* end_slot);
     extern bool parse_moved_string(const std::string& moved_string, std::pair<std::string, uint16_t>* node);
+    extern bool parse_moved_string(const std::string& moved_string, int* slot, std::pair<std::string, uint16_t>* node);
     extern uint64_t get_random_number(uint64_t base);
+    extern int64_t get_monotonic_milliseconds();
+    extern void get_timedwait_deadline(int64_t milliseconds, struct timespec* ts); // The absolute time for pthread_cond_timedwait
+
+    // Hostnames are resolved through a process-wide cache, entries older than DNS_CACHE_TTL_SECONDS
+    // are still returned while being refreshed by a background thread, so only the first lookup blocks.
+    extern bool is_ip_address(const std::string& host);
+    extern bool resolve_host(const std::string& host, std::string* ip, std::string* errmsg);
+    extern void invalidate_resolved_host(const std::string& host); // Refresh in background, e.g. after connection failures
+    extern uint64_t get_thread_random_number(); // Lock-free, per-thread xorshift generator
 
 } // namespace r3c {
 #endif // REDIS_CLUSTER_CLIENT_UTILS_H